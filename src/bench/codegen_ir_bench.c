@@ -0,0 +1,522 @@
+/*
+ * 86Box	A hypervisor and IBM PC system emulator that specializes in
+ *		running old operating systems and software designed for IBM
+ *		PC systems and compatibles from 1981 through fairly recent
+ *		system designs based on the PCI bus.
+ *
+ *		This file is part of the 86Box distribution.
+ *
+ *		Standalone check and micro-benchmark for the new dynarec IR
+ *		optimisation passes.
+ *
+ *		Builds random blocks of integer and memory uOPs and compiles
+ *		each one twice through the real codegen_ir.c and
+ *		codegen_reg.c, once with codegen_ir_optimise off and once
+ *		with it on. The backend is replaced by handlers that execute
+ *		each emitted uOP on a register file and a small memory, so
+ *		constant folding, copy propagation and dead uOP removal are
+ *		checked against what the block computes. It then reports the
+ *		uOPs executed, the register allocator loads and stores, and
+ *		the compile time with the passes off and on.
+ *
+ *		Build and run from src/:
+ *
+ *		  gcc -O2 -include wchar.h -DUSE_NEW_DYNAREC -Iinclude -Icpu \
+ *		      -Icodegen_new -o codegen_ir_bench bench/codegen_ir_bench.c \
+ *		      codegen_new/codegen_ir.c codegen_new/codegen_reg.c
+ *		  ./codegen_ir_bench
+ *
+ *		Exits non-zero if any register or memory byte differs.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include <86box/86box.h>
+#include "cpu.h"
+#include <86box/mem.h>
+#include "codegen.h"
+#include "codegen_allocator.h"
+#include "codegen_backend.h"
+#include "codegen_ir.h"
+#include "codegen_reg.h"
+
+
+#define CHECK_BLOCKS	20000
+#define BLOCK_UOPS	120
+#define MEM_SIZE	0x10000
+
+
+extern int	codegen_ir_optimise;
+extern int	codegen_ir_uops_folded, codegen_ir_reads_propagated;
+
+cpu_state_t	cpu_state;
+int		cpu_block_end;
+int		block_pos;
+uint8_t		*block_write_data;
+
+host_reg_def_t	codegen_host_reg_list[CODEGEN_HOST_REGS];
+host_reg_def_t	codegen_host_fp_reg_list[CODEGEN_HOST_FP_REGS];
+
+
+/*State the emitted uOPs run on. Registers are indexed by IREG_GET_REG(); the
+  IR is in SSA form and the passes only ever redirect reads to the current
+  version of a register, so one value per register is enough.*/
+static uint32_t	regs[IREG_COUNT];
+static uint8_t	mem[MEM_SIZE + 4];
+static int	uops_run, host_loads, host_stores;
+static double	compile_time;
+
+static uint8_t	code_buf[1024];
+
+
+void
+fatal(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    exit(2);
+}
+
+
+uint8_t *
+codeblock_allocator_get_ptr(struct mem_block_t *block)
+{
+    return code_buf;
+}
+
+
+void codegen_backend_prologue(codeblock_t *block) { }
+void codegen_backend_epilogue(codeblock_t *block) { }
+void codegen_set_jump_dest(codeblock_t *block, void *p) { }
+void codegen_set_loop_start(ir_data_t *ir, int first_instruction) { }
+void codegen_backend_chain_exit(codeblock_t *block, uint32_t pc, int check_pc) { }
+
+
+/*Register allocator spills and fills. Only counted.*/
+#define HOST_LOAD(name, ...)	void name(__VA_ARGS__) { host_loads++; }
+#define HOST_STORE(name, ...)	void name(__VA_ARGS__) { host_stores++; }
+
+HOST_LOAD(codegen_direct_read_8, codeblock_t *block, int host_reg, void *p)
+HOST_LOAD(codegen_direct_read_16, codeblock_t *block, int host_reg, void *p)
+HOST_LOAD(codegen_direct_read_32, codeblock_t *block, int host_reg, void *p)
+HOST_LOAD(codegen_direct_read_64, codeblock_t *block, int host_reg, void *p)
+HOST_LOAD(codegen_direct_read_pointer, codeblock_t *block, int host_reg, void *p)
+HOST_LOAD(codegen_direct_read_double, codeblock_t *block, int host_reg, void *p)
+HOST_LOAD(codegen_direct_read_st_8, codeblock_t *block, int host_reg, void *base, int reg_idx)
+HOST_LOAD(codegen_direct_read_st_64, codeblock_t *block, int host_reg, void *base, int reg_idx)
+HOST_LOAD(codegen_direct_read_st_double, codeblock_t *block, int host_reg, void *base, int reg_idx)
+HOST_LOAD(codegen_direct_read_16_stack, codeblock_t *block, int host_reg, int stack_offset)
+HOST_LOAD(codegen_direct_read_32_stack, codeblock_t *block, int host_reg, int stack_offset)
+HOST_LOAD(codegen_direct_read_64_stack, codeblock_t *block, int host_reg, int stack_offset)
+HOST_LOAD(codegen_direct_read_pointer_stack, codeblock_t *block, int host_reg, int stack_offset)
+HOST_LOAD(codegen_direct_read_double_stack, codeblock_t *block, int host_reg, int stack_offset)
+HOST_STORE(codegen_direct_write_8, codeblock_t *block, void *p, int host_reg)
+HOST_STORE(codegen_direct_write_16, codeblock_t *block, void *p, int host_reg)
+HOST_STORE(codegen_direct_write_32, codeblock_t *block, void *p, int host_reg)
+HOST_STORE(codegen_direct_write_64, codeblock_t *block, void *p, int host_reg)
+HOST_STORE(codegen_direct_write_ptr, codeblock_t *block, void *p, int host_reg)
+HOST_STORE(codegen_direct_write_double, codeblock_t *block, void *p, int host_reg)
+HOST_STORE(codegen_direct_write_st_8, codeblock_t *block, void *base, int reg_idx, int host_reg)
+HOST_STORE(codegen_direct_write_st_64, codeblock_t *block, void *base, int reg_idx, int host_reg)
+HOST_STORE(codegen_direct_write_st_double, codeblock_t *block, void *base, int reg_idx, int host_reg)
+HOST_STORE(codegen_direct_write_32_stack, codeblock_t *block, int stack_offset, int host_reg)
+HOST_STORE(codegen_direct_write_64_stack, codeblock_t *block, int stack_offset, int host_reg)
+HOST_STORE(codegen_direct_write_double_stack, codeblock_t *block, int stack_offset, int host_reg)
+
+
+static uint32_t
+reg_get(ir_reg_t r)
+{
+    uint32_t v = regs[IREG_GET_REG(r.reg)];
+
+    switch (IREG_GET_SIZE(r.reg)) {
+	case IREG_SIZE_W:
+		return v & 0xffff;
+	case IREG_SIZE_B:
+		return v & 0xff;
+	case IREG_SIZE_BH:
+		return (v >> 8) & 0xff;
+    }
+    return v;
+}
+
+
+static void
+reg_set(ir_reg_t r, uint32_t v)
+{
+    uint32_t *p = &regs[IREG_GET_REG(r.reg)];
+
+    switch (IREG_GET_SIZE(r.reg)) {
+	case IREG_SIZE_W:
+		*p = (*p & ~0xffff) | (v & 0xffff);
+		break;
+	case IREG_SIZE_B:
+		*p = (*p & ~0xff) | (v & 0xff);
+		break;
+	case IREG_SIZE_BH:
+		*p = (*p & ~0xff00) | ((v & 0xff) << 8);
+		break;
+	default:
+		*p = v;
+		break;
+    }
+}
+
+
+static int
+reg_bytes(ir_reg_t r)
+{
+    switch (IREG_GET_SIZE(r.reg)) {
+	case IREG_SIZE_W:
+		return 2;
+	case IREG_SIZE_B:
+	case IREG_SIZE_BH:
+		return 1;
+    }
+    return 4;
+}
+
+
+static uint32_t
+mem_read(uint32_t addr, int bytes)
+{
+    uint32_t v = 0;
+
+    memcpy(&v, &mem[addr & (MEM_SIZE - 1)], bytes);
+    return v;
+}
+
+
+static void
+mem_write(uint32_t addr, uint32_t v, int bytes)
+{
+    memcpy(&mem[addr & (MEM_SIZE - 1)], &v, bytes);
+}
+
+
+static uint32_t
+alu(uint32_t type, uint32_t a, uint32_t b)
+{
+    switch (type) {
+	case UOP_ADD: case UOP_ADD_IMM:
+		return a + b;
+	case UOP_SUB: case UOP_SUB_IMM:
+		return a - b;
+	case UOP_AND: case UOP_AND_IMM:
+		return a & b;
+	case UOP_OR: case UOP_OR_IMM:
+		return a | b;
+	case UOP_XOR: case UOP_XOR_IMM:
+		return a ^ b;
+	case UOP_SHL: case UOP_SHL_IMM:
+		return a << (b & 31);
+	case UOP_SHR: case UOP_SHR_IMM:
+		return a >> (b & 31);
+	case UOP_SAR: case UOP_SAR_IMM:
+		return (uint32_t) ((int32_t) a >> (b & 31));
+	case UOP_ROL: case UOP_ROL_IMM:
+		b &= 31;
+		return b ? ((a << b) | (a >> (32 - b))) : a;
+	case UOP_ROR: case UOP_ROR_IMM:
+		b &= 31;
+		return b ? ((a >> b) | (a << (32 - b))) : a;
+    }
+    fatal("alu - unexpected uOP %08x\n", type);
+    return 0;
+}
+
+
+/*The backend. Every uOP the generator below can produce, and every uOP the
+  passes can turn it into.*/
+static int
+uop_run(codeblock_t *block, uop_t *uop)
+{
+    uint32_t v;
+
+    uops_run++;
+
+    switch (uop->type) {
+	case UOP_MOV_IMM:
+		reg_set(uop->dest_reg_a, uop->imm_data);
+		break;
+	case UOP_MOV:
+	case UOP_MOVZX:
+		reg_set(uop->dest_reg_a, reg_get(uop->src_reg_a));
+		break;
+	case UOP_MOVSX:
+		v = reg_get(uop->src_reg_a);
+		if (reg_bytes(uop->src_reg_a) == 2)
+			v = (uint32_t) (int32_t) (int16_t) v;
+		else
+			v = (uint32_t) (int32_t) (int8_t) v;
+		reg_set(uop->dest_reg_a, v);
+		break;
+
+	case UOP_ADD: case UOP_SUB: case UOP_AND: case UOP_OR: case UOP_XOR:
+	case UOP_SHL: case UOP_SHR: case UOP_SAR: case UOP_ROL: case UOP_ROR:
+		reg_set(uop->dest_reg_a, alu(uop->type, reg_get(uop->src_reg_a), reg_get(uop->src_reg_b)));
+		break;
+	case UOP_ADD_IMM: case UOP_SUB_IMM: case UOP_AND_IMM: case UOP_OR_IMM: case UOP_XOR_IMM:
+	case UOP_SHL_IMM: case UOP_SHR_IMM: case UOP_SAR_IMM: case UOP_ROL_IMM: case UOP_ROR_IMM:
+		reg_set(uop->dest_reg_a, alu(uop->type, reg_get(uop->src_reg_a), uop->imm_data));
+		break;
+	case UOP_ADD_LSHIFT:
+		reg_set(uop->dest_reg_a, reg_get(uop->src_reg_a) + (reg_get(uop->src_reg_b) << uop->imm_data));
+		break;
+
+	case UOP_MEM_LOAD_REG:
+		v = reg_get(uop->src_reg_a) + reg_get(uop->src_reg_b) + uop->imm_data;
+		reg_set(uop->dest_reg_a, mem_read(v, reg_bytes(uop->dest_reg_a)));
+		break;
+	case UOP_MEM_LOAD_ABS:
+		v = reg_get(uop->src_reg_a) + uop->imm_data;
+		reg_set(uop->dest_reg_a, mem_read(v, reg_bytes(uop->dest_reg_a)));
+		break;
+	case UOP_MEM_STORE_REG:
+		v = reg_get(uop->src_reg_a) + reg_get(uop->src_reg_b) + uop->imm_data;
+		mem_write(v, reg_get(uop->src_reg_c), reg_bytes(uop->src_reg_c));
+		break;
+	case UOP_MEM_STORE_ABS:
+		v = reg_get(uop->src_reg_a) + uop->imm_data;
+		mem_write(v, reg_get(uop->src_reg_b), reg_bytes(uop->src_reg_b));
+		break;
+	case UOP_MEM_STORE_IMM_8:
+		mem_write(reg_get(uop->src_reg_a) + reg_get(uop->src_reg_b), uop->imm_data, 1);
+		break;
+	case UOP_MEM_STORE_IMM_16:
+		mem_write(reg_get(uop->src_reg_a) + reg_get(uop->src_reg_b), uop->imm_data, 2);
+		break;
+	case UOP_MEM_STORE_IMM_32:
+		mem_write(reg_get(uop->src_reg_a) + reg_get(uop->src_reg_b), uop->imm_data, 4);
+		break;
+
+	default:
+		fatal("uop_run - unexpected uOP %08x\n", uop->type);
+    }
+
+    return 0;
+}
+
+const uOpFn uop_handlers[UOP_MAX] = { [0 ... (UOP_MAX - 1)] = uop_run };
+
+
+/*Guest registers, the temporaries the x86 front end uses, and sub-registers of
+  both. Dword registers are picked most often, since those are what the passes
+  work on.*/
+static const int regs_l[] = { IREG_EAX, IREG_ECX, IREG_EDX, IREG_EBX, IREG_ESI, IREG_EDI,
+			      IREG_temp0, IREG_temp1, IREG_temp2, IREG_temp3 };
+static const int regs_w[] = { IREG_AX, IREG_CX, IREG_DX, IREG_BX, IREG_temp0_W, IREG_temp1_W };
+static const int regs_b[] = { IREG_AL, IREG_CL, IREG_AH, IREG_CH, IREG_temp0_B, IREG_temp1_B };
+static const int alu_reg[] = { UOP_ADD, UOP_SUB, UOP_AND, UOP_OR, UOP_XOR,
+			       UOP_SHL, UOP_SHR, UOP_SAR, UOP_ROL, UOP_ROR };
+static const int alu_imm[] = { UOP_ADD_IMM, UOP_SUB_IMM, UOP_AND_IMM, UOP_OR_IMM, UOP_XOR_IMM,
+			       UOP_SHL_IMM, UOP_SHR_IMM, UOP_SAR_IMM, UOP_ROL_IMM, UOP_ROR_IMM };
+
+#define PICK(a)	(a[rnd(seed) % (sizeof(a) / sizeof(a[0]))])
+
+
+static uint32_t
+rnd(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+
+static uint32_t
+rnd_imm(uint32_t *seed)
+{
+    /* Small values often, so folded addresses land inside the memory. */
+    return (rnd(seed) & 1) ? (rnd(seed) & 0xfff) : ((rnd(seed) << 16) ^ rnd(seed));
+}
+
+
+static void
+gen_block(ir_data_t *ir, uint32_t seed_val)
+{
+    uint32_t seed_buf = seed_val, *seed = &seed_buf;
+    int i, op, sz;
+
+    for (i = 0; i < BLOCK_UOPS; i++) {
+	op = rnd(seed) % 16;
+	sz = rnd(seed) % 8;
+
+	switch (op) {
+		case 0: case 1: case 2:
+			uop_MOV_IMM(ir, PICK(regs_l), rnd_imm(seed));
+			break;
+		case 3: case 4:
+			if (sz == 0)
+				uop_MOV(ir, PICK(regs_w), PICK(regs_w));
+			else if (sz == 1)
+				uop_MOV(ir, PICK(regs_b), PICK(regs_b));
+			else
+				uop_MOV(ir, PICK(regs_l), PICK(regs_l));
+			break;
+		case 5:
+			if (sz & 1)
+				uop_MOVZX(ir, PICK(regs_l), (sz & 2) ? PICK(regs_w) : PICK(regs_b));
+			else
+				uop_MOVSX(ir, PICK(regs_l), (sz & 2) ? PICK(regs_w) : PICK(regs_b));
+			break;
+		case 6: case 7: case 8:
+			/* Sub-dword ALU uOPs are only emitted for the non-shift ops. */
+			if (sz == 0)
+				uop_gen_reg_dst_src2(alu_reg[rnd(seed) % 5], ir, PICK(regs_w), PICK(regs_w), PICK(regs_w));
+			else if (sz == 1)
+				uop_gen_reg_dst_src2(alu_reg[rnd(seed) % 5], ir, PICK(regs_b), PICK(regs_b), PICK(regs_b));
+			else
+				uop_gen_reg_dst_src2(PICK(alu_reg), ir, PICK(regs_l), PICK(regs_l), PICK(regs_l));
+			break;
+		case 9: case 10:
+			if (sz == 0)
+				uop_gen_reg_dst_src_imm(alu_imm[rnd(seed) % 5], ir, PICK(regs_w), PICK(regs_w), rnd_imm(seed) & 0xffff);
+			else
+				uop_gen_reg_dst_src_imm(PICK(alu_imm), ir, PICK(regs_l), PICK(regs_l), rnd_imm(seed) & 31);
+			break;
+		case 11:
+			uop_ADD_LSHIFT(ir, PICK(regs_l), PICK(regs_l), PICK(regs_l), rnd(seed) & 3);
+			break;
+		case 12: case 13:
+			if (sz == 0)
+				uop_MEM_LOAD_REG_OFFSET(ir, PICK(regs_w), IREG_DS_base, PICK(regs_l), rnd(seed) & 0xff);
+			else if (sz == 1)
+				uop_MEM_LOAD_REG(ir, PICK(regs_b), IREG_DS_base, PICK(regs_l));
+			else
+				uop_MEM_LOAD_REG_OFFSET(ir, PICK(regs_l), IREG_DS_base, PICK(regs_l), (sz & 2) ? (rnd(seed) & 0xff) : 0);
+			break;
+		default:
+			if (sz == 0)
+				uop_MEM_STORE_REG(ir, IREG_DS_base, PICK(regs_l), PICK(regs_w));
+			else if (sz == 1)
+				uop_MEM_STORE_REG(ir, IREG_DS_base, PICK(regs_l), PICK(regs_b));
+			else
+				uop_MEM_STORE_REG_OFFSET(ir, IREG_DS_base, PICK(regs_l), (sz & 2) ? (rnd(seed) & 0xff) : 0, PICK(regs_l));
+			break;
+	}
+    }
+}
+
+
+static void
+init_state(uint32_t seed_val)
+{
+    uint32_t seed_buf = seed_val ^ 0x5a5a5a5a, *seed = &seed_buf;
+    int i;
+
+    for (i = 0; i < IREG_COUNT; i++)
+	regs[i] = (rnd(seed) << 16) ^ rnd(seed);
+    regs[IREG_DS_base] = rnd(seed) & 0xf000;
+    for (i = 0; i < MEM_SIZE; i++)
+	mem[i] = rnd(seed);
+}
+
+
+static double
+now_sec(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + (t.tv_nsec / 1e9);
+}
+
+
+static void
+run_block(uint32_t seed, int optimise)
+{
+    codeblock_t block;
+    ir_data_t *ir;
+    double start;
+
+    memset(&block, 0, sizeof(block));
+    codegen_ir_optimise = optimise;
+    cpu_block_end = 0;
+
+    codegen_reg_reset();
+    ir = codegen_ir_init();
+    gen_block(ir, seed);
+    init_state(seed);
+
+    start = now_sec();
+    codegen_ir_compile(ir, &block);
+    compile_time += now_sec() - start;
+}
+
+
+static int
+check_blocks(void)
+{
+    static uint8_t ref_mem[MEM_SIZE + 4];
+    uint32_t ref_regs[IREG_COUNT];
+    int b, i, run[2] = { 0, 0 };
+
+    for (b = 0; b < CHECK_BLOCKS; b++) {
+	uops_run = 0;
+	run_block(b + 1, 0);
+	run[0] += uops_run;
+	memcpy(ref_regs, regs, sizeof(regs));
+	memcpy(ref_mem, mem, sizeof(mem));
+
+	uops_run = 0;
+	run_block(b + 1, 1);
+	run[1] += uops_run;
+
+	/* Temporaries are dead at the end of a block, so only the guest
+	   registers have to match. */
+	for (i = IREG_EAX; i <= IREG_EDI; i++) {
+		if (regs[i] != ref_regs[i]) {
+			printf("FAIL: block %i, register %i is %08x, expected %08x\n",
+			       b + 1, i, regs[i], ref_regs[i]);
+			return 0;
+		}
+	}
+	if (memcmp(mem, ref_mem, MEM_SIZE)) {
+		printf("FAIL: block %i, memory differs\n", b + 1);
+		return 0;
+	}
+    }
+
+    printf("Optimised blocks match over %i blocks of %i uOPs\n", CHECK_BLOCKS, BLOCK_UOPS);
+    printf("uOPs executed: %i without the passes, %i with (%.1f%% fewer)\n",
+	   run[0], run[1], 100.0 * (run[0] - run[1]) / run[0]);
+    printf("uOPs folded %i, reads propagated %i\n",
+	   codegen_ir_uops_folded, codegen_ir_reads_propagated);
+    return 1;
+}
+
+
+static void
+bench(int optimise)
+{
+    int b;
+
+    host_loads = host_stores = 0;
+    compile_time = 0.0;
+    for (b = 0; b < CHECK_BLOCKS; b++)
+	run_block(b + 1, optimise);
+
+    printf("Passes %-3s: %8.0f blocks/s compiled, %8i host register loads, %8i stores\n",
+	   optimise ? "on" : "off", CHECK_BLOCKS / compile_time, host_loads, host_stores);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    if (!check_blocks())
+	return 1;
+
+    bench(0);
+    bench(1);
+
+    return 0;
+}
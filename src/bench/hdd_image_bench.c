@@ -0,0 +1,572 @@
+/*
+ * 86Box	A hypervisor and IBM PC system emulator that specializes in
+ *		running old operating systems and software designed for IBM
+ *		PC systems and compatibles from 1981 through fairly recent
+ *		system designs based on the PCI bus.
+ *
+ *		This file is part of the 86Box distribution.
+ *
+ *		Standalone check and trace replay benchmark for the hard
+ *		disk image layer.
+ *
+ *		Drives the real hdd_image.c on a raw image and on a dynamic
+ *		VHD with a random mix of synchronous and queued reads and
+ *		writes, zeroing and requests running off the end of the
+ *		disk. It checks every read against an in-memory copy of
+ *		the disk, and checks the whole image again after reopening
+ *		it. It then replays sequential and random sector traces
+ *		on the raw image, through hdd_image.c and through the old
+ *		one-fread()-per-sector code, and reports MB/s for both.
+ *
+ *		Build and run from src/ (Linux/POSIX host, the images go
+ *		to the current directory):
+ *
+ *		  gcc -O2 -Iinclude -Icpu -o hdd_image_bench \
+ *		      bench/hdd_image_bench.c disk/hdd_image.c -lpthread
+ *		  ./hdd_image_bench
+ *
+ *		Exits non-zero on any mismatch.
+ */
+#define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include <pthread.h>
+#include <86box/86box.h>
+#include <86box/plat.h>
+#include <86box/random.h>
+#include <86box/hdd.h>
+
+
+#define SPT		63
+#define HPC		16
+#define TRACKS		65
+#define SECTORS		(SPT * HPC * TRACKS)
+#define CHECK_OPS	20000
+#define MAX_COUNT	128
+#define RANDOM_READS	50000
+
+
+hard_disk_t	hdd[HDD_NUM];
+
+static uint8_t	*shadow, *buf, *buf2, *expect;
+
+
+void
+pclog(const char *fmt, ...)
+{
+}
+
+
+void
+pclog_toggle_suppr(void)
+{
+}
+
+
+void
+fatal(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    exit(2);
+}
+
+
+uint8_t
+random_generate(void)
+{
+    return (uint8_t) rand();
+}
+
+
+FILE *
+plat_fopen(wchar_t *path, wchar_t *mode)
+{
+    char p[1024], m[16];
+
+    wcstombs(p, path, sizeof(p));
+    wcstombs(m, mode, sizeof(m));
+
+    return fopen(p, m);
+}
+
+
+void
+plat_get_dirname(wchar_t *dest, const wchar_t *path)
+{
+    const wchar_t *s = wcsrchr(path, L'/');
+    int len = s ? (int) (s - path) : 0;
+
+    wcsncpy(dest, path, len);
+    dest[len] = L'\0';
+}
+
+
+void
+plat_append_filename(wchar_t *dest, wchar_t *s1, wchar_t *s2)
+{
+    wcscpy(dest, s1);
+    if (dest[0] && (dest[wcslen(dest) - 1] != L'/'))
+	wcscat(dest, L"/");
+    wcscat(dest, s2);
+}
+
+
+int
+plat_path_abs(wchar_t *path)
+{
+    return path[0] == L'/';
+}
+
+
+/*Auto-reset events on top of pthreads, like the Windows ones in win/.*/
+typedef struct
+{
+    pthread_mutex_t	mutex;
+    pthread_cond_t	cond;
+    int			state;
+} bench_event_t;
+
+
+event_t *
+thread_create_event(void)
+{
+    bench_event_t *ev = (bench_event_t *) calloc(1, sizeof(bench_event_t));
+
+    pthread_mutex_init(&ev->mutex, NULL);
+    pthread_cond_init(&ev->cond, NULL);
+
+    return (event_t *) ev;
+}
+
+
+void
+thread_set_event(event_t *arg)
+{
+    bench_event_t *ev = (bench_event_t *) arg;
+
+    pthread_mutex_lock(&ev->mutex);
+    ev->state = 1;
+    pthread_cond_signal(&ev->cond);
+    pthread_mutex_unlock(&ev->mutex);
+}
+
+
+void
+thread_reset_event(event_t *arg)
+{
+    bench_event_t *ev = (bench_event_t *) arg;
+
+    pthread_mutex_lock(&ev->mutex);
+    ev->state = 0;
+    pthread_mutex_unlock(&ev->mutex);
+}
+
+
+static void
+event_unlock(void *arg)
+{
+    pthread_mutex_unlock((pthread_mutex_t *) arg);
+}
+
+
+int
+thread_wait_event(event_t *arg, int timeout)
+{
+    bench_event_t *ev = (bench_event_t *) arg;
+
+    pthread_mutex_lock(&ev->mutex);
+    pthread_cleanup_push(event_unlock, &ev->mutex);
+    while (!ev->state)
+	pthread_cond_wait(&ev->cond, &ev->mutex);
+    ev->state = 0;
+    pthread_cleanup_pop(1);
+
+    return 0;
+}
+
+
+void
+thread_destroy_event(event_t *arg)
+{
+    bench_event_t *ev = (bench_event_t *) arg;
+
+    pthread_cond_destroy(&ev->cond);
+    pthread_mutex_destroy(&ev->mutex);
+    free(ev);
+}
+
+
+typedef struct
+{
+    pthread_t	thread;
+    void	(*func)(void *param);
+    void	*param;
+} bench_thread_t;
+
+
+static void *
+thread_run(void *arg)
+{
+    bench_thread_t *t = (bench_thread_t *) arg;
+
+    t->func(t->param);
+
+    return NULL;
+}
+
+
+thread_t *
+thread_create(void (*thread_func)(void *param), void *param)
+{
+    bench_thread_t *t = (bench_thread_t *) calloc(1, sizeof(bench_thread_t));
+
+    t->func = thread_func;
+    t->param = param;
+    pthread_create(&t->thread, NULL, thread_run, t);
+
+    return (thread_t *) t;
+}
+
+
+void
+thread_kill(thread_t *arg)
+{
+    bench_thread_t *t = (bench_thread_t *) arg;
+
+    pthread_cancel(t->thread);
+    pthread_join(t->thread, NULL);
+    free(t);
+}
+
+
+static uint32_t	seed = 1;
+
+
+static uint32_t
+next_rand(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+
+static void
+fill(uint8_t *p, uint32_t count)
+{
+    uint32_t i;
+
+    for (i = 0; i < (count << 9); i += 4)
+	*(uint32_t *) &p[i] = next_rand() * 2654435761u;
+}
+
+
+static int
+load(const wchar_t *fn)
+{
+    memset(&hdd[0], 0, sizeof(hard_disk_t));
+    wcscpy(hdd[0].fn, fn);
+    hdd[0].spt = SPT;
+    hdd[0].hpc = HPC;
+    hdd[0].tracks = TRACKS;
+
+    return hdd_image_load(0);
+}
+
+
+static void
+create_raw(const char *fn)
+{
+    FILE *f = fopen(fn, "wb");
+
+    fill(shadow, SECTORS);
+    fwrite(shadow, 512, SECTORS, f);
+    fclose(f);
+}
+
+
+static void
+create_vhd(const char *fn)
+{
+    FILE *f = fopen(fn, "wb+");
+    vhd_footer_t *vft = NULL;
+
+    new_vhd_footer(&vft);
+    vft->orig_size = vft->curr_size = ((uint64_t) SECTORS) << 9;
+    vft->geom.cyl = TRACKS;
+    vft->geom.heads = HPC;
+    vft->geom.spt = SPT;
+    vhd_create_dynamic(f, vft);
+    fclose(f);
+    free(vft);
+
+    memset(shadow, 0, SECTORS << 9);
+}
+
+
+static int
+compare(const char *what, uint32_t sector, uint32_t count, uint8_t *p, uint8_t *ref)
+{
+    if (memcmp(p, ref, count << 9)) {
+	printf("FAIL: %s of %u sectors at %u returned the wrong data\n", what, count, sector);
+	return 0;
+    }
+
+    return 1;
+}
+
+
+static int
+check_image(const char *name, const wchar_t *fn)
+{
+    uint32_t sector, count, i;
+    int op, ret, async_pending = 0;
+    uint32_t async_sector = 0, async_count = 0;
+
+    if (!load(fn)) {
+	printf("FAIL: cannot load the %s image\n", name);
+	return 0;
+    }
+
+    if (hdd_image_get_last_sector(0) != (SECTORS - 1)) {
+	printf("FAIL: %s image reports %u sectors\n", name, hdd_image_get_last_sector(0) + 1);
+	return 0;
+    }
+
+    for (i = 0; i < CHECK_OPS; i++) {
+	op = next_rand() % 20;
+	count = 1 + (next_rand() % MAX_COUNT);
+	sector = next_rand() % (SECTORS - count + 1);
+
+	/* Now and then run a request off the end of the disk. */
+	if (op == 19)
+		sector = SECTORS - (count >> 1) - 1;
+
+	if ((op < 6) || (op == 19)) {
+		ret = hdd_image_read_ex(0, sector, count, buf);
+		if ((sector + count) > SECTORS) {
+			if (!ret) {
+				printf("FAIL: read past the end did not report it\n");
+				return 0;
+			}
+			count = SECTORS - sector;
+		}
+		if (!compare("read", sector, count, buf, &shadow[sector << 9]))
+			return 0;
+	} else if (op < 11) {
+		fill(buf, count);
+		hdd_image_write_ex(0, sector, count, buf);
+		memcpy(&shadow[sector << 9], buf, count << 9);
+	} else if (op < 15) {
+		/* The data is copied at submission, so the buffer can be
+		   scribbled over straight away. */
+		fill(buf, count);
+		hdd_image_write_async(0, sector, count, buf);
+		memcpy(&shadow[sector << 9], buf, count << 9);
+		memset(buf, 0x55, count << 9);
+	} else if (op < 17) {
+		/* A queued read sees everything queued before it and nothing
+		   done after it, so what it should return is known now. The
+		   check comes after whichever request waits for it. */
+		if (async_pending)
+			continue;
+		memcpy(expect, &shadow[sector << 9], count << 9);
+		hdd_image_read_async(0, sector, count, buf2);
+		async_pending = 1;
+		async_sector = sector;
+		async_count = count;
+		continue;
+	} else {
+		hdd_image_zero_ex(0, sector, count);
+		memset(&shadow[sector << 9], 0, count << 9);
+	}
+
+	if (async_pending) {
+		hdd_image_wait(0);
+		if (!compare("queued read", async_sector, async_count, buf2, expect))
+			return 0;
+		async_pending = 0;
+	}
+    }
+
+    hdd_image_wait(0);
+    hdd_image_close(0);
+
+    /* Reopen and check every sector made it to the file. */
+    if (!load(fn)) {
+	printf("FAIL: cannot reload the %s image\n", name);
+	return 0;
+    }
+    for (sector = 0; sector < SECTORS; sector += MAX_COUNT) {
+	count = ((SECTORS - sector) < MAX_COUNT) ? (SECTORS - sector) : MAX_COUNT;
+	hdd_image_read(0, sector, count, buf);
+	if (!compare("read after reopening", sector, count, buf, &shadow[sector << 9]))
+		return 0;
+    }
+    hdd_image_close(0);
+
+    printf("%s image: %i random requests and a reopen match\n", name, CHECK_OPS);
+    return 1;
+}
+
+
+/*hdd_image_read_ex() and hdd_image_write_ex() as they were before: find the
+  disk size by seeking to the end, then one stdio call per sector.*/
+static uint32_t
+ref_sectors(FILE *f)
+{
+    fseeko64(f, 0, SEEK_END);
+    return (uint32_t) (ftello64(f) >> 9);
+}
+
+
+static void
+ref_read_ex(FILE *f, uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+    uint32_t sectors = ref_sectors(f);
+    uint32_t i;
+
+    if ((sectors - sector) < count)
+	count = sectors - sector;
+
+    fseeko64(f, ((uint64_t) sector) << 9, SEEK_SET);
+    for (i = 0; i < count; i++) {
+	if (feof(f))
+		break;
+	fread(buffer + (i << 9), 1, 512, f);
+    }
+}
+
+
+static void
+ref_write_ex(FILE *f, uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+    uint32_t sectors = ref_sectors(f);
+    uint32_t i;
+
+    if ((sectors - sector) < count)
+	count = sectors - sector;
+
+    fseeko64(f, ((uint64_t) sector) << 9, SEEK_SET);
+    for (i = 0; i < count; i++) {
+	if (feof(f))
+		break;
+	fwrite(buffer + (i << 9), 512, 1, f);
+    }
+}
+
+
+static double
+now_sec(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + (t.tv_nsec / 1e9);
+}
+
+
+/*Replay one trace, either through hdd_image.c or through the old code on a
+  FILE * of its own.  Sequential traces sweep the disk in count-sector
+  requests, random ones make RANDOM_READS requests of count sectors.*/
+static double
+replay(FILE *f, int write, int random, uint32_t count)
+{
+    uint32_t sector, n, total;
+    double start;
+
+    n = random ? RANDOM_READS : (SECTORS / count);
+    total = 0;
+
+    start = now_sec();
+    while (n--) {
+	sector = random ? (next_rand() % (SECTORS - count)) : total;
+
+	if (f && write)
+		ref_write_ex(f, sector, count, buf);
+	else if (f)
+		ref_read_ex(f, sector, count, buf);
+	else if (write)
+		hdd_image_write_ex(0, sector, count, buf);
+	else
+		hdd_image_read_ex(0, sector, count, buf);
+
+	total += count;
+    }
+    if (f)
+	fflush(f);
+
+    return ((double) total) * 512.0 / (now_sec() - start) / (1024.0 * 1024.0);
+}
+
+
+static void
+bench(const char *fn, const wchar_t *wfn)
+{
+    static const struct {
+	const char	*name;
+	int		write, random;
+	uint32_t	count;
+    } traces[] = {
+	{ "sequential read, 8 KB",   0, 0, 16  },
+	{ "sequential read, 64 KB",  0, 0, 128 },
+	{ "random read, 4 KB",       0, 1, 8   },
+	{ "sequential write, 8 KB",  1, 0, 16  },
+	{ "random write, 4 KB",      1, 1, 8   }
+    };
+    FILE *f;
+    double mb_new, mb_old;
+    int i;
+
+    fill(buf, MAX_COUNT);
+
+    for (i = 0; i < (int) (sizeof(traces) / sizeof(traces[0])); i++) {
+	load(wfn);
+	mb_new = replay(NULL, traces[i].write, traces[i].random, traces[i].count);
+	hdd_image_close(0);
+
+	f = fopen(fn, "rb+");
+	mb_old = replay(f, traces[i].write, traces[i].random, traces[i].count);
+	fclose(f);
+
+	printf("%-24s: %8.1f MB/s, per-sector %8.1f MB/s\n",
+	       traces[i].name, mb_new, mb_old);
+    }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    shadow = (uint8_t *) malloc(SECTORS << 9);
+    buf = (uint8_t *) malloc(MAX_COUNT << 9);
+    buf2 = (uint8_t *) malloc(MAX_COUNT << 9);
+    expect = (uint8_t *) malloc(MAX_COUNT << 9);
+
+    hdd_image_init();
+
+    create_raw("hdd_bench.img");
+    if (!check_image("Raw", L"hdd_bench.img"))
+	return 1;
+
+    create_vhd("hdd_bench.vhd");
+    if (!check_image("Dynamic VHD", L"hdd_bench.vhd"))
+	return 1;
+
+    bench("hdd_bench.img", L"hdd_bench.img");
+
+    remove("hdd_bench.img");
+    remove("hdd_bench.vhd");
+
+    return 0;
+}
@@ -0,0 +1,487 @@
+/*
+ * 86Box	A hypervisor and IBM PC system emulator that specializes in
+ *		running old operating systems and software designed for IBM
+ *		PC systems and compatibles from 1981 through fairly recent
+ *		system designs based on the PCI bus.
+ *
+ *		This file is part of the 86Box distribution.
+ *
+ *		Standalone check and micro-benchmark for the I/O port
+ *		dispatch.
+ *
+ *		Registers and removes random handlers of mixed widths
+ *		through the real io.c, mirroring them into plain handler
+ *		lists, and checks every inb() ... outl() against the old
+ *		list walk: same return value, same handler calls in the
+ *		same order, same Amstrad latch, and the same io_delay
+ *		charge for unclaimed ports. It then times accesses to a
+ *		typical PC port layout through both.
+ *
+ *		Build and run from src/:
+ *
+ *		  gcc -O2 -Iinclude -Icpu -o io_bench bench/io_bench.c io.c
+ *		  ./io_bench
+ *
+ *		Exits non-zero on any mismatch.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include <86box/86box.h>
+#include <86box/io.h>
+#include <86box/m_amstrad.h>
+
+
+#define CHECK_STEPS	200000
+#define MAX_TRACE	64
+#define MAX_REGS	512
+#define BENCH_ACCESSES	20000000
+
+#define H_INB		1
+#define H_INW		2
+#define H_INL		4
+#define H_OUTB		8
+#define H_OUTW		16
+#define H_OUTL		32
+
+
+int		io_delay = 5;
+int		amstrad_latch;
+
+static int	delay_charges[2], side;
+
+
+void
+sub_cycles(int c)
+{
+    delay_charges[side] += c;
+}
+
+
+/*The old I/O bus: a list of handlers per port, walked on every access.*/
+typedef struct ref_io_t
+{
+    int		mask;
+    void	*priv;
+
+    struct ref_io_t *next;
+} ref_io_t;
+
+static ref_io_t	*ref_io[65536];
+
+
+/*Every handler logs its calls into the trace of the side being run and
+  returns a value that depends on the handler, the port and the width.*/
+typedef struct
+{
+    int		id, kind;
+    uint16_t	port;
+    uint32_t	val;
+} trace_t;
+
+static trace_t	trace[2][MAX_TRACE];
+static int	nr_trace[2];
+
+
+static uint32_t
+h_value(void *priv, int kind, uint16_t port)
+{
+    return ((uint32_t) (intptr_t) priv * 0x9e3779b1u) ^ (port * 0x85ebca6bu) ^ (kind * 0x27d4eb2fu);
+}
+
+
+static void
+h_log(void *priv, int kind, uint16_t port, uint32_t val)
+{
+    trace_t *t;
+
+    if (nr_trace[side] == MAX_TRACE)
+	return;
+
+    t = &trace[side][nr_trace[side]++];
+    t->id = (int) (intptr_t) priv;
+    t->kind = kind;
+    t->port = port;
+    t->val = val;
+}
+
+
+static uint8_t
+h_inb(uint16_t port, void *priv)
+{
+    h_log(priv, H_INB, port, 0);
+    return h_value(priv, H_INB, port);
+}
+
+
+static uint16_t
+h_inw(uint16_t port, void *priv)
+{
+    h_log(priv, H_INW, port, 0);
+    return h_value(priv, H_INW, port);
+}
+
+
+static uint32_t
+h_inl(uint16_t port, void *priv)
+{
+    h_log(priv, H_INL, port, 0);
+    return h_value(priv, H_INL, port);
+}
+
+
+static void
+h_outb(uint16_t port, uint8_t val, void *priv)
+{
+    h_log(priv, H_OUTB, port, val);
+}
+
+
+static void
+h_outw(uint16_t port, uint16_t val, void *priv)
+{
+    h_log(priv, H_OUTW, port, val);
+}
+
+
+static void
+h_outl(uint16_t port, uint32_t val, void *priv)
+{
+    h_log(priv, H_OUTL, port, val);
+}
+
+
+/*Both buses get the same handlers: io.c through io_sethandler() and the old
+  one as a list per port, appended in the same order.*/
+static void
+set_handler(uint16_t base, int size, int mask, void *priv)
+{
+    ref_io_t *p, *q;
+    int c;
+
+    io_sethandler(base, size,
+		  (mask & H_INB) ? h_inb : NULL, (mask & H_INW) ? h_inw : NULL,
+		  (mask & H_INL) ? h_inl : NULL, (mask & H_OUTB) ? h_outb : NULL,
+		  (mask & H_OUTW) ? h_outw : NULL, (mask & H_OUTL) ? h_outl : NULL,
+		  priv);
+
+    for (c = 0; c < size; c++) {
+	q = (ref_io_t *) calloc(1, sizeof(ref_io_t));
+	q->mask = mask;
+	q->priv = priv;
+
+	if (ref_io[base + c]) {
+		for (p = ref_io[base + c]; p->next; p = p->next)
+			;
+		p->next = q;
+	} else
+		ref_io[base + c] = q;
+    }
+}
+
+
+static void
+remove_handler(uint16_t base, int size, int mask, void *priv)
+{
+    ref_io_t **pp, *p;
+    int c;
+
+    io_removehandler(base, size,
+		     (mask & H_INB) ? h_inb : NULL, (mask & H_INW) ? h_inw : NULL,
+		     (mask & H_INL) ? h_inl : NULL, (mask & H_OUTB) ? h_outb : NULL,
+		     (mask & H_OUTW) ? h_outw : NULL, (mask & H_OUTL) ? h_outl : NULL,
+		     priv);
+
+    for (c = 0; c < size; c++) {
+	for (pp = &ref_io[base + c]; *pp; pp = &(*pp)->next) {
+		if (((*pp)->mask == mask) && ((*pp)->priv == priv)) {
+			p = *pp;
+			*pp = p->next;
+			free(p);
+			break;
+		}
+	}
+    }
+}
+
+
+/*The list walks of inb() ... outl() from before the dispatch table.  Returns
+  the found flags, the value read goes to *ret.*/
+static int
+ref_in(uint16_t port, int width, uint32_t *ret)
+{
+    ref_io_t *p;
+    uint32_t r = 0xffffffff;
+    int found = 0, i;
+
+    if (width == 4) {
+	for (p = ref_io[port]; p; p = p->next) {
+		if (p->mask & H_INL) {
+			r &= h_inl(port, p->priv);
+			found |= 4;
+		}
+	}
+    }
+
+    if (width >= 2) {
+	for (i = 0; i < width; i += 2) {
+		for (p = ref_io[(port + i) & 0xffff]; p; p = p->next) {
+			if ((p->mask & H_INW) && ((width == 2) || !(p->mask & H_INL))) {
+				r &= (h_inw(port + i, p->priv) << (i << 3)) | ~(0xffff << (i << 3));
+				found |= 2;
+			}
+		}
+		if (width == 2)
+			break;
+	}
+    }
+
+    for (i = 0; i < width; i++) {
+	for (p = ref_io[(port + i) & 0xffff]; p; p = p->next) {
+		if ((p->mask & H_INB) && ((width == 1) || !(p->mask & H_INW)) &&
+		    ((width < 4) || !(p->mask & H_INL))) {
+			r &= (h_inb(port + i, p->priv) << (i << 3)) | ~(0xff << (i << 3));
+			found |= 1;
+		}
+	}
+    }
+
+    *ret = r;
+    return found;
+}
+
+
+static int
+ref_out(uint16_t port, int width, uint32_t val)
+{
+    ref_io_t *p;
+    int found = 0, i;
+
+    if (width == 4) {
+	for (p = ref_io[port]; p; p = p->next) {
+		if (p->mask & H_OUTL) {
+			h_outl(port, val, p->priv);
+			found |= 4;
+		}
+	}
+    }
+
+    if (width >= 2) {
+	for (i = 0; i < width; i += 2) {
+		for (p = ref_io[(port + i) & 0xffff]; p; p = p->next) {
+			if ((p->mask & H_OUTW) && ((width == 2) || !(p->mask & H_OUTL))) {
+				h_outw(port + i, val >> (i << 3), p->priv);
+				found |= 2;
+			}
+		}
+		if (width == 2)
+			break;
+	}
+    }
+
+    for (i = 0; i < width; i++) {
+	for (p = ref_io[(port + i) & 0xffff]; p; p = p->next) {
+		if ((p->mask & H_OUTB) && ((width == 1) || !(p->mask & H_OUTW)) &&
+		    ((width < 4) || !(p->mask & H_OUTL))) {
+			h_outb(port + i, val >> (i << 3), p->priv);
+			found |= 1;
+		}
+	}
+    }
+
+    return found;
+}
+
+
+/*Run one access through io.c (side 0) and the old walk (side 1).*/
+static uint32_t
+access_io(uint16_t port, int width, int out, uint32_t val)
+{
+    uint32_t ret = 0;
+
+    side = 0;
+    if (out) {
+	switch (width) {
+		case 1: outb(port, val); break;
+		case 2: outw(port, val); break;
+		default: outl(port, val); break;
+	}
+    } else {
+	switch (width) {
+		case 1: ret = inb(port); break;
+		case 2: ret = inw(port); break;
+		default: ret = inl(port); break;
+	}
+    }
+
+    return ret;
+}
+
+
+static uint32_t
+access_ref(uint16_t port, int width, int out, uint32_t val)
+{
+    uint32_t ret = 0;
+    int found;
+
+    side = 1;
+    if (out)
+	found = ref_out(port, width, val);
+    else {
+	found = ref_in(port, width, &ret);
+	if (width < 4)
+		ret &= (1u << (width << 3)) - 1;
+
+	if (port & 0x80)
+		amstrad_latch = AMSTRAD_NOLATCH;
+	else if (port & 0x4000)
+		amstrad_latch = AMSTRAD_SW10;
+	else
+		amstrad_latch = AMSTRAD_SW9;
+    }
+
+    if (!found)
+	sub_cycles(io_delay);
+
+    return ret;
+}
+
+
+static int
+check_dispatch(void)
+{
+    static struct {
+	uint16_t	base;
+	int		size, mask;
+    } regs[MAX_REGS];
+    static const uint16_t windows[] = { 0x01f0, 0x0cf8, 0xfff0 };
+    int nr_regs = 0, step, i, op, width, out, latch;
+    uint32_t seed = 1, val, r0, r1;
+    uint16_t base, port;
+
+    for (step = 0; step < CHECK_STEPS; step++) {
+	seed = seed * 1103515245 + 12345;
+	op = (seed >> 16) % 10;
+
+	if ((op < 2) && (nr_regs < MAX_REGS)) {
+		/* Add a handler of random widths, sometimes several on one
+		   port, sometimes running into the top of the port space. */
+		i = nr_regs++;
+		regs[i].size = 1 + ((seed >> 4) & 7);
+		regs[i].mask = 1 + ((seed >> 8) % 63);
+		base = windows[(seed >> 24) % 3] + ((seed >> 12) & 15);
+		if ((base + regs[i].size) > 0x10000)
+			base = 0x10000 - regs[i].size;
+		regs[i].base = base;
+		set_handler(base, regs[i].size, regs[i].mask, (void *) (intptr_t) (i + 1));
+	} else if ((op < 3) && nr_regs) {
+		/* Remove one, moving the last one into its slot, and give the
+		   moved one a new priv to keep privs unique per slot. */
+		i = (seed >> 8) % nr_regs;
+		remove_handler(regs[i].base, regs[i].size, regs[i].mask, (void *) (intptr_t) (i + 1));
+		nr_regs--;
+		if (i != nr_regs) {
+			remove_handler(regs[nr_regs].base, regs[nr_regs].size, regs[nr_regs].mask,
+				       (void *) (intptr_t) (nr_regs + 1));
+			regs[i] = regs[nr_regs];
+			set_handler(regs[i].base, regs[i].size, regs[i].mask, (void *) (intptr_t) (i + 1));
+		}
+	} else {
+		seed = seed * 1103515245 + 12345;
+		port = windows[(seed >> 24) % 3] + ((seed >> 8) & 31) - 4;
+		width = 1 << ((seed >> 4) % 3);
+		out = (seed >> 20) & 1;
+		val = seed * 2654435761u;
+
+		nr_trace[0] = nr_trace[1] = 0;
+		amstrad_latch = -1;
+		r0 = access_io(port, width, out, val);
+		latch = amstrad_latch;
+		amstrad_latch = -1;
+		r1 = access_ref(port, width, out, val);
+
+		if ((r0 != r1) || (latch != amstrad_latch) || (nr_trace[0] != nr_trace[1]) ||
+		    memcmp(trace[0], trace[1], nr_trace[0] * sizeof(trace_t)) ||
+		    (delay_charges[0] != delay_charges[1])) {
+			printf("FAIL: %s%c(%04X) differs at step %i\n",
+			       out ? "out" : "in", "?bw?l"[width], port, step);
+			return 0;
+		}
+	}
+    }
+
+    printf("Dispatch matches the list walk over %i steps\n", CHECK_STEPS);
+    return 1;
+}
+
+
+static double
+now_sec(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + (t.tv_nsec / 1e9);
+}
+
+
+static void
+bench_access(const char *name, uint16_t port, int spread, int width, int out)
+{
+    double start, t_io, t_ref;
+    uint32_t sum = 0;
+    int i;
+
+    start = now_sec();
+    for (i = 0; i < BENCH_ACCESSES; i++) {
+	nr_trace[0] = 0;
+	sum += access_io(port + (i & spread) * width, width, out, i);
+    }
+    t_io = now_sec() - start;
+
+    start = now_sec();
+    for (i = 0; i < BENCH_ACCESSES; i++) {
+	nr_trace[1] = 0;
+	sum += access_ref(port + (i & spread) * width, width, out, i);
+    }
+    t_ref = now_sec() - start;
+
+    printf("%-24s: dispatch %6.1f M/s, list walk %6.1f M/s (%08X)\n",
+	   name, BENCH_ACCESSES / t_io / 1e6, BENCH_ACCESSES / t_ref / 1e6, sum);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int c;
+
+    io_init();
+
+    if (!check_dispatch())
+	return 1;
+
+    /* A typical layout: byte handlers on most legacy ports, an IDE data
+       port with its own word and dword handlers next to the byte-wide
+       task file, and the PCI configuration ports. */
+    io_init();
+    memset(ref_io, 0, sizeof(ref_io));
+    for (c = 0; c < 0x400; c += 8)
+	set_handler(c, 8, H_INB | H_OUTB, (void *) (intptr_t) (0x1000 + c));
+    set_handler(0x1f0, 1, H_INW | H_INL | H_OUTW | H_OUTL, (void *) (intptr_t) 0x2000);
+    set_handler(0xcf8, 4, H_INB | H_INW | H_INL | H_OUTB | H_OUTW | H_OUTL, (void *) (intptr_t) 0x2001);
+    set_handler(0xcfc, 4, H_INB | H_INW | H_INL | H_OUTB | H_OUTW | H_OUTL, (void *) (intptr_t) 0x2002);
+
+    bench_access("inb, legacy ports", 0x000, 0x3ff, 1, 0);
+    bench_access("outb, legacy ports", 0x000, 0x3ff, 1, 1);
+    bench_access("inw, IDE data", 0x1f0, 0, 2, 0);
+    bench_access("inw, byte-wide VGA pair", 0x3c4, 0, 2, 0);
+    bench_access("outw, byte-wide VGA pair", 0x3c4, 0, 2, 1);
+    bench_access("inl, PCI data", 0xcfc, 0, 4, 0);
+    bench_access("inl, unclaimed", 0x8000, 0, 4, 0);
+
+    return 0;
+}
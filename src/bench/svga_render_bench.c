@@ -0,0 +1,305 @@
+/*
+ * 86Box	A hypervisor and IBM PC system emulator that specializes in
+ *		running old operating systems and software designed for IBM
+ *		PC systems and compatibles from 1981 through fairly recent
+ *		system designs based on the PCI bus.
+ *
+ *		This file is part of the 86Box distribution.
+ *
+ *		Standalone check and micro-benchmark for the direct colour
+ *		SVGA renderers.
+ *
+ *		Renders frames of random VRAM through the real
+ *		vid_svga_render.c and through copies of the plain scalar
+ *		loops, and checks that every pixel matches. This covers
+ *		lines that lie flat in VRAM and lines that wrap around
+ *		vram_display_mask. It then reports frames per second for
+ *		both at common resolutions.
+ *
+ *		Build and run from src/:
+ *
+ *		  gcc -O2 -Iinclude -Icpu -o svga_render_bench \
+ *		      bench/svga_render_bench.c video/vid_svga_render.c
+ *		  ./svga_render_bench
+ *
+ *		Exits non-zero if any pixel differs.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include <86box/86box.h>
+#include <86box/device.h>
+#include <86box/mem.h>
+#include <86box/timer.h>
+#include <86box/video.h>
+#include <86box/vid_svga.h>
+#include <86box/vid_svga_render.h>
+
+
+#define VRAM_SIZE	(8 << 20)
+#define BUF_W		2112
+#define BENCH_FRAMES	50
+
+
+bitmap_t	*buffer32;
+uint8_t		edatlookup[4][4];
+dbcs_font_t	*fontdatksc5601, *fontdatksc5601_user;
+int		overscan_x;
+uint32_t	*video_15to32, *video_16to32;
+
+
+typedef struct
+{
+    const char	*name;
+    int		bpp;
+    void	(*render)(svga_t *svga);
+    void	(*ref)(svga_t *svga, uint32_t *p);
+} render_mode_t;
+
+
+/*The scalar loops as they were before the SSE2 kernels went in.*/
+static void
+ref_15bpp(svga_t *svga, uint32_t *p)
+{
+    uint32_t dat;
+    int x;
+
+    for (x = 0; x <= (svga->hdisp + svga->scrollcache); x += 2) {
+	dat = *(uint32_t *)(&svga->vram[(svga->ma + (x << 1)) & svga->vram_display_mask]);
+	p[x]     = video_15to32[dat & 0xffff];
+	p[x + 1] = video_15to32[dat >> 16];
+    }
+}
+
+
+static void
+ref_16bpp(svga_t *svga, uint32_t *p)
+{
+    uint32_t dat;
+    int x;
+
+    for (x = 0; x <= (svga->hdisp + svga->scrollcache); x += 2) {
+	dat = *(uint32_t *)(&svga->vram[(svga->ma + (x << 1)) & svga->vram_display_mask]);
+	p[x]     = video_16to32[dat & 0xffff];
+	p[x + 1] = video_16to32[dat >> 16];
+    }
+}
+
+
+static void
+ref_32bpp(svga_t *svga, uint32_t *p)
+{
+    uint32_t dat;
+    int x;
+
+    for (x = 0; x <= (svga->hdisp + svga->scrollcache); x++) {
+	dat = *(uint32_t *)(&svga->vram[(svga->ma + (x << 2)) & svga->vram_display_mask]);
+	p[x] = dat & 0xffffff;
+    }
+}
+
+
+static void
+ref_ABGR8888(svga_t *svga, uint32_t *p)
+{
+    uint32_t dat;
+    int x;
+
+    for (x = 0; x <= (svga->hdisp + svga->scrollcache); x++) {
+	dat = *(uint32_t *)(&svga->vram[(svga->ma + (x << 2)) & svga->vram_display_mask]);
+	p[x] = ((dat & 0xff0000) >> 16) | (dat & 0x00ff00) | ((dat & 0x0000ff) << 16);
+    }
+}
+
+
+static void
+ref_RGBA8888(svga_t *svga, uint32_t *p)
+{
+    uint32_t dat;
+    int x;
+
+    for (x = 0; x <= (svga->hdisp + svga->scrollcache); x++) {
+	dat = *(uint32_t *)(&svga->vram[(svga->ma + (x << 2)) & svga->vram_display_mask]);
+	p[x] = dat >> 8;
+    }
+}
+
+
+static const render_mode_t modes[] = {
+    { "15 bpp",   16, svga_render_15bpp_highres,    ref_15bpp    },
+    { "16 bpp",   16, svga_render_16bpp_highres,    ref_16bpp    },
+    { "32 bpp",   32, svga_render_32bpp_highres,    ref_32bpp    },
+    { "ABGR8888", 32, svga_render_ABGR8888_highres, ref_ABGR8888 },
+    { "RGBA8888", 32, svga_render_RGBA8888_highres, ref_RGBA8888 }
+};
+
+
+/*Same formula as calc_15to32()/calc_16to32() in video.c.*/
+static void
+make_tables(void)
+{
+    int c, b, g, r;
+
+    video_15to32 = (uint32_t *) malloc(4 * 65536);
+    video_16to32 = (uint32_t *) malloc(4 * 65536);
+
+    for (c = 0; c < 65536; c++) {
+	b = (int) (((double) (c & 31) / 31.0) * 255.0);
+	g = (int) (((double) ((c >> 5) & 31) / 31.0) * 255.0);
+	r = (int) (((double) ((c >> 10) & 31) / 31.0) * 255.0);
+	video_15to32[c] = b | (g << 8) | (r << 16);
+
+	b = (int) (((double) (c & 31) / 31.0) * 255.0);
+	g = (int) (((double) ((c >> 5) & 63) / 63.0) * 255.0);
+	r = (int) (((double) ((c >> 11) & 31) / 31.0) * 255.0);
+	video_16to32[c] = b | (g << 8) | (r << 16);
+    }
+}
+
+
+static bitmap_t *
+make_bitmap(int h)
+{
+    bitmap_t *b = (bitmap_t *) calloc(1, sizeof(bitmap_t));
+    int y;
+
+    b->w = BUF_W;
+    b->h = h;
+    b->dat = (uint32_t *) calloc(BUF_W * h, sizeof(uint32_t));
+    for (y = 0; y < h; y++)
+	b->line[y] = &b->dat[y * BUF_W];
+
+    return b;
+}
+
+
+/*Render one frame starting at VRAM address ma, either through the renderer
+  under test into buffer32 or through the reference loop into ref.*/
+static void
+render_frame(svga_t *svga, const render_mode_t *m, int w, int h, uint32_t ma,
+	     bitmap_t *ref)
+{
+    int y;
+
+    svga->hdisp = w - 1;
+    svga->firstline_draw = 2000;
+
+    for (y = 0; y < h; y++) {
+	svga->displine = y;
+	svga->ma = (ma + (y * ((w * m->bpp) >> 3))) & svga->vram_display_mask;
+
+	if (ref)
+		m->ref(svga, ref->line[y]);
+	else
+		m->render(svga);
+    }
+}
+
+
+static int
+check_mode(svga_t *svga, const render_mode_t *m, bitmap_t *ref)
+{
+    static const int widths[] = { 1, 7, 8, 9, 640, 799, 1024, 1600 };
+    uint32_t ma;
+    int i, y, sc, wrap;
+
+    for (i = 0; i < (int) (sizeof(widths) / sizeof(widths[0])); i++) {
+	for (sc = 0; sc < 8; sc++) {
+		for (wrap = 0; wrap < 2; wrap++) {
+			/* Either an odd address in the middle of VRAM, or one
+			   that makes the first line wrap round the mask. */
+			ma = wrap ? (VRAM_SIZE - (widths[i] * (m->bpp >> 3) / 2) - 2) : 0x12346;
+			svga->scrollcache = sc;
+
+			memset(buffer32->dat, 0, BUF_W * 16 * sizeof(uint32_t));
+			memset(ref->dat, 0, BUF_W * 16 * sizeof(uint32_t));
+			render_frame(svga, m, widths[i], 16, ma, NULL);
+			render_frame(svga, m, widths[i], 16, ma, ref);
+
+			for (y = 0; y < 16; y++) {
+				if (memcmp(buffer32->line[y], ref->line[y],
+					   (widths[i] + sc) * sizeof(uint32_t))) {
+					printf("FAIL: %s, width %i, scrollcache %i%s, line %i\n",
+					       m->name, widths[i], sc, wrap ? ", wrapping" : "", y);
+					return 0;
+				}
+			}
+		}
+	}
+    }
+
+    return 1;
+}
+
+
+static double
+now_sec(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + (t.tv_nsec / 1e9);
+}
+
+
+static void
+bench_mode(svga_t *svga, const render_mode_t *m, int w, int h, bitmap_t *ref)
+{
+    double start, t_render, t_ref;
+    int f;
+
+    svga->scrollcache = 0;
+
+    start = now_sec();
+    for (f = 0; f < BENCH_FRAMES; f++)
+	render_frame(svga, m, w, h, 0, NULL);
+    t_render = now_sec() - start;
+
+    start = now_sec();
+    for (f = 0; f < BENCH_FRAMES; f++)
+	render_frame(svga, m, w, h, 0, ref);
+    t_ref = now_sec() - start;
+
+    printf("%-8s %4ix%-4i: %8.1f frames/s, scalar %8.1f frames/s\n",
+	   m->name, w, h, BENCH_FRAMES / t_render, BENCH_FRAMES / t_ref);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    static const int res[][2] = { { 640, 480 }, { 1024, 768 }, { 1600, 1200 } };
+    svga_t *svga = (svga_t *) calloc(1, sizeof(svga_t));
+    bitmap_t *ref;
+    int i, j;
+
+    make_tables();
+    buffer32 = make_bitmap(1200);
+    ref = make_bitmap(1200);
+
+    /* Pad the end so the scalar loops' dword reads at the mask stay inside. */
+    svga->vram = (uint8_t *) malloc(VRAM_SIZE + 4);
+    svga->changedvram = (uint8_t *) calloc((VRAM_SIZE >> 12) + 1, 1);
+    svga->vram_mask = svga->vram_display_mask = VRAM_SIZE - 1;
+    svga->fullchange = 1;
+
+    srand(1);
+    for (i = 0; i < (VRAM_SIZE + 4); i++)
+	svga->vram[i] = rand() >> 4;
+
+    for (i = 0; i < (int) (sizeof(modes) / sizeof(modes[0])); i++) {
+	if (!check_mode(svga, &modes[i], ref))
+		return 1;
+    }
+    printf("All renderers match the scalar loops\n");
+
+    for (i = 0; i < (int) (sizeof(modes) / sizeof(modes[0])); i++) {
+	for (j = 0; j < (int) (sizeof(res) / sizeof(res[0])); j++)
+		bench_mode(svga, &modes[i], res[j][0], res[j][1], ref);
+    }
+
+    return 0;
+}
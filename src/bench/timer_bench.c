@@ -0,0 +1,309 @@
+/*
+ * 86Box	A hypervisor and IBM PC system emulator that specializes in
+ *		running old operating systems and software designed for IBM
+ *		PC systems and compatibles from 1981 through fairly recent
+ *		system designs based on the PCI bus.
+ *
+ *		This file is part of the 86Box distribution.
+ *
+ *		Standalone check and micro-benchmark for the timer queue.
+ *
+ *		Drives the real timer.c through a random mix of arms,
+ *		disarms, re-arms from callbacks and expiries, and checks
+ *		that the timers fire in exactly the order the old sorted
+ *		list gave. It then times arm/disarm pairs with N timers
+ *		queued against both, and reports events per second.
+ *
+ *		Build and run from src/:
+ *
+ *		  gcc -O2 -Iinclude -Icpu -o timer_bench bench/timer_bench.c timer.c
+ *		  ./timer_bench
+ *
+ *		Exits non-zero if the firing order differs.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include <86box/86box.h>
+#include <86box/timer.h>
+
+
+#define CHECK_TIMERS	64
+#define CHECK_STEPS	200000
+#define BENCH_OPS	2000000
+
+
+uint64_t	tsc;
+
+
+void
+fatal(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    exit(2);
+}
+
+
+/*The old timer queue: a list kept sorted by timestamp, with a new timer going
+  in front of any timer with the same timestamp.*/
+typedef struct ref_timer_t
+{
+    uint64_t	ts;
+    int		enabled, id;
+
+    struct ref_timer_t *prev, *next;
+} ref_timer_t;
+
+static ref_timer_t *ref_head;
+
+
+static void
+ref_disable(ref_timer_t *t)
+{
+    if (!t->enabled)
+	return;
+
+    t->enabled = 0;
+    if (t->prev)
+	t->prev->next = t->next;
+    else
+	ref_head = t->next;
+    if (t->next)
+	t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+
+static void
+ref_enable(ref_timer_t *t)
+{
+    ref_timer_t *node;
+
+    ref_disable(t);
+    t->enabled = 1;
+
+    if (!ref_head) {
+	ref_head = t;
+	return;
+    }
+
+    for (node = ref_head; ; node = node->next) {
+	if ((int64_t) (t->ts - node->ts) <= 0) {
+		t->next = node;
+		t->prev = node->prev;
+		node->prev = t;
+		if (t->prev)
+			t->prev->next = t;
+		else
+			ref_head = t;
+		return;
+	}
+
+	if (!node->next) {
+		node->next = t;
+		t->prev = node;
+		return;
+	}
+    }
+}
+
+
+/*Both queues run the same workload. A callback re-arms its timer or not
+  depending only on the timer and how often it has fired, so both sides take
+  the same decisions as long as they fire in the same order.*/
+static int	fired[2][CHECK_STEPS * 4], nr_fired[2];
+static int	fire_count[2][CHECK_TIMERS];
+static pc_timer_t	timers[CHECK_TIMERS];
+static ref_timer_t	ref_timers[CHECK_TIMERS];
+
+
+static int
+rearm_delay(int side, int id)
+{
+    uint32_t h = (uint32_t) ((id * 2654435761u) ^ (fire_count[side][id]++ * 40503u));
+
+    return (h & 3) ? (int) ((h >> 8) & 0x3ff) : -1;
+}
+
+
+static void
+timer_cb(void *p)
+{
+    int id = (int) (intptr_t) p;
+    int delay;
+
+    fired[0][nr_fired[0]++] = id;
+
+    delay = rearm_delay(0, id);
+    if (delay >= 0)
+	timer_advance_u64(&timers[id], ((uint64_t) delay) << 32);
+}
+
+
+static void
+ref_process(uint32_t now)
+{
+    ref_timer_t *t;
+    int delay;
+
+    while (ref_head && ((int32_t) ((uint32_t) (ref_head->ts >> 32) - now) <= 0)) {
+	t = ref_head;
+	ref_disable(t);
+
+	fired[1][nr_fired[1]++] = t->id;
+
+	delay = rearm_delay(1, t->id);
+	if (delay >= 0) {
+		t->ts += ((uint64_t) delay) << 32;
+		ref_enable(t);
+	}
+    }
+}
+
+
+static int
+check_order(void)
+{
+    uint32_t seed = 1;
+    int i, step, id, op;
+    uint64_t ts;
+
+    timer_init();
+    ref_head = NULL;
+
+    for (i = 0; i < CHECK_TIMERS; i++) {
+	timer_add(&timers[i], timer_cb, (void *) (intptr_t) i, 0);
+	memset(&ref_timers[i], 0, sizeof(ref_timer_t));
+	ref_timers[i].id = i;
+    }
+
+    for (step = 0; step < CHECK_STEPS; step++) {
+	seed = seed * 1103515245 + 12345;
+	id = (seed >> 8) % CHECK_TIMERS;
+	op = (seed >> 24) & 7;
+
+	if (op < 4) {
+		/* Arm, often onto a timestamp another timer already has. */
+		ts = (tsc + ((seed >> 4) & 0x3f)) << 32;
+		timers[id].ts.ts64 = ts;
+		timer_enable(&timers[id]);
+		ref_timers[id].ts = ts;
+		ref_enable(&ref_timers[id]);
+	} else if (op < 6) {
+		timer_disable(&timers[id]);
+		ref_disable(&ref_timers[id]);
+	} else {
+		tsc += (seed >> 12) & 0x1f;
+		if (TIMER_VAL_LESS_THAN_VAL(timer_target, (uint32_t) tsc))
+			timer_process();
+		ref_process((uint32_t) tsc);
+	}
+
+	if ((nr_fired[0] != nr_fired[1]) ||
+	    memcmp(fired[0], fired[1], nr_fired[0] * sizeof(int))) {
+		printf("FAIL: firing order differs at step %i\n", step);
+		return 0;
+	}
+
+	if (nr_fired[0] > (CHECK_STEPS * 3)) {
+		nr_fired[0] = nr_fired[1] = 0;
+	}
+    }
+
+    timer_close();
+
+    printf("Firing order matches the sorted list over %i steps\n", CHECK_STEPS);
+    return 1;
+}
+
+
+static double
+now_sec(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + (t.tv_nsec / 1e9);
+}
+
+
+/*Queue n timers at random timestamps, then repeatedly re-arm a random one to a
+  new timestamp, which is what a device timer does from its callback.*/
+static void
+bench(int n)
+{
+    pc_timer_t *t = (pc_timer_t *) calloc(n, sizeof(pc_timer_t));
+    ref_timer_t *r = (ref_timer_t *) calloc(n, sizeof(ref_timer_t));
+    uint32_t seed = 12345;
+    double start, heap_time, list_time;
+    int i, id;
+
+    timer_init();
+    for (i = 0; i < n; i++) {
+	seed = seed * 1103515245 + 12345;
+	timer_add(&t[i], NULL, NULL, 0);
+	t[i].ts.ts64 = ((uint64_t) (seed >> 8)) << 32;
+	timer_enable(&t[i]);
+    }
+
+    start = now_sec();
+    for (i = 0; i < BENCH_OPS; i++) {
+	seed = seed * 1103515245 + 12345;
+	id = (seed >> 4) % n;
+	timer_disable(&t[id]);
+	t[id].ts.ts64 = ((uint64_t) (seed >> 8)) << 32;
+	timer_enable(&t[id]);
+    }
+    heap_time = now_sec() - start;
+    timer_close();
+
+    seed = 12345;
+    ref_head = NULL;
+    for (i = 0; i < n; i++) {
+	seed = seed * 1103515245 + 12345;
+	r[i].ts = ((uint64_t) (seed >> 8)) << 32;
+	ref_enable(&r[i]);
+    }
+
+    /* The list is O(n), so give it fewer rounds at large n. */
+    start = now_sec();
+    for (i = 0; i < (BENCH_OPS / 16); i++) {
+	seed = seed * 1103515245 + 12345;
+	id = (seed >> 4) % n;
+	ref_disable(&r[id]);
+	r[id].ts = ((uint64_t) (seed >> 8)) << 32;
+	ref_enable(&r[id]);
+    }
+    list_time = (now_sec() - start) * 16.0;
+
+    printf("%6i timers: heap %8.2f M re-arms/s, list %8.2f M re-arms/s\n",
+	   n, BENCH_OPS / heap_time / 1e6, BENCH_OPS / list_time / 1e6);
+
+    free(t);
+    free(r);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    static const int sizes[] = { 8, 32, 128, 512, 2048 };
+    int i;
+
+    if (!check_order())
+	return 1;
+
+    for (i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); i++)
+	bench(sizes[i]);
+
+    return 0;
+}
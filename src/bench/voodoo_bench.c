@@ -0,0 +1,552 @@
+/*
+ * 86Box	A hypervisor and IBM PC system emulator that specializes in
+ *		running old operating systems and software designed for IBM
+ *		PC systems and compatibles from 1981 through fairly recent
+ *		system designs based on the PCI bus.
+ *
+ *		This file is part of the 86Box distribution.
+ *
+ *		Standalone check and benchmark for the Voodoo render threads.
+ *
+ *		Brings up the real vid_voodoo.c with 1, 2, 4 and 8 render
+ *		threads, and draws the same scene through its register
+ *		interface: a fastfill, then triangles that are depth tested,
+ *		alpha blended and dithered, half of them textured from more
+ *		textures than the texture cache holds, so entries are
+ *		evicted while the render threads still have triangles
+ *		queued. The colour and depth buffers must be identical for
+ *		every thread count. When built with USE_DYNAREC (which the
+ *		x86-64 recompiler only supports under MinGW) this is done
+ *		with the recompiler as well.
+ *
+ *		The render threads sleep on events with timeouts, so the
+ *		events here are pthreads ones that honour the timeout.
+ *
+ *		Build and run from src/:
+ *
+ *		  gcc -O2 -Iinclude -Icpu -o voodoo_bench bench/voodoo_bench.c \
+ *		      video/vid_voodoo.c -lm -lpthread
+ *		  ./voodoo_bench
+ *
+ *		Exits non-zero if any pixel or depth value differs.
+ */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include <pthread.h>
+#include <86box/86box.h>
+#include "cpu.h"
+#include <86box/device.h>
+#include <86box/mem.h>
+#include <86box/pci.h>
+#include <86box/rom.h>
+#include <86box/timer.h>
+#include <86box/plat.h>
+#include <86box/video.h>
+#include <86box/vid_svga.h>
+
+
+#define SCREEN_W	640
+#define SCREEN_H	480
+#define NR_TEXTURES	200
+#define NR_TRIANGLES	5000
+
+/*Register offsets and bits, as in vid_voodoo.c.*/
+#define SST_vertexAx		0x008
+#define SST_startR		0x020
+#define SST_startZ		0x02c
+#define SST_startA		0x030
+#define SST_startS		0x034
+#define SST_startT		0x038
+#define SST_startW		0x03c
+#define SST_dRdX		0x040
+#define SST_dRdY		0x060
+#define SST_triangleCMD		0x080
+#define SST_fbzColorPath	0x104
+#define SST_alphaMode		0x10c
+#define SST_fbzMode		0x110
+#define SST_lfbMode		0x114
+#define SST_clipLeftRight	0x118
+#define SST_clipLowYHighY	0x11c
+#define SST_fastfillCMD		0x124
+#define SST_zaColor		0x130
+#define SST_color1		0x148
+#define SST_fbiInit1		0x214
+#define SST_fbiInit2		0x218
+#define SST_textureMode		0x300
+#define SST_tLOD		0x304
+#define SST_texBaseAddr		0x30c
+
+#define FBZ_CLIP		(1 << 0)
+#define FBZ_DEPTH_ENABLE	(1 << 4)
+#define FBZ_DEPTH_LESS		(1 << 5)
+#define FBZ_DITHER		(1 << 8)
+#define FBZ_RGB_WMASK		(1 << 9)
+#define FBZ_DEPTH_WMASK		(1 << 10)
+#define FBZ_DRAW_BACK		0x4000
+#define FBZCP_TEXTURE_ENABLED	(1 << 27)
+#define LFB_READ_BACK		0x0040
+#define LFB_READ_AUX		0x0080
+#define TEX_R5G6B5		0xa
+#define TEXTUREMODE_LOCAL	0x00241000
+/*8x8 texels at LOD 5, which sits after 174592 bytes of larger levels.*/
+#define TEX_LOD			5
+#define TEX_SIZE		(8 * 8 * 2)
+
+
+bitmap_t	*buffer32;
+double		cpuclock = 100000000.0;
+int		pci_burst_time = 1, pci_nonburst_time = 4;
+uint64_t	TIMER_USEC = 100;
+uint64_t	tsc;
+
+
+static int	cfg_threads, cfg_recompiler;
+
+static uint8_t	(*card_pci_read)(int func, int addr, void *priv);
+static void	(*card_pci_write)(int func, int addr, uint8_t val, void *priv);
+static void	*card_pci_priv;
+static uint32_t	(*card_readl)(uint32_t addr, void *p);
+static void	(*card_writel)(uint32_t addr, uint32_t val, void *p);
+static void	*card;
+
+
+void
+fatal(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    exit(2);
+}
+
+
+int
+device_get_config_int(const char *name)
+{
+    if (!strcmp(name, "type"))
+	return 0;	/*Voodoo Graphics*/
+    if (!strcmp(name, "framebuffer_memory") || !strcmp(name, "texture_memory"))
+	return 4;
+    if (!strcmp(name, "bilinear"))
+	return 1;
+    if (!strcmp(name, "render_threads"))
+	return cfg_threads;
+    if (!strcmp(name, "recompiler"))
+	return cfg_recompiler;
+
+    return 0;
+}
+
+
+/*The first mapping the card adds is its own; the second is the SLI snoop.*/
+void
+mem_mapping_add(mem_mapping_t *mapping, uint32_t base, uint32_t size,
+		uint8_t (*read_b)(uint32_t addr, void *p),
+		uint16_t (*read_w)(uint32_t addr, void *p),
+		uint32_t (*read_l)(uint32_t addr, void *p),
+		void (*write_b)(uint32_t addr, uint8_t val, void *p),
+		void (*write_w)(uint32_t addr, uint16_t val, void *p),
+		void (*write_l)(uint32_t addr, uint32_t val, void *p),
+		uint8_t *exec, uint32_t flags, void *p)
+{
+    if (card)
+	return;
+
+    card_readl = read_l;
+    card_writel = write_l;
+    card = p;
+}
+
+
+void mem_mapping_set_addr(mem_mapping_t *mapping, uint32_t base, uint32_t size) { }
+void mem_mapping_disable(mem_mapping_t *mapping) { }
+
+
+uint8_t
+pci_add_card(uint8_t add_type, uint8_t (*read)(int func, int addr, void *priv),
+	     void (*write)(int func, int addr, uint8_t val, void *priv), void *priv)
+{
+    card_pci_read = read;
+    card_pci_write = write;
+    card_pci_priv = priv;
+
+    return 0;
+}
+
+
+/*Nothing here runs the emulated clock, so the FIFO thread is woken by the FIFO
+  filling up and by framebuffer reads rather than by its wake timer.*/
+void timer_add(pc_timer_t *timer, void (*callback)(void *p), void *p, int start_timer) { }
+void timer_enable(pc_timer_t *timer) { }
+void sub_cycles(int c) { }
+svga_t *svga_get_pri() { return NULL; }
+void svga_set_override(svga_t *svga, int val) { }
+void svga_doblit(int y1, int y2, int wx, int wy, svga_t *svga) { }
+void video_wait_for_buffer(void) { }
+FILE *rom_fopen(wchar_t *fn, wchar_t *mode) { return NULL; }
+
+
+uint64_t
+plat_timer_read(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return ((uint64_t) t.tv_sec * 1000000000ULL) + t.tv_nsec;
+}
+
+
+/*Auto-reset events on top of pthreads, like the Windows ones in win/. A
+  timeout is in milliseconds, and -1 waits forever.*/
+typedef struct
+{
+    pthread_mutex_t	mutex;
+    pthread_cond_t	cond;
+    int			state;
+} bench_event_t;
+
+
+event_t *
+thread_create_event(void)
+{
+    bench_event_t *ev = (bench_event_t *) calloc(1, sizeof(bench_event_t));
+
+    pthread_mutex_init(&ev->mutex, NULL);
+    pthread_cond_init(&ev->cond, NULL);
+
+    return (event_t *) ev;
+}
+
+
+void
+thread_set_event(event_t *arg)
+{
+    bench_event_t *ev = (bench_event_t *) arg;
+
+    pthread_mutex_lock(&ev->mutex);
+    ev->state = 1;
+    pthread_cond_signal(&ev->cond);
+    pthread_mutex_unlock(&ev->mutex);
+}
+
+
+void
+thread_reset_event(event_t *arg)
+{
+    bench_event_t *ev = (bench_event_t *) arg;
+
+    pthread_mutex_lock(&ev->mutex);
+    ev->state = 0;
+    pthread_mutex_unlock(&ev->mutex);
+}
+
+
+int
+thread_wait_event(event_t *arg, int timeout)
+{
+    bench_event_t *ev = (bench_event_t *) arg;
+    struct timespec abstime;
+    int ret = 0;
+
+    clock_gettime(CLOCK_REALTIME, &abstime);
+    if (timeout > 0) {
+	abstime.tv_nsec += (timeout % 1000) * 1000000;
+	abstime.tv_sec += (timeout / 1000) + (abstime.tv_nsec / 1000000000);
+	abstime.tv_nsec %= 1000000000;
+    }
+
+    pthread_mutex_lock(&ev->mutex);
+    while (!ev->state && !ret) {
+	if (timeout < 0)
+		pthread_cond_wait(&ev->cond, &ev->mutex);
+	else
+		ret = pthread_cond_timedwait(&ev->cond, &ev->mutex, &abstime);
+    }
+    ev->state = 0;
+    pthread_mutex_unlock(&ev->mutex);
+
+    return (ret == ETIMEDOUT) ? 1 : 0;
+}
+
+
+void
+thread_destroy_event(event_t *arg)
+{
+    bench_event_t *ev = (bench_event_t *) arg;
+
+    pthread_cond_destroy(&ev->cond);
+    pthread_mutex_destroy(&ev->mutex);
+    free(ev);
+}
+
+
+typedef struct
+{
+    pthread_t	thread;
+    void	(*func)(void *param);
+    void	*param;
+} bench_thread_t;
+
+
+static void *
+thread_run(void *arg)
+{
+    bench_thread_t *t = (bench_thread_t *) arg;
+
+    t->func(t->param);
+
+    return NULL;
+}
+
+
+thread_t *
+thread_create(void (*thread_func)(void *param), void *param)
+{
+    bench_thread_t *t = (bench_thread_t *) calloc(1, sizeof(bench_thread_t));
+
+    t->func = thread_func;
+    t->param = param;
+    pthread_create(&t->thread, NULL, thread_run, t);
+
+    return (thread_t *) t;
+}
+
+
+/*Cards are never closed here.*/
+void
+thread_kill(thread_t *arg)
+{
+}
+
+
+static uint32_t	seed;
+
+
+static uint32_t
+rnd(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+
+/*Signed random value in [-range, range].*/
+static int32_t
+rnd_signed(int32_t range)
+{
+    return (int32_t) (rnd() % (2 * range + 1)) - range;
+}
+
+
+static void
+wr(uint32_t addr, uint32_t val)
+{
+    card_writel(addr, val, card);
+}
+
+
+static void
+upload_textures(void)
+{
+    int i, s, t;
+
+    wr(SST_textureMode, TEXTUREMODE_LOCAL | (TEX_R5G6B5 << 8));
+    wr(SST_tLOD, (TEX_LOD << 2) | (TEX_LOD << 8));
+
+    for (i = 0; i < NR_TEXTURES; i++) {
+	wr(SST_texBaseAddr, (i * TEX_SIZE) >> 3);
+	for (t = 0; t < 8; t++) {
+		for (s = 0; s < 8; s += 2)
+			wr(0x800000 | (TEX_LOD << 17) | (t << 9) | (s << 1), (rnd() << 16) ^ rnd());
+	}
+    }
+}
+
+
+static void
+draw_triangle(void)
+{
+    int32_t x[3], y[3], tx, ty, area;
+    int i, j, size = 8 + (rnd() % 200);
+    int textured = rnd() & 1;
+
+    x[0] = rnd() % SCREEN_W;
+    y[0] = rnd() % SCREEN_H;
+    for (i = 1; i < 3; i++) {
+	x[i] = x[0] + rnd_signed(size);
+	y[i] = y[0] + rnd_signed(size);
+    }
+
+    /* The setup engine wants the vertices sorted top to bottom. */
+    for (i = 0; i < 2; i++) {
+	for (j = 0; j < 2 - i; j++) {
+		if (y[j] > y[j + 1]) {
+			tx = x[j]; x[j] = x[j + 1]; x[j + 1] = tx;
+			ty = y[j]; y[j] = y[j + 1]; y[j + 1] = ty;
+		}
+	}
+    }
+    area = ((x[1] - x[0]) * (y[2] - y[0])) - ((x[2] - x[0]) * (y[1] - y[0]));
+
+    for (i = 0; i < 3; i++) {
+	/* 12.4 fixed point, with a random subpixel offset. */
+	wr(SST_vertexAx + (i * 8), ((x[i] << 4) | (rnd() & 15)) & 0xffff);
+	wr(SST_vertexAx + (i * 8) + 4, ((y[i] << 4) | (rnd() & 15)) & 0xffff);
+    }
+
+    /* R, G, B and A in 12.12, Z in 20.12. */
+    for (i = 0; i < 3; i++) {
+	wr(SST_startR + (i * 4), (rnd() & 0xff) << 12);
+	wr(SST_dRdX + (i * 4), rnd_signed(2 << 12));
+	wr(SST_dRdY + (i * 4), rnd_signed(2 << 12));
+    }
+    wr(SST_startZ, (rnd() & 0xffff) << 12);
+    wr(SST_dRdX + 0x0c, rnd_signed(64 << 12));
+    wr(SST_dRdY + 0x0c, rnd_signed(64 << 12));
+    wr(SST_startA, (rnd() & 0xff) << 12);
+    wr(SST_dRdX + 0x10, rnd_signed(1 << 12));
+    wr(SST_dRdY + 0x10, rnd_signed(1 << 12));
+
+    if (textured) {
+	wr(SST_texBaseAddr, ((rnd() % NR_TEXTURES) * TEX_SIZE) >> 3);
+	wr(SST_startS, rnd_signed(8 << 18));
+	wr(SST_startT, rnd_signed(8 << 18));
+	wr(SST_startW, 1 << 30);
+	wr(SST_dRdX + 0x14, rnd_signed(1 << 17));
+	wr(SST_dRdY + 0x14, rnd_signed(1 << 17));
+	wr(SST_dRdX + 0x18, rnd_signed(1 << 17));
+	wr(SST_dRdY + 0x18, rnd_signed(1 << 17));
+	wr(SST_fbzColorPath, FBZCP_TEXTURE_ENABLED | 1);
+    } else
+	wr(SST_fbzColorPath, 0);
+
+    wr(SST_triangleCMD, (area < 0) ? (1 << 31) : 0);
+}
+
+
+/*Read a buffer back through the linear framebuffer, which first waits for the
+  FIFO to drain and the render threads to go idle.*/
+static void
+read_buffer(uint32_t lfb_mode, uint32_t *dest)
+{
+    int x, y;
+
+    wr(SST_lfbMode, lfb_mode);
+    for (y = 0; y < SCREEN_H; y++) {
+	for (x = 0; x < SCREEN_W; x += 2)
+		*dest++ = card_readl(0x400000 | (y << 11) | (x << 1), card);
+    }
+}
+
+
+static double
+now_sec(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + (t.tv_nsec / 1e9);
+}
+
+
+/*Bring up a card and draw the scene. Returns the time taken to draw.*/
+static double
+render_scene(int threads, int recompiler, uint32_t *colour, uint32_t *depth)
+{
+    double start, t;
+    int i;
+
+    cfg_threads = threads;
+    cfg_recompiler = recompiler;
+    card = NULL;
+    voodoo_device.init(&voodoo_device);
+
+    /* initEnable, 1280 byte rows, and 150 pages per buffer. */
+    card_pci_write(0, 0x40, 0x01, card_pci_priv);
+    wr(SST_fbiInit1, 10 << 4);
+    wr(SST_fbiInit2, 150 << 11);
+
+    wr(SST_clipLeftRight, SCREEN_W);
+    wr(SST_clipLowYHighY, SCREEN_H);
+    wr(SST_fbzMode, FBZ_CLIP | FBZ_RGB_WMASK | FBZ_DEPTH_WMASK | FBZ_DRAW_BACK);
+    wr(SST_color1, 0);
+    wr(SST_zaColor, 0xffff);
+    wr(SST_fastfillCMD, 0);
+
+    seed = 1;
+    upload_textures();
+
+    wr(SST_fbzMode, FBZ_CLIP | FBZ_DEPTH_ENABLE | FBZ_DEPTH_LESS | FBZ_DITHER |
+		    FBZ_RGB_WMASK | FBZ_DEPTH_WMASK | FBZ_DRAW_BACK);
+    wr(SST_alphaMode, (1 << 4) | (1 << 8) | (5 << 12));
+    wr(SST_lfbMode, LFB_READ_BACK);
+
+    /* One framebuffer read waits for everything queued to be drawn. */
+    start = now_sec();
+    for (i = 0; i < NR_TRIANGLES; i++)
+	draw_triangle();
+    card_readl(0x400000, card);
+    t = now_sec() - start;
+
+    read_buffer(LFB_READ_BACK, colour);
+    read_buffer(LFB_READ_AUX, depth);
+
+    return t;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    static const int threads[] = { 1, 2, 4, 8 };
+    int words = (SCREEN_W * SCREEN_H) / 2;
+    uint32_t *ref_colour = (uint32_t *) malloc(words * 4), *ref_depth = (uint32_t *) malloc(words * 4);
+    uint32_t *colour = (uint32_t *) malloc(words * 4), *depth = (uint32_t *) malloc(words * 4);
+    int recompiler, i, c, drawn;
+    double t;
+#ifdef USE_DYNAREC
+    int nr_modes = 2;
+#else
+    int nr_modes = 1;
+#endif
+
+    for (recompiler = 0; recompiler < nr_modes; recompiler++) {
+	for (i = 0; i < (int) (sizeof(threads) / sizeof(threads[0])); i++) {
+		t = render_scene(threads[i], recompiler, colour, depth);
+
+		if (i == 0) {
+			memcpy(ref_colour, colour, words * 4);
+			memcpy(ref_depth, depth, words * 4);
+
+			/* Make sure the scene actually drew something. */
+			for (drawn = 0, c = 0; c < words; c++)
+				drawn += (colour[c] != 0);
+			if (drawn < (words / 2)) {
+				printf("FAIL: only %i of %i pixel pairs drawn\n", drawn, words);
+				return 1;
+			}
+		} else if (memcmp(colour, ref_colour, words * 4) || memcmp(depth, ref_depth, words * 4)) {
+			printf("FAIL: %s, %i render threads differ from 1 thread\n",
+			       recompiler ? "recompiler" : "interpreter", threads[i]);
+			return 1;
+		}
+
+		printf("%-11s %i render thread%s: %8.1f triangles/s\n",
+		       recompiler ? "recompiler" : "interpreter", threads[i],
+		       (threads[i] == 1) ? " " : "s", NR_TRIANGLES / t);
+	}
+    }
+
+    printf("Colour and depth buffers match for every thread count\n");
+
+    return 0;
+}
@@ -411,6 +411,9 @@ void codegen_generate_call(uint8_t opcode, OpFn op, uint32_t fetchdat, uint32_t
         op_ea_seg = &cpu_state.seg_ds;
         op_ssegs = 0;
 
+        /*Only known once the instruction has been recompiled*/
+        ir->exit_pc = BLOCK_PC_INVALID;
+
         codegen_timing_start();
 
         while (!over)
@@ -690,7 +693,10 @@ generate_call:
                 if (new_pc)
                 {
                         if (new_pc != -1)
+                        {
                                 uop_MOV_IMM(ir, IREG_pc, new_pc);
+                                ir->exit_pc = new_pc;
+                        }
 
                         codegen_endpc = (cs + cpu_state.pc) + 8;
 
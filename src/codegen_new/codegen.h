@@ -30,6 +30,80 @@
   same page).
 */
 
+/*Code cache eviction :
+
+  When either codeblock_t entries or executable memory run out, a block is
+  evicted using a CLOCK sweep over the codeblock array. Each block counts its
+  executions in exec_count; the sweep records the count it saw in sweep_count.
+  A block whose count has moved on since the hand last passed it has been used
+  recently and gets a second chance, so only blocks that have sat idle for a
+  whole revolution are thrown away. Hot loops therefore survive cache pressure
+  instead of being evicted at random.
+
+  The physical addresses of recently evicted blocks are remembered in a small
+  table, so that blocks which have to be compiled again after eviction can be
+  counted (cpu_recomp_refilled). A high refill rate means the cache is too small
+  for the workload.
+*/
+
+/*Block chaining :
+
+  An exit whose guest PC is known at compile time (a taken direct branch, or
+  running off the end of a block after a recompiled instruction) is emitted as
+  a patchable jump. Until it is linked this jump leads to a short miss path,
+  which records the exit in codegen_chain.exit before returning to
+  exec386_dynarec(). When the dispatcher next enters a compiled block, and
+  that block is the static target of the recorded exit, the jump is patched to
+  the block's chain entry. From then on the transition stays in generated
+  code.
+
+  Only blocks in the same linear and physical page as the exiting block, and
+  lying wholly within that page, are linked. A chain entry calls a shared check
+  routine (codegen_chain_rout) that repeats the dispatcher's work between
+  blocks. It falls back to the dispatcher if the cycle budget or next timer
+  event would be reached, timer_target has moved, an interrupt, NMI or SMI is
+  pending, the trap flag or cache disable bit is set, CS or cpu_cur_status
+  differ from what the target was compiled for, or the target's code has been
+  written to. Blocks compiled with a static FPU top-of-stack also check TOP.
+  codegen_flush() raises the cycle threshold out of reach, so any TLB flush, CR3
+  load or A20 change ends the chain and sends the next lookup through get_phys()
+  again.
+
+  Each block keeps a list of the exits linked to it. invalidate_block(),
+  delete_block() and recompilation unlink these, and the block's own exits,
+  before its code memory is freed or rewritten.*/
+
+#define CODEBLOCK_CHAIN_EXITS 4
+
+/*Exits are numbered (block number * CODEBLOCK_CHAIN_EXITS) + exit. Block 0
+  holds the shared routines and never chains, so exit 0 means none.*/
+#define CHAIN_EXIT_NONE 0
+#define CHAIN_EXIT(block_nr, exit) (((block_nr) * CODEBLOCK_CHAIN_EXITS) + (exit))
+
+typedef struct codegen_chain_t
+{
+        /*Chained entry is allowed while cycles >= cycles_limit. Set from the
+          cycle budget and the next timer event by codegen_chain_enter(), and
+          raised out of reach by codegen_flush().*/
+        int32_t cycles_limit;
+        /*timer_target when the dispatcher last ran.*/
+        uint32_t timer_target;
+        /*Unlinked exit that last returned to the dispatcher.*/
+        uint32_t exit;
+} codegen_chain_t;
+
+extern codegen_chain_t codegen_chain;
+
+/*Compiled blocks are only valid for the process that generated them. Host code
+  embeds absolute addresses (cpu_state fields, helper functions, the exit and
+  GPF routines) and the uOP list holds the same pointers, so neither can be
+  stored across runs without a relocation scheme. A block also depends on state
+  that is not part of its key: immediates read from guest memory at compile
+  time, segments already checked earlier in the block (seg->checked), flat DS/SS
+  assumptions and the FPU top-of-stack for CODEBLOCK_STATIC_TOP blocks.
+  Persisting translations would need all of this made explicit in the block
+  key and the code made position-independent first.*/
+
 typedef struct codeblock_t
 {
         uint32_t pc;
@@ -58,6 +132,24 @@ typedef struct codeblock_t
         /*First mem_block_t used by this block. Any subsequent mem_block_ts
           will be in the list starting at head_mem_block->next.*/
         struct mem_block_t *head_mem_block;
+
+        /*Number of times this block has been dispatched, and the value seen by
+          the eviction sweep last time it passed this block.*/
+        uint32_t exec_count, sweep_count;
+
+        /*Where chained jumps enter this block. NULL if it can not be chained
+          to.*/
+        uint8_t *chain_entry;
+        /*Patchable jump for each chainable exit, the guest PC (without CS
+          base) it leaves with, and the block it is linked to.*/
+        uint8_t *chain_stub[CODEBLOCK_CHAIN_EXITS];
+        uint32_t chain_pc[CODEBLOCK_CHAIN_EXITS];
+        uint16_t chain_target[CODEBLOCK_CHAIN_EXITS];
+        /*List of exits linked to this block, threaded through chain_in_prev[]
+          and chain_in_next[] of the exiting blocks.*/
+        uint32_t chain_in_prev[CODEBLOCK_CHAIN_EXITS], chain_in_next[CODEBLOCK_CHAIN_EXITS];
+        uint32_t chain_in;
+        uint8_t chain_exits;
 } codeblock_t;
 
 extern codeblock_t *codeblock;
@@ -334,9 +426,14 @@ void codegen_check_seg_read(codeblock_t *block, struct ir_data_t *ir, x86seg *se
 void codegen_check_seg_write(codeblock_t *block, struct ir_data_t *ir, x86seg *seg);
 
 int codegen_purge_purgable_list();
-/*Delete a random code block to free memory. This is obviously quite expensive, and
-  will only be called when the allocator is out of memory*/
-void codegen_delete_random_block(int required_mem_block);
+/*Evict the least recently used code block (approximately) to free memory. If
+  required_mem_block is set, only blocks holding executable memory are considered.
+  This is expensive, and will only be called when the allocator is out of memory*/
+void codegen_evict_block(int required_mem_block);
+/*Called by the dispatcher just before it runs a block. Links the exit that
+  last returned to the dispatcher to this block if it can be chained, and sets
+  the cycle threshold for chained entry.*/
+void codegen_chain_enter(codeblock_t *block);
 
 extern int cpu_block_end;
 extern uint32_t codegen_endpc;
@@ -347,6 +444,14 @@ extern int cpu_recomp_flushes, cpu_recomp_flushes_latched;
 extern int cpu_recomp_evicted, cpu_recomp_evicted_latched;
 extern int cpu_recomp_reuse, cpu_recomp_reuse_latched;
 extern int cpu_recomp_removed, cpu_recomp_removed_latched;
+extern int cpu_recomp_cache_evicted, cpu_recomp_cache_evicted_latched;
+extern int cpu_recomp_refilled, cpu_recomp_refilled_latched;
+/*Blocks entered through a chained jump, and through the dispatcher.*/
+extern int cpu_recomp_chained, cpu_recomp_chained_latched;
+extern int cpu_recomp_dispatched, cpu_recomp_dispatched_latched;
+
+/*Number of codeblock_t entries currently in use*/
+extern int codegen_block_usage;
 
 extern int cpu_reps, cpu_reps_latched;
 extern int cpu_notreps, cpu_notreps_latched;
@@ -56,15 +56,10 @@ mem_block_t *codegen_allocator_allocate(mem_block_t *parent, int code_block)
         mem_block_t *block;
         uint32_t block_nr;
         
+        /*Out of memory - evict code blocks until one gives some back. code_block
+          is always block_current, which the eviction sweep skips*/
         while (!mem_block_free_list)
-        {
-                /*Pick a random memory block and free the owning code block*/
-                block_nr = rand() & MEM_BLOCK_MASK;
-                block = &mem_blocks[block_nr];
-                
-                if (block->code_block && block->code_block != code_block)
-                        codegen_delete_block(&codeblock[block->code_block]);
-        }
+                codegen_evict_block(1);
 
         /*Remove from free list*/
         block_nr = mem_block_free_list;
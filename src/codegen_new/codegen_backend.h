@@ -16,6 +16,12 @@
 void codegen_backend_init();
 void codegen_backend_prologue(codeblock_t *block);
 void codegen_backend_epilogue(codeblock_t *block);
+/*Emit a block exit to guest PC pc (relative to CS base) that can later be
+  linked to the block at that PC. If check_pc is set, cpu_state.pc is compared
+  against pc first and the block exits normally if they differ.*/
+void codegen_backend_chain_exit(codeblock_t *block, uint32_t pc, int check_pc);
+/*Point the exit jump at stub to dest, or back to its miss path if dest is NULL*/
+void codegen_backend_chain_patch(uint8_t *stub, uint8_t *dest);
 
 struct ir_data_t;
 struct uop_t;
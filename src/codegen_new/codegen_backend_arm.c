@@ -367,4 +367,15 @@ void codegen_backend_epilogue(codeblock_t *block)
 	codegen_allocator_clean_blocks(block->head_mem_block);
 }
 
+/*Block chaining is not implemented on this backend. Exits always return to the
+  dispatcher, and as no block has a chain entry no exit is ever patched*/
+void codegen_backend_chain_exit(codeblock_t *block, uint32_t pc, int check_pc)
+{
+	host_arm_B(block, (uintptr_t)codegen_exit_rout);
+}
+
+void codegen_backend_chain_patch(uint8_t *stub, uint8_t *dest)
+{
+}
+
 #endif
@@ -14,6 +14,9 @@
 #include "codegen_reg.h"
 #include "x86.h"
 #include "x87.h"
+#include <86box/nmi.h>
+#include <86box/pic.h>
+#include <86box/timer.h>
 
 #if defined(__linux__) || defined(__APPLE__)
 #include <sys/mman.h>
@@ -43,6 +46,13 @@ void *codegen_fp_round_quad;
 void *codegen_gpf_rout;
 void *codegen_exit_rout;
 
+/*Block chaining routines, see codegen.h*/
+static void *codegen_chain_rout;
+static void *codegen_chain_miss_rout;
+/*Code following the stack frame setup of the block being compiled. Chained
+  jumps enter here, reusing the frame of the block they came from*/
+static uint8_t *block_body_start;
+
 host_reg_def_t codegen_host_reg_list[CODEGEN_HOST_REGS] =
 {
         {REG_X19, 0},
@@ -278,6 +288,94 @@ static void build_fp_round_routine(codeblock_t *block, int is_quad)
 	host_arm64_RET(block, REG_X30);
 }
 
+/*codegen_chain_rout is called from a block's chain entry, with the block in
+  X0. It returns if the block can be entered directly, otherwise it leaves
+  through codegen_exit_rout, which restores X30 from the stack frame.
+  cpu_state.pc holds the block's PC either way.
+
+  codegen_chain_miss_rout is the miss path of an unlinked exit, with the exit
+  number in W7.*/
+static void build_chain_routines(codeblock_t *block)
+{
+	void *chain_fail;
+
+	codegen_alloc(block, 80);
+	chain_fail = &block_write_data[block_pos];
+	host_arm64_jump(block, (uintptr_t)codegen_exit_rout);
+
+	codegen_chain_rout = &block_write_data[block_pos];
+	/*Cycle budget and next timer event*/
+	host_arm64_LDR_IMM_W(block, REG_TEMP, REG_CPUSTATE, (uintptr_t)&cycles - (uintptr_t)&cpu_state);
+	host_arm64_MOVX_IMM(block, REG_X1, (uint64_t)&codegen_chain);
+	host_arm64_LDR_IMM_W(block, REG_TEMP2, REG_X1, offsetof(codegen_chain_t, cycles_limit));
+	host_arm64_CMP_REG(block, REG_TEMP, REG_TEMP2);
+	host_arm64_branch_set_offset(host_arm64_BLT_(block), chain_fail);
+	host_arm64_MOVX_IMM(block, REG_X2, (uint64_t)&timer_target);
+	host_arm64_LDR_IMM_W(block, REG_TEMP, REG_X2, 0);
+	host_arm64_LDR_IMM_W(block, REG_TEMP2, REG_X1, offsetof(codegen_chain_t, timer_target));
+	host_arm64_CMP_REG(block, REG_TEMP, REG_TEMP2);
+	host_arm64_branch_set_offset(host_arm64_BNE_(block), chain_fail);
+
+	codegen_alloc(block, 80);
+	/*Pending interrupt, NMI or SMI*/
+	host_arm64_MOVX_IMM(block, REG_X2, (uint64_t)&pic_intpending);
+	host_arm64_LDR_IMM_W(block, REG_TEMP, REG_X2, 0);
+	host_arm64_CBNZ(block, REG_TEMP, (uintptr_t)chain_fail);
+	host_arm64_MOVX_IMM(block, REG_X2, (uint64_t)&nmi);
+	host_arm64_LDR_IMM_W(block, REG_TEMP, REG_X2, 0);
+	host_arm64_CBNZ(block, REG_TEMP, (uintptr_t)chain_fail);
+	host_arm64_MOVX_IMM(block, REG_X2, (uint64_t)&smi_line);
+	host_arm64_LDR_IMM_W(block, REG_TEMP, REG_X2, 0);
+	host_arm64_CBNZ(block, REG_TEMP, (uintptr_t)chain_fail);
+
+	codegen_alloc(block, 80);
+	/*Cache disabled or trap flag set, exec386_dynarec() interprets these*/
+	host_arm64_LDR_IMM_W(block, REG_TEMP, REG_CPUSTATE, (uintptr_t)&cr0 - (uintptr_t)&cpu_state);
+	host_arm64_TST_IMM(block, REG_TEMP, 1 << 30);
+	host_arm64_branch_set_offset(host_arm64_BNE_(block), chain_fail);
+	host_arm64_LDRH_IMM(block, REG_TEMP, REG_CPUSTATE, (uintptr_t)&cpu_state.flags - (uintptr_t)&cpu_state);
+	host_arm64_TST_IMM(block, REG_TEMP, T_FLAG);
+	host_arm64_branch_set_offset(host_arm64_BNE_(block), chain_fail);
+	/*Block must have been compiled for the current CS and CPU status*/
+	host_arm64_LDR_IMM_W(block, REG_TEMP, REG_CPUSTATE, (uintptr_t)&cpu_state.seg_cs.base - (uintptr_t)&cpu_state);
+	host_arm64_LDR_IMM_W(block, REG_TEMP2, REG_ARG0, offsetof(codeblock_t, _cs));
+	host_arm64_CMP_REG(block, REG_TEMP, REG_TEMP2);
+	host_arm64_branch_set_offset(host_arm64_BNE_(block), chain_fail);
+
+	codegen_alloc(block, 80);
+	host_arm64_MOVX_IMM(block, REG_X2, (uint64_t)&cpu_cur_status);
+	host_arm64_LDRH_IMM(block, REG_TEMP, REG_X2, 0);
+	host_arm64_LDRH_IMM(block, REG_TEMP2, REG_ARG0, offsetof(codeblock_t, status));
+	host_arm64_CMP_REG(block, REG_TEMP, REG_TEMP2);
+	host_arm64_branch_set_offset(host_arm64_BNE_(block), chain_fail);
+	/*Block code must not have been written to*/
+	host_arm64_LDR_IMM_X(block, REG_X2, REG_ARG0, offsetof(codeblock_t, dirty_mask));
+	host_arm64_LDR_IMM_W(block, REG_TEMP, REG_X2, 0);
+	host_arm64_LDR_IMM_W(block, REG_TEMP2, REG_ARG0, offsetof(codeblock_t, page_mask));
+	host_arm64_AND_REG(block, REG_TEMP, REG_TEMP, REG_TEMP2, 0);
+	host_arm64_CBNZ(block, REG_TEMP, (uintptr_t)chain_fail);
+	host_arm64_LDR_IMM_W(block, REG_TEMP, REG_X2, 4);
+	host_arm64_LDR_IMM_W(block, REG_TEMP2, REG_ARG0, offsetof(codeblock_t, page_mask) + 4);
+	host_arm64_AND_REG(block, REG_TEMP, REG_TEMP, REG_TEMP2, 0);
+	host_arm64_CBNZ(block, REG_TEMP, (uintptr_t)chain_fail);
+
+	codegen_alloc(block, 80);
+	/*Count the execution, as exec386_dynarec() would*/
+	host_arm64_LDR_IMM_W(block, REG_TEMP, REG_ARG0, offsetof(codeblock_t, exec_count));
+	host_arm64_ADD_IMM(block, REG_TEMP, REG_TEMP, 1);
+	host_arm64_STR_IMM_W(block, REG_TEMP, REG_ARG0, offsetof(codeblock_t, exec_count));
+	host_arm64_MOVX_IMM(block, REG_X2, (uint64_t)&cpu_recomp_chained);
+	host_arm64_LDR_IMM_W(block, REG_TEMP, REG_X2, 0);
+	host_arm64_ADD_IMM(block, REG_TEMP, REG_TEMP, 1);
+	host_arm64_STR_IMM_W(block, REG_TEMP, REG_X2, 0);
+	host_arm64_RET(block, REG_X30);
+
+	codegen_chain_miss_rout = &block_write_data[block_pos];
+	host_arm64_MOVX_IMM(block, REG_X1, (uint64_t)&codegen_chain);
+	host_arm64_STR_IMM_W(block, REG_TEMP, REG_X1, offsetof(codegen_chain_t, exit));
+	host_arm64_jump(block, (uintptr_t)codegen_exit_rout);
+}
+
 void codegen_backend_init()
 {
 	codeblock_t *block;
@@ -328,6 +426,8 @@ void codegen_backend_init()
 	host_arm64_LDP_POSTIDX_X(block, REG_X29, REG_X30, REG_XSP, 16);
 	host_arm64_RET(block, REG_X30);
 
+	build_chain_routines(block);
+
         block_write_data = NULL;
 
 	codegen_allocator_clean_blocks(block->head_mem_block);
@@ -358,6 +458,7 @@ void codegen_backend_prologue(codeblock_t *block)
 	host_arm64_STP_PREIDX_X(block, REG_X21, REG_X22, REG_XSP, -16);
 	host_arm64_STP_PREIDX_X(block, REG_X19, REG_X20, REG_XSP, -64);
 
+	block_body_start = &block_write_data[block_pos];
 	host_arm64_MOVX_IMM(block, REG_CPUSTATE, (uint64_t)&cpu_state);
 
         if (block->flags & CODEBLOCK_HAS_FPU)
@@ -378,7 +479,58 @@ void codegen_backend_epilogue(codeblock_t *block)
 	host_arm64_LDP_POSTIDX_X(block, REG_X29, REG_X30, REG_XSP, 16);
 	host_arm64_RET(block, REG_X30);
 
+	/*Chain entry*/
+	codegen_alloc(block, 64);
+	block->chain_entry = &block_write_data[block_pos];
+	if (block->flags & CODEBLOCK_STATIC_TOP)
+	{
+		host_arm64_LDR_IMM_W(block, REG_TEMP, REG_CPUSTATE, (uintptr_t)&cpu_state.TOP - (uintptr_t)&cpu_state);
+		host_arm64_AND_IMM(block, REG_TEMP, REG_TEMP, 7);
+		host_arm64_CMP_IMM(block, REG_TEMP, block->TOP);
+		host_arm64_branch_set_offset(host_arm64_BNE_(block), codegen_exit_rout);
+	}
+	host_arm64_MOVX_IMM(block, REG_ARG0, (uint64_t)block);
+	host_arm64_call(block, codegen_chain_rout);
+	host_arm64_B(block, block_body_start);
+
 	codegen_allocator_clean_blocks(block->head_mem_block);
 }
 
+void codegen_backend_chain_exit(codeblock_t *block, uint32_t pc, int check_pc)
+{
+	int n = block->chain_exits;
+
+	codegen_alloc(block, 64);
+	if (check_pc)
+	{
+		host_arm64_LDR_IMM_W(block, REG_TEMP, REG_CPUSTATE, (uintptr_t)&cpu_state.pc - (uintptr_t)&cpu_state);
+		host_arm64_mov_imm(block, REG_TEMP2, pc);
+		host_arm64_CMP_REG(block, REG_TEMP, REG_TEMP2);
+		host_arm64_branch_set_offset(host_arm64_BNE_(block), codegen_exit_rout);
+	}
+	if (n == CODEBLOCK_CHAIN_EXITS)
+	{
+		host_arm64_B(block, codegen_exit_rout);
+		return;
+	}
+
+	/*Branch to the following miss path until linked*/
+	block->chain_stub[n] = (uint8_t *)host_arm64_B_(block);
+	host_arm64_B_set_dest((uint32_t *)block->chain_stub[n], &block_write_data[block_pos]);
+	block->chain_pc[n] = pc;
+	block->chain_target[n] = BLOCK_INVALID;
+	block->chain_exits++;
+	host_arm64_mov_imm(block, REG_TEMP, CHAIN_EXIT(get_block_nr(block), n));
+	host_arm64_B(block, codegen_chain_miss_rout);
+}
+
+void codegen_backend_chain_patch(uint8_t *stub, uint8_t *dest)
+{
+	if (dest)
+		host_arm64_B_set_dest((uint32_t *)stub, dest);
+	else
+		host_arm64_B_set_dest((uint32_t *)stub, stub + 4);
+	__clear_cache((char *)stub, (char *)stub + 4);
+}
+
 #endif
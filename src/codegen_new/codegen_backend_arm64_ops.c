@@ -446,6 +446,23 @@ void host_arm64_B(codeblock_t *block, void *dest)
 	codegen_addlong(block, OPCODE_B | OFFSET26(offset));
 }
 
+uint32_t *host_arm64_B_(codeblock_t *block)
+{
+	codegen_alloc(block, 4);
+	codegen_addlong(block, OPCODE_B);
+	return (uint32_t *)&block_write_data[block_pos-4];
+}
+
+/*Unlike host_arm64_branch_set_offset(), this can retarget an existing B*/
+void host_arm64_B_set_dest(uint32_t *opcode, void *dest)
+{
+	int offset = (uintptr_t)dest - (uintptr_t)opcode;
+
+	if (!offset_is_26bit(offset))
+		fatal("host_arm64_B_set_dest - offset out of range %x\n", offset);
+	*opcode = OPCODE_B | OFFSET26(offset);
+}
+
 void host_arm64_BFI(codeblock_t *block, int dst_reg, int src_reg, int lsb, int width)
 {
 	codegen_addlong(block, OPCODE_BFI | Rd(dst_reg) | Rn(src_reg) | IMMN(0) | IMMR((32 - lsb) & 31) | IMMS((width-1) & 31));
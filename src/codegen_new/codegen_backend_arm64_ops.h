@@ -21,6 +21,8 @@ void host_arm64_ANDS_IMM(codeblock_t *block, int dst_reg, int src_n_reg, uint32_
 void host_arm64_ASR(codeblock_t *block, int dst_reg, int src_n_reg, int shift_reg);
 
 void host_arm64_B(codeblock_t *block, void *dest);
+uint32_t *host_arm64_B_(codeblock_t *block);
+void host_arm64_B_set_dest(uint32_t *opcode, void *dest);
 
 void host_arm64_BFI(codeblock_t *block, int dst_reg, int src_reg, int lsb, int width);
 
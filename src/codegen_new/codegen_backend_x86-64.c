@@ -13,6 +13,9 @@
 #include "codegen_backend_x86-64_ops_sse.h"
 #include "codegen_reg.h"
 #include "x86.h"
+#include <86box/nmi.h>
+#include <86box/pic.h>
+#include <86box/timer.h>
 
 #if defined(__linux__) || defined(__APPLE__)
 #include <sys/mman.h>
@@ -39,6 +42,13 @@ void *codegen_mem_store_double;
 void *codegen_gpf_rout;
 void *codegen_exit_rout;
 
+/*Block chaining routines, see codegen.h*/
+static void *codegen_chain_rout;
+static void *codegen_chain_miss_rout;
+/*Code following the stack frame setup of the block being compiled. Chained
+  jumps enter here, reusing the frame of the block they came from*/
+static uint8_t *block_body_start;
+
 host_reg_def_t codegen_host_reg_list[CODEGEN_HOST_REGS] =
 {
         /*Note: while EAX and EDX are normally volatile registers under x86
@@ -67,6 +77,15 @@ host_reg_def_t codegen_host_fp_reg_list[CODEGEN_HOST_FP_REGS] =
         {REG_XMM5, HOST_REG_FLAG_VOLATILE}
 };
 
+/*Generated code reaches guest memory only through these routines. The fast
+  path indexes readlookup2/writelookup2 by linear page; an entry is only set
+  for RAM pages (see addreadlookup()/addwritelookup()), so ROM, MMIO, SMRAM
+  and pages holding code blocks (which need dirty tracking via page_lookup)
+  always take the call into the C handlers. A20 wrap-around does not: the
+  physical address is masked with rammask before the entry is made, so a
+  wrapped page gets a fast entry pointing at the masked page, and the tables
+  are flushed when A20 changes. Any scheme that lets generated code access
+  guest RAM directly has to preserve those cases.*/
 static void build_load_routine(codeblock_t *block, int size, int is_float)
 {
         uint8_t *branch_offset;
@@ -288,6 +307,93 @@ static void build_loadstore_routines(codeblock_t *block)
         build_store_routine(block, 8, 1);
 }
 
+static void chain_set_jump_dest(uint32_t *p, void *dest)
+{
+        *p = (uintptr_t)dest - ((uintptr_t)p + 4);
+}
+
+/*codegen_chain_rout is called from a block's chain entry, with the block in
+  RDI. It returns if the block can be entered directly, otherwise it drops the
+  return address and leaves through codegen_exit_rout. cpu_state.pc holds the
+  block's PC either way.
+
+  codegen_chain_miss_rout is the miss path of an unlinked exit, with the exit
+  number in EAX.*/
+static void build_chain_routines(codeblock_t *block)
+{
+        void *chain_fail = &codeblock[block_current].data[block_pos];
+
+        host_x86_ADD64_REG_IMM(block, REG_RSP, 8);
+        host_x86_JMP(block, codegen_exit_rout);
+
+        codegen_chain_rout = &codeblock[block_current].data[block_pos];
+        /*Cycle budget and next timer event*/
+        host_x86_MOV32_REG_ABS(block, REG_EAX, &cycles);
+        host_x86_MOV64_REG_IMM(block, REG_RCX, (uintptr_t)&codegen_chain);
+        host_x86_MOV32_REG_BASE_OFFSET(block, REG_EDX, REG_RCX, offsetof(codegen_chain_t, cycles_limit));
+        host_x86_CMP32_REG_REG(block, REG_EAX, REG_EDX);
+        chain_set_jump_dest(host_x86_JL_long(block), chain_fail);
+        host_x86_MOV64_REG_IMM(block, REG_RAX, (uintptr_t)&timer_target);
+        host_x86_MOV32_REG_BASE_OFFSET(block, REG_EAX, REG_RAX, 0);
+        host_x86_MOV32_REG_BASE_OFFSET(block, REG_EDX, REG_RCX, offsetof(codegen_chain_t, timer_target));
+        host_x86_CMP32_REG_REG(block, REG_EAX, REG_EDX);
+        host_x86_JNZ(block, chain_fail);
+        /*Pending interrupt, NMI or SMI*/
+        host_x86_MOV64_REG_IMM(block, REG_RAX, (uintptr_t)&pic_intpending);
+        host_x86_MOV32_REG_BASE_OFFSET(block, REG_EAX, REG_RAX, 0);
+        host_x86_TEST32_REG(block, REG_EAX, REG_EAX);
+        host_x86_JNZ(block, chain_fail);
+        host_x86_MOV64_REG_IMM(block, REG_RAX, (uintptr_t)&nmi);
+        host_x86_MOV32_REG_BASE_OFFSET(block, REG_EAX, REG_RAX, 0);
+        host_x86_TEST32_REG(block, REG_EAX, REG_EAX);
+        host_x86_JNZ(block, chain_fail);
+        host_x86_MOV64_REG_IMM(block, REG_RAX, (uintptr_t)&smi_line);
+        host_x86_MOV32_REG_BASE_OFFSET(block, REG_EAX, REG_RAX, 0);
+        host_x86_TEST32_REG(block, REG_EAX, REG_EAX);
+        host_x86_JNZ(block, chain_fail);
+        /*Cache disabled or trap flag set, exec386_dynarec() interprets these*/
+        host_x86_MOV32_REG_ABS(block, REG_EAX, &cr0);
+        host_x86_TEST32_REG_IMM(block, REG_EAX, 1 << 30);
+        host_x86_JNZ(block, chain_fail);
+        host_x86_MOV32_REG_ABS(block, REG_EAX, &cpu_state.flags);
+        host_x86_TEST32_REG_IMM(block, REG_EAX, T_FLAG);
+        host_x86_JNZ(block, chain_fail);
+        /*Block must have been compiled for the current CS and CPU status*/
+        host_x86_MOV32_REG_ABS(block, REG_EAX, &cpu_state.seg_cs.base);
+        host_x86_MOV32_REG_BASE_OFFSET(block, REG_EDX, REG_RDI, offsetof(codeblock_t, _cs));
+        host_x86_CMP32_REG_REG(block, REG_EAX, REG_EDX);
+        host_x86_JNZ(block, chain_fail);
+        host_x86_MOV64_REG_IMM(block, REG_RAX, (uintptr_t)&cpu_cur_status);
+        host_x86_MOV16_REG_BASE_OFFSET(block, REG_EAX, REG_RAX, 0);
+        host_x86_MOV16_REG_BASE_OFFSET(block, REG_EDX, REG_RDI, offsetof(codeblock_t, status));
+        host_x86_CMP16_REG_REG(block, REG_EAX, REG_EDX);
+        host_x86_JNZ(block, chain_fail);
+        /*Block code must not have been written to*/
+        host_x86_MOV64_REG_BASE_OFFSET(block, REG_RAX, REG_RDI, offsetof(codeblock_t, dirty_mask));
+        host_x86_MOV32_REG_BASE_OFFSET(block, REG_ECX, REG_RAX, 0);
+        host_x86_MOV32_REG_BASE_OFFSET(block, REG_EDX, REG_RDI, offsetof(codeblock_t, page_mask));
+        host_x86_TEST32_REG(block, REG_ECX, REG_EDX);
+        host_x86_JNZ(block, chain_fail);
+        host_x86_MOV32_REG_BASE_OFFSET(block, REG_ECX, REG_RAX, 4);
+        host_x86_MOV32_REG_BASE_OFFSET(block, REG_EDX, REG_RDI, offsetof(codeblock_t, page_mask) + 4);
+        host_x86_TEST32_REG(block, REG_ECX, REG_EDX);
+        host_x86_JNZ(block, chain_fail);
+        /*Count the execution, as exec386_dynarec() would*/
+        host_x86_MOV32_REG_BASE_OFFSET(block, REG_EAX, REG_RDI, offsetof(codeblock_t, exec_count));
+        host_x86_ADD32_REG_IMM(block, REG_EAX, 1);
+        host_x86_MOV32_BASE_OFFSET_REG(block, REG_RDI, offsetof(codeblock_t, exec_count), REG_EAX);
+        host_x86_MOV64_REG_IMM(block, REG_RCX, (uintptr_t)&cpu_recomp_chained);
+        host_x86_MOV32_REG_BASE_OFFSET(block, REG_EAX, REG_RCX, 0);
+        host_x86_ADD32_REG_IMM(block, REG_EAX, 1);
+        host_x86_MOV32_BASE_OFFSET_REG(block, REG_RCX, 0, REG_EAX);
+        host_x86_RET(block);
+
+        codegen_chain_miss_rout = &codeblock[block_current].data[block_pos];
+        host_x86_MOV64_REG_IMM(block, REG_RCX, (uintptr_t)&codegen_chain);
+        host_x86_MOV32_BASE_OFFSET_REG(block, REG_RCX, offsetof(codegen_chain_t, exit), REG_EAX);
+        host_x86_JMP(block, codegen_exit_rout);
+}
+
 void codegen_backend_init()
 {
         codeblock_t *block;
@@ -338,6 +444,8 @@ void codegen_backend_init()
         host_x86_POP(block, REG_RDX);
         host_x86_RET(block);
 
+        build_chain_routines(block);
+
         block_write_data = NULL;
 
         asm(
@@ -364,6 +472,8 @@ void codegen_backend_prologue(codeblock_t *block)
         host_x86_PUSH(block, REG_R14);
         host_x86_PUSH(block, REG_R15);
         host_x86_SUB64_REG_IMM(block, REG_RSP, 0x38);
+
+        block_body_start = &block_write_data[block_pos];
         host_x86_MOV64_REG_IMM(block, REG_RBP, ((uintptr_t)&cpu_state) + 128);
         if (block->flags & CODEBLOCK_HAS_FPU)
         {
@@ -387,5 +497,53 @@ void codegen_backend_epilogue(codeblock_t *block)
         host_x86_POP(block, REG_RBP);
         host_x86_POP(block, REG_RDX);
         host_x86_RET(block);
+
+        /*Chain entry*/
+        block->chain_entry = &block_write_data[block_pos];
+        if (block->flags & CODEBLOCK_STATIC_TOP)
+        {
+                host_x86_MOV32_REG_ABS(block, REG_EAX, &cpu_state.TOP);
+                host_x86_AND32_REG_IMM(block, REG_EAX, 7);
+                host_x86_CMP32_REG_IMM(block, REG_EAX, block->TOP);
+                host_x86_JNZ(block, codegen_exit_rout);
+        }
+        host_x86_MOV64_REG_IMM(block, REG_RDI, (uintptr_t)block);
+        host_x86_CALL(block, codegen_chain_rout);
+        host_x86_JMP(block, block_body_start);
+}
+
+void codegen_backend_chain_exit(codeblock_t *block, uint32_t pc, int check_pc)
+{
+        int n = block->chain_exits;
+
+        if (check_pc)
+        {
+                host_x86_MOV32_REG_ABS(block, REG_EAX, &cpu_state.pc);
+                host_x86_CMP32_REG_IMM(block, REG_EAX, pc);
+                host_x86_JNZ(block, codegen_exit_rout);
+        }
+        if (n == CODEBLOCK_CHAIN_EXITS)
+        {
+                host_x86_JMP(block, codegen_exit_rout);
+                return;
+        }
+
+        /*Jump to the following miss path until linked*/
+        block->chain_stub[n] = (uint8_t *)host_x86_JMP_long(block);
+        block->chain_pc[n] = pc;
+        block->chain_target[n] = BLOCK_INVALID;
+        block->chain_exits++;
+        host_x86_MOV32_REG_IMM(block, REG_EAX, CHAIN_EXIT(get_block_nr(block), n));
+        host_x86_JMP(block, codegen_chain_miss_rout);
+}
+
+void codegen_backend_chain_patch(uint8_t *stub, uint8_t *dest)
+{
+        uint32_t *offset = (uint32_t *)stub;
+
+        if (dest)
+                chain_set_jump_dest(offset, dest);
+        else
+                *offset = 0;
 }
 #endif
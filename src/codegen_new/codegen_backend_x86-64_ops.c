@@ -330,6 +330,13 @@ void host_x86_JMP(codeblock_t *block, void *p)
 {
         jmp(block, (uintptr_t)p);
 }
+uint32_t *host_x86_JMP_long(codeblock_t *block)
+{
+        codegen_alloc_bytes(block, 5);
+        codegen_addbyte(block, 0xe9); /*JMP*/
+        codegen_addlong(block, 0);
+        return (uint32_t *)&block_write_data[block_pos-4];
+}
 
 void host_x86_JNZ(codeblock_t *block, void *p)
 {
@@ -845,6 +845,13 @@ static int codegen_JMP(codeblock_t *block, uop_t *uop)
         return 0;
 }
 
+static int codegen_JMP_CHAIN(codeblock_t *block, uop_t *uop)
+{
+        codegen_backend_chain_exit(block, uop->imm_data, 0);
+
+        return 0;
+}
+
 static int codegen_LOAD_FUNC_ARG0(codeblock_t *block, uop_t *uop)
 {
         int src_reg = HOST_REG_GET(uop->src_reg_a_real);
@@ -2826,6 +2833,7 @@ const uOpFn uop_handlers[UOP_MAX] =
         [UOP_CALL_INSTRUCTION_FUNC & UOP_MASK] = codegen_CALL_INSTRUCTION_FUNC,
 
         [UOP_JMP & UOP_MASK] = codegen_JMP,
+        [UOP_JMP_CHAIN & UOP_MASK] = codegen_JMP_CHAIN,
 
         [UOP_LOAD_SEG & UOP_MASK] = codegen_LOAD_SEG,
 
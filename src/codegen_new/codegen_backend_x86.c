@@ -348,4 +348,15 @@ void codegen_backend_epilogue(codeblock_t *block)
         host_x86_RET(block);
 }
 
+/*Block chaining is not implemented on this backend. Exits always return to the
+  dispatcher, and as no block has a chain entry no exit is ever patched*/
+void codegen_backend_chain_exit(codeblock_t *block, uint32_t pc, int check_pc)
+{
+        host_x86_JMP(block, codegen_exit_rout);
+}
+
+void codegen_backend_chain_patch(uint8_t *stub, uint8_t *dest)
+{
+}
+
 #endif
@@ -840,6 +840,12 @@ static int codegen_JMP(codeblock_t *block, uop_t *uop)
 
         return 0;
 }
+static int codegen_JMP_CHAIN(codeblock_t *block, uop_t *uop)
+{
+        codegen_backend_chain_exit(block, uop->imm_data, 0);
+
+        return 0;
+}
 static int codegen_JMP_DEST(codeblock_t *block, uop_t *uop)
 {
         uop->p = host_x86_JMP_long(block);
@@ -2822,6 +2828,7 @@ const uOpFn uop_handlers[UOP_MAX] =
         [UOP_CALL_INSTRUCTION_FUNC & UOP_MASK] = codegen_CALL_INSTRUCTION_FUNC,
 
         [UOP_JMP & UOP_MASK] = codegen_JMP,
+        [UOP_JMP_CHAIN & UOP_MASK] = codegen_JMP_CHAIN,
         [UOP_JMP_DEST & UOP_MASK] = codegen_JMP_DEST,
 
         [UOP_LOAD_SEG & UOP_MASK] = codegen_LOAD_SEG,
@@ -4,6 +4,7 @@
 #include <86box/86box.h>
 #include "cpu.h"
 #include <86box/mem.h>
+#include <86box/timer.h>
 
 #include "x86.h"
 #include "x86_flags.h"
@@ -41,6 +42,23 @@ int cpu_recomp_flushes, cpu_recomp_flushes_latched;
 int cpu_recomp_evicted, cpu_recomp_evicted_latched;
 int cpu_recomp_reuse, cpu_recomp_reuse_latched;
 int cpu_recomp_removed, cpu_recomp_removed_latched;
+int cpu_recomp_cache_evicted, cpu_recomp_cache_evicted_latched;
+int cpu_recomp_refilled, cpu_recomp_refilled_latched;
+int cpu_recomp_chained, cpu_recomp_chained_latched;
+int cpu_recomp_dispatched, cpu_recomp_dispatched_latched;
+
+codegen_chain_t codegen_chain;
+
+int codegen_block_usage = 0;
+
+/*Position of the eviction sweep in the codeblock array*/
+static int evict_hand = 0;
+
+/*Physical addresses of recently evicted blocks, used to count refills*/
+#define EVICT_HISTORY_SIZE 0x1000
+#define EVICT_HISTORY_MASK (EVICT_HISTORY_SIZE-1)
+#define EVICT_HISTORY(l) (((l) >> 2) & EVICT_HISTORY_MASK)
+static uint32_t evict_history[EVICT_HISTORY_SIZE];
 
 uint32_t codegen_endpc;
 
@@ -80,6 +98,7 @@ static void block_free_list_add(codeblock_t *block)
                 block->next = 0;
         block_free_list = get_block_nr(block);
         block->flags = CODEBLOCK_IN_FREE_LIST;
+        codegen_block_usage--;
 }
 
 static void block_dirty_list_add(codeblock_t *block)
@@ -194,13 +213,14 @@ static codeblock_t *block_free_list_get()
                 }
                 /*Free list is empty - free up a block*/
                 if (!codegen_purge_purgable_list())
-                        codegen_delete_random_block(0);
+                        codegen_evict_block(0);
         }
 
         block = &codeblock[block_free_list];
         block_free_list = block->next;
         block->flags &= ~CODEBLOCK_IN_FREE_LIST;
         block->next = 0;
+        codegen_block_usage++;
         return block;
 }
 
@@ -216,6 +236,9 @@ void codegen_init()
                 block_free_list_add(&codeblock[c]);
         block_dirty_list_head = block_dirty_list_tail = 0;
         dirty_list_size = 0;
+        codegen_block_usage = 0;
+        evict_hand = 0;
+        memset(evict_history, 0xff, sizeof(evict_history));
 #ifdef DEBUG_EXTRA
         memset(instr_counts, 0, sizeof(instr_counts));
 #endif
@@ -224,6 +247,13 @@ void codegen_init()
 void codegen_close()
 {
 #ifdef DEBUG_EXTRA
+        pclog("Code cache : %i blocks compiled, %i evicted, %i recompiled after eviction, %i/%i blocks and %i/%i memory blocks in use\n",
+                cpu_new_blocks, cpu_recomp_cache_evicted, cpu_recomp_refilled,
+                codegen_block_usage, BLOCK_SIZE, codegen_allocator_usage, MEM_BLOCK_NR);
+        pclog("Block chaining : %i blocks entered through the dispatcher, %i through chained jumps\n",
+                cpu_recomp_dispatched, cpu_recomp_chained);
+        pclog("IR optimisation %s : %i uOPs folded, %i register reads propagated\n",
+                codegen_ir_optimise ? "on" : "off", codegen_ir_uops_folded, codegen_ir_reads_propagated);
         pclog("Instruction counts :\n");
         while (1)
         {
@@ -276,6 +306,9 @@ void codegen_reset()
                 codeblock[c].pc = BLOCK_PC_INVALID;
                 block_free_list_add(&codeblock[c]);
         }
+        codegen_block_usage = 0;
+        evict_hand = 0;
+        memset(evict_history, 0xff, sizeof(evict_history));
 }
 
 void dump_block()
@@ -388,6 +421,46 @@ static void remove_from_block_list(codeblock_t *block, uint32_t pc)
         }
 }
 
+/*Point exit n of block back at its miss path, and remove it from the list of
+  exits linked to its target*/
+static void chain_unlink_exit(codeblock_t *block, int n)
+{
+        codeblock_t *target = &codeblock[block->chain_target[n]];
+        uint32_t prev = block->chain_in_prev[n];
+        uint32_t next = block->chain_in_next[n];
+
+        if (prev != CHAIN_EXIT_NONE)
+                codeblock[prev / CODEBLOCK_CHAIN_EXITS].chain_in_next[prev % CODEBLOCK_CHAIN_EXITS] = next;
+        else
+                target->chain_in = next;
+        if (next != CHAIN_EXIT_NONE)
+                codeblock[next / CODEBLOCK_CHAIN_EXITS].chain_in_prev[next % CODEBLOCK_CHAIN_EXITS] = prev;
+
+        block->chain_target[n] = BLOCK_INVALID;
+        codegen_backend_chain_patch(block->chain_stub[n], NULL);
+}
+
+/*Unlink all exits leaving and entering block. Must be called before the
+  block's code memory is freed or rewritten*/
+static void chain_unlink_block(codeblock_t *block)
+{
+        int n;
+
+        for (n = 0; n < block->chain_exits; n++)
+        {
+                if (block->chain_target[n] != BLOCK_INVALID)
+                        chain_unlink_exit(block, n);
+        }
+        while (block->chain_in != CHAIN_EXIT_NONE)
+        {
+                uint32_t exit = block->chain_in;
+
+                chain_unlink_exit(&codeblock[exit / CODEBLOCK_CHAIN_EXITS], exit % CODEBLOCK_CHAIN_EXITS);
+        }
+        block->chain_exits = 0;
+        block->chain_entry = NULL;
+}
+
 static void invalidate_block(codeblock_t *block)
 {
         uint32_t old_pc = block->pc;
@@ -399,6 +472,7 @@ static void invalidate_block(codeblock_t *block)
                 
         remove_from_block_list(block, old_pc);
         block_dirty_list_add(block);
+        chain_unlink_block(block);
         if (block->head_mem_block)
                 codegen_allocator_free(block->head_mem_block);
         block->head_mem_block = NULL;
@@ -420,6 +494,7 @@ static void delete_block(codeblock_t *block)
                 block_dirty_list_remove(block);
         else
                 remove_from_block_list(block, old_pc);
+        chain_unlink_block(block);
         if (block->head_mem_block)
                 codegen_allocator_free(block->head_mem_block);
         block->head_mem_block = NULL;
@@ -445,23 +520,33 @@ void codegen_delete_block(codeblock_t *block)
                 delete_block(block);
 }
 
-void codegen_delete_random_block(int required_mem_block)
+void codegen_evict_block(int required_mem_block)
 {
-        int block_nr = rand() & BLOCK_MASK;
-        
         while (1)
         {
+                int block_nr = evict_hand;
+
+                evict_hand = (evict_hand + 1) & BLOCK_MASK;
+
                 if (block_nr && block_nr != block_current)
                 {
                         codeblock_t *block = &codeblock[block_nr];
 
                         if (block->pc != BLOCK_PC_INVALID && (!required_mem_block || block->head_mem_block))
                         {
+                                if (block->exec_count != block->sweep_count)
+                                {
+                                        /*Used since the hand last passed, give it a second chance*/
+                                        block->sweep_count = block->exec_count;
+                                        continue;
+                                }
+
+                                evict_history[EVICT_HISTORY(block->phys)] = block->phys;
                                 delete_block(block);
+                                cpu_recomp_cache_evicted++;
                                 return;
                         }
                 }
-                block_nr = (block_nr + 1) & BLOCK_MASK;
         }
 }
 
@@ -545,6 +630,19 @@ void codegen_block_init(uint32_t phys_addr)
         block->page_mask = block->page_mask2 = 0;
         block->flags = CODEBLOCK_STATIC_TOP;
         block->status = cpu_cur_status;
+        /*Start with one execution on the count, so a new block survives its
+          first pass of the eviction sweep*/
+        block->exec_count = 1;
+        block->sweep_count = 0;
+        block->chain_entry = NULL;
+        block->chain_exits = 0;
+        block->chain_in = CHAIN_EXIT_NONE;
+
+        if (evict_history[EVICT_HISTORY(phys_addr)] == phys_addr)
+        {
+                evict_history[EVICT_HISTORY(phys_addr)] = BLOCK_PC_INVALID;
+                cpu_recomp_refilled++;
+        }
         
         recomp_page = block->phys & ~0xfff;
         codeblock_tree_add(block);
@@ -570,6 +668,7 @@ void codegen_block_start_recompile(codeblock_t *block)
         if (block->pc != cs + cpu_state.pc || (block->flags & CODEBLOCK_WAS_RECOMPILED))
                 fatal("Recompile to used block!\n");
 
+        chain_unlink_block(block);
         block->head_mem_block = codegen_allocator_allocate(NULL, block_current);
         block->data = codeblock_allocator_get_ptr(block->head_mem_block);
 
@@ -802,7 +901,54 @@ void codegen_block_end_recompile(codeblock_t *block)
 
 void codegen_flush()
 {
-        return;
+        /*Mappings may have changed, so make the next chained jump return to the
+          dispatcher. Existing links stay valid, as a block is only ever linked
+          to blocks in the same page as itself*/
+        codegen_chain.cycles_limit = INT32_MAX;
+}
+
+void codegen_chain_enter(codeblock_t *block)
+{
+        uint32_t exit = codegen_chain.exit;
+        int32_t until_timer;
+        int64_t cycles_limit;
+
+        cpu_recomp_dispatched++;
+
+        codegen_chain.exit = CHAIN_EXIT_NONE;
+        if (exit != CHAIN_EXIT_NONE && block->chain_entry && !block->page_mask2)
+        {
+                codeblock_t *source = &codeblock[exit / CODEBLOCK_CHAIN_EXITS];
+                int n = exit % CODEBLOCK_CHAIN_EXITS;
+
+                /*Link the exit if this block is where it always goes, and this
+                  block is in the same linear and physical page as the exiting
+                  block. chain_exits is cleared whenever the exiting block's
+                  code is freed, so a stale exit can not be patched*/
+                if (n < source->chain_exits && source->chain_target[n] == BLOCK_INVALID &&
+                    source->_cs == block->_cs && (source->_cs + source->chain_pc[n]) == block->pc &&
+                    !((source->pc ^ block->pc) & ~0xfff) && !((source->phys ^ block->phys) & ~0xfff))
+                {
+                        source->chain_target[n] = get_block_nr(block);
+                        source->chain_in_prev[n] = CHAIN_EXIT_NONE;
+                        source->chain_in_next[n] = block->chain_in;
+                        if (block->chain_in != CHAIN_EXIT_NONE)
+                                codeblock[block->chain_in / CODEBLOCK_CHAIN_EXITS].chain_in_prev[block->chain_in % CODEBLOCK_CHAIN_EXITS] = exit;
+                        block->chain_in = exit;
+                        codegen_backend_chain_patch(source->chain_stub[n], block->chain_entry);
+                }
+        }
+
+        /*Chained blocks must stop before the cycle budget runs out or the next
+          timer event is due, as exec386_dynarec() would*/
+        until_timer = (int32_t)(timer_target - (uint32_t)tsc);
+        cycles_limit = (int64_t)cycles - until_timer + 1;
+        if (cycles_limit < 1)
+                cycles_limit = 1;
+        else if (cycles_limit > INT32_MAX)
+                cycles_limit = INT32_MAX;
+        codegen_chain.cycles_limit = (int32_t)cycles_limit;
+        codegen_chain.timer_target = timer_target;
 }
 
 void codegen_mark_code_present_multibyte(codeblock_t *block, uint32_t start_pc, int len)
@@ -1,4 +1,7 @@
+#include <stdarg.h>
 #include <stdint.h>
+#include <string.h>
+#define HAVE_STDARG_H
 #include <86box/86box.h>
 #include "cpu.h"
 #include <86box/mem.h>
@@ -15,9 +18,113 @@ static ir_data_t ir_block;
 static int codegen_unroll_start, codegen_unroll_count;
 static int codegen_unroll_first_instruction;
 
+/*Set to 0 to skip the IR optimisation passes, eg when comparing generated code*/
+int codegen_ir_optimise = 1;
+/*uOPs simplified by constant folding, and register reads redirected by copy
+  propagation*/
+int codegen_ir_uops_folded, codegen_ir_reads_propagated;
+
+#ifdef ENABLE_CODEGEN_IR_LOG
+int codegen_ir_do_log = ENABLE_CODEGEN_IR_LOG;
+
+
+static void
+codegen_ir_log(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (codegen_ir_do_log) {
+	va_start(ap, fmt);
+	pclog_ex(fmt, ap);
+	va_end(ap);
+    }
+}
+
+static void codegen_ir_dump_reg(const char *name, ir_reg_t ir_reg)
+{
+        if (!ir_reg_is_invalid(ir_reg))
+                codegen_ir_log(" %s=%03x.%i", name, ir_reg.reg, ir_reg.version);
+}
+
+static void codegen_ir_dump(ir_data_t *ir, const char *title)
+{
+        int c;
+
+        if (!codegen_ir_do_log)
+                return;
+
+        codegen_ir_log("%s (%i uOPs):\n", title, ir->wr_pos);
+        for (c = 0; c < ir->wr_pos; c++)
+        {
+                uop_t *uop = &ir->uops[c];
+
+                if ((uop->type & UOP_MASK) == UOP_INVALID)
+                        continue;
+
+                codegen_ir_log(" %4i: %02x", c, uop->type & UOP_MASK);
+                if (uop->type & UOP_TYPE_PARAMS_REGS)
+                {
+                        codegen_ir_dump_reg("dest", uop->dest_reg_a);
+                        codegen_ir_dump_reg("a", uop->src_reg_a);
+                        codegen_ir_dump_reg("b", uop->src_reg_b);
+                        codegen_ir_dump_reg("c", uop->src_reg_c);
+                }
+                if (uop->type & UOP_TYPE_PARAMS_IMM)
+                        codegen_ir_log(" imm=%08x", uop->imm_data);
+                if (uop->type & UOP_TYPE_PARAMS_POINTER)
+                        codegen_ir_log(" p=%p", uop->p);
+                if (uop->jump_dest_uop != -1)
+                        codegen_ir_log(" ->%i", uop->jump_dest_uop);
+                codegen_ir_log("\n");
+        }
+}
+#else
+#define codegen_ir_log(fmt, ...)
+#define codegen_ir_dump(ir, title)
+#endif
+
+/*Optimisation passes :
+
+  The IR is in SSA form - each write to a register creates a new version - so the
+  passes can track what is known about each register version in a single
+  forward walk over the uOP list :
+
+  - Constant folding. A full 32-bit register version written by UOP_MOV_IMM has
+    a known value. uOPs whose sources are all known become UOP_MOV_IMM, register
+    operands that are known are turned into immediates (eg UOP_ADD -> UOP_ADD_IMM)
+    and memory accesses to a known address use the _ABS forms.
+  - Copy propagation. Reads of a register version written by UOP_MOV are
+    redirected to the source, as long as the source has not since been
+    overwritten.
+
+  Removed reads drop the refcount of the register version, and temporary
+  registers left without readers are then removed by
+  codegen_reg_process_dead_list(). Flag computations that are overwritten before
+  being read, and redundant guest register loads/stores, are already handled by
+  the dead list and the register allocator respectively.
+
+  Calls to external functions (barrier uOPs) may change any register in memory,
+  and jump destinations can be reached with a different set of values, so all
+  knowledge is discarded at either of those.*/
+typedef struct ir_value_t
+{
+        /*Entry is only valid while equal to ir_value_stamp*/
+        uint32_t stamp;
+        int is_const;
+        uint32_t imm;
+        /*Register version this is a copy of, if not invalid*/
+        ir_reg_t copy;
+} ir_value_t;
+
+static ir_value_t ir_values[IREG_COUNT][256];
+static uint32_t ir_value_stamp;
+static uint8_t ir_cur_version[IREG_COUNT];
+static uint8_t ir_jump_dest[UOP_NR_MAX];
+
 ir_data_t *codegen_ir_init()
 {
         ir_block.wr_pos = 0;
+        ir_block.exit_pc = BLOCK_PC_INVALID;
 
         codegen_unroll_count = 0;
 
@@ -55,6 +162,332 @@ static void duplicate_uop(ir_data_t *ir, uop_t *uop, int offset)
         }
 }
 
+static void ir_values_forget()
+{
+        ir_value_stamp++;
+        if (!ir_value_stamp)
+        {
+                memset(ir_values, 0, sizeof(ir_values));
+                ir_value_stamp = 1;
+        }
+}
+
+static ir_value_t *ir_get_value(ir_reg_t ir_reg)
+{
+        ir_value_t *value = &ir_values[IREG_GET_REG(ir_reg.reg)][ir_reg.version];
+
+        if (value->stamp != ir_value_stamp)
+                return NULL;
+        return value;
+}
+
+/*Return non-zero and the value of ir_reg in *imm if it is known*/
+static int ir_get_const(ir_reg_t ir_reg, uint32_t *imm)
+{
+        ir_value_t *value;
+
+        if (ir_reg_is_invalid(ir_reg))
+                return 0;
+        value = ir_get_value(ir_reg);
+        if (!value || !value->is_const)
+                return 0;
+
+        switch (IREG_GET_SIZE(ir_reg.reg))
+        {
+                case IREG_SIZE_L:
+                *imm = value->imm;
+                return 1;
+                case IREG_SIZE_W:
+                *imm = value->imm & 0xffff;
+                return 1;
+                case IREG_SIZE_B:
+                *imm = value->imm & 0xff;
+                return 1;
+                case IREG_SIZE_BH:
+                *imm = (value->imm >> 8) & 0xff;
+                return 1;
+        }
+        return 0;
+}
+
+static void ir_propagate_copy(ir_data_t *ir, ir_reg_t *ir_reg)
+{
+        ir_value_t *value;
+        reg_version_t *regv;
+
+        if (ir_reg_is_invalid(*ir_reg) || IREG_GET_SIZE(ir_reg->reg) != IREG_SIZE_L)
+                return;
+        value = ir_get_value(*ir_reg);
+        if (!value || ir_reg_is_invalid(value->copy))
+                return;
+        /*Source must still be the current version, otherwise the register
+          allocator can no longer provide it*/
+        if (ir_cur_version[IREG_GET_REG(value->copy.reg)] != value->copy.version)
+                return;
+        regv = &reg_version[IREG_GET_REG(value->copy.reg)][value->copy.version];
+        if (regv->refcount >= REG_REFCOUNT_MAX)
+                return;
+
+        regv->refcount++;
+        codegen_reg_drop_read(ir, *ir_reg);
+        *ir_reg = value->copy;
+        codegen_ir_reads_propagated++;
+}
+
+static void ir_fold_to_imm(ir_data_t *ir, uop_t *uop, uint32_t imm)
+{
+        if (!ir_reg_is_invalid(uop->src_reg_a))
+                codegen_reg_drop_read(ir, uop->src_reg_a);
+        if (!ir_reg_is_invalid(uop->src_reg_b))
+                codegen_reg_drop_read(ir, uop->src_reg_b);
+        uop->src_reg_a = invalid_ir_reg;
+        uop->src_reg_b = invalid_ir_reg;
+        uop->type = UOP_MOV_IMM;
+        uop->imm_data = imm;
+        codegen_ir_uops_folded++;
+}
+
+static uint32_t ir_alu_op(uint32_t type, uint32_t a, uint32_t b)
+{
+        switch (type)
+        {
+                case UOP_ADD: case UOP_ADD_IMM:
+                return a + b;
+                case UOP_SUB: case UOP_SUB_IMM:
+                return a - b;
+                case UOP_AND: case UOP_AND_IMM:
+                return a & b;
+                case UOP_OR: case UOP_OR_IMM:
+                return a | b;
+                case UOP_XOR: case UOP_XOR_IMM:
+                return a ^ b;
+                case UOP_SHL: case UOP_SHL_IMM:
+                return a << (b & 31);
+                case UOP_SHR: case UOP_SHR_IMM:
+                return a >> (b & 31);
+                case UOP_SAR: case UOP_SAR_IMM:
+                return (uint32_t)((int32_t)a >> (b & 31));
+                case UOP_ROL: case UOP_ROL_IMM:
+                b &= 31;
+                return b ? ((a << b) | (a >> (32 - b))) : a;
+                case UOP_ROR: case UOP_ROR_IMM:
+                b &= 31;
+                return b ? ((a >> b) | (a << (32 - b))) : a;
+        }
+        fatal("ir_alu_op - unknown uOP %08x\n", type);
+        return 0;
+}
+
+/*Immediate form of a two register ALU uOP*/
+static uint32_t ir_alu_imm_type(uint32_t type)
+{
+        switch (type)
+        {
+                case UOP_ADD: return UOP_ADD_IMM;
+                case UOP_SUB: return UOP_SUB_IMM;
+                case UOP_AND: return UOP_AND_IMM;
+                case UOP_OR:  return UOP_OR_IMM;
+                case UOP_XOR: return UOP_XOR_IMM;
+                case UOP_SHL: return UOP_SHL_IMM;
+                case UOP_SHR: return UOP_SHR_IMM;
+                case UOP_SAR: return UOP_SAR_IMM;
+                case UOP_ROL: return UOP_ROL_IMM;
+                case UOP_ROR: return UOP_ROR_IMM;
+        }
+        return 0;
+}
+
+static int ir_is_int_size(ir_reg_t ir_reg)
+{
+        int size = IREG_GET_SIZE(ir_reg.reg);
+
+        return (size == IREG_SIZE_L || size == IREG_SIZE_W || size == IREG_SIZE_B);
+}
+
+static void ir_fold_constants(ir_data_t *ir, uop_t *uop)
+{
+        uint32_t imm_a, imm_b;
+        int const_a = ir_get_const(uop->src_reg_a, &imm_a);
+        int const_b = ir_get_const(uop->src_reg_b, &imm_b);
+        int dest_dword = !ir_reg_is_invalid(uop->dest_reg_a) && reg_is_dword(uop->dest_reg_a);
+
+        switch (uop->type)
+        {
+                case UOP_MOV:
+                if (dest_dword && const_a && IREG_GET_SIZE(uop->src_reg_a.reg) == IREG_SIZE_L)
+                        ir_fold_to_imm(ir, uop, imm_a);
+                break;
+
+                case UOP_MOVZX:
+                if (dest_dword && const_a)
+                        ir_fold_to_imm(ir, uop, imm_a);
+                break;
+
+                case UOP_MOVSX:
+                if (dest_dword && const_a)
+                {
+                        if (IREG_GET_SIZE(uop->src_reg_a.reg) == IREG_SIZE_W)
+                                imm_a = (uint32_t)(int32_t)(int16_t)imm_a;
+                        else if (IREG_GET_SIZE(uop->src_reg_a.reg) != IREG_SIZE_L)
+                                imm_a = (uint32_t)(int32_t)(int8_t)imm_a;
+                        ir_fold_to_imm(ir, uop, imm_a);
+                }
+                break;
+
+                case UOP_ADD_IMM: case UOP_SUB_IMM: case UOP_AND_IMM: case UOP_OR_IMM: case UOP_XOR_IMM:
+                case UOP_SHL_IMM: case UOP_SHR_IMM: case UOP_SAR_IMM: case UOP_ROL_IMM: case UOP_ROR_IMM:
+                if (dest_dword && const_a && IREG_GET_SIZE(uop->src_reg_a.reg) == IREG_SIZE_L)
+                        ir_fold_to_imm(ir, uop, ir_alu_op(uop->type, imm_a, uop->imm_data));
+                break;
+
+                case UOP_ADD: case UOP_AND: case UOP_OR: case UOP_XOR:
+                case UOP_SUB: case UOP_SHL: case UOP_SHR: case UOP_SAR: case UOP_ROL: case UOP_ROR:
+                if (!dest_dword || IREG_GET_SIZE(uop->src_reg_a.reg) != IREG_SIZE_L || IREG_GET_SIZE(uop->src_reg_b.reg) != IREG_SIZE_L)
+                        break;
+                if (const_a && const_b)
+                        ir_fold_to_imm(ir, uop, ir_alu_op(uop->type, imm_a, imm_b));
+                else if (const_a && (uop->type == UOP_ADD || uop->type == UOP_AND || uop->type == UOP_OR || uop->type == UOP_XOR))
+                {
+                        /*Commutative, so the known operand can become the immediate*/
+                        codegen_reg_drop_read(ir, uop->src_reg_a);
+                        uop->src_reg_a = uop->src_reg_b;
+                        uop->src_reg_b = invalid_ir_reg;
+                        uop->type = ir_alu_imm_type(uop->type);
+                        uop->imm_data = imm_a;
+                        codegen_ir_uops_folded++;
+                }
+                else if (const_b)
+                {
+                        codegen_reg_drop_read(ir, uop->src_reg_b);
+                        uop->src_reg_b = invalid_ir_reg;
+                        if (uop->type == UOP_SHL || uop->type == UOP_SHR || uop->type == UOP_SAR || uop->type == UOP_ROL || uop->type == UOP_ROR)
+                                imm_b &= 31;
+                        uop->type = ir_alu_imm_type(uop->type);
+                        uop->imm_data = imm_b;
+                        codegen_ir_uops_folded++;
+                }
+                break;
+
+                case UOP_ADD_LSHIFT:
+                if (!dest_dword || IREG_GET_SIZE(uop->src_reg_a.reg) != IREG_SIZE_L || IREG_GET_SIZE(uop->src_reg_b.reg) != IREG_SIZE_L || !const_b)
+                        break;
+                if (const_a)
+                        ir_fold_to_imm(ir, uop, imm_a + (imm_b << uop->imm_data));
+                else
+                {
+                        codegen_reg_drop_read(ir, uop->src_reg_b);
+                        uop->src_reg_b = invalid_ir_reg;
+                        uop->type = UOP_ADD_IMM;
+                        uop->imm_data = imm_b << uop->imm_data;
+                        codegen_ir_uops_folded++;
+                }
+                break;
+
+                case UOP_MEM_LOAD_REG:
+                /*seg:[known address + offset] -> seg:[immediate]*/
+                if (const_b && ir_is_int_size(uop->dest_reg_a))
+                {
+                        codegen_reg_drop_read(ir, uop->src_reg_b);
+                        uop->src_reg_b = invalid_ir_reg;
+                        uop->type = UOP_MEM_LOAD_ABS;
+                        uop->imm_data += imm_b;
+                        codegen_ir_uops_folded++;
+                }
+                break;
+
+                case UOP_MEM_STORE_REG:
+                if (const_b && ir_is_int_size(uop->src_reg_c))
+                {
+                        codegen_reg_drop_read(ir, uop->src_reg_b);
+                        uop->src_reg_b = uop->src_reg_c;
+                        uop->src_reg_c = invalid_ir_reg;
+                        uop->type = UOP_MEM_STORE_ABS;
+                        uop->imm_data += imm_b;
+                        codegen_ir_uops_folded++;
+                }
+                else if (!uop->imm_data && ir_is_int_size(uop->src_reg_c) && ir_get_const(uop->src_reg_c, &imm_a))
+                {
+                        /*Storing a known value; the _IMM forms have no offset*/
+                        switch (IREG_GET_SIZE(uop->src_reg_c.reg))
+                        {
+                                case IREG_SIZE_L: uop->type = UOP_MEM_STORE_IMM_32; break;
+                                case IREG_SIZE_W: uop->type = UOP_MEM_STORE_IMM_16; break;
+                                default:          uop->type = UOP_MEM_STORE_IMM_8;  break;
+                        }
+                        codegen_reg_drop_read(ir, uop->src_reg_c);
+                        uop->src_reg_c = invalid_ir_reg;
+                        uop->imm_data = imm_a;
+                        codegen_ir_uops_folded++;
+                }
+                break;
+        }
+}
+
+static void ir_record_value(uop_t *uop)
+{
+        int reg = IREG_GET_REG(uop->dest_reg_a.reg);
+        ir_value_t *value = &ir_values[reg][uop->dest_reg_a.version];
+
+        ir_cur_version[reg] = uop->dest_reg_a.version;
+
+        value->stamp = 0;
+        if (!reg_is_dword(uop->dest_reg_a))
+                return;
+
+        if (uop->type == UOP_MOV_IMM)
+        {
+                value->stamp = ir_value_stamp;
+                value->is_const = 1;
+                value->imm = uop->imm_data;
+                value->copy = invalid_ir_reg;
+        }
+        else if (uop->type == UOP_MOV && reg_is_dword(uop->src_reg_a))
+        {
+                value->stamp = ir_value_stamp;
+                value->is_const = 0;
+                value->copy = uop->src_reg_a;
+        }
+}
+
+static void codegen_ir_optimise_block(ir_data_t *ir)
+{
+        int c;
+
+        memset(ir_jump_dest, 0, ir->wr_pos);
+        for (c = 0; c < ir->wr_pos; c++)
+        {
+                uop_t *uop = &ir->uops[c];
+
+                if ((uop->type & UOP_TYPE_JUMP) && uop->jump_dest_uop >= 0 && uop->jump_dest_uop < ir->wr_pos)
+                        ir_jump_dest[uop->jump_dest_uop] = 1;
+        }
+
+        memset(ir_cur_version, 0, sizeof(ir_cur_version));
+        ir_values_forget();
+
+        for (c = 0; c < ir->wr_pos; c++)
+        {
+                uop_t *uop = &ir->uops[c];
+
+                if (ir_jump_dest[c] || (uop->type & UOP_TYPE_BARRIER))
+                        ir_values_forget();
+
+                if (!(uop->type & UOP_TYPE_PARAMS_REGS))
+                        continue;
+
+                if (!(uop->type & UOP_TYPE_BARRIER))
+                {
+                        ir_propagate_copy(ir, &uop->src_reg_a);
+                        ir_propagate_copy(ir, &uop->src_reg_b);
+                        ir_propagate_copy(ir, &uop->src_reg_c);
+                        ir_fold_constants(ir, uop);
+                }
+
+                if (!ir_reg_is_invalid(uop->dest_reg_a))
+                        ir_record_value(uop);
+        }
+}
+
 void codegen_ir_compile(ir_data_t *ir, codeblock_t *block)
 {
         int jump_target_at_end = -1;
@@ -79,7 +512,11 @@ void codegen_ir_compile(ir_data_t *ir, codeblock_t *block)
         }
 
         codegen_reg_mark_as_required();
+        codegen_ir_dump(ir, "IR before optimisation");
+        if (codegen_ir_optimise)
+                codegen_ir_optimise_block(ir);
         codegen_reg_process_dead_list(ir);
+        codegen_ir_dump(ir, "IR after optimisation");
         block_write_data = codeblock_allocator_get_ptr(block->head_mem_block);
         block_pos = 0;
         codegen_backend_prologue(block);
@@ -181,6 +618,12 @@ void codegen_ir_compile(ir_data_t *ir, codeblock_t *block)
                 }
         }
 
+        /*Emitted here rather than as a uOP so loop unrolling does not duplicate
+          it. Jumps to the end of the block may arrive with a different PC, so
+          the exit checks it first*/
+        if (ir->exit_pc != BLOCK_PC_INVALID)
+                codegen_backend_chain_exit(block, ir->exit_pc, 1);
+
         codegen_backend_epilogue(block);
         block_write_data = NULL;
 //        if (has_ea)
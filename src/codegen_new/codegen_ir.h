@@ -4,3 +4,6 @@ ir_data_t *codegen_ir_init();
 
 void codegen_ir_set_unroll(int count, int start, int first_instruction);
 void codegen_ir_compile(ir_data_t *ir, codeblock_t *block);
+
+extern int codegen_ir_optimise;
+extern int codegen_ir_uops_folded, codegen_ir_reads_propagated;
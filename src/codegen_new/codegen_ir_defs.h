@@ -55,6 +55,8 @@
 /*UOP_JMP_DEST - jump to ptr*/
 #define UOP_JMP_DEST              (UOP_TYPE_PARAMS_IMM | UOP_TYPE_PARAMS_POINTER | 0x17 | UOP_TYPE_ORDER_BARRIER | UOP_TYPE_JUMP)
 #define UOP_NOP_BARRIER           (UOP_TYPE_BARRIER | 0x18)
+/*UOP_JMP_CHAIN - exit block to guest PC imm_data, through a jump that can be linked to the next block*/
+#define UOP_JMP_CHAIN             (UOP_TYPE_PARAMS_IMM | 0x19 | UOP_TYPE_ORDER_BARRIER)
 
 #ifdef DEBUG_EXTRA
 /*UOP_LOG_INSTR - log non-recompiled instruction in imm_data*/
@@ -355,6 +357,9 @@ typedef struct ir_data_t
         uop_t uops[UOP_NR_MAX];
         int wr_pos;
         struct codeblock_t *block;
+        /*Guest PC the block leaves with if it runs to the end, or
+          BLOCK_PC_INVALID if that is not known at compile time*/
+        uint32_t exit_pc;
 } ir_data_t;
 
 static inline uop_t *uop_alloc(ir_data_t *ir, uint32_t uop_type)
@@ -671,6 +676,7 @@ static inline void uop_gen_reg_src2_pointer(uint32_t uop_type, ir_data_t *ir, in
 
 #define uop_JMP(ir, p)                   uop_gen_pointer(UOP_JMP, ir, p)
 #define uop_JMP_DEST(ir)                 uop_gen(UOP_JMP_DEST, ir)
+#define uop_JMP_CHAIN(ir, pc)            uop_gen_imm(UOP_JMP_CHAIN, ir, pc)
 
 #define uop_LOAD_SEG(ir, p, src_reg) uop_gen_reg_src_pointer(UOP_LOAD_SEG, ir, src_reg, p)
 
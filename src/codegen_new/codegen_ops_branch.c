@@ -51,7 +51,7 @@ static int ropJO_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr, u
                 break;
         }
         uop_MOV_IMM(ir, IREG_pc, dest_addr);
-        uop_JMP(ir, codegen_exit_rout);
+        uop_JMP_CHAIN(ir, dest_addr);
         uop_set_jump_dest(ir, jump_uop);
         return 0;
 }
@@ -64,7 +64,7 @@ static int ropJNO_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr,
                 case FLAGS_ZN8: case FLAGS_ZN16: case FLAGS_ZN32:
                 /*Overflow is always zero*/
                 uop_MOV_IMM(ir, IREG_pc, dest_addr);
-                uop_JMP(ir, codegen_exit_rout);
+                uop_JMP_CHAIN(ir, dest_addr);
                 return 0;
 
                 case FLAGS_SUB8: case FLAGS_DEC8:
@@ -86,7 +86,7 @@ static int ropJNO_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr,
                 break;
         }
         uop_MOV_IMM(ir, IREG_pc, dest_addr);
-        uop_JMP(ir, codegen_exit_rout);
+        uop_JMP_CHAIN(ir, dest_addr);
         uop_set_jump_dest(ir, jump_uop);
         return 0;
 }
@@ -133,7 +133,7 @@ static int ropJB_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr, u
                 break;
         }
         uop_MOV_IMM(ir, IREG_pc, do_unroll ? next_pc : dest_addr);
-        uop_JMP(ir, codegen_exit_rout);
+        uop_JMP_CHAIN(ir, do_unroll ? next_pc : dest_addr);
         uop_set_jump_dest(ir, jump_uop);
         return do_unroll ? 1 : 0;
 }
@@ -147,7 +147,7 @@ static int ropJNB_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr,
                 case FLAGS_ZN8: case FLAGS_ZN16: case FLAGS_ZN32:
                 /*Carry is always zero*/
                 uop_MOV_IMM(ir, IREG_pc, dest_addr);
-                uop_JMP(ir, codegen_exit_rout);
+                uop_JMP_CHAIN(ir, dest_addr);
                 return 0;
 
                 case FLAGS_SUB8:
@@ -181,7 +181,7 @@ static int ropJNB_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr,
                 break;
         }
         uop_MOV_IMM(ir, IREG_pc, do_unroll ? next_pc : dest_addr);
-        uop_JMP(ir, codegen_exit_rout);
+        uop_JMP_CHAIN(ir, do_unroll ? next_pc : dest_addr);
         uop_set_jump_dest(ir, jump_uop);
         return do_unroll ? 1 : 0;
 }
@@ -202,7 +202,7 @@ static int ropJE_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr, u
                         jump_uop = uop_CMP_IMM_JZ_DEST(ir, IREG_flags_res, 0);
                 }
                 uop_MOV_IMM(ir, IREG_pc, next_pc);
-                uop_JMP(ir, codegen_exit_rout);
+                uop_JMP_CHAIN(ir, next_pc);
                 uop_set_jump_dest(ir, jump_uop);
                 return 1;
         }
@@ -218,7 +218,7 @@ static int ropJE_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr, u
                         jump_uop = uop_CMP_IMM_JNZ_DEST(ir, IREG_flags_res, 0);
                 }
                 uop_MOV_IMM(ir, IREG_pc, dest_addr);
-                uop_JMP(ir, codegen_exit_rout);
+                uop_JMP_CHAIN(ir, dest_addr);
                 uop_set_jump_dest(ir, jump_uop);
         }
         return 0;
@@ -239,7 +239,7 @@ int ropJNE_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr, uint32_
                         jump_uop = uop_CMP_IMM_JNZ_DEST(ir, IREG_flags_res, 0);
                 }
                 uop_MOV_IMM(ir, IREG_pc, next_pc);
-                uop_JMP(ir, codegen_exit_rout);
+                uop_JMP_CHAIN(ir, next_pc);
                 uop_set_jump_dest(ir, jump_uop);
                 return 1;
         }
@@ -255,7 +255,7 @@ int ropJNE_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr, uint32_
                         jump_uop = uop_CMP_IMM_JZ_DEST(ir, IREG_flags_res, 0);
                 }
                 uop_MOV_IMM(ir, IREG_pc, dest_addr);
-                uop_JMP(ir, codegen_exit_rout);
+                uop_JMP_CHAIN(ir, dest_addr);
                 uop_set_jump_dest(ir, jump_uop);
         }
         return 0;
@@ -316,7 +316,7 @@ static int ropJBE_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr,
         if (do_unroll)
         {
                 uop_MOV_IMM(ir, IREG_pc, next_pc);
-                uop_JMP(ir, codegen_exit_rout);
+                uop_JMP_CHAIN(ir, next_pc);
                 uop_set_jump_dest(ir, jump_uop);
                 if (jump_uop2 != -1)
                         uop_set_jump_dest(ir, jump_uop2);
@@ -327,7 +327,7 @@ static int ropJBE_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr,
                 if (jump_uop2 != -1)
                         uop_set_jump_dest(ir, jump_uop2);
                 uop_MOV_IMM(ir, IREG_pc, dest_addr);
-                uop_JMP(ir, codegen_exit_rout);
+                uop_JMP_CHAIN(ir, dest_addr);
                 uop_set_jump_dest(ir, jump_uop);
                 return 0;
         }
@@ -389,14 +389,14 @@ static int ropJNBE_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr,
                 if (jump_uop2 != -1)
                         uop_set_jump_dest(ir, jump_uop2);
                 uop_MOV_IMM(ir, IREG_pc, next_pc);
-                uop_JMP(ir, codegen_exit_rout);
+                uop_JMP_CHAIN(ir, next_pc);
                 uop_set_jump_dest(ir, jump_uop);
                 return 1;
         }
         else
         {
                 uop_MOV_IMM(ir, IREG_pc, dest_addr);
-                uop_JMP(ir, codegen_exit_rout);
+                uop_JMP_CHAIN(ir, dest_addr);
                 uop_set_jump_dest(ir, jump_uop);
                 if (jump_uop2 != -1)
                         uop_set_jump_dest(ir, jump_uop2);
@@ -463,7 +463,7 @@ static int ropJS_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr, u
                 break;
         }
         uop_MOV_IMM(ir, IREG_pc, do_unroll ? next_pc : dest_addr);
-        uop_JMP(ir, codegen_exit_rout);
+        uop_JMP_CHAIN(ir, do_unroll ? next_pc : dest_addr);
         uop_set_jump_dest(ir, jump_uop);
         return do_unroll ? 1 : 0;
 }
@@ -526,7 +526,7 @@ static int ropJNS_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr,
                 break;
         }
         uop_MOV_IMM(ir, IREG_pc, do_unroll ? next_pc : dest_addr);
-        uop_JMP(ir, codegen_exit_rout);
+        uop_JMP_CHAIN(ir, do_unroll ? next_pc : dest_addr);
         uop_set_jump_dest(ir, jump_uop);
         return do_unroll ? 1 : 0;
 }
@@ -538,7 +538,7 @@ static int ropJP_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr, u
         uop_CALL_FUNC_RESULT(ir, IREG_temp0, PF_SET);
         jump_uop = uop_CMP_IMM_JZ_DEST(ir, IREG_temp0, 0);
         uop_MOV_IMM(ir, IREG_pc, dest_addr);
-        uop_JMP(ir, codegen_exit_rout);
+        uop_JMP_CHAIN(ir, dest_addr);
         uop_set_jump_dest(ir, jump_uop);
         return 0;
 }
@@ -549,7 +549,7 @@ static int ropJNP_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr,
         uop_CALL_FUNC_RESULT(ir, IREG_temp0, PF_SET);
         jump_uop = uop_CMP_IMM_JNZ_DEST(ir, IREG_temp0, 0);
         uop_MOV_IMM(ir, IREG_pc, dest_addr);
-        uop_JMP(ir, codegen_exit_rout);
+        uop_JMP_CHAIN(ir, dest_addr);
         uop_set_jump_dest(ir, jump_uop);
         return 0;
 }
@@ -614,7 +614,7 @@ static int ropJL_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr, u
                 uop_MOV_IMM(ir, IREG_pc, next_pc);
         else
                 uop_MOV_IMM(ir, IREG_pc, dest_addr);
-        uop_JMP(ir, codegen_exit_rout);
+        uop_JMP_CHAIN(ir, dest_addr);
         uop_set_jump_dest(ir, jump_uop);
         return do_unroll ? 1 : 0;
 }
@@ -678,7 +678,7 @@ static int ropJNL_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr,
                 uop_MOV_IMM(ir, IREG_pc, next_pc);
         else
                 uop_MOV_IMM(ir, IREG_pc, dest_addr);
-        uop_JMP(ir, codegen_exit_rout);
+        uop_JMP_CHAIN(ir, dest_addr);
         uop_set_jump_dest(ir, jump_uop);
         return do_unroll ? 1 : 0;
 }
@@ -732,7 +732,7 @@ static int ropJLE_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr,
         if (do_unroll)
         {
                 uop_MOV_IMM(ir, IREG_pc, next_pc);
-                uop_JMP(ir, codegen_exit_rout);
+                uop_JMP_CHAIN(ir, next_pc);
                 uop_set_jump_dest(ir, jump_uop);
                 if (jump_uop2 != -1)
                         uop_set_jump_dest(ir, jump_uop2);
@@ -743,7 +743,7 @@ static int ropJLE_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr,
                 if (jump_uop2 != -1)
                         uop_set_jump_dest(ir, jump_uop2);
                 uop_MOV_IMM(ir, IREG_pc, dest_addr);
-                uop_JMP(ir, codegen_exit_rout);
+                uop_JMP_CHAIN(ir, dest_addr);
                 uop_set_jump_dest(ir, jump_uop);
                 return 0;
         }
@@ -799,14 +799,14 @@ static int ropJNLE_common(codeblock_t *block, ir_data_t *ir, uint32_t dest_addr,
                 if (jump_uop2 != -1)
                         uop_set_jump_dest(ir, jump_uop2);
                 uop_MOV_IMM(ir, IREG_pc, next_pc);
-                uop_JMP(ir, codegen_exit_rout);
+                uop_JMP_CHAIN(ir, next_pc);
                 uop_set_jump_dest(ir, jump_uop);
                 return 1;
         }
         else
         {
                 uop_MOV_IMM(ir, IREG_pc, dest_addr);
-                uop_JMP(ir, codegen_exit_rout);
+                uop_JMP_CHAIN(ir, dest_addr);
                 uop_set_jump_dest(ir, jump_uop);
                 if (jump_uop2 != -1)
                         uop_set_jump_dest(ir, jump_uop2);
@@ -883,7 +883,7 @@ uint32_t ropJCXZ(codeblock_t *block, ir_data_t *ir, uint8_t opcode, uint32_t fet
         else
                 jump_uop = uop_CMP_IMM_JNZ_DEST(ir, IREG_CX, 0);
         uop_MOV_IMM(ir, IREG_pc, dest_addr);
-        uop_JMP(ir, codegen_exit_rout);
+        uop_JMP_CHAIN(ir, dest_addr);
         uop_set_jump_dest(ir, jump_uop);
 
         codegen_mark_code_present(block, cs+op_pc, 1);
@@ -894,7 +894,7 @@ uint32_t ropLOOP(codeblock_t *block, ir_data_t *ir, uint8_t opcode, uint32_t fet
 {
         uint32_t offset = (int32_t)(int8_t)fastreadb(cs + op_pc);
         uint32_t dest_addr = op_pc + 1 + offset;
-        uint32_t ret_addr;
+        uint32_t ret_addr, exit_addr;
         int jump_uop;
 
 	if (!(op_32 & 0x100))
@@ -913,6 +913,7 @@ uint32_t ropLOOP(codeblock_t *block, ir_data_t *ir, uint8_t opcode, uint32_t fet
                         jump_uop = uop_CMP_IMM_JNZ_DEST(ir, IREG_CX, 0);
                 }
                 uop_MOV_IMM(ir, IREG_pc, op_pc+1);
+                exit_addr = op_pc+1;
                 ret_addr = dest_addr;
                 CPU_BLOCK_END();
         }
@@ -929,9 +930,10 @@ uint32_t ropLOOP(codeblock_t *block, ir_data_t *ir, uint8_t opcode, uint32_t fet
                         jump_uop = uop_CMP_IMM_JZ_DEST(ir, IREG_CX, 0);
                 }
                 uop_MOV_IMM(ir, IREG_pc, dest_addr);
+                exit_addr = dest_addr;
                 ret_addr = op_pc+1;
         }
-        uop_JMP(ir, codegen_exit_rout);
+        uop_JMP_CHAIN(ir, exit_addr);
         uop_set_jump_dest(ir, jump_uop);
 
         codegen_mark_code_present(block, cs+op_pc, 1);
@@ -967,7 +969,7 @@ uint32_t ropLOOPE(codeblock_t *block, ir_data_t *ir, uint8_t opcode, uint32_t fe
                 jump_uop2 = uop_CMP_IMM_JNZ_DEST(ir, IREG_flags_res, 0);
         }
         uop_MOV_IMM(ir, IREG_pc, dest_addr);
-        uop_JMP(ir, codegen_exit_rout);
+        uop_JMP_CHAIN(ir, dest_addr);
         uop_NOP_BARRIER(ir);
         uop_set_jump_dest(ir, jump_uop);
         uop_set_jump_dest(ir, jump_uop2);
@@ -1004,7 +1006,7 @@ uint32_t ropLOOPNE(codeblock_t *block, ir_data_t *ir, uint8_t opcode, uint32_t f
                 jump_uop2 = uop_CMP_IMM_JZ_DEST(ir, IREG_flags_res, 0);
         }
         uop_MOV_IMM(ir, IREG_pc, dest_addr);
-        uop_JMP(ir, codegen_exit_rout);
+        uop_JMP_CHAIN(ir, dest_addr);
         uop_NOP_BARRIER(ir);
         uop_set_jump_dest(ir, jump_uop);
         uop_set_jump_dest(ir, jump_uop2);
@@ -90,6 +90,7 @@ uint32_t ropCALL_r16(codeblock_t *block, ir_data_t *ir, uint8_t opcode, uint32_t
         uop_MEM_STORE_IMM_16(ir, IREG_SS_base, sp_reg, ret_addr);
         SUB_SP(ir, 2);
         uop_MOV_IMM(ir, IREG_pc, dest_addr);
+        ir->exit_pc = dest_addr;
 
         codegen_mark_code_present(block, cs+op_pc, 2);
         return -1;
@@ -106,6 +107,7 @@ uint32_t ropCALL_r32(codeblock_t *block, ir_data_t *ir, uint8_t opcode, uint32_t
         uop_MEM_STORE_IMM_32(ir, IREG_SS_base, sp_reg, ret_addr);
         SUB_SP(ir, 4);
         uop_MOV_IMM(ir, IREG_pc, dest_addr);
+        ir->exit_pc = dest_addr;
         
         codegen_mark_code_present(block, cs+op_pc, 4);
         return -1;
@@ -222,6 +222,11 @@ int reg_is_native_size(ir_reg_t ir_reg)
         return 0;
 }
 
+int reg_is_dword(ir_reg_t ir_reg)
+{
+        return ireg_data[IREG_GET_REG(ir_reg.reg)].native_size == REG_DWORD && IREG_GET_SIZE(ir_reg.reg) == IREG_SIZE_L;
+}
+
 void codegen_reg_reset()
 {
         int c;
@@ -721,6 +726,30 @@ void codegen_reg_flush_invalidate(ir_data_t *ir, codeblock_t *block)
         }
 }
 
+void codegen_reg_drop_read(ir_data_t *ir, ir_reg_t ir_reg)
+{
+        int reg = IREG_GET_REG(ir_reg.reg);
+        reg_version_t *regv = &reg_version[reg][ir_reg.version];
+
+        if (!regv->refcount)
+                fatal("codegen_reg_drop_read - refcount already 0\n");
+        regv->refcount--;
+
+        /*Permanent registers may still be needed when written back, and version 0
+          is the value on block entry, which has no parent uOP*/
+        if (regv->refcount || ireg_data[reg].is_volatile != REG_VOLATILE || !ir_reg.version)
+                return;
+        /*Non-native size writes have an implicit dependency on the previous version*/
+        if (ir_reg.version < reg_last_version[reg])
+        {
+                uop_t *next_uop = &ir->uops[reg_version[reg][ir_reg.version + 1].parent_uop];
+
+                if (!reg_is_native_size(next_uop->dest_reg_a))
+                        return;
+        }
+        add_to_dead_list(regv, reg, ir_reg.version);
+}
+
 /*Process dead register list, and optimise out register versions and uOPs where
   possible*/
 void codegen_reg_process_dead_list(ir_data_t *ir)
@@ -399,4 +399,10 @@ ir_host_reg_t codegen_reg_alloc_write_reg(codeblock_t *block, ir_reg_t ir_reg);
 
 void codegen_reg_mark_as_required();
 void codegen_reg_process_dead_list(struct ir_data_t *ir);
+
+/*Is ir_reg a full access to a 32-bit integer register*/
+int reg_is_dword(ir_reg_t ir_reg);
+/*Remove a pending read of ir_reg, after an optimisation pass has taken it out of
+  its uOP. Temporary registers left with no readers are added to the dead list*/
+void codegen_reg_drop_read(struct ir_data_t *ir, ir_reg_t ir_reg);
 #endif
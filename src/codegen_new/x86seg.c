@@ -2312,7 +2312,7 @@ void taskswitch286(uint16_t seg, uint16_t *segdat, int is32)
                 cr0 |= 8;
 
                 cr3=new_cr3;
-                flushmmucache();
+                flushmmucache_nonglobal();
 
                 cpu_state.pc=new_pc;
                 cpu_state.flags = new_flags;
@@ -600,6 +600,7 @@ load_video(void)
 	}
 
 	voodoo_enabled = !!config_get_int(cat, "voodoo", 0);
+	svga_render_threads = config_get_int(cat, "svga_render_threads", 0);
 }
 
 
@@ -1581,6 +1582,11 @@ save_video(void)
 	else
 		config_set_int(cat, "voodoo", voodoo_enabled);
 
+	if (svga_render_threads == 0)
+		config_delete_var(cat, "svga_render_threads");
+	else
+		config_set_int(cat, "svga_render_threads", svga_render_threads);
+
 	delete_section_if_empty(cat);
 }
 
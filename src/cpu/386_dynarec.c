@@ -521,6 +521,9 @@ void exec386_dynarec(int cycs)
 				}
 
 #ifdef USE_NEW_DYNAREC
+				if (valid_block)
+					block->exec_count++;
+
 				if (valid_block && (block->flags & CODEBLOCK_WAS_RECOMPILED))
 #else
 				if (valid_block && block->was_recompiled)
@@ -532,6 +535,9 @@ void exec386_dynarec(int cycs)
 					codeblock_hash[hash] = block;
 #endif
 
+#ifdef USE_NEW_DYNAREC
+					codegen_chain_enter(block);
+#endif
 					inrecomp=1;
 					code();
 					inrecomp=0;
@@ -134,12 +134,12 @@ static int opMOV_CRx_r_a16(uint32_t fetchdat)
                 break;
                 case 3:
                 cr3 = cpu_state.regs[cpu_rm].l;
-                flushmmucache();
+                flushmmucache_nonglobal();
                 break;
                 case 4:
                 if (cpu_has_feature(CPU_FEATURE_CR4))
                 {
-	                if (((cpu_state.regs[cpu_rm].l ^ cr4) & cpu_CR4_mask) & CR4_PAE)
+	                if (((cpu_state.regs[cpu_rm].l ^ cr4) & cpu_CR4_mask) & (CR4_PAE | CR4_PGE))
         	                flushmmucache();
                         cr4 = cpu_state.regs[cpu_rm].l & cpu_CR4_mask;
                         break;
@@ -190,12 +190,12 @@ static int opMOV_CRx_r_a32(uint32_t fetchdat)
                 break;
                 case 3:
                 cr3 = cpu_state.regs[cpu_rm].l;
-                flushmmucache();
+                flushmmucache_nonglobal();
                 break;
                 case 4:
                 if (cpu_has_feature(CPU_FEATURE_CR4))
                 {
-	                if (((cpu_state.regs[cpu_rm].l ^ cr4) & cpu_CR4_mask) & CR4_PAE)
+	                if (((cpu_state.regs[cpu_rm].l ^ cr4) & cpu_CR4_mask) & (CR4_PAE | CR4_PGE))
         	                flushmmucache();
                         cr4 = cpu_state.regs[cpu_rm].l & cpu_CR4_mask;
                         break;
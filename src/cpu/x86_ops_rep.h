@@ -1,15 +1,176 @@
+/*Bulk string I/O: a forward REP INSW/OUTSW run that stays inside one
+  linear page, the segment limit and the address size can be checked once
+  up front and then handed to the port's string handler in one call.*/
+#define REP_IO_MAX 256
+
+#define REP_ADDR_MASK(reg) ((sizeof(reg) == 2) ? 0xffff : 0xffffffff)
+
+static __inline int rep_io_run(uint32_t base, uint32_t addr, uint32_t limit, uint32_t mask, uint32_t cnt, int cycles_left, int cost)
+{
+        uint32_t n;
+
+        if ((cpu_state.flags & D_FLAG) || (addr > limit) || (cycles_left <= 0))
+                return 0;
+
+        n = (0x1000 - ((base + addr) & 0xfff)) >> 1;
+        if (n > cnt)
+                n = cnt;
+        if (n > REP_IO_MAX)
+                n = REP_IO_MAX;
+        if (n > ((limit - addr) >> 1) + ((limit - addr) & 1))
+                n = ((limit - addr) >> 1) + ((limit - addr) & 1);
+        if (n > ((mask - addr) >> 1) + ((mask - addr) & 1))
+                n = ((mask - addr) >> 1) + ((mask - addr) & 1);
+        if (n > (uint32_t)(cycles_left / cost) + 1)
+                n = (uint32_t)(cycles_left / cost) + 1;
+
+        return n;
+}
+
+/*Bulk INSW pulls the whole run out of the device before the first store, so
+  a page fault on the destination would lose all of it. It is only taken
+  when the destination page is already known writable; otherwise the run
+  goes through the per-word path and faults the way it always has.*/
+static __inline int rep_io_writable(uint32_t lin)
+{
+        if ((writelookup2[lin >> 12] != -1) || !(cr0 >> 31))
+                return 1;
+
+        return mmutranslate_noabrt(lin, 1) != 0xffffffffffffffffULL;
+}
+
+/*Page-span REP MOVS/STOS: number of size byte elements, starting at addr
+  and going in the current direction, that stay inside one linear page, the
+  segment limits and the address size. Misaligned or page straddling
+  elements return 0 so they keep the per-element path and its timing.*/
+static __inline uint32_t rep_mem_span(x86seg *seg, uint32_t addr, uint32_t mask, int size)
+{
+        uint32_t lin = seg->base + addr;
+        uint32_t n, m;
+
+        if ((lin & (size - 1)) || (addr < seg->limit_low) || (addr + size - 1 > seg->limit_high) || (addr + size - 1 > mask))
+                return 0;
+        if ((msw & 1) && !(cpu_state.eflags & VM_FLAG) && !(seg->access & 0x80))
+                return 0;
+
+        if (cpu_state.flags & D_FLAG)
+        {
+                n = ((lin & 0xfff) / size) + 1;
+                m = (addr - seg->limit_low) / size;
+        }
+        else
+        {
+                n = (0x1000 - (lin & 0xfff)) / size;
+                m = (seg->limit_high - (addr + size - 1)) / size;
+                if (m > (mask - (addr + size - 1)) / size)
+                        m = (mask - (addr + size - 1)) / size;
+        }
+        if (m < n - 1)
+                n = m + 1;
+
+        return n;
+}
+
+/*Host pointer to the lowest byte of an n element run, or NULL unless the
+  page is plain RAM in the TLB. writelookup2 is never filled in for pages
+  holding translated code, so writes through it need no invalidation.*/
+static __inline uint8_t *rep_mem_host(uintptr_t *lookup, uint32_t lin, uint32_t bytes, int size)
+{
+        if (cpu_state.flags & D_FLAG)
+                lin -= bytes - size;
+        if (lookup[lin >> 12] == (uintptr_t)-1)
+                return NULL;
+        return (uint8_t *)(lookup[lin >> 12] + lin);
+}
+
+static __inline uint32_t rep_mem_budget(uint32_t n, uint32_t cnt, int cycles_left, int cost)
+{
+        if (cycles_left <= 0)
+                return 0;
+        if (n > cnt)
+                n = cnt;
+        if (n > (uint32_t)(cycles_left / cost) + 1)
+                n = (uint32_t)(cycles_left / cost) + 1;
+        return n;
+}
+
+/*Copy as much of a REP MOVS as one memmove() can do exactly: both ends must
+  be plain RAM, and if the host ranges overlap the destination must trail
+  the source in the direction of the copy, otherwise the element-by-element
+  result (e.g. a pattern fill) would differ.*/
+static __inline uint32_t rep_movs_run(uint32_t src, uint32_t src_mask, uint32_t dst, uint32_t dst_mask, uint32_t cnt, int size, int cycles_left, int cost)
+{
+        uint32_t n, m, bytes;
+        uint8_t *hs, *hd;
+
+        n = rep_mem_span(cpu_state.ea_seg, src, src_mask, size);
+        m = rep_mem_span(&cpu_state.seg_es, dst, dst_mask, size);
+        if (m < n)
+                n = m;
+        n = rep_mem_budget(n, cnt, cycles_left, cost);
+        if (n < 2)
+                return 0;
+
+        bytes = n * size;
+        hs = rep_mem_host(readlookup2, cpu_state.ea_seg->base + src, bytes, size);
+        hd = rep_mem_host(writelookup2, cpu_state.seg_es.base + dst, bytes, size);
+        if (!hs || !hd)
+                return 0;
+        if ((hd < hs + bytes) && (hs < hd + bytes) && ((cpu_state.flags & D_FLAG) ? (hd < hs) : (hd > hs)))
+                return 0;
+
+        memmove(hd, hs, bytes);
+        return n;
+}
+
+static __inline uint32_t rep_stos_run(uint32_t dst, uint32_t dst_mask, uint32_t cnt, int size, uint32_t val, int cycles_left, int cost)
+{
+        uint32_t c, n;
+        uint8_t *hd;
+
+        n = rep_mem_budget(rep_mem_span(&cpu_state.seg_es, dst, dst_mask, size), cnt, cycles_left, cost);
+        if (n < 2)
+                return 0;
+
+        hd = rep_mem_host(writelookup2, cpu_state.seg_es.base + dst, n * size, size);
+        if (!hd)
+                return 0;
+
+        switch (size)
+        {
+                case 1:
+                memset(hd, val, n);
+                break;
+                case 2:
+                for (c = 0; c < n; c++)
+                        ((uint16_t *)hd)[c] = val;
+                break;
+                case 4:
+                for (c = 0; c < n; c++)
+                        ((uint32_t *)hd)[c] = val;
+                break;
+        }
+        return n;
+}
+
 #define REP_OPS(size, CNT_REG, SRC_REG, DEST_REG) \
 static int opREP_INSB_ ## size(uint32_t fetchdat)                               \
 {                                                                               \
         int reads = 0, writes = 0, total_cycles = 0;                            \
-                                                                                \
+        int cycles_end = cycles - ((is386 && cpu_use_dynarec) ? 1000 : 100);    \
+        if (trap)                                                               \
+                cycles_end = cycles+1; /*Force the instruction to end after only one iteration when trap flag set*/    \
         if (CNT_REG > 0)                                                        \
         {                                                                       \
-                uint8_t temp;                                                   \
-                                                                                \
-		SEG_CHECK_WRITE(&cpu_state.seg_es);                             \
+                SEG_CHECK_WRITE(&cpu_state.seg_es);                             \
                 check_io_perm(DX);                                              \
                 CHECK_WRITE(&cpu_state.seg_es, DEST_REG, DEST_REG);             \
+        }                                                                       \
+        while (CNT_REG > 0)                                                     \
+        {                                                                       \
+                uint8_t temp;                                                   \
+                                                                                \
+                CHECK_WRITE_REP(&cpu_state.seg_es, DEST_REG, DEST_REG);         \
                 temp = inb(DX);                                                 \
                 writememb(es, DEST_REG, temp); if (cpu_state.abrt) return 1;    \
                                                                                 \
@@ -17,8 +178,12 @@ static int opREP_INSB_ ## size(uint32_t fetchdat)
                 else                DEST_REG++;                                 \
                 CNT_REG--;                                                      \
                 cycles -= 15;                                                   \
+                ins++;                                                          \
                 reads++; writes++; total_cycles += 15;                          \
+                if ((cycles < cycles_end) || smi_line)                          \
+                        break;                                                  \
         }                                                                       \
+        ins--;                                                                  \
         PREFETCH_RUN(total_cycles, 1, -1, reads, 0, writes, 0, 0);              \
         if (CNT_REG > 0)                                                        \
         {                                                                       \
@@ -31,15 +196,51 @@ static int opREP_INSB_ ## size(uint32_t fetchdat)
 static int opREP_INSW_ ## size(uint32_t fetchdat)                               \
 {                                                                               \
         int reads = 0, writes = 0, total_cycles = 0;                            \
-                                                                                \
+        int bulk = 0;                                                           \
+        int cycles_end = cycles - ((is386 && cpu_use_dynarec) ? 1000 : 100);    \
+        if (trap)                                                               \
+                cycles_end = cycles+1; /*Force the instruction to end after only one iteration when trap flag set*/    \
         if (CNT_REG > 0)                                                        \
         {                                                                       \
-                uint16_t temp;                                                  \
-                                                                                \
-		SEG_CHECK_WRITE(&cpu_state.seg_es);                             \
+                SEG_CHECK_WRITE(&cpu_state.seg_es);                             \
                 check_io_perm(DX);                                              \
                 check_io_perm(DX+1);                                            \
                 CHECK_WRITE(&cpu_state.seg_es, DEST_REG, DEST_REG + 1);         \
+                bulk = io_string_port(DX);                                      \
+        }                                                                       \
+        while (CNT_REG > 0)                                                     \
+        {                                                                       \
+                uint16_t temp;                                                  \
+                int c, n = 0;                                                   \
+                                                                                \
+                if (bulk)                                                       \
+                        n = rep_io_run(es, DEST_REG, cpu_state.seg_es.limit_high, REP_ADDR_MASK(DEST_REG), CNT_REG, cycles - cycles_end, 15);    \
+                if ((n > 1) && !rep_io_writable(es + DEST_REG))                 \
+                        n = 0;                                                  \
+                if (n > 1)                                                      \
+                {                                                               \
+                        uint16_t buf[REP_IO_MAX];                               \
+                                                                                \
+                        CHECK_WRITE_REP(&cpu_state.seg_es, DEST_REG, DEST_REG + (n << 1) - 1);    \
+                        n = inw_string(DX, buf, n);                             \
+                        for (c = 0; c < n; c++)                                 \
+                        {                                                       \
+                                writememw(es, DEST_REG, buf[c]); if (cpu_state.abrt) return 1;    \
+                                DEST_REG += 2;                                  \
+                                CNT_REG--;                                      \
+                        }                                                       \
+                        cycles -= 15 * n;                                       \
+                        ins += n;                                               \
+                        reads += n; writes += n; total_cycles += 15 * n;        \
+                        if (!n)                                                 \
+                                bulk = 0; /*Handler declined, don't retry for the rest of the run*/    \
+                        else if ((cycles < cycles_end) || smi_line)             \
+                                break;                                          \
+                        else                                                    \
+                                continue;                                       \
+                }                                                               \
+                                                                                \
+                CHECK_WRITE_REP(&cpu_state.seg_es, DEST_REG, DEST_REG + 1);     \
                 temp = inw(DX);                                                 \
                 writememw(es, DEST_REG, temp); if (cpu_state.abrt) return 1;    \
                                                                                 \
@@ -47,8 +248,12 @@ static int opREP_INSW_ ## size(uint32_t fetchdat)
                 else                DEST_REG += 2;                              \
                 CNT_REG--;                                                      \
                 cycles -= 15;                                                   \
+                ins++;                                                          \
                 reads++; writes++; total_cycles += 15;                          \
+                if ((cycles < cycles_end) || smi_line)                          \
+                        break;                                                  \
         }                                                                       \
+        ins--;                                                                  \
         PREFETCH_RUN(total_cycles, 1, -1, reads, 0, writes, 0, 0);              \
         if (CNT_REG > 0)                                                        \
         {                                                                       \
@@ -61,17 +266,23 @@ static int opREP_INSW_ ## size(uint32_t fetchdat)
 static int opREP_INSL_ ## size(uint32_t fetchdat)                               \
 {                                                                               \
         int reads = 0, writes = 0, total_cycles = 0;                            \
-                                                                                \
+        int cycles_end = cycles - ((is386 && cpu_use_dynarec) ? 1000 : 100);    \
+        if (trap)                                                               \
+                cycles_end = cycles+1; /*Force the instruction to end after only one iteration when trap flag set*/    \
         if (CNT_REG > 0)                                                        \
         {                                                                       \
-                uint32_t temp;                                                  \
-                                                                                \
-		SEG_CHECK_WRITE(&cpu_state.seg_es);                             \
+                SEG_CHECK_WRITE(&cpu_state.seg_es);                             \
                 check_io_perm(DX);                                              \
                 check_io_perm(DX+1);                                            \
                 check_io_perm(DX+2);                                            \
                 check_io_perm(DX+3);                                            \
                 CHECK_WRITE(&cpu_state.seg_es, DEST_REG, DEST_REG + 3);         \
+        }                                                                       \
+        while (CNT_REG > 0)                                                     \
+        {                                                                       \
+                uint32_t temp;                                                  \
+                                                                                \
+                CHECK_WRITE_REP(&cpu_state.seg_es, DEST_REG, DEST_REG + 3);     \
                 temp = inl(DX);                                                 \
                 writememl(es, DEST_REG, temp); if (cpu_state.abrt) return 1;    \
                                                                                 \
@@ -79,8 +290,12 @@ static int opREP_INSL_ ## size(uint32_t fetchdat)
                 else                DEST_REG += 4;                              \
                 CNT_REG--;                                                      \
                 cycles -= 15;                                                   \
+                ins++;                                                          \
                 reads++; writes++; total_cycles += 15;                          \
+                if ((cycles < cycles_end) || smi_line)                          \
+                        break;                                                  \
         }                                                                       \
+        ins--;                                                                  \
         PREFETCH_RUN(total_cycles, 1, -1, 0, reads, 0, writes, 0);              \
         if (CNT_REG > 0)                                                        \
         {                                                                       \
@@ -94,21 +309,32 @@ static int opREP_INSL_ ## size(uint32_t fetchdat)
 static int opREP_OUTSB_ ## size(uint32_t fetchdat)                              \
 {                                                                               \
         int reads = 0, writes = 0, total_cycles = 0;                            \
-                                                                                \
+        int cycles_end = cycles - ((is386 && cpu_use_dynarec) ? 1000 : 100);    \
+        if (trap)                                                               \
+                cycles_end = cycles+1; /*Force the instruction to end after only one iteration when trap flag set*/    \
         if (CNT_REG > 0)                                                        \
         {                                                                       \
-                uint8_t temp;                                                   \
                 SEG_CHECK_READ(cpu_state.ea_seg);                               \
                 CHECK_READ(cpu_state.ea_seg, SRC_REG, SRC_REG);                 \
+                check_io_perm(DX);                                              \
+        }                                                                       \
+        while (CNT_REG > 0)                                                     \
+        {                                                                       \
+                uint8_t temp;                                                   \
+                                                                                \
+                CHECK_READ_REP(cpu_state.ea_seg, SRC_REG, SRC_REG);             \
                 temp = readmemb(cpu_state.ea_seg->base, SRC_REG); if (cpu_state.abrt) return 1;    \
-                check_io_perm(DX);                                               \
                 outb(DX, temp);                                                 \
-                if (cpu_state.flags & D_FLAG) SRC_REG--;                                  \
+                if (cpu_state.flags & D_FLAG) SRC_REG--;                        \
                 else                SRC_REG++;                                  \
                 CNT_REG--;                                                      \
                 cycles -= 14;                                                   \
+                ins++;                                                          \
                 reads++; writes++; total_cycles += 14;                          \
+                if ((cycles < cycles_end) || smi_line)                          \
+                        break;                                                  \
         }                                                                       \
+        ins--;                                                                  \
         PREFETCH_RUN(total_cycles, 1, -1, reads, 0, writes, 0, 0);              \
         if (CNT_REG > 0)                                                        \
         {                                                                       \
@@ -121,22 +347,61 @@ static int opREP_OUTSB_ ## size(uint32_t fetchdat)
 static int opREP_OUTSW_ ## size(uint32_t fetchdat)                              \
 {                                                                               \
         int reads = 0, writes = 0, total_cycles = 0;                            \
-                                                                                \
+        int bulk = 0;                                                           \
+        int cycles_end = cycles - ((is386 && cpu_use_dynarec) ? 1000 : 100);    \
+        if (trap)                                                               \
+                cycles_end = cycles+1; /*Force the instruction to end after only one iteration when trap flag set*/    \
         if (CNT_REG > 0)                                                        \
         {                                                                       \
-                uint16_t temp;                                                  \
                 SEG_CHECK_READ(cpu_state.ea_seg);                               \
                 CHECK_READ(cpu_state.ea_seg, SRC_REG, SRC_REG + 1);             \
-                temp = readmemw(cpu_state.ea_seg->base, SRC_REG); if (cpu_state.abrt) return 1;   \
-                check_io_perm(DX);                                               \
-                check_io_perm(DX+1);                                             \
+                check_io_perm(DX);                                              \
+                check_io_perm(DX+1);                                            \
+                bulk = io_string_port(DX);                                      \
+        }                                                                       \
+        while (CNT_REG > 0)                                                     \
+        {                                                                       \
+                uint16_t temp;                                                  \
+                int c, n = 0;                                                   \
+                                                                                \
+                if (bulk)                                                       \
+                        n = rep_io_run(cpu_state.ea_seg->base, SRC_REG, cpu_state.ea_seg->limit_high, REP_ADDR_MASK(SRC_REG), CNT_REG, cycles - cycles_end, 14);    \
+                if (n > 1)                                                      \
+                {                                                               \
+                        uint16_t buf[REP_IO_MAX];                               \
+                                                                                \
+                        CHECK_READ_REP(cpu_state.ea_seg, SRC_REG, SRC_REG + (n << 1) - 1);    \
+                        for (c = 0; c < n; c++)                                 \
+                        {                                                       \
+                                buf[c] = readmemw(cpu_state.ea_seg->base, SRC_REG + (c << 1)); if (cpu_state.abrt) return 1;    \
+                        }                                                       \
+                        n = outw_string(DX, buf, n);                            \
+                        SRC_REG += n << 1;                                      \
+                        CNT_REG -= n;                                           \
+                        cycles -= 14 * n;                                       \
+                        ins += n;                                               \
+                        reads += n; writes += n; total_cycles += 14 * n;        \
+                        if (!n)                                                 \
+                                bulk = 0; /*Handler declined, don't retry for the rest of the run*/    \
+                        else if ((cycles < cycles_end) || smi_line)             \
+                                break;                                          \
+                        else                                                    \
+                                continue;                                       \
+                }                                                               \
+                                                                                \
+                CHECK_READ_REP(cpu_state.ea_seg, SRC_REG, SRC_REG + 1);         \
+                temp = readmemw(cpu_state.ea_seg->base, SRC_REG); if (cpu_state.abrt) return 1;    \
                 outw(DX, temp);                                                 \
-                if (cpu_state.flags & D_FLAG) SRC_REG -= 2;                               \
+                if (cpu_state.flags & D_FLAG) SRC_REG -= 2;                     \
                 else                SRC_REG += 2;                               \
                 CNT_REG--;                                                      \
                 cycles -= 14;                                                   \
+                ins++;                                                          \
                 reads++; writes++; total_cycles += 14;                          \
+                if ((cycles < cycles_end) || smi_line)                          \
+                        break;                                                  \
         }                                                                       \
+        ins--;                                                                  \
         PREFETCH_RUN(total_cycles, 1, -1, reads, 0, writes, 0, 0);              \
         if (CNT_REG > 0)                                                        \
         {                                                                       \
@@ -149,24 +414,35 @@ static int opREP_OUTSW_ ## size(uint32_t fetchdat)
 static int opREP_OUTSL_ ## size(uint32_t fetchdat)                              \
 {                                                                               \
         int reads = 0, writes = 0, total_cycles = 0;                            \
-                                                                                \
+        int cycles_end = cycles - ((is386 && cpu_use_dynarec) ? 1000 : 100);    \
+        if (trap)                                                               \
+                cycles_end = cycles+1; /*Force the instruction to end after only one iteration when trap flag set*/    \
         if (CNT_REG > 0)                                                        \
         {                                                                       \
-                uint32_t temp;                                                  \
                 SEG_CHECK_READ(cpu_state.ea_seg);                               \
                 CHECK_READ(cpu_state.ea_seg, SRC_REG, SRC_REG + 3);             \
-                temp = readmeml(cpu_state.ea_seg->base, SRC_REG); if (cpu_state.abrt) return 1;   \
-                check_io_perm(DX);                                               \
-                check_io_perm(DX+1);                                             \
-                check_io_perm(DX+2);                                             \
-                check_io_perm(DX+3);                                             \
+                check_io_perm(DX);                                              \
+                check_io_perm(DX+1);                                            \
+                check_io_perm(DX+2);                                            \
+                check_io_perm(DX+3);                                            \
+        }                                                                       \
+        while (CNT_REG > 0)                                                     \
+        {                                                                       \
+                uint32_t temp;                                                  \
+                                                                                \
+                CHECK_READ_REP(cpu_state.ea_seg, SRC_REG, SRC_REG + 3);         \
+                temp = readmeml(cpu_state.ea_seg->base, SRC_REG); if (cpu_state.abrt) return 1;    \
                 outl(DX, temp);                                                 \
-                if (cpu_state.flags & D_FLAG) SRC_REG -= 4;                               \
+                if (cpu_state.flags & D_FLAG) SRC_REG -= 4;                     \
                 else                SRC_REG += 4;                               \
                 CNT_REG--;                                                      \
                 cycles -= 14;                                                   \
+                ins++;                                                          \
                 reads++; writes++; total_cycles += 14;                          \
+                if ((cycles < cycles_end) || smi_line)                          \
+                        break;                                                  \
         }                                                                       \
+        ins--;                                                                  \
         PREFETCH_RUN(total_cycles, 1, -1, 0, reads, 0, writes, 0);              \
         if (CNT_REG > 0)                                                        \
         {                                                                       \
@@ -191,6 +467,21 @@ static int opREP_MOVSB_ ## size(uint32_t fetchdat)
         while (CNT_REG > 0)                                                     \
         {                                                                       \
                 uint8_t temp;                                                   \
+                uint32_t n;                                                     \
+                                                                                \
+                n = rep_movs_run(SRC_REG, REP_ADDR_MASK(SRC_REG), DEST_REG, REP_ADDR_MASK(DEST_REG), CNT_REG, 1, cycles - cycles_end, is486 ? 3 : 4);    \
+                if (n)                                                          \
+                {                                                               \
+                        if (cpu_state.flags & D_FLAG) { DEST_REG -= n; SRC_REG -= n; }    \
+                        else                { DEST_REG += n; SRC_REG += n; }    \
+                        CNT_REG -= n;                                           \
+                        cycles -= (is486 ? 3 : 4) * n;                          \
+                        ins += n;                                               \
+                        reads += n; writes += n; total_cycles += (is486 ? 3 : 4) * n;    \
+                        if (cycles < cycles_end)                                \
+                                break;                                          \
+                        continue;                                               \
+                }                                                               \
                                                                                 \
                 CHECK_READ_REP(cpu_state.ea_seg, SRC_REG, SRC_REG);             \
                 CHECK_WRITE_REP(&cpu_state.seg_es, DEST_REG, DEST_REG);         \
@@ -230,6 +521,21 @@ static int opREP_MOVSW_ ## size(uint32_t fetchdat)
         while (CNT_REG > 0)                                                     \
         {                                                                       \
                 uint16_t temp;                                                  \
+                uint32_t n;                                                     \
+                                                                                \
+                n = rep_movs_run(SRC_REG, REP_ADDR_MASK(SRC_REG), DEST_REG, REP_ADDR_MASK(DEST_REG), CNT_REG, 2, cycles - cycles_end, is486 ? 3 : 4);    \
+                if (n)                                                          \
+                {                                                               \
+                        if (cpu_state.flags & D_FLAG) { DEST_REG -= (n << 1); SRC_REG -= (n << 1); }    \
+                        else                { DEST_REG += (n << 1); SRC_REG += (n << 1); }    \
+                        CNT_REG -= n;                                           \
+                        cycles -= (is486 ? 3 : 4) * n;                          \
+                        ins += n;                                               \
+                        reads += n; writes += n; total_cycles += (is486 ? 3 : 4) * n;    \
+                        if (cycles < cycles_end)                                \
+                                break;                                          \
+                        continue;                                               \
+                }                                                               \
                                                                                 \
                 CHECK_READ_REP(cpu_state.ea_seg, SRC_REG, SRC_REG + 1);         \
                 CHECK_WRITE_REP(&cpu_state.seg_es, DEST_REG, DEST_REG + 1);     \
@@ -269,6 +575,21 @@ static int opREP_MOVSL_ ## size(uint32_t fetchdat)
         while (CNT_REG > 0)                                                     \
         {                                                                       \
                 uint32_t temp;                                                  \
+                uint32_t n;                                                     \
+                                                                                \
+                n = rep_movs_run(SRC_REG, REP_ADDR_MASK(SRC_REG), DEST_REG, REP_ADDR_MASK(DEST_REG), CNT_REG, 4, cycles - cycles_end, is486 ? 3 : 4);    \
+                if (n)                                                          \
+                {                                                               \
+                        if (cpu_state.flags & D_FLAG) { DEST_REG -= (n << 2); SRC_REG -= (n << 2); }    \
+                        else                { DEST_REG += (n << 2); SRC_REG += (n << 2); }    \
+                        CNT_REG -= n;                                           \
+                        cycles -= (is486 ? 3 : 4) * n;                          \
+                        ins += n;                                               \
+                        reads += n; writes += n; total_cycles += (is486 ? 3 : 4) * n;    \
+                        if (cycles < cycles_end)                                \
+                                break;                                          \
+                        continue;                                               \
+                }                                                               \
                                                                                 \
                 CHECK_READ_REP(cpu_state.ea_seg, SRC_REG, SRC_REG + 3);         \
                 CHECK_WRITE_REP(&cpu_state.seg_es, DEST_REG, DEST_REG + 3);     \
@@ -306,6 +627,22 @@ static int opREP_STOSB_ ## size(uint32_t fetchdat)
                 SEG_CHECK_WRITE(&cpu_state.seg_es);                             \
         while (CNT_REG > 0)                                                     \
         {                                                                       \
+                uint32_t n;                                                     \
+                                                                                \
+                n = rep_stos_run(DEST_REG, REP_ADDR_MASK(DEST_REG), CNT_REG, 1, AL, cycles - cycles_end, is486 ? 4 : 5);    \
+                if (n)                                                          \
+                {                                                               \
+                        if (cpu_state.flags & D_FLAG) DEST_REG -= n;            \
+                        else                DEST_REG += n;                      \
+                        CNT_REG -= n;                                           \
+                        cycles -= (is486 ? 4 : 5) * n;                          \
+                        writes += n; total_cycles += (is486 ? 4 : 5) * n;       \
+                        ins += n;                                               \
+                        if (cycles < cycles_end)                                \
+                                break;                                          \
+                        continue;                                               \
+                }                                                               \
+                                                                                \
                 CHECK_WRITE_REP(&cpu_state.seg_es, DEST_REG, DEST_REG);         \
                 writememb(es, DEST_REG, AL); if (cpu_state.abrt) return 1;      \
                 if (cpu_state.flags & D_FLAG) DEST_REG--;                       \
@@ -336,6 +673,22 @@ static int opREP_STOSW_ ## size(uint32_t fetchdat)
                 SEG_CHECK_WRITE(&cpu_state.seg_es);                             \
         while (CNT_REG > 0)                                                     \
         {                                                                       \
+                uint32_t n;                                                     \
+                                                                                \
+                n = rep_stos_run(DEST_REG, REP_ADDR_MASK(DEST_REG), CNT_REG, 2, AX, cycles - cycles_end, is486 ? 4 : 5);    \
+                if (n)                                                          \
+                {                                                               \
+                        if (cpu_state.flags & D_FLAG) DEST_REG -= (n << 1);     \
+                        else                DEST_REG += (n << 1);               \
+                        CNT_REG -= n;                                           \
+                        cycles -= (is486 ? 4 : 5) * n;                          \
+                        writes += n; total_cycles += (is486 ? 4 : 5) * n;       \
+                        ins += n;                                               \
+                        if (cycles < cycles_end)                                \
+                                break;                                          \
+                        continue;                                               \
+                }                                                               \
+                                                                                \
                 CHECK_WRITE_REP(&cpu_state.seg_es, DEST_REG, DEST_REG + 1);     \
                 writememw(es, DEST_REG, AX); if (cpu_state.abrt) return 1;      \
                 if (cpu_state.flags & D_FLAG) DEST_REG -= 2;                    \
@@ -366,6 +719,22 @@ static int opREP_STOSL_ ## size(uint32_t fetchdat)
                 SEG_CHECK_WRITE(&cpu_state.seg_es);                             \
         while (CNT_REG > 0)                                                     \
         {                                                                       \
+                uint32_t n;                                                     \
+                                                                                \
+                n = rep_stos_run(DEST_REG, REP_ADDR_MASK(DEST_REG), CNT_REG, 4, EAX, cycles - cycles_end, is486 ? 4 : 5);    \
+                if (n)                                                          \
+                {                                                               \
+                        if (cpu_state.flags & D_FLAG) DEST_REG -= (n << 2);     \
+                        else                DEST_REG += (n << 2);               \
+                        CNT_REG -= n;                                           \
+                        cycles -= (is486 ? 4 : 5) * n;                          \
+                        writes += n; total_cycles += (is486 ? 4 : 5) * n;       \
+                        ins += n;                                               \
+                        if (cycles < cycles_end)                                \
+                                break;                                          \
+                        continue;                                               \
+                }                                                               \
+                                                                                \
                 CHECK_WRITE_REP(&cpu_state.seg_es, DEST_REG, DEST_REG + 3);     \
                 writememl(es, DEST_REG, EAX); if (cpu_state.abrt) return 1;     \
                 if (cpu_state.flags & D_FLAG) DEST_REG -= 4;                    \
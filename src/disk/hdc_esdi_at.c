@@ -239,6 +239,31 @@ esdi_writew(uint16_t port, uint16_t val, void *priv)
 }
 
 
+/* REP OUTSW into the data register; the last word of the run goes through
+   esdi_writew() so the end of sector handling is left where it was. */
+static int
+esdi_writesw(uint16_t port, uint16_t *buf, int count, void *priv)
+{
+    esdi_t *esdi = (esdi_t *)priv;
+    int n;
+
+    if ((port != 0x01f0) || (esdi->pos & 1))
+	return(0);
+
+    n = (512 - esdi->pos) >> 1;
+    if (n > count)
+	n = count;
+    if (n <= 0)
+	return(0);
+
+    memcpy(&esdi->buffer[esdi->pos >> 1], buf, (n - 1) << 1);
+    esdi->pos += (n - 1) << 1;
+    esdi_writew(port, buf[n - 1], priv);
+
+    return(n);
+}
+
+
 static void
 esdi_write(uint16_t port, uint8_t val, void *priv)
 {
@@ -426,6 +451,29 @@ esdi_readw(uint16_t port, void *priv)
 }
 
 
+static int
+esdi_readsw(uint16_t port, uint16_t *buf, int count, void *priv)
+{
+    esdi_t *esdi = (esdi_t *)priv;
+    int n;
+
+    if ((port != 0x01f0) || (esdi->pos & 1))
+	return(0);
+
+    n = (512 - esdi->pos) >> 1;
+    if (n > count)
+	n = count;
+    if (n <= 0)
+	return(0);
+
+    memcpy(buf, &esdi->buffer[esdi->pos >> 1], (n - 1) << 1);
+    esdi->pos += (n - 1) << 1;
+    buf[n - 1] = esdi_readw(port, priv);
+
+    return(n);
+}
+
+
 static uint8_t
 esdi_read(uint16_t port, void *priv)
 {
@@ -804,6 +852,8 @@ wd1007vse1_init(const device_t *info)
     io_sethandler(0x01f0, 1,
 		  esdi_read, esdi_readw, NULL,
 		  esdi_write, esdi_writew, NULL, esdi);
+    io_sethandler_string(0x01f0, 1,
+			 esdi_readsw, esdi_writesw, esdi);
     io_sethandler(0x01f1, 7,
 		  esdi_read, esdi_readw, NULL,
 		  esdi_write, esdi_writew, NULL, esdi);
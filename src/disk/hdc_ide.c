@@ -650,6 +650,70 @@ ide_get_sector(ide_t *ide)
 }
 
 
+/**
+* Start reading the sectors of a read command in the background as soon
+* as the command is issued, so the host I/O overlaps the emulated delay
+* before ide_callback() runs.
+*/
+static void
+ide_hdd_queue_read(ide_t *ide)
+{
+	ide->queued_sector = (uint32_t) ide_get_sector(ide);
+	ide->queued_count = ide->secount ? ide->secount : 256;
+	hdd_image_read_async(ide->hdd_num, ide->queued_sector, ide->queued_count, ide->sector_buffer);
+	ide->read_queued = 1;
+}
+
+
+/**
+* Fill the sector buffer for a read command, picking up the queued read
+* if it still matches the registers.
+*/
+static void
+ide_hdd_read(ide_t *ide, uint32_t count)
+{
+	uint32_t sector = (uint32_t) ide_get_sector(ide);
+
+	if (ide->read_queued) {
+		ide->read_queued = 0;
+		hdd_image_wait(ide->hdd_num);
+		if ((ide->queued_sector == sector) && (ide->queued_count == count))
+			return;
+	}
+
+	hdd_image_read(ide->hdd_num, sector, count, ide->sector_buffer);
+}
+
+
+/**
+* Gather one sector of a PIO write command in the sector buffer, so the
+* whole command goes to the background queue as a single request.
+*/
+static void
+ide_hdd_gather_write(ide_t *ide)
+{
+	if (!ide->write_count)
+		ide->write_sector = (uint32_t) ide_get_sector(ide);
+
+	memcpy(&ide->sector_buffer[ide->write_count << 9], ide->buffer, 512);
+	ide->write_count++;
+}
+
+
+/**
+* Queue the PIO write sectors gathered so far.
+*/
+static void
+ide_hdd_flush_write(ide_t *ide)
+{
+	if (!ide->write_count)
+		return;
+
+	hdd_image_write_async(ide->hdd_num, ide->write_sector, ide->write_count, ide->sector_buffer);
+	ide->write_count = 0;
+}
+
+
 /**
 * Move to the next sector using CHS addressing
 */
@@ -1243,6 +1307,34 @@ ide_writew(uint16_t addr, uint16_t val, void *priv)
 }
 
 
+/* REP OUTSW into the data port: copy straight into the sector buffer,
+   leaving the last word of the run to ide_write_data() so the end of
+   sector handling happens exactly where it would word by word. */
+static int
+ide_writesw(uint16_t addr, uint16_t *buf, int count, void *priv)
+{
+	ide_board_t *dev = (ide_board_t *)priv;
+	ide_t *ide = ide_drives[dev->cur_dev];
+	int n;
+
+	if ((addr & 0x7) || (ide->type == IDE_NONE) || !ide->buffer ||
+	    (ide->command == WIN_PACKETCMD) || (ide->pos & 1))
+		return 0;
+
+	n = (512 - ide->pos) >> 1;
+	if (n > count)
+		n = count;
+	if (n <= 0)
+		return 0;
+
+	memcpy(&ide->buffer[ide->pos >> 1], buf, (n - 1) << 1);
+	ide->pos += (n - 1) << 1;
+	ide_write_data(ide, buf[n - 1], 2);
+
+	return n;
+}
+
+
 static void
 ide_writel(uint16_t addr, uint32_t val, void *priv)
 {
@@ -1526,6 +1618,18 @@ ide_writeb(uint16_t addr, uint8_t val, void *priv)
 		ide_irq_lower(ide);
 		ide->command = val;
 
+		/* Sectors of an interrupted PIO write have been accepted by
+		   the drive, commit them before anything else. */
+		if (ide->type == IDE_HDD)
+			ide_hdd_flush_write(ide);
+
+		if (ide->read_queued) {
+			/* The previous read was never picked up, finish it
+			   before the sector buffer gets reused. */
+			hdd_image_wait(ide->hdd_num);
+			ide->read_queued = 0;
+		}
+
 		ide->error = 0;
 		if (ide->type == IDE_ATAPI)
 			ide->sc->error = 0;
@@ -1578,6 +1682,9 @@ ide_writeb(uint16_t addr, uint8_t val, void *priv)
 				ide->atastat = BSY_STAT;
 
 			if (ide->type == IDE_HDD) {
+				if (ide->lba || (ide->cfg_spt != 0))
+					ide_hdd_queue_read(ide);
+
 				if ((val == WIN_READ_DMA) || (val == WIN_READ_DMA_ALT)) {
 					if (ide->secount)
 						ide_set_callback(ide, ide_get_period(ide, (int)ide->secount << 9));
@@ -1985,6 +2092,31 @@ ide_readw(uint16_t addr, void *priv)
 }
 
 
+/* REP INSW from the data port, the read side of ide_writesw(). */
+static int
+ide_readsw(uint16_t addr, uint16_t *buf, int count, void *priv)
+{
+	ide_board_t *dev = (ide_board_t *)priv;
+	ide_t *ide = ide_drives[dev->cur_dev];
+	int n;
+
+	if ((addr & 0x7) || !ide->buffer || (ide->command == WIN_PACKETCMD) || (ide->pos & 1))
+		return 0;
+
+	n = (512 - ide->pos) >> 1;
+	if (n > count)
+		n = count;
+	if (n <= 0)
+		return 0;
+
+	memcpy(buf, &ide->buffer[ide->pos >> 1], (n - 1) << 1);
+	ide->pos += (n - 1) << 1;
+	buf[n - 1] = ide_read_data(ide, 2);
+
+	return n;
+}
+
+
 static uint32_t
 ide_readl(uint16_t addr, void *priv)
 {
@@ -2126,10 +2258,7 @@ ide_callback(void *priv)
 		if (ide->do_initial_read) {
 			ide->do_initial_read = 0;
 			ide->sector_pos = 0;
-			if (ide->secount)
-				hdd_image_read(ide->hdd_num, ide_get_sector(ide), ide->secount, ide->sector_buffer);
-			else
-				hdd_image_read(ide->hdd_num, ide_get_sector(ide), 256, ide->sector_buffer);
+			ide_hdd_read(ide, ide->secount ? ide->secount : 256);
 		}
 
 		memcpy(ide->buffer, &ide->sector_buffer[ide->sector_pos * 512], 512);
@@ -2160,7 +2289,7 @@ ide_callback(void *priv)
 			ide->sector_pos = ide->secount;
 		else
 			ide->sector_pos = 256;
-		hdd_image_read(ide->hdd_num, ide_get_sector(ide), ide->sector_pos, ide->sector_buffer);
+		ide_hdd_read(ide, ide->sector_pos);
 
 		ide->pos = 0;
 
@@ -2211,10 +2340,7 @@ ide_callback(void *priv)
 		if (ide->do_initial_read) {
 			ide->do_initial_read = 0;
 			ide->sector_pos = 0;
-			if (ide->secount)
-				hdd_image_read(ide->hdd_num, ide_get_sector(ide), ide->secount, ide->sector_buffer);
-			else
-				hdd_image_read(ide->hdd_num, ide_get_sector(ide), 256, ide->sector_buffer);
+			ide_hdd_read(ide, ide->secount ? ide->secount : 256);
 		}
 
 		memcpy(ide->buffer, &ide->sector_buffer[ide->sector_pos * 512], 512);
@@ -2236,7 +2362,7 @@ ide_callback(void *priv)
 			goto abort_cmd;
 		if (!ide->lba && (ide->cfg_spt == 0))
 			goto id_not_found;
-		hdd_image_write(ide->hdd_num, ide_get_sector(ide), 1, (uint8_t *)ide->buffer);
+		ide_hdd_gather_write(ide);
 		ide_irq_raise(ide);
 		ide->secount = (ide->secount - 1) & 0xff;
 		if (ide->secount) {
@@ -2246,6 +2372,7 @@ ide_callback(void *priv)
 			ui_sb_update_icon(SB_HDD | hdd[ide->hdd_num].bus, 1);
 		}
 		else {
+			ide_hdd_flush_write(ide);
 			ide->atastat = DRDY_STAT | DSC_STAT;
 			ui_sb_update_icon(SB_HDD | hdd[ide->hdd_num].bus, 0);
 		}
@@ -2282,7 +2409,7 @@ ide_callback(void *priv)
 				/*DMA successful*/
 				ide_log("IDE %i: DMA write successful\n", ide->channel);
 
-				hdd_image_write(ide->hdd_num, ide_get_sector(ide), ide->sector_pos, ide->sector_buffer);
+				hdd_image_write_async(ide->hdd_num, ide_get_sector(ide), ide->sector_pos, ide->sector_buffer);
 
 				ide->atastat = DRDY_STAT | DSC_STAT;
 
@@ -2307,7 +2434,7 @@ ide_callback(void *priv)
 			goto abort_cmd;
 		if (!ide->lba && (ide->cfg_spt == 0))
 			goto id_not_found;
-		hdd_image_write(ide->hdd_num, ide_get_sector(ide), 1, (uint8_t *)ide->buffer);
+		ide_hdd_gather_write(ide);
 		ide->blockcount++;
 		if (ide->blockcount >= ide->blocksize || ide->secount == 1) {
 			ide->blockcount = 0;
@@ -2320,6 +2447,7 @@ ide_callback(void *priv)
 			ide_next_sector(ide);
 		}
 		else {
+			ide_hdd_flush_write(ide);
 			ide->atastat = DRDY_STAT | DSC_STAT;
 			ui_sb_update_icon(SB_HDD | hdd[ide->hdd_num].bus, 0);
 		}
@@ -2467,6 +2595,9 @@ ide_set_handlers(uint8_t board)
 			ide_readb, ide_readw, ide_readl,
 			ide_writeb, ide_writew, ide_writel,
 			ide_boards[board]);
+		io_sethandler_string(ide_boards[board]->base_main, 1,
+			ide_readsw, ide_writesw,
+			ide_boards[board]);
 	}
 
 	if (ide_boards[board]->side_main) {
@@ -2489,6 +2620,9 @@ ide_remove_handlers(uint8_t board)
 			ide_readb, ide_readw, ide_readl,
 			ide_writeb, ide_writew, ide_writel,
 			ide_boards[board]);
+		io_removehandler_string(ide_boards[board]->base_main, 1,
+			ide_readsw, ide_writesw,
+			ide_boards[board]);
 	}
 
 	if (ide_boards[board]->side_main) {
@@ -2604,8 +2738,10 @@ ide_board_close(int board)
 		if (dev == NULL)
 			continue;
 
-		if ((dev->type == IDE_HDD) && (dev->hdd_num != -1))
+		if ((dev->type == IDE_HDD) && (dev->hdd_num != -1)) {
+			ide_hdd_flush_write(dev);
 			hdd_image_close(dev->hdd_num);
+		}
 
 		if (dev->type == IDE_ATAPI)
 			dev->sc->status = DRDY_STAT | DSC_STAT;
@@ -2824,6 +2960,15 @@ ide_drive_reset(int d)
 
 	ide_set_signature(ide_drives[d]);
 
+	/* Let the background queue finish with the sector buffer before it
+	   is cleared, and forget any read-ahead still pending. */
+	if ((ide_drives[d]->type == IDE_HDD) && (ide_drives[d]->hdd_num != -1)) {
+		ide_hdd_flush_write(ide_drives[d]);
+		hdd_image_wait(ide_drives[d]->hdd_num);
+	}
+	ide_drives[d]->read_queued = 0;
+	ide_drives[d]->write_count = 0;
+
 	if (ide_drives[d]->sector_buffer)
 		memset(ide_drives[d]->sector_buffer, 0, 256 * 512);
 
@@ -20,6 +20,7 @@
 #define _LARGEFILE64_SOURCE
 #define _GNU_SOURCE
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -34,13 +35,60 @@
 #include <86box/hdd.h>
 
 
+#define HDD_IO_QUEUE_SIZE	16
+#define HDD_IO_QUEUE_MASK	(HDD_IO_QUEUE_SIZE - 1)
+
+#define HDD_IO_READ		0
+#define HDD_IO_WRITE		1
+
+
+typedef struct
+{
+    uint8_t type;
+    uint32_t sector, count;
+    uint8_t *buffer;		/* caller's buffer for reads, our own copy
+				   of the data for writes */
+} hdd_io_req_t;
+
+
+/* Dynamic and differencing VHD state. Fixed VHDs only show up here as
+   the parent of a differencing image. */
+typedef struct vhd_image_t
+{
+    FILE *file;
+    uint32_t type;
+    uint64_t size;		/* virtual disk size in bytes */
+    uint64_t bat_offset;
+    uint64_t footer_offset;	/* new blocks get appended here */
+    uint32_t *bat;		/* whole BAT, host byte order */
+    uint32_t bat_entries;
+    uint32_t block_sectors, bitmap_sectors;
+    uint32_t bitmap_block;	/* block whose bitmap is in bitmap */
+    uint8_t *bitmap;
+    uint8_t footer[512];
+    struct vhd_image_t *parent;
+} vhd_image_t;
+
+
 typedef struct
 {
     FILE *file;
+    vhd_image_t *vhd;		/* dynamic/differencing VHD, NULL otherwise */
+    uint64_t file_size;		/* image file size, kept up to date so
+				   hdd_sectors() does not have to seek */
     uint32_t base;
     uint32_t pos, last_sector;
     uint8_t type;
     uint8_t loaded;    
+
+    /* Asynchronous requests, serviced in order by io_thread. The
+       emulation thread publishes a request with a release store of
+       io_write_idx, the worker retires it with a release store of
+       io_read_idx; each side reads the other's index with acquire. */
+    hdd_io_req_t io_queue[HDD_IO_QUEUE_SIZE];
+    atomic_int io_read_idx, io_write_idx;
+    thread_t *io_thread;
+    event_t *io_wake, *io_done;
 } hdd_image_t;
 
 
@@ -69,6 +117,24 @@ static char *empty_sector_1mb;
 #define VHD_OFFSET_SAVED_STATE 84
 #define VHD_OFFSET_RESERVED 85
 
+#define VHD_DYN_OFFSET_DATA_OFFSET 8
+#define VHD_DYN_OFFSET_TABLE_OFFSET 16
+#define VHD_DYN_OFFSET_VERSION 24
+#define VHD_DYN_OFFSET_MAX_ENTRIES 28
+#define VHD_DYN_OFFSET_BLOCK_SIZE 32
+#define VHD_DYN_OFFSET_CHECKSUM 36
+#define VHD_DYN_OFFSET_PARENT_UUID 40
+#define VHD_DYN_OFFSET_PARENT_NAME 64
+#define VHD_DYN_OFFSET_LOCATORS 576
+#define VHD_DYN_HEADER_SIZE 1024
+
+#define VHD_TYPE_FIXED 2
+#define VHD_TYPE_DYNAMIC 3
+#define VHD_TYPE_DIFF 4
+
+#define VHD_BAT_UNUSED 0xffffffff
+#define VHD_BLOCK_SIZE 0x200000
+
 
 #ifdef ENABLE_HDD_IMAGE_LOG
 int hdd_image_do_log = ENABLE_HDD_IMAGE_LOG;
@@ -95,11 +161,10 @@ image_is_hdi(const wchar_t *s)
 {
     int len;
     wchar_t ext[5] = { 0, 0, 0, 0, 0 };
-    char *ws = (char *) s;
     len = wcslen(s);
     if ((len < 4) || (s[0] == L'.'))
 	return 0;
-    memcpy(ext, ws + ((len - 4) << 1), 8);
+    memcpy(ext, s + len - 4, 4 * sizeof(wchar_t));
     if (! wcscasecmp(ext, L".HDI"))
 	return 1;
     else
@@ -114,12 +179,11 @@ image_is_hdx(const wchar_t *s, int check_signature)
     FILE *f;
     uint64_t filelen;
     uint64_t signature;
-    char *ws = (char *) s;
     wchar_t ext[5] = { 0, 0, 0, 0, 0 };
     len = wcslen(s);
     if ((len < 4) || (s[0] == L'.'))
 	return 0;
-    memcpy(ext, ws + ((len - 4) << 1), 8);
+    memcpy(ext, s + len - 4, 4 * sizeof(wchar_t));
     if (wcscasecmp(ext, L".HDX") == 0) {
 	if (check_signature) {
 		f = plat_fopen((wchar_t *)s, L"rb");
@@ -156,12 +220,11 @@ image_is_vhd(const wchar_t *s, int check_signature)
     FILE *f;
     uint64_t filelen;
     uint64_t signature;
-    char *ws = (char *) s;
     wchar_t ext[5] = { 0, 0, 0, 0, 0 };
     len = wcslen(s);
     if ((len < 4) || (s[0] == L'.'))
 	return 0;
-    memcpy(ext, ws + ((len - 4) << 1), 8);
+    memcpy(ext, s + len - 4, 4 * sizeof(wchar_t));
     if (wcscasecmp(ext, L".VHD") == 0) {
 	if (check_signature) {
 		f = plat_fopen((wchar_t *)s, L"rb");
@@ -415,6 +478,500 @@ generate_vhd_checksum(vhd_footer_t *vhd)
 }
 
 
+static void
+be_put_u32(uint8_t *bytes, int start, uint32_t value)
+{
+    bytes[start    ] = (value >> 24) & 0xff;
+    bytes[start + 1] = (value >> 16) & 0xff;
+    bytes[start + 2] = (value >>  8) & 0xff;
+    bytes[start + 3] = value & 0xff;
+}
+
+
+static void
+be_put_u64(uint8_t *bytes, int start, uint64_t value)
+{
+    be_put_u32(bytes, start, (uint32_t) (value >> 32));
+    be_put_u32(bytes, start + 4, (uint32_t) value);
+}
+
+
+/* Spec checksum: one's complement of the byte sum, checksum field excluded. */
+static void
+vhd_fix_checksum(uint8_t *bytes, int len, int offset)
+{
+    uint32_t chk = 0;
+    int i;
+
+    be_put_u32(bytes, offset, 0);
+    for (i = 0; i < len; i++)
+	chk += bytes[i];
+    be_put_u32(bytes, offset, ~chk);
+}
+
+
+static int
+vhd_read_raw(vhd_image_t *vhd, uint64_t addr, uint8_t *buffer, uint32_t len)
+{
+    if (fseeko64(vhd->file, addr, SEEK_SET) == -1)
+	return 0;
+
+    return (fread(buffer, 1, len, vhd->file) == len);
+}
+
+
+static int
+vhd_write_raw(vhd_image_t *vhd, uint64_t addr, uint8_t *buffer, uint32_t len)
+{
+    if (fseeko64(vhd->file, addr, SEEK_SET) == -1)
+	return 0;
+
+    return (fwrite(buffer, 1, len, vhd->file) == len);
+}
+
+
+/* Sector bitmaps are MSB first: bit 7 of byte 0 is the first sector. */
+static __inline int
+vhd_bitmap_test(uint8_t *bitmap, uint32_t sector)
+{
+    return !!(bitmap[sector >> 3] & (0x80 >> (sector & 7)));
+}
+
+
+static int
+vhd_load_bitmap(vhd_image_t *vhd, uint32_t block)
+{
+    if (vhd->bitmap_block == block)
+	return 1;
+
+    vhd->bitmap_block = VHD_BAT_UNUSED;
+    if (!vhd_read_raw(vhd, ((uint64_t) vhd->bat[block]) << 9LL, vhd->bitmap, vhd->bitmap_sectors << 9))
+	return 0;
+    vhd->bitmap_block = block;
+
+    return 1;
+}
+
+
+static void
+vhd_read_sectors(vhd_image_t *vhd, uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+    uint32_t block, off, n, i, run;
+    uint64_t addr;
+    int in_file;
+
+    if (vhd->type == VHD_TYPE_FIXED) {
+	vhd_read_raw(vhd, ((uint64_t) sector) << 9LL, buffer, count << 9);
+	return;
+    }
+
+    while (count) {
+	block = sector / vhd->block_sectors;
+	off = sector % vhd->block_sectors;
+	n = vhd->block_sectors - off;
+	if (n > count)
+		n = count;
+
+	if ((block >= vhd->bat_entries) || (vhd->bat[block] == VHD_BAT_UNUSED)) {
+		/* Never written: zeroes, or whatever the parent has. */
+		if (vhd->parent)
+			vhd_read_sectors(vhd->parent, sector, n, buffer);
+		else
+			memset(buffer, 0, n << 9);
+	} else {
+		addr = (((uint64_t) vhd->bat[block]) + vhd->bitmap_sectors + off) << 9LL;
+
+		if ((vhd->type == VHD_TYPE_DIFF) && vhd_load_bitmap(vhd, block)) {
+			/* Sectors whose bit is clear still live in the parent. */
+			for (i = 0; i < n; i += run) {
+				in_file = vhd_bitmap_test(vhd->bitmap, off + i);
+				for (run = 1; ((i + run) < n) && (vhd_bitmap_test(vhd->bitmap, off + i + run) == in_file); run++)
+					;
+				if (in_file)
+					vhd_read_raw(vhd, addr + (i << 9), buffer + (i << 9), run << 9);
+				else
+					vhd_read_sectors(vhd->parent, sector + i, run, buffer + (i << 9));
+			}
+		} else
+			vhd_read_raw(vhd, addr, buffer, n << 9);
+	}
+
+	sector += n;
+	count -= n;
+	buffer += (n << 9);
+    }
+}
+
+
+/* Append a new block (bitmap + data) where the footer used to be, then
+   move the footer behind it and point the BAT entry at the block. */
+static int
+vhd_alloc_block(vhd_image_t *vhd, uint32_t block)
+{
+    uint32_t size = (vhd->bitmap_sectors + vhd->block_sectors) << 9;
+    uint64_t addr = vhd->footer_offset;
+    uint8_t entry[4];
+    uint8_t *buf;
+
+    buf = (uint8_t *) malloc(size);
+    memset(buf, 0x00, size);
+    /* Differencing blocks start out with every sector in the parent. */
+    if (vhd->type == VHD_TYPE_DYNAMIC)
+	memset(buf, 0xff, vhd->bitmap_sectors << 9);
+
+    if (!vhd_write_raw(vhd, addr, buf, size) ||
+	!vhd_write_raw(vhd, addr + size, vhd->footer, 512)) {
+	free(buf);
+	return 0;
+    }
+    free(buf);
+
+    vhd->bat[block] = (uint32_t) (addr >> 9);
+    be_put_u32(entry, 0, vhd->bat[block]);
+    if (!vhd_write_raw(vhd, vhd->bat_offset + (block << 2), entry, 4))
+	return 0;
+
+    vhd->footer_offset = addr + size;
+    if (vhd->bitmap_block == block)
+	vhd->bitmap_block = VHD_BAT_UNUSED;
+
+    return 1;
+}
+
+
+static void
+vhd_write_sectors(vhd_image_t *vhd, uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+    uint32_t block, off, n, i;
+    uint64_t addr;
+    int dirty;
+
+    if (vhd->type == VHD_TYPE_FIXED) {
+	vhd_write_raw(vhd, ((uint64_t) sector) << 9LL, buffer, count << 9);
+	return;
+    }
+
+    while (count) {
+	block = sector / vhd->block_sectors;
+	off = sector % vhd->block_sectors;
+	n = vhd->block_sectors - off;
+	if (n > count)
+		n = count;
+
+	if (block >= vhd->bat_entries)
+		return;
+
+	if ((vhd->bat[block] == VHD_BAT_UNUSED) && !vhd_alloc_block(vhd, block)) {
+		hdd_image_log("VHD: Unable to allocate block %i\n", block);
+		return;
+	}
+
+	addr = (((uint64_t) vhd->bat[block]) + vhd->bitmap_sectors + off) << 9LL;
+	vhd_write_raw(vhd, addr, buffer, n << 9);
+
+	/* Mark the sectors as present in this file. */
+	if (vhd_load_bitmap(vhd, block)) {
+		dirty = 0;
+		for (i = off; i < (off + n); i++) {
+			if (!vhd_bitmap_test(vhd->bitmap, i)) {
+				vhd->bitmap[i >> 3] |= (0x80 >> (i & 7));
+				dirty = 1;
+			}
+		}
+		if (dirty)
+			vhd_write_raw(vhd, ((uint64_t) vhd->bat[block]) << 9LL, vhd->bitmap, vhd->bitmap_sectors << 9);
+	}
+
+	sector += n;
+	count -= n;
+	buffer += (n << 9);
+    }
+}
+
+
+/* Zero count sectors without allocating storage for them where possible:
+   unallocated blocks of a dynamic image already read back as zeroes, so
+   only blocks that exist get written. A differencing image has to
+   allocate, since an unallocated block reads through to the parent.
+   Each run within a block is written in one go, so the block's bitmap
+   and BAT entry are touched once per run rather than once per sector. */
+static void
+vhd_zero_sectors(vhd_image_t *vhd, uint32_t sector, uint32_t count)
+{
+    uint32_t block, n, chunk;
+    uint8_t *zero;
+
+    chunk = (vhd->type == VHD_TYPE_FIXED) ? 2048 : vhd->block_sectors;
+    if (chunk > count)
+	chunk = count;
+    zero = (uint8_t *) calloc(chunk, 512);
+    if (zero == NULL)
+	return;
+
+    while (count) {
+	if (vhd->type == VHD_TYPE_FIXED) {
+		n = count;
+		if (n > chunk)
+			n = chunk;
+	} else {
+		block = sector / vhd->block_sectors;
+		n = vhd->block_sectors - (sector % vhd->block_sectors);
+		if (n > count)
+			n = count;
+
+		if ((vhd->parent == NULL) &&
+		    ((block >= vhd->bat_entries) || (vhd->bat[block] == VHD_BAT_UNUSED))) {
+			sector += n;
+			count -= n;
+			continue;
+		}
+	}
+
+	vhd_write_sectors(vhd, sector, n, zero);
+
+	sector += n;
+	count -= n;
+    }
+
+    free(zero);
+}
+
+
+static vhd_image_t	*vhd_open(FILE *f, const wchar_t *fn);
+
+
+static void
+vhd_close(vhd_image_t *vhd)
+{
+    if (vhd == NULL)
+	return;
+
+    if (vhd->parent) {
+	fclose(vhd->parent->file);
+	vhd_close(vhd->parent);
+    }
+
+    if (vhd->bat)
+	free(vhd->bat);
+    if (vhd->bitmap)
+	free(vhd->bitmap);
+    free(vhd);
+}
+
+
+/* Open a candidate parent, and only accept it if it is the image the
+   child was created from: a moved or replaced file with the same name
+   would otherwise silently feed the wrong data into every read. */
+static vhd_image_t *
+vhd_try_parent(const wchar_t *path, uint8_t *header)
+{
+    vhd_image_t *parent;
+    FILE *f;
+
+    hdd_image_log("VHD: Trying parent %ls\n", path);
+
+    if (!image_is_vhd(path, 1))
+	return NULL;
+
+    f = plat_fopen((wchar_t *) path, L"rb");
+    if (f == NULL)
+	return NULL;
+
+    parent = vhd_open(f, path);
+    if (parent == NULL) {
+	fclose(f);
+	return NULL;
+    }
+
+    if (memcmp(header + VHD_DYN_OFFSET_PARENT_UUID, parent->footer + VHD_OFFSET_UUID, 16)) {
+	hdd_image_log("VHD: Parent %ls has the wrong UUID\n", path);
+	fclose(f);
+	vhd_close(parent);
+	return NULL;
+    }
+
+    return parent;
+}
+
+
+/* Find and open the parent of a differencing image: the Windows relative
+   and absolute locators first, then the bare parent name next to us. */
+static vhd_image_t *
+vhd_open_parent(uint8_t *header, const wchar_t *fn, FILE *f)
+{
+    wchar_t dir[1024], path[1024], name[512];
+    uint8_t *data;
+    uint32_t code, len, i, j;
+    uint64_t off;
+    vhd_image_t *parent = NULL;
+
+    memset(dir, 0, sizeof(dir));
+    plat_get_dirname(dir, fn);
+
+    for (i = 0; (i < 8) && (parent == NULL); i++) {
+	code = be_to_u32(header, VHD_DYN_OFFSET_LOCATORS + (i * 24));
+	len = be_to_u32(header, VHD_DYN_OFFSET_LOCATORS + (i * 24) + 8);
+	off = be_to_u64(header, VHD_DYN_OFFSET_LOCATORS + (i * 24) + 16);
+
+	if (((code != 0x57326b75) && (code != 0x57327275)) ||	/* "W2ku", "W2ru" */
+	    (len == 0) || (len >= sizeof_w(name) * 2))
+		continue;
+
+	data = (uint8_t *) malloc(len);
+	if (fseeko64(f, off, SEEK_SET) == -1 || (fread(data, 1, len, f) != len)) {
+		free(data);
+		continue;
+	}
+
+	/* UTF-16LE, no terminator. */
+	memset(name, 0, sizeof(name));
+	for (j = 0; j < (len >> 1); j++) {
+		name[j] = data[j << 1] | (data[(j << 1) + 1] << 8);
+#ifndef _WIN32
+		if (name[j] == L'\\')
+			name[j] = L'/';
+#endif
+	}
+	free(data);
+
+	memset(path, 0, sizeof(path));
+	if (plat_path_abs(name) || (dir[0] == L'\0'))
+		wcscpy(path, name);
+	else
+		plat_append_filename(path, dir, (name[0] == L'.') && ((name[1] == L'/') || (name[1] == L'\\')) ? &name[2] : name);
+	parent = vhd_try_parent(path, header);
+    }
+
+    if (parent == NULL) {
+	/* Parent Unicode Name, UTF-16BE. */
+	memset(name, 0, sizeof(name));
+	for (j = 0; j < 256; j++)
+		name[j] = be_to_u16(header, VHD_DYN_OFFSET_PARENT_NAME + (j << 1));
+	name[255] = L'\0';
+
+	memset(path, 0, sizeof(path));
+	if (dir[0] == L'\0')
+		wcscpy(path, name);
+	else
+		plat_append_filename(path, dir, name);
+	parent = vhd_try_parent(path, header);
+    }
+
+    return parent;
+}
+
+
+static vhd_image_t *
+vhd_open(FILE *f, const wchar_t *fn)
+{
+    uint8_t footer[512], header[VHD_DYN_HEADER_SIZE];
+    vhd_footer_t *vft = NULL;
+    vhd_image_t *vhd;
+    uint64_t fsize;
+    uint32_t i;
+
+    if (fseeko64(f, 0, SEEK_END) == -1)
+	return NULL;
+    fsize = ftello64(f);
+    if ((fsize < 512) || !(vhd = (vhd_image_t *) malloc(sizeof(vhd_image_t))))
+	return NULL;
+    memset(vhd, 0, sizeof(vhd_image_t));
+    vhd->file = f;
+    vhd->bitmap_block = VHD_BAT_UNUSED;
+
+    /* Very old Virtual PC images have a 511-byte footer. */
+    vhd->footer_offset = (fsize & 511) ? (fsize & ~511ULL) : (fsize - 512);
+    if (!vhd_read_raw(vhd, vhd->footer_offset, footer, 512))
+	goto fail;
+    memcpy(vhd->footer, footer, 512);
+
+    new_vhd_footer(&vft);
+    vhd_footer_from_bytes(vft, footer);
+    vhd->type = vft->type;
+    vhd->size = vft->curr_size;
+    free(vft);
+
+    if (vhd->type == VHD_TYPE_FIXED)
+	return vhd;
+    if ((vhd->type != VHD_TYPE_DYNAMIC) && (vhd->type != VHD_TYPE_DIFF))
+	goto fail;
+
+    if (!vhd_read_raw(vhd, be_to_u64(footer, VHD_OFFSET_DATA_OFFSET), header, VHD_DYN_HEADER_SIZE) ||
+	memcmp(header, "cxsparse", 8))
+	goto fail;
+
+    vhd->bat_offset = be_to_u64(header, VHD_DYN_OFFSET_TABLE_OFFSET);
+    vhd->bat_entries = be_to_u32(header, VHD_DYN_OFFSET_MAX_ENTRIES);
+    vhd->block_sectors = be_to_u32(header, VHD_DYN_OFFSET_BLOCK_SIZE) >> 9;
+    if ((vhd->block_sectors < 8) || (vhd->bat_entries == 0))
+	goto fail;
+    vhd->bitmap_sectors = ((vhd->block_sectors >> 3) + 511) >> 9;
+
+    /* The whole BAT is kept in memory, in host byte order. */
+    vhd->bat = (uint32_t *) malloc(vhd->bat_entries << 2);
+    vhd->bitmap = (uint8_t *) malloc(vhd->bitmap_sectors << 9);
+    if (!vhd_read_raw(vhd, vhd->bat_offset, (uint8_t *) vhd->bat, vhd->bat_entries << 2))
+	goto fail;
+    for (i = 0; i < vhd->bat_entries; i++)
+	vhd->bat[i] = be_to_u32((uint8_t *) &vhd->bat[i], 0);
+
+    if (vhd->type == VHD_TYPE_DIFF) {
+	vhd->parent = vhd_open_parent(header, fn, f);
+	if (vhd->parent == NULL) {
+		hdd_image_log("VHD: Unable to find the parent of %ls\n", fn);
+		goto fail;
+	}
+    }
+
+    return vhd;
+
+fail:
+    vhd_close(vhd);
+    return NULL;
+}
+
+
+/* Write an empty dynamic VHD of vft->curr_size bytes to f: footer copy,
+   dynamic header, a BAT with every block unallocated and the footer. */
+void
+vhd_create_dynamic(FILE *f, vhd_footer_t *vft)
+{
+    uint8_t footer[512], header[VHD_DYN_HEADER_SIZE];
+    uint32_t entries, bat_size;
+    uint8_t *bat;
+
+    entries = (uint32_t) ((vft->curr_size + VHD_BLOCK_SIZE - 1) / VHD_BLOCK_SIZE);
+    bat_size = ((entries << 2) + 511) & ~511;
+
+    vft->offset = 512;
+    vft->type = VHD_TYPE_DYNAMIC;
+    memset(footer, 0, 512);
+    vhd_footer_to_bytes(footer, vft);
+    vhd_fix_checksum(footer, 512, VHD_OFFSET_CHECKSUM);
+
+    memset(header, 0, VHD_DYN_HEADER_SIZE);
+    memcpy(header, "cxsparse", 8);
+    be_put_u64(header, VHD_DYN_OFFSET_DATA_OFFSET, 0xffffffffffffffffULL);
+    be_put_u64(header, VHD_DYN_OFFSET_TABLE_OFFSET, 512 + VHD_DYN_HEADER_SIZE);
+    be_put_u32(header, VHD_DYN_OFFSET_VERSION, 0x00010000);
+    be_put_u32(header, VHD_DYN_OFFSET_MAX_ENTRIES, entries);
+    be_put_u32(header, VHD_DYN_OFFSET_BLOCK_SIZE, VHD_BLOCK_SIZE);
+    vhd_fix_checksum(header, VHD_DYN_HEADER_SIZE, VHD_DYN_OFFSET_CHECKSUM);
+
+    bat = (uint8_t *) malloc(bat_size);
+    memset(bat, 0xff, bat_size);
+
+    fseeko64(f, 0, SEEK_SET);
+    fwrite(footer, 1, 512, f);
+    fwrite(header, 1, VHD_DYN_HEADER_SIZE, f);
+    fwrite(bat, 1, bat_size, f);
+    fwrite(footer, 1, 512, f);
+    fflush(f);
+
+    free(bat);
+}
+
+
 void
 hdd_image_calc_chs(uint32_t *c, uint32_t *h, uint32_t *s, uint32_t size)
 {
@@ -501,6 +1058,183 @@ prepare_new_hard_disk(uint8_t id, uint64_t full_size)
 }
 
 
+static uint32_t
+hdd_image_do_read(hdd_image_t *img, uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+    if (img->vhd) {
+	vhd_read_sectors(img->vhd, sector, count, buffer);
+	return count;
+    }
+
+    if (fseeko64(img->file, ((uint64_t)(sector) << 9LL) + img->base, SEEK_SET) == -1) {
+	fatal("Hard disk image %i: Read error during seek\n", (int) (img - hdd_images));
+	return 0;
+    }
+
+    /* One request, one read; a short read means we hit the end of the image. */
+    return (uint32_t) fread(buffer, 512, count, img->file);
+}
+
+
+static void
+hdd_image_do_write(hdd_image_t *img, uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+    if (img->vhd) {
+	vhd_write_sectors(img->vhd, sector, count, buffer);
+	return;
+    }
+
+    if (fseeko64(img->file, ((uint64_t)(sector) << 9LL) + img->base, SEEK_SET) == -1) {
+	fatal("Hard disk image %i: Write error during seek\n", (int) (img - hdd_images));
+	return;
+    }
+
+    fwrite(buffer, 512, count, img->file);
+}
+
+
+static void
+hdd_image_io_thread(void *param)
+{
+    hdd_image_t *img = (hdd_image_t *) param;
+    hdd_io_req_t *req;
+    int r;
+
+    while (1) {
+	thread_wait_event(img->io_wake, -1);
+	thread_reset_event(img->io_wake);
+
+	while ((r = atomic_load_explicit(&img->io_read_idx, memory_order_relaxed)) !=
+	       atomic_load_explicit(&img->io_write_idx, memory_order_acquire)) {
+		req = &img->io_queue[r & HDD_IO_QUEUE_MASK];
+
+		if (req->type == HDD_IO_WRITE) {
+			hdd_image_do_write(img, req->sector, req->count, req->buffer);
+			free(req->buffer);
+		} else
+			hdd_image_do_read(img, req->sector, req->count, req->buffer);
+		req->buffer = NULL;
+
+		atomic_store_explicit(&img->io_read_idx, r + 1, memory_order_release);
+		thread_set_event(img->io_done);
+	}
+    }
+}
+
+
+/* Block until every request queued on the image has been carried out.
+   All synchronous accesses go through here first, so they always see
+   the image as if the queued requests had been done synchronously. */
+void
+hdd_image_wait(uint8_t id)
+{
+    hdd_image_t *img = &hdd_images[id];
+
+    while (atomic_load_explicit(&img->io_read_idx, memory_order_acquire) !=
+	   atomic_load_explicit(&img->io_write_idx, memory_order_relaxed)) {
+	thread_wait_event(img->io_done, -1);
+	thread_reset_event(img->io_done);
+    }
+}
+
+
+static void
+hdd_image_io_stop(uint8_t id)
+{
+    hdd_image_t *img = &hdd_images[id];
+
+    if (img->io_thread == NULL)
+	return;
+
+    hdd_image_wait(id);
+
+    thread_kill(img->io_thread);
+    thread_destroy_event(img->io_wake);
+    thread_destroy_event(img->io_done);
+    img->io_thread = NULL;
+    img->io_wake = img->io_done = NULL;
+    atomic_store(&img->io_read_idx, 0);
+    atomic_store(&img->io_write_idx, 0);
+}
+
+
+static void
+hdd_image_io_submit(uint8_t id, uint8_t type, uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+    hdd_image_t *img = &hdd_images[id];
+    hdd_io_req_t *req;
+    int w;
+
+    if (img->io_thread == NULL) {
+	img->io_wake = thread_create_event();
+	img->io_done = thread_create_event();
+	img->io_thread = thread_create(hdd_image_io_thread, img);
+    }
+
+    /* Queue full, wait for the worker to retire the oldest request. */
+    w = atomic_load_explicit(&img->io_write_idx, memory_order_relaxed);
+    while ((w - atomic_load_explicit(&img->io_read_idx, memory_order_acquire)) >= HDD_IO_QUEUE_SIZE) {
+	thread_wait_event(img->io_done, -1);
+	thread_reset_event(img->io_done);
+    }
+
+    req = &img->io_queue[w & HDD_IO_QUEUE_MASK];
+    req->type = type;
+    req->sector = sector;
+    req->count = count;
+    req->buffer = buffer;
+
+    atomic_store_explicit(&img->io_write_idx, w + 1, memory_order_release);
+    thread_set_event(img->io_wake);
+}
+
+
+/* Start reading count sectors into buffer in the background. The buffer
+   must be left alone until hdd_image_wait() has returned; controllers
+   submit when the command is issued and wait in their timer callback,
+   so host latency overlaps the emulated seek/transfer time. */
+void
+hdd_image_read_async(uint8_t id, uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+    if (count == 0)
+	return;
+
+    hdd_images[id].pos = sector + count - 1;
+    hdd_image_io_submit(id, HDD_IO_READ, sector, count, buffer);
+}
+
+
+/* Queue a write of count sectors. The data is copied, so the caller's
+   buffer may be reused as soon as this returns. */
+void
+hdd_image_write_async(uint8_t id, uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+    uint64_t addr = ((((uint64_t) sector) + count) << 9LL) + hdd_images[id].base;
+    uint8_t *data;
+
+    if (count == 0)
+	return;
+
+    data = (uint8_t *) malloc(count << 9);
+    memcpy(data, buffer, count << 9);
+
+    hdd_images[id].pos = sector + count - 1;
+    if (addr > hdd_images[id].file_size)
+	hdd_images[id].file_size = addr;
+
+    hdd_image_io_submit(id, HDD_IO_WRITE, sector, count, data);
+}
+
+
+static void
+hdd_image_update_size(uint8_t id)
+{
+    if (fseeko64(hdd_images[id].file, 0, SEEK_END) == -1)
+	fatal("hdd_image_update_size(): Error seeking to the end of file\n");
+    hdd_images[id].file_size = ftello64(hdd_images[id].file);
+}
+
+
 void
 hdd_image_init(void)
 {
@@ -550,6 +1284,9 @@ hdd_image_load(int id)
     hdd_images[id].base = 0;
 
     if (hdd_images[id].loaded) {
+	hdd_image_io_stop(id);
+	vhd_close(hdd_images[id].vhd);
+	hdd_images[id].vhd = NULL;
 	if (hdd_images[id].file) {
 		fclose(hdd_images[id].file);
 		hdd_images[id].file = NULL;
@@ -636,6 +1373,8 @@ hdd_image_load(int id)
 			hdd_image_gen_vft(id, &vft, full_size);
 		}
 
+		hdd_image_update_size(id);
+
 		return ret;
 	} else {
 		/* Failed for another reason */
@@ -711,9 +1450,20 @@ hdd_image_load(int id)
 			fatal("hdd_image_load(): HDX: Error reading the footer\n");
 		new_vhd_footer(&vft);
 		vhd_footer_from_bytes(vft, (uint8_t *) empty_sector);
-		if (vft->type != 2) {
-			/* VHD is not fixed size */
-			hdd_image_log("VHD: Image is not fixed size\n");
+		if ((vft->type == VHD_TYPE_DYNAMIC) || (vft->type == VHD_TYPE_DIFF)) {
+			hdd_images[id].vhd = vhd_open(hdd_images[id].file, fn);
+			if (hdd_images[id].vhd == NULL) {
+				hdd_image_log("VHD: Unable to open dynamic or differencing image\n");
+				free(vft);
+				vft = NULL;
+				fclose(hdd_images[id].file);
+				hdd_images[id].file = NULL;
+				memset(hdd[id].fn, 0, sizeof(hdd[id].fn));
+				return 0;
+			}
+		} else if (vft->type != VHD_TYPE_FIXED) {
+			/* VHD is of a type we do not know */
+			hdd_image_log("VHD: Unsupported image type %i\n", vft->type);
 			free(vft);
 			vft = NULL;
 			fclose(hdd_images[id].file);
@@ -721,7 +1471,7 @@ hdd_image_load(int id)
 			memset(hdd[id].fn, 0, sizeof(hdd[id].fn));
 			return 0;
 		}
-		full_size = vft->orig_size;
+		full_size = hdd_images[id].vhd ? vft->curr_size : vft->orig_size;
 		hdd[id].tracks = vft->geom.cyl;
 		hdd[id].hpc = vft->geom.heads;
 		hdd[id].spt = vft->geom.spt;
@@ -733,6 +1483,7 @@ hdd_image_load(int id)
 		   are there. */
 		hdd_images[id].last_sector = (uint32_t) (full_size >> 9) - 1;
 		hdd_images[id].loaded = 1;
+		hdd_image_update_size(id);
 		return 1;
 	} else {
 		full_size = ((uint64_t) hdd[id].spt) *
@@ -763,6 +1514,8 @@ hdd_image_load(int id)
 	}
     }
 
+    hdd_image_update_size(id);
+
     return ret;
 }
 
@@ -773,7 +1526,11 @@ hdd_image_seek(uint8_t id, uint32_t sector)
     off64_t addr = sector;
     addr = (uint64_t)sector << 9LL;
 
+    hdd_image_wait(id);
+
     hdd_images[id].pos = sector;
+    if (hdd_images[id].vhd)
+	return;
     if (fseeko64(hdd_images[id].file, addr + hdd_images[id].base, SEEK_SET) == -1)
 	fatal("hdd_image_seek(): Error seeking\n");
 }
@@ -782,28 +1539,27 @@ hdd_image_seek(uint8_t id, uint32_t sector)
 void
 hdd_image_read(uint8_t id, uint32_t sector, uint32_t count, uint8_t *buffer)
 {
-    int i;
+    uint32_t n;
 
-    if (fseeko64(hdd_images[id].file, ((uint64_t)(sector) << 9LL) + hdd_images[id].base, SEEK_SET) == -1) {
-	fatal("Hard disk image %i: Read error during seek\n", id);
+    if (count == 0)
 	return;
-    }
 
-    for (i = 0; i < count; i++) {
-	if (feof(hdd_images[id].file))
-		break;
+    hdd_image_wait(id);
 
-	hdd_images[id].pos = sector + i;
-	fread(buffer + (i << 9), 1, 512, hdd_images[id].file);
-    }
+    n = hdd_image_do_read(&hdd_images[id], sector, count, buffer);
+    if (n > (count - 1))
+	n = count - 1;
+    hdd_images[id].pos = sector + n;
 }
 
 
 uint32_t
 hdd_sectors(uint8_t id)
 {
-    fseeko64(hdd_images[id].file, 0, SEEK_END);
-    return (uint32_t) ((ftello64(hdd_images[id].file) - hdd_images[id].base) >> 9);
+    if (hdd_images[id].vhd)
+	return (uint32_t) (hdd_images[id].vhd->size >> 9);
+
+    return (uint32_t) ((hdd_images[id].file_size - hdd_images[id].base) >> 9);
 }
 
 
@@ -827,20 +1583,18 @@ hdd_image_read_ex(uint8_t id, uint32_t sector, uint32_t count, uint8_t *buffer)
 void
 hdd_image_write(uint8_t id, uint32_t sector, uint32_t count, uint8_t *buffer)
 {
-    int i;
+    uint64_t addr = ((((uint64_t) sector) + count) << 9LL) + hdd_images[id].base;
 
-    if (fseeko64(hdd_images[id].file, ((uint64_t)(sector) << 9LL) + hdd_images[id].base, SEEK_SET) == -1) {
-	fatal("Hard disk image %i: Write error during seek\n", id);
+    if (count == 0)
 	return;
-    }
 
-    for (i = 0; i < count; i++) {
-	if (feof(hdd_images[id].file))
-		break;
+    hdd_image_wait(id);
 
-	hdd_images[id].pos = sector + i;
-	fwrite(buffer + (i << 9), 512, 1, hdd_images[id].file);
-    }
+    hdd_image_do_write(&hdd_images[id], sector, count, buffer);
+    hdd_images[id].pos = sector + count - 1;
+
+    if (addr > hdd_images[id].file_size)
+	hdd_images[id].file_size = addr;
 }
 
 
@@ -868,6 +1622,16 @@ hdd_image_zero(uint8_t id, uint32_t sector, uint32_t count)
 
     memset(empty_sector, 0, 512);
 
+    hdd_image_wait(id);
+
+    if (hdd_images[id].vhd) {
+	if (count) {
+		vhd_zero_sectors(hdd_images[id].vhd, sector, count);
+		hdd_images[id].pos = sector + count - 1;
+	}
+	return;
+    }
+
     if (fseeko64(hdd_images[id].file, ((uint64_t)(sector) << 9LL) + hdd_images[id].base, SEEK_SET) == -1) {
 	fatal("Hard disk image %i: Zero error during seek\n", id);
 	return;
@@ -928,6 +1692,9 @@ hdd_image_unload(uint8_t id, int fn_preserve)
 	return;
 
     if (hdd_images[id].loaded) {
+	hdd_image_io_stop(id);
+	vhd_close(hdd_images[id].vhd);
+	hdd_images[id].vhd = NULL;
 	if (hdd_images[id].file != NULL) {
 		fclose(hdd_images[id].file);
 		hdd_images[id].file = NULL;
@@ -952,6 +1719,11 @@ hdd_image_close(uint8_t id)
     if (!hdd_images[id].loaded)
 	return;
 
+    hdd_image_io_stop(id);
+
+    vhd_close(hdd_images[id].vhd);
+    hdd_images[id].vhd = NULL;
+
     if (hdd_images[id].file != NULL) {
 	fclose(hdd_images[id].file);
 	hdd_images[id].file = NULL;
@@ -1647,17 +1647,15 @@ dma_mode(int channel)
 void
 dma_bm_read(uint32_t PhysAddress, uint8_t *DataRead, uint32_t TotalSize, int TransferSize)
 {
-	uint32_t i = 0, n, n2;
+	uint32_t n, n2;
 	uint8_t bytes[4] = { 0, 0, 0, 0 };
 
 	n = TotalSize & ~(TransferSize - 1);
 	n2 = TotalSize - n;
 
 	/* Do the divisible block, if there is one. */
-	if (n) {
-		for (i = 0; i < n; i += TransferSize)
-			mem_read_phys((void *) &(DataRead[i]), PhysAddress + i, TransferSize);
-	}
+	if (n)
+		mem_read_phys_block((void *) DataRead, PhysAddress, n, TransferSize);
 
 	/* Do the non-divisible block, if there is one. */
 	if (n2) {
@@ -1670,17 +1668,15 @@ dma_bm_read(uint32_t PhysAddress, uint8_t *DataRead, uint32_t TotalSize, int Tra
 void
 dma_bm_write(uint32_t PhysAddress, const uint8_t *DataWrite, uint32_t TotalSize, int TransferSize)
 {
-	uint32_t i = 0, n, n2;
+	uint32_t n, n2;
 	uint8_t bytes[4] = { 0, 0, 0, 0 };
 
 	n = TotalSize & ~(TransferSize - 1);
 	n2 = TotalSize - n;
 
 	/* Do the divisible block, if there is one. */
-	if (n) {
-		for (i = 0; i < n; i += TransferSize)
-			mem_write_phys((void *) &(DataWrite[i]), PhysAddress + i, TransferSize);
-	}
+	if (n)
+		mem_write_phys_block(DataWrite, PhysAddress, n, TransferSize);
 
 	/* Do the non-divisible block, if there is one. */
 	if (n2) {
@@ -95,7 +95,8 @@ extern int	sound_is_float,			/* (C) sound uses FP values */
 		GAMEBLASTER,			/* (C) sound option */
 		GUS, GUSMAX,			/* (C) sound option */
 		SSI2001,			/* (C) sound option */
-		voodoo_enabled;			/* (C) video option */
+		voodoo_enabled,			/* (C) video option */
+		svga_render_threads;		/* (C) video option */
 extern uint32_t	mem_size;			/* (C) memory size */
 extern int	cpu_manufacturer,		/* (C) cpu manufacturer */
 		cpu,				/* (C) cpu type */
@@ -39,13 +39,15 @@ typedef struct ide_s {
 		pos, sector_pos,
 		lba, skip512,
 		reset, mdma_mode,
-		do_initial_read;
+		do_initial_read, read_queued;
 	uint32_t secount, sector,
 		cylinder, head,
 		drive, cylprecomp,
 		cfg_spt, cfg_hpc,
 		lba_addr, tracks,
-		spt, hpc;
+		spt, hpc,
+		queued_sector, queued_count,
+		write_sector, write_count;
 
 	uint16_t *buffer;
 	uint8_t *sector_buffer;
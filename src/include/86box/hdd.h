@@ -141,6 +141,9 @@ extern void	hdd_image_write(uint8_t id, uint32_t sector, uint32_t count, uint8_t
 extern int	hdd_image_write_ex(uint8_t id, uint32_t sector, uint32_t count, uint8_t *buffer);
 extern void	hdd_image_zero(uint8_t id, uint32_t sector, uint32_t count);
 extern int	hdd_image_zero_ex(uint8_t id, uint32_t sector, uint32_t count);
+extern void	hdd_image_read_async(uint8_t id, uint32_t sector, uint32_t count, uint8_t *buffer);
+extern void	hdd_image_write_async(uint8_t id, uint32_t sector, uint32_t count, uint8_t *buffer);
+extern void	hdd_image_wait(uint8_t id);
 extern uint32_t	hdd_image_get_last_sector(uint8_t id);
 extern uint32_t	hdd_image_get_pos(uint8_t id);
 extern uint8_t	hdd_image_get_type(uint8_t id);
@@ -152,6 +155,7 @@ extern void	vhd_footer_from_bytes(vhd_footer_t *vhd, uint8_t *bytes);
 extern void	vhd_footer_to_bytes(uint8_t *bytes, vhd_footer_t *vhd);
 extern void	new_vhd_footer(vhd_footer_t **vhd);
 extern void	generate_vhd_checksum(vhd_footer_t *vhd);
+extern void	vhd_create_dynamic(FILE *f, vhd_footer_t *vhd);
 
 extern int	image_is_hdi(const wchar_t *s);
 extern int	image_is_hdx(const wchar_t *s, int check_signature);
@@ -50,6 +50,16 @@ extern void	io_handler(int set, uint16_t base, int size,
 			void (*outl)(uint16_t addr, uint32_t val, void *priv),
 			void *priv);
 
+extern void	io_sethandler_string(uint16_t base, int size,
+			int (*insw)(uint16_t addr, uint16_t *buf, int count, void *priv),
+			int (*outsw)(uint16_t addr, uint16_t *buf, int count, void *priv),
+			void *priv);
+
+extern void	io_removehandler_string(uint16_t base, int size,
+			int (*insw)(uint16_t addr, uint16_t *buf, int count, void *priv),
+			int (*outsw)(uint16_t addr, uint16_t *buf, int count, void *priv),
+			void *priv);
+
 #ifdef PC98
 extern void	io_sethandler_interleaved(uint16_t base, int size,
 			uint8_t (*inb)(uint16_t addr, void *priv),
@@ -77,5 +87,9 @@ extern void	outw(uint16_t port, uint16_t val);
 extern uint32_t	inl(uint16_t port);
 extern void	outl(uint16_t port, uint32_t val);
 
+extern int	io_string_port(uint16_t port);
+extern int	inw_string(uint16_t port, uint16_t *buf, int count);
+extern int	outw_string(uint16_t port, uint16_t *buf, int count);
+
 
 #endif	/*EMU_IO_H*/
@@ -94,6 +94,11 @@ internal 4k pages. */
 #define MEM_GRANULARITY_PAGE	(MEM_GRANULARITY_MASK & ~0xfff)
 #endif
 
+/* MMU lookup cache (readlookup/writelookup) geometry. */
+#define TLB_SETS		128	/* power of 2 */
+#define TLB_WAYS		4	/* power of 2 */
+#define TLB_SIZE		(TLB_SETS * TLB_WAYS)
+
 #define mem_set_mem_state_common(smm, base, size, state) mem_set_state(!!smm, 0, base, size, state)
 #define mem_set_mem_state(base, size, state) mem_set_state(0, 0, base, size, state)
 #define mem_set_mem_state_smm(base, size, state) mem_set_state(1, 0, base, size, state)
@@ -191,20 +196,33 @@ typedef struct
 } smram_t;
 
 
+/* MMU lookup cache statistics, for profiling. */
+typedef struct
+{
+	uint64_t	misses,		/* entries (re)filled after a page walk */
+		flushes,	/* full flushes */
+		cr3_flushes,	/* CR3 loads */
+		global_kept,	/* global entries that survived a CR3 load */
+		invlpg;		/* single-page invalidations */
+} mmu_tlb_stats_t;
+
+
 extern uint8_t		*ram, *ram2;
 extern uint32_t		rammask;
 
 extern uint8_t		*rom;
 extern uint32_t		biosmask, biosaddr;
 
-extern int		readlookup[256],
-readlookupp[256];
+extern int		readlookup[TLB_SIZE],
+readlookupp[TLB_SIZE];
+extern uint8_t		readlookupf[TLB_SIZE];
 extern uintptr_t *	readlookup2;
-extern int		readlnext;
-extern int		writelookup[256],
-writelookupp[256];
+extern int		readlnext[TLB_SETS];
+extern int		writelookup[TLB_SIZE],
+writelookupp[TLB_SIZE];
+extern uint8_t		writelookupf[TLB_SIZE];
 extern uintptr_t	*writelookup2;
-extern int		writelnext;
+extern int		writelnext[TLB_SETS];
 extern uint32_t		ram_mapped_addr[64];
 
 extern mem_mapping_t	base_mapping,
@@ -234,6 +252,8 @@ writelnum;
 
 extern int		memspeed[11];
 
+extern mmu_tlb_stats_t	mmu_tlb_stats;
+
 extern int		mmu_perm,
 use_phys_exec;
 
@@ -318,6 +338,8 @@ extern void	mem_writeb_phys(uint32_t addr, uint8_t val);
 extern void	mem_writew_phys(uint32_t addr, uint16_t val);
 extern void	mem_writel_phys(uint32_t addr, uint32_t val);
 extern void	mem_write_phys(void *src, uint32_t addr, int tranfer_size);
+extern void	mem_read_phys_block(void *dest, uint32_t addr, uint32_t len, int transfer_size);
+extern void	mem_write_phys_block(const void *src, uint32_t addr, uint32_t len, int transfer_size);
 
 extern uint8_t	mem_read_ram(uint32_t addr, void *priv);
 extern uint16_t	mem_read_ramw(uint32_t addr, void *priv);
@@ -357,6 +379,7 @@ extern void	mem_reset_page_blocks(void);
 extern void     flushmmucache(void);
 extern void     flushmmucache_cr3(void);
 extern void	flushmmucache_nopc(void);
+extern void	flushmmucache_nonglobal(void);
 extern void     mmu_invalidate(uint32_t addr);
 
 extern void	mem_a20_init(void);
@@ -73,8 +73,6 @@ typedef struct netpkt {
     void		*priv;
     uint8_t		data[65536];	/* Maximum length + 1 to round up to the nearest power of 2. */
     int			len;
-
-    struct netpkt	*prev, *next;
 } netpkt_t;
 
 typedef struct {
@@ -107,8 +105,8 @@ extern netdev_t network_devs[32];
 /* Function prototypes. */
 extern void	network_wait(uint8_t wait);
 extern void	network_poll(void);
-extern void	network_busy(uint8_t set);
-extern void	network_end(void);
+extern void	network_rx_wait(void);
+extern void	network_wake(void);
 
 extern void	network_init(void);
 extern void	network_attach(void *, uint8_t *, NETRXCB, NETWAITCB, NETSETLINKSTATE);
@@ -118,6 +116,7 @@ extern int	network_available(void);
 extern void	network_tx(uint8_t *, int);
 extern void	network_do_tx(void);
 extern int	network_tx_queue_check(void);
+extern int	network_rx_queue_space(void);
 
 extern int	net_pcap_prepare(netdev_t *);
 extern int	net_pcap_init(void);
@@ -129,6 +128,7 @@ extern int	net_slirp_init(void);
 extern int	net_slirp_reset(const netcard_t *, uint8_t *);
 extern void	net_slirp_close(void);
 extern void	net_slirp_in(uint8_t *, int);
+extern void	net_slirp_wake(void);
 
 extern int	network_dev_to_id(char *);
 extern int	network_card_available(int);
@@ -141,7 +141,7 @@ extern const device_t	*network_card_getdevice(int);
 extern void	network_set_wait(int wait);
 extern int	network_get_wait(void);
 
-extern void	network_queue_put(int tx, void *priv, uint8_t *data, int len);
+extern int	network_queue_put(int tx, void *priv, uint8_t *data, int len);
 
 #ifdef __cplusplus
 }
@@ -33,13 +33,20 @@ typedef struct {
 
     void	(*load_func)(uint8_t new_m, int new_count);
     void	(*out_func)(int new_out, int old_out);
+
+    struct PIT	*dev;
 } ctr_t;
 
 
 typedef struct PIT {
-    int		flags, clock;
+    int		flags, clock,
+		syncing;
     pc_timer_t	callback_timer;
 
+    uint64_t	edge_ts, edge_period;	/* Timestamp of the last processed half
+					   clock edge, and the length of a half
+					   clock, both in 32:32 format. */
+
     ctr_t	counters[3];
 
     uint8_t	ctrl;
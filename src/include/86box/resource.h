@@ -211,6 +211,7 @@
 #define IDC_EDIT_HD_SIZE	1164
 #define IDC_COMBO_HD_TYPE	1165
 #define IDC_PBAR_IMG_CREATE	1166
+#define IDC_CHECK_HD_DYNAMIC	1167
 
 #define IDC_REMOV_DEVICES	1170	/* removable dev config */
 #define IDC_LIST_FLOPPY_DRIVES	1171
@@ -53,7 +53,9 @@ typedef struct pc_timer_t
     void	(*callback)(void *p);
     void	*p;
 
-    struct	pc_timer_t *prev, *next;
+    int		heap_pos;		/* Slot in the timer heap plus one, 0 if the
+					   timer is not currently queued. */
+    uint32_t	seq;			/* Enable order, used to break timestamp ties. */
 } pc_timer_t;
 
 /*Timestamp of nearest enabled timer. CPU emulation must call timer_process()
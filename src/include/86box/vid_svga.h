@@ -143,6 +143,9 @@ typedef struct svga_t
 	int hsync_divisor;
 
 	void *ramdac, *clock_gen;
+
+	/*Scanline render worker threads, NULL if disabled*/
+	void *render_threads;
 } svga_t;
 
 
@@ -153,6 +156,7 @@ extern int	svga_init(const device_t *info, svga_t *svga, void *p, int memsize,
 	void(*hwcursor_draw)(struct svga_t *svga, int displine),
 	void(*overlay_draw)(struct svga_t *svga, int displine));
 extern void	svga_recalctimings(svga_t *svga);
+extern void	svga_render_state_changed(svga_t *svga);
 extern void	svga_close(svga_t *svga);
 
 uint8_t		svga_read(uint32_t addr, void *p);
@@ -16,8 +16,13 @@
 #include <intrin.h>
 #include <xmmintrin.h>
 
-#define BLOCK_NUM 8
-#define BLOCK_MASK (BLOCK_NUM-1)
+/*Recompiled pixel pipelines are cached per render thread. Each thread has
+  BLOCK_NUM blocks, organised as BLOCK_SETS sets of BLOCK_WAYS. A hash of the
+  pipeline state selects the set, and on a miss the least recently used way of
+  that set is recompiled.*/
+#define BLOCK_WAYS 4
+#define BLOCK_SETS 64
+#define BLOCK_NUM (BLOCK_SETS * BLOCK_WAYS)
 #define BLOCK_SIZE 8192
 
 #define LOD_MASK (LOD_TMIRROR_S | LOD_TMIRROR_T)
@@ -33,11 +38,9 @@ typedef struct voodoo_x86_data_t
         uint32_t textureMode[2];
         uint32_t tLOD[2];
         uint32_t trexInit1;        
+        uint32_t last_used;
 } voodoo_x86_data_t;
 
-static int last_block[2] = {0, 0};
-static int next_block_to_write[2] = {0, 0};
-
 #define addbyte(val)                                    \
         code_block[block_pos++] = val;                  \
         if (block_pos >= BLOCK_SIZE)                    \
@@ -3226,18 +3229,36 @@ static inline void voodoo_generate(uint8_t *code_block, voodoo_t *voodoo, voodoo
         if (params->textureMode[1] & TEXTUREMODE_TRILINEAR)
                 cs = cs;
 }
-static int voodoo_recomp = 0;
+static inline int voodoo_block_hash(voodoo_t *voodoo, voodoo_params_t *params, voodoo_state_t *state)
+{
+        uint32_t h = params->fbzMode;
+
+        h = (h * 0x9e3779b1) ^ params->alphaMode;
+        h = (h * 0x9e3779b1) ^ params->fogMode;
+        h = (h * 0x9e3779b1) ^ params->fbzColorPath;
+        h = (h * 0x9e3779b1) ^ params->textureMode[0];
+        h = (h * 0x9e3779b1) ^ params->textureMode[1];
+        h = (h * 0x9e3779b1) ^ (params->tLOD[0] & LOD_MASK) ^ ((params->tLOD[1] & LOD_MASK) << 1);
+        h = (h * 0x9e3779b1) ^ (voodoo->trexInit1[0] & (1 << 18)) ^ (state->xdir & 3);
+        h ^= h >> 16;
+        h *= 0x85ebca6b;
+        h ^= h >> 13;
+
+        return h & (BLOCK_SETS - 1);
+}
 
 static inline void *voodoo_get_block(voodoo_t *voodoo, voodoo_params_t *params, voodoo_state_t *state, int odd_even)
 {
         int c;
-        int b = last_block[odd_even];
-        voodoo_x86_data_t *data;
         voodoo_x86_data_t *codegen_data = voodoo->codegen_data;
+        voodoo_x86_data_t *data, *lru = NULL;
+        uint32_t stamp = ++voodoo->codegen_stamp[odd_even];
         
-        for (c = 0; c < 8; c++)
+        codegen_data = &codegen_data[(odd_even * BLOCK_NUM) + (voodoo_block_hash(voodoo, params, state) * BLOCK_WAYS)];
+        
+        for (c = 0; c < BLOCK_WAYS; c++)
         {
-                data = &codegen_data[odd_even + b*2];
+                data = &codegen_data[c];
                 
                 if (state->xdir == data->xdir &&
                     params->alphaMode == data->alphaMode &&
@@ -3250,15 +3271,16 @@ static inline void *voodoo_get_block(voodoo_t *voodoo, voodoo_params_t *params,
                     (params->tLOD[0] & LOD_MASK) == data->tLOD[0] &&
                     (params->tLOD[1] & LOD_MASK) == data->tLOD[1])
                 {
-                        last_block[odd_even] = b;
+                        data->last_used = stamp;
+                        voodoo->codegen_hits[odd_even]++;
                         return data->code_block;
                 }
                 
-                b = (b + 1) & 7;
+                if (!lru || (uint32_t)(stamp - data->last_used) > (uint32_t)(stamp - lru->last_used))
+                        lru = data;
         }
-voodoo_recomp++;
-        data = &codegen_data[odd_even + next_block_to_write[odd_even]*2];
-//        code_block = data->code_block;
+        voodoo->codegen_compiles[odd_even]++;
+        data = lru;
         
         voodoo_generate(data->code_block, voodoo, params, state, depth_op);
 
@@ -3272,8 +3294,7 @@ voodoo_recomp++;
         data->textureMode[1] = params->textureMode[1];
         data->tLOD[0] = params->tLOD[0] & LOD_MASK;
         data->tLOD[1] = params->tLOD[1] & LOD_MASK;
-
-        next_block_to_write[odd_even] = (next_block_to_write[odd_even] + 1) & 7;
+        data->last_used = stamp;
         
         return data->code_block;
 }
@@ -3289,14 +3310,14 @@ static void voodoo_codegen_init(voodoo_t *voodoo)
 #endif
 
 #if defined WIN32 || defined _WIN32 || defined _WIN32
-        voodoo->codegen_data = VirtualAlloc(NULL, sizeof(voodoo_x86_data_t) * BLOCK_NUM*2, MEM_COMMIT, PAGE_EXECUTE_READWRITE);
+        voodoo->codegen_data = VirtualAlloc(NULL, sizeof(voodoo_x86_data_t) * BLOCK_NUM * voodoo->render_threads, MEM_COMMIT, PAGE_EXECUTE_READWRITE);
 #else
-        voodoo->codegen_data = malloc(sizeof(voodoo_x86_data_t) * BLOCK_NUM*2);
+        voodoo->codegen_data = malloc(sizeof(voodoo_x86_data_t) * BLOCK_NUM * voodoo->render_threads);
 #endif
 
 #ifdef __linux__
 	start = (void *)((long)voodoo->codegen_data & pagemask);
-	len = ((sizeof(voodoo_x86_data_t) * BLOCK_NUM*2) + pagesize) & pagemask;
+	len = ((sizeof(voodoo_x86_data_t) * BLOCK_NUM * voodoo->render_threads) + pagesize) & pagemask;
 	if (mprotect(start, len, PROT_READ | PROT_WRITE | PROT_EXEC) != 0)
 	{
 		perror("mprotect");
@@ -3304,6 +3325,15 @@ static void voodoo_codegen_init(voodoo_t *voodoo)
 	}
 #endif
 
+        /*xdir is never 0 for a real pipeline, so this marks every block empty*/
+        for (c = 0; c < BLOCK_NUM * voodoo->render_threads; c++)
+        {
+                voodoo_x86_data_t *data = &((voodoo_x86_data_t *)voodoo->codegen_data)[c];
+
+                data->xdir = 0;
+                data->last_used = 0;
+        }
+
         for (c = 0; c < 256; c++)
         {
                 int d[4];
@@ -3328,6 +3358,11 @@ static void voodoo_codegen_init(voodoo_t *voodoo)
 
 static void voodoo_codegen_close(voodoo_t *voodoo)
 {
+        int c;
+
+        for (c = 0; c < voodoo->render_threads; c++)
+                voodoo_log("Voodoo render thread %i: %i pipeline cache hits, %i compiles\n", c, voodoo->codegen_hits[c], voodoo->codegen_compiles[c]);
+
 #if defined WIN32 || defined _WIN32 || defined _WIN32
         VirtualFree(voodoo->codegen_data, 0, MEM_RELEASE);
 #else
@@ -32,6 +32,16 @@
 
 #define NPORTS		65536		/* PC/AT supports 64K ports */
 
+#define IO_INB		0
+#define IO_INW		1
+#define IO_INL		2
+#define IO_OUTB		3
+#define IO_OUTW		4
+#define IO_OUTL		5
+
+#define IO_CALLS_MAX	4		/* handler calls per access */
+#define IO_WALK		0xff		/* too many, walk the lists */
+
 
 typedef struct _io_ {
 	uint8_t(*inb)(uint16_t addr, void *priv);
@@ -47,8 +57,45 @@ typedef struct _io_ {
 	struct _io_ *prev, *next;
 } io_t;
 
+typedef struct {
+	int(*insw)(uint16_t addr, uint16_t *buf, int count, void *priv);
+	int(*outsw)(uint16_t addr, uint16_t *buf, int count, void *priv);
+
+	void	*priv;
+} io_string_t;
+
+/* One handler call an access has to make: which handler, at which width,
+   and at which byte offset from the accessed port. */
+typedef struct {
+	union {
+		uint8_t(*inb)(uint16_t addr, void *priv);
+		uint16_t(*inw)(uint16_t addr, void *priv);
+		uint32_t(*inl)(uint16_t addr, void *priv);
+
+		void(*outb)(uint16_t addr, uint8_t  val, void *priv);
+		void(*outw)(uint16_t addr, uint16_t val, void *priv);
+		void(*outl)(uint16_t addr, uint32_t val, void *priv);
+	} f;
+
+	void	*priv;
+
+	uint8_t	width, offset;
+} io_call_t;
+
+/* The handler lists of a port and the three above it, flattened per access
+   width into the calls inb() ... outl() would make walking them.  Nearly
+   every port ends up with a single call here; only ports with more than
+   IO_CALLS_MAX calls for a width still walk the lists. */
+typedef struct {
+	uint8_t		n[6], found[6];
+
+	io_call_t	call[6][IO_CALLS_MAX];
+} io_dispatch_t;
+
 int initialized = 0;
 io_t *io[NPORTS], *io_last[NPORTS];
+static io_string_t *io_string[NPORTS];
+static io_dispatch_t *io_dispatch[NPORTS];
 
 
 #ifdef ENABLE_IO_LOG
@@ -78,8 +125,11 @@ io_init(void)
 	io_t *p, *q;
 
 	if (!initialized) {
-		for (c = 0; c<NPORTS; c++)
+		for (c = 0; c<NPORTS; c++) {
 			io[c] = io_last[c] = NULL;
+			io_string[c] = NULL;
+			io_dispatch[c] = NULL;
+		}
 		initialized = 1;
 	}
 
@@ -98,6 +148,174 @@ io_init(void)
 
 		/* io[c] should be NULL. */
 		io[c] = io_last[c] = NULL;
+
+		if (io_string[c]) {
+			free(io_string[c]);
+			io_string[c] = NULL;
+		}
+
+		if (io_dispatch[c]) {
+			free(io_dispatch[c]);
+			io_dispatch[c] = NULL;
+		}
+	}
+}
+
+
+static void
+io_add_call(io_dispatch_t *d, int type, void *f, void *priv, int width, int offset)
+{
+	io_call_t *c;
+
+	if (d->n[type] == IO_WALK)
+		return;
+
+	if (d->n[type] == IO_CALLS_MAX) {
+		d->n[type] = IO_WALK;
+		return;
+	}
+
+	c = &d->call[type][d->n[type]++];
+	c->f.inb = (uint8_t(*)(uint16_t, void *))f;
+	c->priv = priv;
+	c->width = width;
+	c->offset = offset;
+
+	d->found[type] |= width;
+}
+
+
+/* Rebuild the dispatch entry of a port, following the same walk order
+   inb() ... outl() use, so handlers are called in the same sequence. */
+static void
+io_compile_port(uint16_t port)
+{
+	io_dispatch_t *d = io_dispatch[port];
+	io_t *p;
+	int i;
+
+	if (!d) {
+		for (i = 0; i < 4; i++) {
+			if (io[(port + i) & 0xffff])
+				break;
+		}
+		if (i == 4)
+			return;
+
+		d = (io_dispatch_t *)malloc(sizeof(io_dispatch_t));
+		io_dispatch[port] = d;
+	}
+
+	/* The entry is never freed outside io_init(), so a handler that
+	   remaps its own ports mid-access doesn't pull it out from under
+	   the dispatch loop. */
+	memset(d->n, 0, sizeof(d->n));
+	memset(d->found, 0, sizeof(d->found));
+
+	for (p = io[port]; p; p = p->next) {
+		if (p->inb)
+			io_add_call(d, IO_INB, (void *)p->inb, p->priv, 1, 0);
+		if (p->outb)
+			io_add_call(d, IO_OUTB, (void *)p->outb, p->priv, 1, 0);
+		if (p->inw)
+			io_add_call(d, IO_INW, (void *)p->inw, p->priv, 2, 0);
+		if (p->outw)
+			io_add_call(d, IO_OUTW, (void *)p->outw, p->priv, 2, 0);
+		if (p->inl)
+			io_add_call(d, IO_INL, (void *)p->inl, p->priv, 4, 0);
+		if (p->outl)
+			io_add_call(d, IO_OUTL, (void *)p->outl, p->priv, 4, 0);
+	}
+
+	for (i = 0; i < 2; i++) {
+		for (p = io[(port + i) & 0xffff]; p; p = p->next) {
+			if (p->inb && !p->inw)
+				io_add_call(d, IO_INW, (void *)p->inb, p->priv, 1, i);
+			if (p->outb && !p->outw)
+				io_add_call(d, IO_OUTW, (void *)p->outb, p->priv, 1, i);
+		}
+	}
+
+	for (i = 0; i < 4; i += 2) {
+		for (p = io[(port + i) & 0xffff]; p; p = p->next) {
+			if (p->inw && !p->inl)
+				io_add_call(d, IO_INL, (void *)p->inw, p->priv, 2, i);
+			if (p->outw && !p->outl)
+				io_add_call(d, IO_OUTL, (void *)p->outw, p->priv, 2, i);
+		}
+	}
+
+	for (i = 0; i < 4; i++) {
+		for (p = io[(port + i) & 0xffff]; p; p = p->next) {
+			if (p->inb && !p->inw && !p->inl)
+				io_add_call(d, IO_INL, (void *)p->inb, p->priv, 1, i);
+			if (p->outb && !p->outw && !p->outl)
+				io_add_call(d, IO_OUTL, (void *)p->outb, p->priv, 1, i);
+		}
+	}
+}
+
+
+/* A handler at port X takes part in accesses starting at X - 3 to X. */
+static void
+io_compile_range(uint16_t base, int size)
+{
+	int c;
+
+	for (c = -3; c < size; c++)
+		io_compile_port((base + c) & 0xffff);
+}
+
+
+static uint32_t
+io_dispatch_in(io_dispatch_t *d, int type, uint16_t port)
+{
+	io_call_t *c = d->call[type];
+	uint32_t ret = 0xffffffff;
+	uint32_t val, mask;
+	int i, shift;
+
+	for (i = 0; i < d->n[type]; i++, c++) {
+		switch (c->width) {
+		case 1:
+			val = c->f.inb(port + c->offset, c->priv);
+			mask = 0xff;
+			break;
+		case 2:
+			val = c->f.inw(port + c->offset, c->priv);
+			mask = 0xffff;
+			break;
+		default:
+			val = c->f.inl(port, c->priv);
+			mask = 0xffffffff;
+			break;
+		}
+		shift = c->offset << 3;
+		ret &= (val << shift) | ~(mask << shift);
+	}
+
+	return ret;
+}
+
+
+static void
+io_dispatch_out(io_dispatch_t *d, int type, uint16_t port, uint32_t val)
+{
+	io_call_t *c = d->call[type];
+	int i;
+
+	for (i = 0; i < d->n[type]; i++, c++) {
+		switch (c->width) {
+		case 1:
+			c->f.outb(port + c->offset, val >> (c->offset << 3), c->priv);
+			break;
+		case 2:
+			c->f.outw(port + c->offset, val >> (c->offset << 3), c->priv);
+			break;
+		default:
+			c->f.outl(port, val, c->priv);
+			break;
+		}
 	}
 }
 
@@ -141,6 +359,8 @@ io_sethandler(uint16_t base, int size,
 
 		io_last[base + c] = q;
 	}
+
+	io_compile_range(base, size);
 }
 
 
@@ -182,6 +402,8 @@ io_removehandler(uint16_t base, int size,
 			p = q;
 		}
 	}
+
+	io_compile_range(base, size);
 }
 
 
@@ -202,6 +424,80 @@ io_handler(int set, uint16_t base, int size,
 }
 
 
+/* String handlers let a device move a whole run of words through its
+   data port in one call, for REP INSW/OUTSW.  They are only an
+   accelerator: the device must also have regular word handlers on the
+   same ports, and a string handler may transfer fewer words than asked
+   for (or none) whenever it needs the single word path. */
+void
+io_sethandler_string(uint16_t base, int size,
+	int(*insw)(uint16_t addr, uint16_t *buf, int count, void *priv),
+	int(*outsw)(uint16_t addr, uint16_t *buf, int count, void *priv),
+	void *priv)
+{
+	int c;
+	io_string_t *p;
+
+	for (c = 0; c < size; c++) {
+		p = io_string[base + c];
+		if (!p) {
+			p = (io_string_t *)malloc(sizeof(io_string_t));
+			io_string[base + c] = p;
+		}
+
+		p->insw = insw;
+		p->outsw = outsw;
+		p->priv = priv;
+	}
+}
+
+
+void
+io_removehandler_string(uint16_t base, int size,
+	int(*insw)(uint16_t addr, uint16_t *buf, int count, void *priv),
+	int(*outsw)(uint16_t addr, uint16_t *buf, int count, void *priv),
+	void *priv)
+{
+	int c;
+	io_string_t *p;
+
+	for (c = 0; c < size; c++) {
+		p = io_string[base + c];
+		if (p && (p->insw == insw) && (p->outsw == outsw) && (p->priv == priv)) {
+			free(p);
+			io_string[base + c] = NULL;
+		}
+	}
+}
+
+
+/* The string handler may only stand in for inw()/outw() if its device
+   owns both bytes of the port outright; anything sharing the port, or
+   splitting it into byte handlers, keeps going through the list walk. */
+static io_string_t *
+io_string_handler(uint16_t port)
+{
+	io_string_t *s = io_string[port];
+	io_t *p = io[port];
+	io_t *q = io[(port + 1) & 0xffff];
+
+	if (!s || !p || p->next || (p->priv != s->priv))
+		return NULL;
+
+	if (q && (q->next || (q->priv != s->priv)))
+		return NULL;
+
+	return s;
+}
+
+
+int
+io_string_port(uint16_t port)
+{
+	return !!io_string_handler(port);
+}
+
+
 #ifdef PC98
 void
 io_sethandler_interleaved(uint16_t base, int size,
@@ -240,6 +536,8 @@ io_sethandler_interleaved(uint16_t base, int size,
 
 		q->priv = priv;
 	}
+
+	io_compile_range(base, size);
 }
 
 
@@ -277,6 +575,8 @@ io_removehandler_interleaved(uint16_t base, int size,
 			p = q;
 		}
 	}
+
+	io_compile_range(base, size);
 }
 #endif
 
@@ -288,15 +588,25 @@ inb(uint16_t port)
 	io_t *p;
 	int found = 0;
 	int qfound = 0;
-
-	p = io[port];
-	while (p) {
-		if (p->inb) {
-			ret &= p->inb(port, p->priv);
-			found |= 1;
-			qfound++;
+	int i;
+	io_dispatch_t *d = io_dispatch[port];
+
+	if (d && (d->n[IO_INB] != IO_WALK)) {
+		/* Byte calls are all width 1 at offset 0, no merging needed. */
+		for (i = 0; i < d->n[IO_INB]; i++)
+			ret &= d->call[IO_INB][i].f.inb(port, d->call[IO_INB][i].priv);
+		found = d->found[IO_INB];
+		qfound = d->n[IO_INB];
+	} else {
+		p = io[port];
+		while (p) {
+			if (p->inb) {
+				ret &= p->inb(port, p->priv);
+				found |= 1;
+				qfound++;
+			}
+			p = p->next;
 		}
-		p = p->next;
 	}
 
 	if (port & 0x80)
@@ -321,15 +631,24 @@ outb(uint16_t port, uint8_t val)
 	io_t *p;
 	int found = 0;
 	int qfound = 0;
-
-	p = io[port];
-	while (p) {
-		if (p->outb) {
-			p->outb(port, val, p->priv);
-			found |= 1;
-			qfound++;
+	int i;
+	io_dispatch_t *d = io_dispatch[port];
+
+	if (d && (d->n[IO_OUTB] != IO_WALK)) {
+		for (i = 0; i < d->n[IO_OUTB]; i++)
+			d->call[IO_OUTB][i].f.outb(port, val, d->call[IO_OUTB][i].priv);
+		found = d->found[IO_OUTB];
+		qfound = d->n[IO_OUTB];
+	} else {
+		p = io[port];
+		while (p) {
+			if (p->outb) {
+				p->outb(port, val, p->priv);
+				found |= 1;
+				qfound++;
+			}
+			p = p->next;
 		}
-		p = p->next;
 	}
 
 	if (!found) {
@@ -355,31 +674,38 @@ inw(uint16_t port)
 	int qfound = 0;
 	uint8_t ret8[2];
 	int i = 0;
-
-	p = io[port];
-	while (p) {
-		if (p->inw) {
-			ret &= p->inw(port, p->priv);
-			found |= 2;
-			qfound++;
-		}
-		p = p->next;
-	}
-
-	ret8[0] = ret & 0xff;
-	ret8[1] = (ret >> 8) & 0xff;
-	for (i = 0; i < 2; i++) {
-		p = io[(port + i) & 0xffff];
+	io_dispatch_t *d = io_dispatch[port];
+
+	if (d && (d->n[IO_INW] != IO_WALK)) {
+		ret = io_dispatch_in(d, IO_INW, port);
+		found = d->found[IO_INW];
+		qfound = d->n[IO_INW];
+	} else {
+		p = io[port];
 		while (p) {
-			if (p->inb && !p->inw) {
-				ret8[i] &= p->inb(port + i, p->priv);
-				found |= 1;
+			if (p->inw) {
+				ret &= p->inw(port, p->priv);
+				found |= 2;
 				qfound++;
 			}
 			p = p->next;
 		}
+
+		ret8[0] = ret & 0xff;
+		ret8[1] = (ret >> 8) & 0xff;
+		for (i = 0; i < 2; i++) {
+			p = io[(port + i) & 0xffff];
+			while (p) {
+				if (p->inb && !p->inw) {
+					ret8[i] &= p->inb(port + i, p->priv);
+					found |= 1;
+					qfound++;
+				}
+				p = p->next;
+			}
+		}
+		ret = (ret8[1] << 8) | ret8[0];
 	}
-	ret = (ret8[1] << 8) | ret8[0];
 
 	if (port & 0x80)
 		amstrad_latch = AMSTRAD_NOLATCH;
@@ -404,27 +730,34 @@ outw(uint16_t port, uint16_t val)
 	int found = 0;
 	int qfound = 0;
 	int i = 0;
-
-	p = io[port];
-	while (p) {
-		if (p->outw) {
-			p->outw(port, val, p->priv);
-			found |= 2;
-			qfound++;
-		}
-		p = p->next;
-	}
-
-	for (i = 0; i < 2; i++) {
-		p = io[(port + i) & 0xffff];
+	io_dispatch_t *d = io_dispatch[port];
+
+	if (d && (d->n[IO_OUTW] != IO_WALK)) {
+		io_dispatch_out(d, IO_OUTW, port, val);
+		found = d->found[IO_OUTW];
+		qfound = d->n[IO_OUTW];
+	} else {
+		p = io[port];
 		while (p) {
-			if (p->outb && !p->outw) {
-				p->outb(port + i, val >> (i << 3), p->priv);
-				found |= 1;
+			if (p->outw) {
+				p->outw(port, val, p->priv);
+				found |= 2;
 				qfound++;
 			}
 			p = p->next;
 		}
+
+		for (i = 0; i < 2; i++) {
+			p = io[(port + i) & 0xffff];
+			while (p) {
+				if (p->outb && !p->outw) {
+					p->outb(port + i, val >> (i << 3), p->priv);
+					found |= 1;
+					qfound++;
+				}
+				p = p->next;
+			}
+		}
 	}
 
 	if (!found) {
@@ -441,6 +774,46 @@ outw(uint16_t port, uint16_t val)
 }
 
 
+int
+inw_string(uint16_t port, uint16_t *buf, int count)
+{
+	io_string_t *s = io_string_handler(port);
+	int ret = 0;
+
+	if (s && s->insw)
+		ret = s->insw(port, buf, count, s->priv);
+
+	if (ret) {
+		if (port & 0x80)
+			amstrad_latch = AMSTRAD_NOLATCH;
+		else if (port & 0x4000)
+			amstrad_latch = AMSTRAD_SW10;
+		else
+			amstrad_latch = AMSTRAD_SW9;
+
+		io_log("[%04X:%08X] (%i) in w(%04X) x %i\n", CS, cpu_state.pc, in_smm, port, ret);
+	}
+
+	return ret;
+}
+
+
+int
+outw_string(uint16_t port, uint16_t *buf, int count)
+{
+	io_string_t *s = io_string_handler(port);
+	int ret = 0;
+
+	if (s && s->outsw)
+		ret = s->outsw(port, buf, count, s->priv);
+
+	if (ret)
+		io_log("[%04X:%08X] (%i) outw(%04X) x %i\n", CS, cpu_state.pc, in_smm, port, ret);
+
+	return ret;
+}
+
+
 uint32_t
 inl(uint16_t port)
 {
@@ -451,48 +824,55 @@ inl(uint16_t port)
 	int found = 0;
 	int qfound = 0;
 	int i = 0;
-
-	p = io[port];
-	while (p) {
-		if (p->inl) {
-			ret &= p->inl(port, p->priv);
-			found |= 4;
-			qfound++;
-		}
-		p = p->next;
-	}
-
-	ret16[0] = ret & 0xffff;
-	ret16[1] = (ret >> 16) & 0xffff;
-	for (i = 0; i < 4; i += 2) {
-		p = io[(port + i) & 0xffff];
+	io_dispatch_t *d = io_dispatch[port];
+
+	if (d && (d->n[IO_INL] != IO_WALK)) {
+		ret = io_dispatch_in(d, IO_INL, port);
+		found = d->found[IO_INL];
+		qfound = d->n[IO_INL];
+	} else {
+		p = io[port];
 		while (p) {
-			if (p->inw && !p->inl) {
-				ret16[i >> 1] &= p->inw(port + i, p->priv);
-				found |= 2;
+			if (p->inl) {
+				ret &= p->inl(port, p->priv);
+				found |= 4;
 				qfound++;
 			}
 			p = p->next;
 		}
-	}
-	ret = (ret16[1] << 16) | ret16[0];
 
-	ret8[0] = ret & 0xff;
-	ret8[1] = (ret >> 8) & 0xff;
-	ret8[2] = (ret >> 16) & 0xff;
-	ret8[3] = (ret >> 24) & 0xff;
-	for (i = 0; i < 4; i++) {
-		p = io[(port + i) & 0xffff];
-		while (p) {
-			if (p->inb && !p->inw && !p->inl) {
-				ret8[i] &= p->inb(port + i, p->priv);
-				found |= 1;
-				qfound++;
+		ret16[0] = ret & 0xffff;
+		ret16[1] = (ret >> 16) & 0xffff;
+		for (i = 0; i < 4; i += 2) {
+			p = io[(port + i) & 0xffff];
+			while (p) {
+				if (p->inw && !p->inl) {
+					ret16[i >> 1] &= p->inw(port + i, p->priv);
+					found |= 2;
+					qfound++;
+				}
+				p = p->next;
+			}
+		}
+		ret = (ret16[1] << 16) | ret16[0];
+
+		ret8[0] = ret & 0xff;
+		ret8[1] = (ret >> 8) & 0xff;
+		ret8[2] = (ret >> 16) & 0xff;
+		ret8[3] = (ret >> 24) & 0xff;
+		for (i = 0; i < 4; i++) {
+			p = io[(port + i) & 0xffff];
+			while (p) {
+				if (p->inb && !p->inw && !p->inl) {
+					ret8[i] &= p->inb(port + i, p->priv);
+					found |= 1;
+					qfound++;
+				}
+				p = p->next;
 			}
-			p = p->next;
 		}
+		ret = (ret8[3] << 24) | (ret8[2] << 16) | (ret8[1] << 8) | ret8[0];
 	}
-	ret = (ret8[3] << 24) | (ret8[2] << 16) | (ret8[1] << 8) | ret8[0];
 
 	if (port & 0x80)
 		amstrad_latch = AMSTRAD_NOLATCH;
@@ -517,40 +897,47 @@ outl(uint16_t port, uint32_t val)
 	int found = 0;
 	int qfound = 0;
 	int i = 0;
-
-	p = io[port];
-	if (p) {
-		while (p) {
-			if (p->outl) {
-				p->outl(port, val, p->priv);
-				found |= 4;
-				qfound++;
+	io_dispatch_t *d = io_dispatch[port];
+
+	if (d && (d->n[IO_OUTL] != IO_WALK)) {
+		io_dispatch_out(d, IO_OUTL, port, val);
+		found = d->found[IO_OUTL];
+		qfound = d->n[IO_OUTL];
+	} else {
+		p = io[port];
+		if (p) {
+			while (p) {
+				if (p->outl) {
+					p->outl(port, val, p->priv);
+					found |= 4;
+					qfound++;
+				}
+				p = p->next;
 			}
-			p = p->next;
 		}
-	}
 
-	for (i = 0; i < 4; i += 2) {
-		p = io[(port + i) & 0xffff];
-		while (p) {
-			if (p->outw && !p->outl) {
-				p->outw(port + i, val >> (i << 3), p->priv);
-				found |= 2;
-				qfound++;
+		for (i = 0; i < 4; i += 2) {
+			p = io[(port + i) & 0xffff];
+			while (p) {
+				if (p->outw && !p->outl) {
+					p->outw(port + i, val >> (i << 3), p->priv);
+					found |= 2;
+					qfound++;
+				}
+				p = p->next;
 			}
-			p = p->next;
 		}
-	}
 
-	for (i = 0; i < 4; i++) {
-		p = io[(port + i) & 0xffff];
-		while (p) {
-			if (p->outb && !p->outw && !p->outl) {
-				p->outb(port + i, val >> (i << 3), p->priv);
-				found |= 1;
-				qfound++;
+		for (i = 0; i < 4; i++) {
+			p = io[(port + i) & 0xffff];
+			while (p) {
+				if (p->outb && !p->outw && !p->outl) {
+					p->outb(port + i, val >> (i << 3), p->priv);
+					found |= 1;
+					qfound++;
+				}
+				p = p->next;
 			}
-			p = p->next;
 		}
 	}
 
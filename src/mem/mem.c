@@ -61,6 +61,9 @@
 #define FIXME			0
 #define DYNAMIC_TABLES		0		/* experimental */
 
+#define TLB_GLOBAL		0x01		/* global page, kept across CR3 loads */
+#define TLB_LARGE		0x02		/* part of a 4M/2M page */
+
 
 mem_mapping_t		base_mapping,
 ram_low_mapping,	/* 0..640K mapping */
@@ -90,13 +93,15 @@ uint32_t		biosmask, biosaddr;
 uint32_t		pccache;
 uint8_t			*pccache2;
 
-int			readlnext;
-int			readlookup[256],
-readlookupp[256];
+int			readlnext[TLB_SETS];
+int			readlookup[TLB_SIZE],
+readlookupp[TLB_SIZE];
+uint8_t			readlookupf[TLB_SIZE];
 uintptr_t		*readlookup2;
-int			writelnext;
-int			writelookup[256],
-writelookupp[256];
+int			writelnext[TLB_SETS];
+int			writelookup[TLB_SIZE],
+writelookupp[TLB_SIZE];
+uint8_t			writelookupf[TLB_SIZE];
 uintptr_t		*writelookup2;
 
 uint32_t		mem_logical_addr;
@@ -105,7 +110,6 @@ int			shadowbios = 0,
 shadowbios_write;
 int			readlnum = 0,
 writelnum = 0;
-int			cachesize = 256;
 
 uint32_t		get_phys_virt,
 get_phys_phys;
@@ -118,6 +122,7 @@ mem_a20_state = 0;
 
 int			mmuflush = 0;
 int			mmu_perm = 4;
+mmu_tlb_stats_t		mmu_tlb_stats;
 
 uint64_t		*byte_dirty_mask;
 uint64_t		*byte_code_present_mask;
@@ -144,6 +149,10 @@ static uint8_t		ff_array[4096];			/* Must be at least one page. */
 static uint8_t		ff_pccache[4] = { 0xff, 0xff, 0xff, 0xff };
 #endif
 
+/* What the last successful page walk was for, see mmu_tlb_set(). */
+static uint32_t		mmu_tlb_vpn = 0xffffffff;
+static int		mmu_tlb_flags;
+
 
 #ifdef ENABLE_MEM_LOG
 int mem_do_log = ENABLE_MEM_LOG;
@@ -192,9 +201,11 @@ resetreadlookup(void)
 #endif
 
 	/* Initialize the tables for lower (<= 1024K) RAM. */
-	for (c = 0; c < 256; c++) {
+	for (c = 0; c < TLB_SIZE; c++) {
 		readlookup[c] = 0xffffffff;
+		readlookupf[c] = 0;
 		writelookup[c] = 0xffffffff;
+		writelookupf[c] = 0;
 	}
 
 	/* Initialize the tables for high (> 1024K) RAM. */
@@ -206,29 +217,64 @@ resetreadlookup(void)
 	memset(writelookup2, 0xff, (1 << 20) * sizeof(uintptr_t));
 #endif
 
-	readlnext = 0;
-	writelnext = 0;
+	memset(readlnext, 0x00, sizeof(readlnext));
+	memset(writelnext, 0x00, sizeof(writelnext));
 	pccache = 0xffffffff;
 }
 
 
-void
-flushmmucache(void)
+/* Drop one read lookup cache entry. */
+static __inline void
+mmu_tlb_drop_read(int c)
+{
+	readlookup2[readlookup[c]] = -1;
+	readlookup[c] = 0xffffffff;
+	readlookupf[c] = 0;
+}
+
+
+/* Drop one write lookup cache entry. */
+static __inline void
+mmu_tlb_drop_write(int c)
+{
+	page_lookup[writelookup[c]] = NULL;
+	writelookup2[writelookup[c]] = -1;
+	writelookup[c] = 0xffffffff;
+	writelookupf[c] = 0;
+}
+
+
+/* Empty the MMU lookup caches, optionally keeping global pages. */
+static void
+mmu_tlb_flush(int keep_global)
 {
 	int c;
 
-	for (c = 0; c < 256; c++) {
+	for (c = 0; c < TLB_SIZE; c++) {
 		if (readlookup[c] != (int)0xffffffff) {
-			readlookup2[readlookup[c]] = -1;
-			readlookup[c] = 0xffffffff;
+			if (keep_global && (readlookupf[c] & TLB_GLOBAL))
+				mmu_tlb_stats.global_kept++;
+			else
+				mmu_tlb_drop_read(c);
 		}
 		if (writelookup[c] != (int)0xffffffff) {
-			page_lookup[writelookup[c]] = NULL;
-			writelookup2[writelookup[c]] = -1;
-			writelookup[c] = 0xffffffff;
+			if (keep_global && (writelookupf[c] & TLB_GLOBAL))
+				mmu_tlb_stats.global_kept++;
+			else
+				mmu_tlb_drop_write(c);
 		}
 	}
+
+	mmu_tlb_vpn = 0xffffffff;
+}
+
+
+void
+flushmmucache(void)
+{
+	mmu_tlb_flush(0);
 	mmuflush++;
+	mmu_tlb_stats.flushes++;
 
 	pccache = (uint32_t)0xffffffff;
 	pccache2 = (uint8_t *)0xffffffff;
@@ -242,38 +288,44 @@ flushmmucache(void)
 void
 flushmmucache_nopc(void)
 {
-	int c;
+	mmu_tlb_flush(0);
+	mmu_tlb_stats.flushes++;
 
-	for (c = 0; c < 256; c++) {
-		if (readlookup[c] != (int)0xffffffff) {
-			readlookup2[readlookup[c]] = -1;
-			readlookup[c] = 0xffffffff;
-		}
-		if (writelookup[c] != (int)0xffffffff) {
-			page_lookup[writelookup[c]] = NULL;
-			writelookup2[writelookup[c]] = -1;
-			writelookup[c] = 0xffffffff;
-		}
-	}
+#ifdef USE_DYNAREC
+	codegen_flush();
+#endif
 }
 
 
 void
 flushmmucache_cr3(void)
 {
-	int c;
+	mmu_tlb_flush(0);
+	mmu_tlb_stats.flushes++;
 
-	for (c = 0; c < 256; c++) {
-		if (readlookup[c] != (int)0xffffffff) {
-			readlookup2[readlookup[c]] = -1;
-			readlookup[c] = 0xffffffff;
-		}
-		if (writelookup[c] != (int)0xffffffff) {
-			page_lookup[writelookup[c]] = NULL;
-			writelookup2[writelookup[c]] = -1;
-			writelookup[c] = 0xffffffff;
-		}
-	}
+#ifdef USE_DYNAREC
+	codegen_flush();
+#endif
+}
+
+
+/*
+* A CR3 load (MOV CR3 or a task switch.)  Like on the real thing,
+* translations of global pages stay valid if CR4.PGE is set.
+*/
+void
+flushmmucache_nonglobal(void)
+{
+	mmu_tlb_flush(1);
+	mmuflush++;
+	mmu_tlb_stats.cr3_flushes++;
+
+	pccache = (uint32_t)0xffffffff;
+	pccache2 = (uint8_t *)0xffffffff;
+
+#ifdef USE_DYNAREC
+	codegen_flush();
+#endif
 }
 
 
@@ -284,7 +336,7 @@ mem_flush_write_page(uint32_t addr, uint32_t virt)
 	int c;
 	uint32_t a;
 
-	for (c = 0; c < 256; c++) {
+	for (c = 0; c < TLB_SIZE; c++) {
 		if (writelookup[c] != (int)0xffffffff) {
 			a = (uintptr_t)(addr & ~0xfff) - (virt & ~0xfff);
 			uintptr_t target;
@@ -294,16 +346,45 @@ mem_flush_write_page(uint32_t addr, uint32_t virt)
 			else
 				target = (uintptr_t)&ram[a];
 
-			if (writelookup2[writelookup[c]] == target || page_lookup[writelookup[c]] == page_target) {
-				writelookup2[writelookup[c]] = -1;
-				page_lookup[writelookup[c]] = NULL;
-				writelookup[c] = 0xffffffff;
-			}
+			if (writelookup2[writelookup[c]] == target || page_lookup[writelookup[c]] == page_target)
+				mmu_tlb_drop_write(c);
 		}
 	}
 }
 
 
+/*
+* Remember what kind of page the last successful walk ended in, so
+* add{read,write}lookup() can tag the entry they create from it.
+*/
+static __inline void
+mmu_tlb_set(uint32_t addr, uint64_t pte, int flags)
+{
+	mmu_tlb_vpn = addr >> 12;
+	mmu_tlb_flags = flags;
+	if ((cr4 & CR4_PGE) && (pte & 0x100))
+		mmu_tlb_flags |= TLB_GLOBAL;
+}
+
+
+/* Flags for a new lookup cache entry for the given virtual page. */
+static __inline int
+mmu_tlb_get_flags(uint32_t virt)
+{
+	if (!(cr0 >> 31))
+		return 0;
+
+	/*
+	 * If this is not what the last walk was for, assume the worst:
+	 * not global, and possibly part of a large page.
+	 */
+	if ((virt >> 12) != mmu_tlb_vpn)
+		return TLB_LARGE;
+
+	return mmu_tlb_flags;
+}
+
+
 #define mmutranslate_read(addr) mmutranslatereal(addr,0)
 #define mmutranslate_write(addr) mmutranslatereal(addr,1)
 #define rammap(x)	((uint32_t *)(_mem_exec[(x) >> MEM_GRANULARITY_BITS]))[((x) >> 2) & MEM_GRANULARITY_QMASK]
@@ -346,6 +427,7 @@ mmutranslatereal_normal(uint32_t addr, int rw)
 		}
 
 		mmu_perm = temp & 4;
+		mmu_tlb_set(addr, temp, TLB_LARGE);
 		rammap(addr2) |= 0x20;
 
 		return (temp & ~0x3fffff) + (addr & 0x3fffff);
@@ -364,6 +446,7 @@ mmutranslatereal_normal(uint32_t addr, int rw)
 	}
 
 	mmu_perm = temp & 4;
+	mmu_tlb_set(addr, temp, 0);
 	rammap(addr2) |= 0x20;
 	rammap((temp2 & ~0xfff) + ((addr >> 10) & 0xffc)) |= (rw ? 0x60 : 0x20);
 
@@ -420,6 +503,7 @@ mmutranslatereal_pae(uint32_t addr, int rw)
 			return 0xffffffffffffffffULL;
 		}
 		mmu_perm = temp & 4;
+		mmu_tlb_set(addr, temp, TLB_LARGE);
 		rammap64(addr3) |= 0x20;
 
 		return ((temp & ~0x1fffffULL) + (addr & 0x1fffffULL)) & 0x000000ffffffffffULL;
@@ -439,6 +523,7 @@ mmutranslatereal_pae(uint32_t addr, int rw)
 	}
 
 	mmu_perm = temp & 4;
+	mmu_tlb_set(addr, temp, 0);
 	rammap64(addr3) |= 0x20;
 	rammap64(addr4) |= (rw ? 0x60 : 0x20);
 
@@ -484,6 +569,7 @@ mmutranslate_noabrt_normal(uint32_t addr, int rw)
 		if (((CPL == 3) && !(temp & 4) && !cpl_override) || (rw && !(temp & 2) && ((CPL == 3) || (cr0 & WP_FLAG))))
 			return 0xffffffffffffffffULL;
 
+		mmu_tlb_set(addr, temp, TLB_LARGE);
 		return (temp & ~0x3fffff) + (addr & 0x3fffff);
 	}
 
@@ -493,6 +579,7 @@ mmutranslate_noabrt_normal(uint32_t addr, int rw)
 	if (!(temp & 1) || ((CPL == 3) && !(temp3 & 4) && !cpl_override) || (rw && !(temp3 & 2) && ((CPL == 3) || (cr0 & WP_FLAG))))
 		return 0xffffffffffffffffULL;
 
+	mmu_tlb_set(addr, temp, 0);
 	return (uint64_t)((temp & ~0xfff) + (addr & 0xfff));
 }
 
@@ -524,6 +611,7 @@ mmutranslate_noabrt_pae(uint32_t addr, int rw)
 		if (((CPL == 3) && !(temp & 4) && !cpl_override) || (rw && !(temp & 2) && ((CPL == 3) || (cr0 & WP_FLAG))))
 			return 0xffffffffffffffffULL;
 
+		mmu_tlb_set(addr, temp, TLB_LARGE);
 		return ((temp & ~0x1fffffULL) + (addr & 0x1fffff)) & 0x000000ffffffffffULL;
 	}
 
@@ -534,6 +622,7 @@ mmutranslate_noabrt_pae(uint32_t addr, int rw)
 	if (!(temp & 1) || ((CPL == 3) && !(temp3 & 4) && !cpl_override) || (rw && !(temp3 & 2) && ((CPL == 3) || (cr0 & WP_FLAG))))
 		return 0xffffffffffffffffULL;
 
+	mmu_tlb_set(addr, temp, 0);
 	return ((temp & ~0xfffULL) + ((uint64_t)(addr & 0xfff))) & 0x000000ffffffffffULL;
 }
 
@@ -548,10 +637,33 @@ mmutranslate_noabrt(uint32_t addr, int rw)
 }
 
 
+/* INVLPG: only drop what could map the given address. */
 void
 mmu_invalidate(uint32_t addr)
 {
-	flushmmucache_cr3();
+	int vpn = addr >> 12;
+	int c;
+
+	for (c = 0; c < TLB_SIZE; c++) {
+		if ((readlookup[c] != (int)0xffffffff) &&
+		    ((readlookup[c] == vpn) || ((readlookupf[c] & TLB_LARGE) && (((readlookup[c] ^ vpn) >> 10) == 0))))
+			mmu_tlb_drop_read(c);
+		if ((writelookup[c] != (int)0xffffffff) &&
+		    ((writelookup[c] == vpn) || ((writelookupf[c] & TLB_LARGE) && (((writelookup[c] ^ vpn) >> 10) == 0))))
+			mmu_tlb_drop_write(c);
+	}
+
+	if (mmu_tlb_vpn == (addr >> 12))
+		mmu_tlb_vpn = 0xffffffff;
+
+	pccache = (uint32_t)0xffffffff;
+	pccache2 = (uint8_t *)0xffffffff;
+
+	mmu_tlb_stats.invlpg++;
+
+#ifdef USE_DYNAREC
+	codegen_flush();
+#endif
 }
 
 
@@ -576,17 +688,40 @@ mem_addr_translate(uint32_t addr, uint32_t chunk_start, uint32_t len)
 }
 
 
+/* Pick the entry of the set for virtual page vpn to (re)use. */
+static __inline int
+mmu_tlb_alloc(int *lookup, int *next, uint32_t vpn)
+{
+	int set = vpn & (TLB_SETS - 1);
+	int c = set * TLB_WAYS;
+	int w;
+
+	for (w = 0; w < TLB_WAYS; w++) {
+		if (lookup[c + w] == (int)0xffffffff)
+			return c + w;
+	}
+
+	/* Set full, evict round-robin. */
+	w = next[set];
+	next[set] = (w + 1) & (TLB_WAYS - 1);
+
+	return c + w;
+}
+
+
 void
 addreadlookup(uint32_t virt, uint32_t phys)
 {
 	uint32_t a;
+	int c;
 
 	if (virt == 0xffffffff) return;
 
 	if (readlookup2[virt >> 12] != (uintptr_t)-1) return;
 
-	if (readlookup[readlnext] != (int)0xffffffff)
-		readlookup2[readlookup[readlnext]] = -1;
+	c = mmu_tlb_alloc(readlookup, readlnext, virt >> 12);
+	if (readlookup[c] != (int)0xffffffff)
+		mmu_tlb_drop_read(c);
 
 	a = (uintptr_t)(phys & ~0xfff) - (uintptr_t)(virt & ~0xfff);
 
@@ -595,9 +730,10 @@ addreadlookup(uint32_t virt, uint32_t phys)
 	else
 		readlookup2[virt >> 12] = (uintptr_t)&ram[a];
 
-	readlookupp[readlnext] = mmu_perm;
-	readlookup[readlnext++] = virt >> 12;
-	readlnext &= (cachesize - 1);
+	readlookupp[c] = mmu_perm;
+	readlookupf[c] = mmu_tlb_get_flags(virt);
+	readlookup[c] = virt >> 12;
+	mmu_tlb_stats.misses++;
 
 	/* Speed settings: */
 	/*  -       Speed 1:   9 */
@@ -613,15 +749,15 @@ void
 addwritelookup(uint32_t virt, uint32_t phys)
 {
 	uint32_t a;
+	int c;
 
 	if (virt == 0xffffffff) return;
 
 	if (page_lookup[virt >> 12]) return;
 
-	if (writelookup[writelnext] != -1) {
-		page_lookup[writelookup[writelnext]] = NULL;
-		writelookup2[writelookup[writelnext]] = -1;
-	}
+	c = mmu_tlb_alloc(writelookup, writelnext, virt >> 12);
+	if (writelookup[c] != -1)
+		mmu_tlb_drop_write(c);
 
 #ifdef USE_NEW_DYNAREC
 #ifdef USE_DYNAREC
@@ -646,9 +782,10 @@ addwritelookup(uint32_t virt, uint32_t phys)
 			writelookup2[virt >> 12] = (uintptr_t)&ram[a];
 	}
 
-	writelookupp[writelnext] = mmu_perm;
-	writelookup[writelnext++] = virt >> 12;
-	writelnext &= (cachesize - 1);
+	writelookupp[c] = mmu_perm;
+	writelookupf[c] = mmu_tlb_get_flags(virt);
+	writelookup[c] = virt >> 12;
+	mmu_tlb_stats.misses++;
 
 	/* Speed settings: */
 	/*  -       Speed 1:   9 */
@@ -1979,6 +2116,145 @@ mem_write_smraml(uint32_t addr, uint32_t val, void *priv)
 }
 
 
+/* Copy a run of bytes that lies within a single RAM page, marking the
+   16/64-byte lines that actually change as dirty, the same way the
+   per-access page write handlers above do. */
+static void
+mem_write_ram_block_page(uint32_t addr, const uint8_t *src, uint32_t len, page_t *p)
+{
+	uint32_t off = addr & 0xfff, end = off + len, next, l;
+
+	if ((p == NULL) || (p->mem == NULL) || (p->mem == page_ff))
+		return;
+
+	while (off < end) {
+		next = (off | ((1 << PAGE_MASK_SHIFT) - 1)) + 1;
+		if (next > end)
+			next = end;
+		l = next - off;
+
+#ifdef USE_DYNAREC
+		if (memcmp(&p->mem[off], src, l) || codegen_in_recompile) {
+#else
+		if (memcmp(&p->mem[off], src, l)) {
+#endif
+			uint64_t mask = (uint64_t)1 << ((off >> PAGE_MASK_SHIFT) & PAGE_MASK_MASK);
+#ifdef USE_NEW_DYNAREC
+			int byte_offset = (off >> PAGE_BYTE_MASK_SHIFT) & PAGE_BYTE_MASK_OFFSET_MASK;
+			uint64_t byte_mask = (l == 64) ? 0xffffffffffffffffULL :
+					     ((((uint64_t)1 << l) - 1) << (off & PAGE_BYTE_MASK_MASK));
+
+			memcpy(&p->mem[off], src, l);
+			p->dirty_mask |= mask;
+			p->byte_dirty_mask[byte_offset] |= byte_mask;
+			if (!page_in_evict_list(p) && ((p->code_present_mask & mask) || (p->byte_code_present_mask[byte_offset] & byte_mask)))
+				page_add_to_evict_list(p);
+#else
+			memcpy(&p->mem[off], src, l);
+			p->dirty_mask[(off >> PAGE_MASK_INDEX_SHIFT) & PAGE_MASK_INDEX_MASK] |= mask;
+#endif
+		}
+
+		src += l;
+		off = next;
+	}
+}
+
+
+/* Host pointer to the physical address if it is backed by plain RAM for
+   reads, NULL if it has to go through the mapping's handlers. */
+static uint8_t *
+mem_read_ram_ptr(uint32_t addr)
+{
+	mem_mapping_t *map = read_mapping[addr >> MEM_GRANULARITY_BITS];
+
+	if (use_phys_exec && _mem_exec[addr >> MEM_GRANULARITY_BITS])
+		return &(_mem_exec[addr >> MEM_GRANULARITY_BITS][addr & MEM_GRANULARITY_MASK]);
+	else if (map && (map->read_b == mem_read_ram))
+		return &(ram[addr]);
+	else if (map && (map->read_b == mem_read_ram_2gb))
+		return &(ram2[addr - (1 << 30)]);
+
+	return NULL;
+}
+
+
+/* Bulk physical read for bus masters. Runs that are backed by plain RAM
+   are copied a granularity block at a time, anything else (MMIO, ROM,
+   SMRAM, unmapped space) goes through mem_read_phys() one transfer_size
+   unit at a time exactly as before. len must be a multiple of
+   transfer_size. */
+void
+mem_read_phys_block(void *dest, uint32_t addr, uint32_t len, int transfer_size)
+{
+	uint8_t *d = (uint8_t *)dest, *p;
+	uint32_t run;
+
+	mem_logical_addr = 0xffffffff;
+
+	while (len) {
+		run = MEM_GRANULARITY_SIZE - (addr & MEM_GRANULARITY_MASK);
+		if (run > len)
+			run = len;
+		run &= ~(transfer_size - 1);
+
+		p = run ? mem_read_ram_ptr(addr) : NULL;
+		if (p)
+			memcpy(d, p, run);
+		else {
+			run = transfer_size;
+			mem_read_phys(d, addr, transfer_size);
+		}
+
+		d += run;
+		addr += run;
+		len -= run;
+	}
+}
+
+
+/* Bulk physical write for bus masters, see mem_read_phys_block(). RAM
+   runs still feed the dynarec's dirty masks, per line instead of per
+   access. */
+void
+mem_write_phys_block(const void *src, uint32_t addr, uint32_t len, int transfer_size)
+{
+	const uint8_t *s = (const uint8_t *)src;
+	mem_mapping_t *map;
+	uint32_t run, l, i;
+
+	mem_logical_addr = 0xffffffff;
+
+	while (len) {
+		map = write_mapping[addr >> MEM_GRANULARITY_BITS];
+
+		run = MEM_GRANULARITY_SIZE - (addr & MEM_GRANULARITY_MASK);
+		if (run > len)
+			run = len;
+		run &= ~(transfer_size - 1);
+
+		if (run && use_phys_exec && _mem_exec[addr >> MEM_GRANULARITY_BITS])
+			memcpy(&(_mem_exec[addr >> MEM_GRANULARITY_BITS][addr & MEM_GRANULARITY_MASK]), s, run);
+		else if (run && map && (map->write_b == mem_write_ram)) {
+			for (i = 0; i < run; i += l) {
+				l = 0x1000 - ((addr + i) & 0xfff);
+				if (l > (run - i))
+					l = run - i;
+				mem_write_ram_block_page(addr + i, s + i, l, &pages[(addr + i) >> 12]);
+			}
+		}
+		else {
+			run = transfer_size;
+			mem_write_phys((void *)s, addr, transfer_size);
+		}
+
+		s += run;
+		addr += run;
+		len -= run;
+	}
+}
+
+
 static uint8_t
 mem_read_remapped(uint32_t addr, void *priv)
 {
@@ -106,8 +106,10 @@ struct pcap_if {
 static volatile void		*pcap_handle;	/* handle to WinPcap DLL */
 static volatile void		*pcap;		/* handle to WinPcap library */
 static volatile thread_t	*poll_tid;
+static volatile thread_t	*rx_tid;
 static const netcard_t		*poll_card;	/* netcard linked to us */
 static event_t			*poll_state;
+static event_t			*rx_state;
 
 
 /* Pointers to the real functions. */
@@ -156,73 +158,73 @@ pcap_log(const char *fmt, ...)
 #endif
 
 
-/* Handle the receiving of frames from the channel. */
+/*
+ * Handle the receiving of frames from the channel.
+ *
+ * This blocks in the driver until a frame arrives, so it runs on
+ * its own thread, apart from the one that transmits.
+ */
 static void
-poll_thread(void *arg)
+rx_thread(void *arg)
 {
     uint8_t *mac = (uint8_t *)arg;
     uint8_t *data = NULL;
+    void *pc = (void *)pcap;
     struct pcap_pkthdr h;
     uint32_t mac_cmp32[2];
     uint16_t mac_cmp16[2];
-    event_t *evt;
-    int tx;
 
-    pcap_log("PCAP: polling started.\n");
-    thread_set_event(poll_state);
-
-    /* Create a waitable event. */
-    evt = thread_create_event();
+    pcap_log("PCAP: receiving started.\n");
+    thread_set_event(rx_state);
 
     /* As long as the channel is open.. */
     while (pcap != NULL) {
-	/* Request ownership of the device. */
-	network_wait(1);
+	/* Wait for the emulation thread to make room in the ring. */
+	if (! network_rx_queue_space()) {
+		network_rx_wait();
+		continue;
+	}
 
-	/* Wait for a poll request. */
-	network_poll();
+	/* Wait for a frame, or for the read timeout to expire. */
+	data = (uint8_t *)f_pcap_next(pc, &h);
+	if (data == NULL)
+		continue;
 
-	if (pcap == NULL)
-		break;
+	/* Received MAC. */
+	mac_cmp32[0] = *(uint32_t *)(data+6);
+	mac_cmp16[0] = *(uint16_t *)(data+10);
 
-	/* Wait for the next packet to arrive. */
-	tx = network_tx_queue_check();
-	if (network_get_wait() || (poll_card->set_link_state && poll_card->set_link_state(poll_card->priv)) || (poll_card->wait && poll_card->wait(poll_card->priv)))
-		data = NULL;
-	else
-		data = (uint8_t *)f_pcap_next((void *)pcap, &h);
-	if (data != NULL) {
-		/* Received MAC. */
-		mac_cmp32[0] = *(uint32_t *)(data+6);
-		mac_cmp16[0] = *(uint16_t *)(data+10);
-
-		/* Local MAC. */
-		mac_cmp32[1] = *(uint32_t *)mac;
-		mac_cmp16[1] = *(uint16_t *)(mac+4);
-		if ((mac_cmp32[0] != mac_cmp32[1]) ||
-		    (mac_cmp16[0] != mac_cmp16[1])) {
-
-			network_queue_put(0, poll_card->priv, data, h.caplen);
-		} else {
-			/* Mark as invalid packet. */
-			data = NULL;
-		}
+	/* Local MAC. */
+	mac_cmp32[1] = *(uint32_t *)mac;
+	mac_cmp16[1] = *(uint16_t *)(mac+4);
+	if ((mac_cmp32[0] != mac_cmp32[1]) ||
+	    (mac_cmp16[0] != mac_cmp16[1])) {
+
+		network_queue_put(0, poll_card->priv, data, h.caplen);
 	}
+    }
 
-	if (tx)
-		network_do_tx();
+    pcap_log("PCAP: receiving stopped.\n");
+    thread_set_event(rx_state);
+}
 
-	/* If we did not get anything, wait a while. */
-	if ((data == NULL) && !tx)
-		thread_wait_event(evt, 10);
 
-	/* Release ownership of the device. */
-	network_wait(0);
-    }
+/* Handle the sending of frames to the channel. */
+static void
+poll_thread(void *arg)
+{
+    pcap_log("PCAP: polling started.\n");
+    thread_set_event(poll_state);
 
-    /* No longer needed. */
-    if (evt != NULL)
-	thread_destroy_event(evt);
+    /* As long as the channel is open.. */
+    while (pcap != NULL) {
+	/* Send everything the guest has queued up. */
+	while (network_tx_queue_check())
+		network_do_tx();
+
+	/* Sleep until there is more. */
+	network_poll();
+    }
 
     pcap_log("PCAP: polling stopped.\n");
     thread_set_event(poll_state);
@@ -313,6 +315,8 @@ net_pcap_init(void)
 
     poll_tid = NULL;
     poll_state = NULL;
+    rx_tid = NULL;
+    rx_state = NULL;
     poll_card = NULL;
 
     return(0);
@@ -334,7 +338,7 @@ net_pcap_close(void)
 
     /* Tell the thread to terminate. */
     if (poll_tid != NULL) {
-	network_busy(0);
+	network_wake();
 
 	/* Wait for the thread to finish. */
 	pcap_log("PCAP: waiting for thread to end...\n");
@@ -344,9 +348,20 @@ net_pcap_close(void)
 
 	poll_tid = NULL;
 	poll_state = NULL;
-	poll_card = NULL;
     }
 
+    /* The receiver notices within one read timeout. */
+    if (rx_tid != NULL) {
+	pcap_log("PCAP: waiting for receiver to end...\n");
+	thread_wait_event(rx_state, -1);
+	pcap_log("PCAP: receiver ended\n");
+	thread_destroy_event(rx_state);
+
+	rx_tid = NULL;
+	rx_state = NULL;
+    }
+    poll_card = NULL;
+
     /* OK, now shut down Pcap itself. */
     f_pcap_close(pc);
     pcap = NULL;
@@ -409,6 +424,10 @@ net_pcap_reset(const netcard_t *card, uint8_t *mac)
     poll_tid = thread_create(poll_thread, mac);
     thread_wait_event(poll_state, -1);
 
+    rx_state = thread_create_event();
+    rx_tid = thread_create(rx_thread, mac);
+    thread_wait_event(rx_state, -1);
+
     return(0);
 }
 
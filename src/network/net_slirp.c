@@ -63,6 +63,8 @@ static volatile queueADT	slirpq;		/* SLiRP library handle */
 static volatile thread_t	*poll_tid;
 static const netcard_t		*poll_card;	/* netcard attached to us */
 static event_t			*poll_state;
+static int			wake_sock = -1;	/* poked by net_slirp_wake() */
+static struct sockaddr_in	wake_addr;
 
 
 #ifdef ENABLE_SLIRP_LOG
@@ -85,12 +87,53 @@ slirp_log(const char *fmt, ...)
 #endif
 
 
+/*
+ * Create the loopback datagram socket that network_wake() uses to
+ * interrupt the poll thread while it sleeps in select().
+ */
+static int
+slirp_wake_open(void)
+{
+    socklen_t len = sizeof(wake_addr);
+
+    wake_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (wake_sock < 0)
+	return(-1);
+
+    memset(&wake_addr, 0x00, sizeof(wake_addr));
+    wake_addr.sin_family = AF_INET;
+    wake_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    wake_addr.sin_port = 0;
+    if ((bind(wake_sock, (struct sockaddr *)&wake_addr, sizeof(wake_addr)) < 0) ||
+	(getsockname(wake_sock, (struct sockaddr *)&wake_addr, &len) < 0)) {
+	closesocket(wake_sock);
+	wake_sock = -1;
+	return(-1);
+    }
+    fd_nonblock(wake_sock);
+
+    return(0);
+}
+
+
 static void
-slirp_tic(void)
+slirp_wake_close(void)
+{
+    if (wake_sock < 0)
+	return;
+
+    closesocket(wake_sock);
+    wake_sock = -1;
+}
+
+
+static void
+slirp_tic(int idle)
 {
     int ret2, nfds;
-    struct timeval tv;
+    struct timeval tv, *tvp;
     fd_set rfds, wfds, xfds;
+    char buf[16];
     int tmo;
 
     /* Let SLiRP create a list of all open sockets. */
@@ -99,18 +142,39 @@ slirp_tic(void)
     FD_ZERO(&wfds);
     FD_ZERO(&xfds);
     tmo = slirp_select_fill(&nfds, &rfds, &wfds, &xfds); /* this can crash */
-    if (tmo < 0)
-	tmo = 500;
 
-    tv.tv_sec = 0;
-    tv.tv_usec = tmo;
+    /* Also wake up when network_wake() pokes us. */
+    FD_SET(wake_sock, &rfds);
+    if (wake_sock > nfds)
+	nfds = wake_sock;
+
+    /*
+     * Sleep until a socket has something for us, we are poked, or
+     * SLiRP's next timer is due; with no timer pending, there is no
+     * need to wake up at all.  If the last pass did any work, there
+     * may be more already, so just check without sleeping.
+     */
+    if (!idle)
+	tmo = 0;
+    if (tmo < 0)
+	tvp = NULL;
+    else {
+	tv.tv_sec = tmo / 1000000;
+	tv.tv_usec = tmo % 1000000;
+	tvp = &tv;
+    }
 
-    /* Now wait for something to happen, or at most 'tmo' usec. */
-    ret2 = select(nfds+1, &rfds, &wfds, &xfds, &tv);
+    ret2 = select(nfds+1, &rfds, &wfds, &xfds, tvp);
 
     /* If something happened, let SLiRP handle it. */
-    if (ret2 >= 0)
+    if (ret2 >= 0) {
+	if (FD_ISSET(wake_sock, &rfds)) {
+		while (recv(wake_sock, buf, sizeof(buf), 0) > 0)
+			;
+	}
+
 	slirp_select_poll(&rfds, &wfds, &xfds);
+    }
 }
 
 
@@ -122,34 +186,22 @@ poll_thread(void *arg)
     struct queuepacket *qp;
     uint32_t mac_cmp32[2];
     uint16_t mac_cmp16[2];
-    event_t *evt;
     int data_valid = 0;
-    int tx;
+    int tx = 0;
 
     slirp_log("SLiRP: polling started.\n");
     thread_set_event(poll_state);
 
-    /* Create a waitable event. */
-    evt = thread_create_event();
-
     while (slirpq != NULL) {
-	/* Request ownership of the queue. */
-	network_wait(1);
-
-	/* Wait for a poll request. */
-	network_poll();
-
-	/* See if there is any work. */
-	slirp_tic();
+	/* See if there is any work, sleeping until there is if we're idle. */
+	slirp_tic(!data_valid && !tx);
 
 	/* Our queue may have been nuked.. */
 	if (slirpq == NULL) break;
 
-	/* Wait for the next packet to arrive. */
-	tx = network_tx_queue_check();
+	/* Move whatever SLiRP has for us into the receive ring. */
 	data_valid = 0;
-
-	if ((!network_get_wait() && !(poll_card->set_link_state && poll_card->set_link_state(poll_card->priv)) && !(poll_card->wait && poll_card->wait(poll_card->priv))) && (QueuePeek(slirpq) != 0)) {
+	while ((QueuePeek(slirpq) != 0) && network_rx_queue_space()) {
 		/* Grab a packet from the queue. */
 		qp = QueueDelete(slirpq);
 		slirp_log("SLiRP: inQ:%d  got a %dbyte packet @%08lx\n",
@@ -165,29 +217,21 @@ poll_thread(void *arg)
 		if ((mac_cmp32[0] != mac_cmp32[1]) ||
 		    (mac_cmp16[0] != mac_cmp16[1])) {
 
-			network_queue_put(0, poll_card->priv, (uint8_t *)qp->data, qp->len);
-			data_valid = 1;
+			data_valid |= network_queue_put(0, poll_card->priv, (uint8_t *)qp->data, qp->len);
 		}
 
 		/* Done with this one. */
 		free(qp);
 	}
 
-	if (tx)
+	/* Send everything the guest has queued up. */
+	tx = 0;
+	while (network_tx_queue_check()) {
 		network_do_tx();
-
-	/* If we did not get anything, wait a while. */
-	if (!data_valid && !tx)
-		thread_wait_event(evt, 10);
-
-	/* Release ownership of the queue. */
-	network_wait(0);
+		tx = 1;
+	}
     }
 
-    /* No longer needed. */
-    if (evt != NULL)
-	thread_destroy_event(evt);
-
     slirp_log("SLiRP: polling stopped.\n");
     thread_set_event(poll_state);
 }
@@ -204,6 +248,12 @@ net_slirp_init(void)
 	return(-1);
     }
 
+    if (slirp_wake_open() != 0) {
+	slirp_log("SLiRP could not create its wake-up socket!\n");
+	slirp_exit(0);
+	return(-1);
+    }
+
     slirpq = QueueCreate();
 
     poll_tid = NULL;
@@ -224,6 +274,13 @@ net_slirp_reset(const netcard_t *card, uint8_t *mac)
     slirp_log("SLiRP: creating thread..\n");
     poll_state = thread_create_event();
     poll_tid = thread_create(poll_thread, mac);
+    if (poll_tid == NULL) {
+	/* net_slirp_close() still tears down SLiRP and the wake socket. */
+	slirp_log("SLiRP could not create its thread!\n");
+	thread_destroy_event(poll_state);
+	poll_state = NULL;
+	return(-1);
+    }
     thread_wait_event(poll_state, -1);
 
     return(0);
@@ -245,7 +302,7 @@ net_slirp_close(void)
 
     /* Tell the thread to terminate. */
     if (poll_tid != NULL) {
-	network_busy(0);
+	network_wake();
 
 	/* Wait for the thread to finish. */
 	slirp_log("SLiRP: waiting for thread to end...\n");
@@ -260,10 +317,24 @@ net_slirp_close(void)
 
     /* OK, now shut down SLiRP itself. */
     QueueDestroy(sl);
+    slirp_wake_close();
     slirp_exit(0);
 }
 
 
+/* Interrupt the poll thread's select(). */
+void
+net_slirp_wake(void)
+{
+    char c = 0;
+
+    if (wake_sock < 0)
+	return;
+
+    sendto(wake_sock, &c, 1, 0, (struct sockaddr *)&wake_addr, sizeof(wake_addr));
+}
+
+
 /* Send a packet to the SLiRP interface. */
 void
 net_slirp_in(uint8_t *pkt, int pkt_len)
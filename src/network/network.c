@@ -49,6 +49,7 @@
 * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -67,6 +68,28 @@
 #include <86box/net_wd8003.h>
 
 
+#define NET_QUEUE_LEN	16		/* frames per ring, power of 2 */
+#define NET_QUEUE_MASK	(NET_QUEUE_LEN - 1)
+#define NET_RX_BATCH	8		/* max frames handed to the card per tick */
+#define NET_TX_WAIT	1		/* ms network_tx waits for room before dropping */
+
+
+/*
+* Single-producer, single-consumer ring of frames.  The RX ring is
+* filled by the provider's poll thread and drained by the emulation
+* thread, the TX ring the other way around.  Each index is written by
+* one side only, so no locking is needed; the producer publishes a
+* frame with a release store of write_idx, and the consumer hands the
+* slot back with a release store of read_idx, each paired with an
+* acquire load on the other side.
+*/
+typedef struct {
+	atomic_uint		read_idx,
+				write_idx;
+	netpkt_t		pkts[NET_QUEUE_LEN];
+} netqueue_t;
+
+
 static netcard_t net_cards[] = {
 	{ "None",				"none",		NULL,
 	NULL },
@@ -123,17 +146,13 @@ static volatile int	net_wait = 0;
 static mutex_t		*network_mutex;
 static uint8_t		*network_mac;
 static pc_timer_t	network_rx_queue_timer;
-static netpkt_t		*first_pkt[2] = { NULL, NULL },
-*last_pkt[2] = { NULL, NULL };
+static netqueue_t	*net_queues[2] = { NULL, NULL };
 
 
 static struct {
-	volatile int	busy,
-		queue_in_use;
-
 	event_t		*wake_poll_thread,
-		*poll_complete,
-		*queue_not_in_use;
+			*rx_room,
+			*tx_room;
 } poll_data;
 
 
@@ -167,30 +186,37 @@ network_wait(uint8_t wait)
 }
 
 
+/*
+* Put the provider's poll thread to sleep until there is work for it:
+* a frame to transmit, room in the receive ring, or a shutdown.
+*/
 void
 network_poll(void)
 {
-	while (poll_data.busy)
-		thread_wait_event(poll_data.wake_poll_thread, -1);
-
+	thread_wait_event(poll_data.wake_poll_thread, -1);
 	thread_reset_event(poll_data.wake_poll_thread);
 }
 
 
+/* Put a provider's receive thread to sleep until the receive ring has room. */
 void
-network_busy(uint8_t set)
+network_rx_wait(void)
 {
-	poll_data.busy = !!set;
-
-	if (!set)
-		thread_set_event(poll_data.wake_poll_thread);
+	thread_wait_event(poll_data.rx_room, -1);
+	thread_reset_event(poll_data.rx_room);
 }
 
 
 void
-network_end(void)
+network_wake(void)
 {
-	thread_set_event(poll_data.poll_complete);
+	if (poll_data.wake_poll_thread != NULL)
+		thread_set_event(poll_data.wake_poll_thread);
+	if (poll_data.rx_room != NULL)
+		thread_set_event(poll_data.rx_room);
+
+	/* SLiRP sleeps in select(), so it has to be poked through a socket. */
+	net_slirp_wake();
 }
 
 
@@ -222,94 +248,132 @@ network_init(void)
 }
 
 
-void
+/*
+* Queue a frame on the receive (tx=0) or transmit (tx=1) ring.
+*
+* Each ring has exactly one producer and one consumer thread, so
+* this must only be called by the producing side.  Returns 0 if
+* the ring was full and the frame had to be dropped.
+*/
+int
 network_queue_put(int tx, void *priv, uint8_t *data, int len)
 {
-	netpkt_t *temp;
-
-	temp = (netpkt_t *)malloc(sizeof(netpkt_t));
-	memset(temp, 0, sizeof(netpkt_t));
-	temp->priv = priv;
-	memcpy(temp->data, data, len);
-	temp->len = len;
-	temp->prev = last_pkt[tx];
-	temp->next = NULL;
-
-	if (last_pkt[tx] != NULL)
-		last_pkt[tx]->next = temp;
-	last_pkt[tx] = temp;
-
-	if (first_pkt[tx] == NULL)
-		first_pkt[tx] = temp;
+	netqueue_t *q = net_queues[tx];
+	netpkt_t *pkt;
+	uint32_t w;
+
+	if ((q == NULL) || (len <= 0) || (len > (int)sizeof(pkt->data)))
+		return 0;
+
+	w = atomic_load_explicit(&q->write_idx, memory_order_relaxed);
+	if ((w - atomic_load_explicit(&q->read_idx, memory_order_acquire)) >= NET_QUEUE_LEN) {
+		network_log("NETWORK: %s queue full, dropping %d byte frame\n",
+			tx ? "TX" : "RX", len);
+		return 0;
+	}
+
+	pkt = &q->pkts[w & NET_QUEUE_MASK];
+	pkt->priv = priv;
+	memcpy(pkt->data, data, len);
+	pkt->len = len;
+
+	/* Only now may the consumer see the frame. */
+	atomic_store_explicit(&q->write_idx, w + 1, memory_order_release);
+
+	return 1;
 }
 
 
-static void
-network_queue_get(int tx, netpkt_t **pkt)
+static netpkt_t *
+network_queue_get(int tx)
 {
-	if (first_pkt[tx] == NULL)
-		*pkt = NULL;
-	else
-		*pkt = first_pkt[tx];
+	netqueue_t *q = net_queues[tx];
+	uint32_t r;
+
+	if (q == NULL)
+		return NULL;
+
+	r = atomic_load_explicit(&q->read_idx, memory_order_relaxed);
+	if (r == atomic_load_explicit(&q->write_idx, memory_order_acquire))
+		return NULL;
+
+	return &q->pkts[r & NET_QUEUE_MASK];
 }
 
 
 static void
 network_queue_advance(int tx)
 {
-	netpkt_t *temp;
-
-	temp = first_pkt[tx];
+	netqueue_t *q = net_queues[tx];
+	uint32_t r;
 
-	if (temp == NULL)
+	if (q == NULL)
 		return;
 
-	first_pkt[tx] = temp->next;
-	free(temp);
+	/* The slot is done with, so hand it back to the producer. */
+	r = atomic_load_explicit(&q->read_idx, memory_order_relaxed);
+	if (r != atomic_load_explicit(&q->write_idx, memory_order_acquire))
+		atomic_store_explicit(&q->read_idx, r + 1, memory_order_release);
+}
+
+
+static int
+network_queue_full(int tx)
+{
+	netqueue_t *q = net_queues[tx];
 
-	if (first_pkt[tx] == NULL)
-		last_pkt[tx] = NULL;
+	return ((q != NULL) &&
+		((atomic_load_explicit(&q->write_idx, memory_order_relaxed) -
+		  atomic_load_explicit(&q->read_idx, memory_order_acquire)) >= NET_QUEUE_LEN));
 }
 
 
 static void
 network_queue_clear(int tx)
 {
-	netpkt_t *temp = first_pkt[tx], *temp2;
-
-	if (temp == NULL)
+	if (net_queues[tx] == NULL)
 		return;
 
-	do {
-		temp2 = temp->next;
-		free(temp);
-		temp = temp2;
-	} while (temp != NULL);
-
-	first_pkt[tx] = last_pkt[tx] = NULL;
+	free(net_queues[tx]);
+	net_queues[tx] = NULL;
 }
 
 
 static void
 network_rx_queue(void *priv)
 {
-	netpkt_t *pkt = NULL;
+	netcard_t *card = &net_cards[network_card];
+	netpkt_t *pkt;
+	double len = 0.0;
+	int n;
+
+	/*
+	 * Hand the card as many frames as it will take in one go, rather
+	 * than one per tick; the tick is then stretched to the wire time
+	 * of everything that was delivered.
+	 */
+	for (n = 0; n < NET_RX_BATCH; n++) {
+		pkt = network_queue_get(0);
+		if (pkt == NULL)
+			break;
 
-	network_busy(1);
+		if (net_wait || (card->set_link_state && card->set_link_state(card->priv)) ||
+		    (card->wait && card->wait(card->priv)))
+			break;
 
-	network_queue_get(0, &pkt);
-	if ((pkt != NULL) && (pkt->len > 0)) {
-		net_cards[network_card].rx(pkt->priv, pkt->data, pkt->len);
-		if (pkt->len >= 128)
-			timer_on_auto(&network_rx_queue_timer, 0.762939453125 * 2.0 * ((double)pkt->len));
-		else
-			timer_on_auto(&network_rx_queue_timer, 0.762939453125 * 2.0 * 128.0);
+		card->rx(pkt->priv, pkt->data, pkt->len);
+		len += (pkt->len >= 128) ? (double)pkt->len : 128.0;
+
+		network_queue_advance(0);
 	}
-	else
-		timer_on_auto(&network_rx_queue_timer, 0.762939453125 * 2.0 * 128.0);
-	network_queue_advance(0);
 
-	network_busy(0);
+	/* We made room in the ring, let the poll thread refill it. */
+	if (n > 0)
+		network_wake();
+
+	if (len == 0.0)
+		len = 128.0;
+	timer_on_auto(&network_rx_queue_timer, 0.762939453125 * 2.0 * len);
 }
 
 
@@ -336,7 +400,8 @@ network_attach(void *dev, uint8_t *mac, NETRXCB rx, NETWAITCB wait, NETSETLINKST
 
 	/* Create the network events. */
 	poll_data.wake_poll_thread = thread_create_event();
-	poll_data.poll_complete = thread_create_event();
+	poll_data.rx_room = thread_create_event();
+	poll_data.tx_room = thread_create_event();
 
 	/* Activate the platform module. */
 	switch (network_type) {
@@ -349,8 +414,6 @@ network_attach(void *dev, uint8_t *mac, NETRXCB rx, NETWAITCB wait, NETSETLINKST
 		break;
 	}
 
-	first_pkt[0] = first_pkt[1] = NULL;
-	last_pkt[0] = last_pkt[1] = NULL;
 	memset(&network_rx_queue_timer, 0x00, sizeof(pc_timer_t));
 	timer_add(&network_rx_queue_timer, network_rx_queue, NULL, 0);
 	/* 10 mbps. */
@@ -378,9 +441,13 @@ network_close(void)
 		thread_destroy_event(poll_data.wake_poll_thread);
 		poll_data.wake_poll_thread = NULL;
 	}
-	if (poll_data.poll_complete != NULL) {
-		thread_destroy_event(poll_data.poll_complete);
-		poll_data.poll_complete = NULL;
+	if (poll_data.rx_room != NULL) {
+		thread_destroy_event(poll_data.rx_room);
+		poll_data.rx_room = NULL;
+	}
+	if (poll_data.tx_room != NULL) {
+		thread_destroy_event(poll_data.tx_room);
+		poll_data.tx_room = NULL;
 	}
 
 	/* Close the network thread mutex. */
@@ -426,6 +493,10 @@ network_reset(void)
 
 	network_mutex = thread_create_mutex();
 
+	/* Preallocate the packet rings, so nothing is malloc'ed per frame. */
+	net_queues[0] = (netqueue_t *)calloc(1, sizeof(netqueue_t));
+	net_queues[1] = (netqueue_t *)calloc(1, sizeof(netqueue_t));
+
 	/* Initialize the platform module. */
 	switch (network_type) {
 	case NET_TYPE_PCAP:
@@ -468,15 +539,26 @@ network_reset(void)
 void
 network_tx(uint8_t *bufp, int len)
 {
-	network_busy(1);
-
 	ui_sb_update_icon(SB_NETWORK, 1);
 
-	network_queue_put(1, NULL, bufp, len);
+	/*
+	 * If the provider has fallen behind, give it a moment to make
+	 * room, but never stall the emulation thread for longer than
+	 * NET_TX_WAIT; past that the frame is dropped like on a busy
+	 * wire, and the guest's protocol stack retransmits it.
+	 */
+	if (poll_data.tx_room != NULL) {
+		thread_reset_event(poll_data.tx_room);
+		if (network_queue_full(1)) {
+			network_wake();
+			thread_wait_event(poll_data.tx_room, NET_TX_WAIT);
+		}
+	}
+
+	if (network_queue_put(1, NULL, bufp, len))
+		network_wake();
 
 	ui_sb_update_icon(SB_NETWORK, 0);
-
-	network_busy(0);
 }
 
 
@@ -484,10 +566,10 @@ network_tx(uint8_t *bufp, int len)
 void
 network_do_tx(void)
 {
-	netpkt_t *pkt = NULL;
+	netpkt_t *pkt;
 
-	network_queue_get(1, &pkt);
-	if ((pkt != NULL) && (pkt->len > 0)) {
+	pkt = network_queue_get(1);
+	if (pkt != NULL) {
 		switch (network_type) {
 		case NET_TYPE_PCAP:
 			net_pcap_in(pkt->data, pkt->len);
@@ -499,16 +581,29 @@ network_do_tx(void)
 		}
 	}
 	network_queue_advance(1);
+
+	/* Let network_tx() know there is room again. */
+	if (poll_data.tx_room != NULL)
+		thread_set_event(poll_data.tx_room);
 }
 
 
 int
 network_tx_queue_check(void)
 {
-	if ((first_pkt[1] == NULL) && (last_pkt[1] == NULL))
-		return 0;
+	return (network_queue_get(1) != NULL);
+}
 
-	return 1;
+
+/* Returns non-zero if the receive ring can take another frame. */
+int
+network_rx_queue_space(void)
+{
+	netqueue_t *q = net_queues[0];
+
+	return ((q != NULL) &&
+		((atomic_load_explicit(&q->write_idx, memory_order_relaxed) -
+		  atomic_load_explicit(&q->read_idx, memory_order_acquire)) < NET_QUEUE_LEN));
 }
 
 
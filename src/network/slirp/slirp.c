@@ -372,9 +372,11 @@ int slirp_select_fill(int *pnfds,
 
 	/*
 	 * Adjust the timeout to make the minimum timeout
-	 * 2ms (XXX?) to lessen the CPU load
+	 * 2ms (XXX?) to lessen the CPU load; -1 means no
+	 * timer is pending, so the caller may sleep until
+	 * a socket becomes ready.
 	 */
-	if (timeout < (FAST_TIMO * 1000))
+	if ((timeout >= 0) && (timeout < (FAST_TIMO * 1000)))
 		timeout = FAST_TIMO * 1000;
 
 	return timeout;
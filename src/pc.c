@@ -131,7 +131,8 @@ int	sound_is_float = 1,			/* (C) sound uses FP values */
 GAMEBLASTER = 0,			/* (C) sound option */
 GUS = 0,				/* (C) sound option */
 SSI2001 = 0,				/* (C) sound option */
-voodoo_enabled = 0;			/* (C) video option */
+voodoo_enabled = 0,			/* (C) video option */
+svga_render_threads = 0;		/* (C) video option */
 uint32_t mem_size = 0;				/* (C) memory size */
 int	cpu_manufacturer = 0,			/* (C) cpu manufacturer */
 cpu_use_dynarec = 0,			/* (C) cpu uses/needs Dyna */
@@ -63,6 +63,8 @@ int64_t		firsttime = 1;
 #define PIT_EXT_IO		32	/* The PIT has externally specified port I/O. */
 #define PIT_CUSTOM_CLOCK	64	/* The PIT uses custom clock inputs provided by another provider. */
 
+#define PIT_MAX_EDGES		0x20000	/* Longest time, in half clocks, the timer is left unserviced. */
+
 
 enum {
     PIT_8253 = 0,
@@ -103,10 +105,9 @@ ctr_set_out(ctr_t *ctr, int out)
 
 
 static void
-ctr_decrease_count(ctr_t *ctr)
+ctr_decrease_count(ctr_t *ctr, int dec_cnt)
 {
     uint8_t units, tens, hundreds, thousands, myriads;
-    int dec_cnt = 1;
 
     if (ctr->ctrl & 0x01) {
 	units = ctr->count & 0x0f;
@@ -147,7 +148,29 @@ ctr_decrease_count(ctr_t *ctr)
 
 	ctr->count = (myriads << 16) | (thousands << 12) | (hundreds << 8) | (tens << 4) | units;
     } else
-	ctr->count = (ctr->count - 1) & 0xffff;
+	ctr->count = (ctr->count - dec_cnt) & 0xffff;
+}
+
+
+/* Returns the count as the number of decrements it takes to get to zero, or
+   -1 if it is a BCD count with non-decimal digits, which ctr_decrease_count()
+   does not count down linearly. */
+static int
+ctr_get_value(ctr_t *ctr)
+{
+    int i, digit, ret = 0;
+
+    if (!(ctr->ctrl & 0x01))
+	return ctr->count;
+
+    for (i = 16; i >= 0; i -= 4) {
+	digit = (ctr->count >> i) & 0x0f;
+	if (digit > 9)
+		return -1;
+	ret = (ret * 10) + digit;
+    }
+
+    return ret;
 }
 
 
@@ -176,7 +199,7 @@ ctr_tick(ctr_t *ctr)
 				break;
 			case 2:
 				if (ctr->gate && (ctr->count >= 1)) {
-					ctr_decrease_count(ctr);
+					ctr_decrease_count(ctr, 1);
 					if (ctr->count < 1) {
 						ctr->state = 3;
 						ctr_set_out(ctr, 1);
@@ -184,7 +207,7 @@ ctr_tick(ctr_t *ctr)
 				}
 				break;
 			case 3:
-				ctr_decrease_count(ctr);
+				ctr_decrease_count(ctr, 1);
 				break;
 		}
 		break;
@@ -198,7 +221,7 @@ ctr_tick(ctr_t *ctr)
 				break;
 			case 2:
 				if (ctr->count >= 1) {
-					ctr_decrease_count(ctr);
+					ctr_decrease_count(ctr, 1);
 					if (ctr->count < 1) {
 						ctr->state = 3;
 						ctr_set_out(ctr, 1);
@@ -206,7 +229,7 @@ ctr_tick(ctr_t *ctr)
 				}
 				break;
 			case 3:
-				ctr_decrease_count(ctr);
+				ctr_decrease_count(ctr, 1);
 				break;
 		}
 		break;
@@ -223,7 +246,7 @@ ctr_tick(ctr_t *ctr)
 				if (ctr->gate == 0)
 					break;
 				else if (ctr->count >= 2) {
-					ctr_decrease_count(ctr);
+					ctr_decrease_count(ctr, 1);
 					if (ctr->count < 2) {
 						ctr->state = 3;
 						ctr_set_out(ctr, 0);
@@ -273,7 +296,7 @@ ctr_tick(ctr_t *ctr)
 		if ((ctr->gate != 0) || (ctr->m != 4)) {
 			switch(ctr->state) {
 				case 0:
-					ctr_decrease_count(ctr);
+					ctr_decrease_count(ctr, 1);
 					break;
 				case 1:
 					ctr_load_count(ctr);
@@ -281,7 +304,7 @@ ctr_tick(ctr_t *ctr)
 					break;
 				case 2:
 					if (ctr->count >= 1) {
-						ctr_decrease_count(ctr);
+						ctr_decrease_count(ctr, 1);
 						if (ctr->count < 1) {
 							ctr->state = 3;
 							ctr_set_out(ctr, 0);
@@ -315,6 +338,228 @@ ctr_clock(ctr_t *ctr)
 }
 
 
+/* Returns the number of ticks until the counter does anything other than
+   decrementing its count, 0 if it never will on its own, or 1 if the count
+   has to be decremented one tick at a time. */
+static int
+ctr_ticks_to_event(ctr_t *ctr)
+{
+    int value = ctr_get_value(ctr);
+
+    switch(ctr->m & 0x07) {
+	case 0:
+		if ((ctr->state == 2) && ctr->gate && (ctr->count >= 1))
+			return (value < 0) ? 1 : value;
+		else if (ctr->state == 3)
+			return (value < 0) ? 1 : 0;
+		break;
+	case 1:
+		if ((ctr->state == 2) && (ctr->count >= 1))
+			return (value < 0) ? 1 : value;
+		else if (ctr->state == 3)
+			return (value < 0) ? 1 : 0;
+		break;
+	case 2: case 6:
+		if (ctr->state == 3)
+			return 1;
+		else if ((ctr->state == 2) && ctr->gate && (ctr->count >= 2))
+			return (value < 0) ? 1 : (value - 1);
+		break;
+	case 3: case 7:
+		if (((ctr->state == 2) || (ctr->state == 3)) && ctr->gate && (ctr->count >= 0))
+			return ctr->newcount ? 1 : ((ctr->count >> 1) + 1);
+		break;
+	case 4: case 5:
+		if ((ctr->gate != 0) || (ctr->m != 4)) {
+			if (ctr->state == 3)
+				return 1;
+			else if ((ctr->state == 2) && (ctr->count >= 1))
+				return (value < 0) ? 1 : value;
+			else if (ctr->state == 0)
+				return (value < 0) ? 1 : 0;
+		}
+		break;
+    }
+
+    return 0;
+}
+
+
+/* Applies ticks that are known to only decrement the count, this must be kept
+   in sync with ctr_tick(). */
+static void
+ctr_skip_ticks(ctr_t *ctr, int ticks)
+{
+    switch(ctr->m & 0x07) {
+	case 0:
+		if (((ctr->state == 2) && ctr->gate && (ctr->count >= 1)) || (ctr->state == 3))
+			ctr_decrease_count(ctr, ticks);
+		break;
+	case 1:
+		if (((ctr->state == 2) && (ctr->count >= 1)) || (ctr->state == 3))
+			ctr_decrease_count(ctr, ticks);
+		break;
+	case 2: case 6:
+		if ((ctr->state == 2) && ctr->gate && (ctr->count >= 2))
+			ctr_decrease_count(ctr, ticks);
+		break;
+	case 3: case 7:
+		if (((ctr->state == 2) || (ctr->state == 3)) && ctr->gate && (ctr->count >= 0))
+			ctr->count -= (ticks << 1);
+		break;
+	case 4: case 5:
+		if (((ctr->gate != 0) || (ctr->m != 4)) &&
+		    ((ctr->state == 0) || ((ctr->state == 2) && (ctr->count >= 1))))
+			ctr_decrease_count(ctr, ticks);
+		break;
+    }
+}
+
+
+/* Returns the number of half clocks, counted from the current CLOCK level,
+   until the edge on which the counter has to be clocked the slow way. */
+static int
+ctr_edges_to_event(ctr_t *ctr, int clock)
+{
+    int ticks;
+
+    if (!ctr->using_timer)
+	return PIT_MAX_EDGES;
+
+    /* The next falling edge moves the counter out of the latch. */
+    if (ctr->latch)
+	return clock ? 1 : 2;
+
+    /* State 1 is edge detected, so do it edge by edge, unless the
+       load is being held off by the gate anyway. */
+    if (ctr->state == 1)
+	return ((ctr->m == 4) && !ctr->gate) ? PIT_MAX_EDGES : 1;
+
+    ticks = ctr_ticks_to_event(ctr);
+    if ((ticks == 0) || (ticks > (PIT_MAX_EDGES >> 1)))
+	return PIT_MAX_EDGES;
+
+    /* Counters tick on the falling edge of CLOCK. */
+    return (ticks << 1) - clock;
+}
+
+
+static void
+ctr_skip_edges(ctr_t *ctr, int ticks, int clock)
+{
+    ctr->clock = clock;
+
+    if (!ctr->using_timer || ctr->latch)
+	return;
+
+    if (ctr->state == 1)
+	ctr->s1_det = clock;
+    else if (ticks)
+	ctr_skip_ticks(ctr, ticks);
+}
+
+
+static int
+pit_edges_to_event(pit_t *dev)
+{
+    int i, edges, ret = PIT_MAX_EDGES;
+
+    for (i = 0; i < 3; i++) {
+	edges = ctr_edges_to_event(&dev->counters[i], dev->clock);
+	if (edges < ret)
+		ret = edges;
+    }
+
+    return ret;
+}
+
+
+static void
+pit_skip_edges(pit_t *dev, int edges)
+{
+    int i, ticks;
+
+    if (edges == 0)
+	return;
+
+    ticks = dev->clock ? ((edges + 1) >> 1) : (edges >> 1);
+
+    dev->edge_ts += ((uint64_t) edges) * dev->edge_period;
+    dev->clock ^= (edges & 1);
+
+    for (i = 0; i < 3; i++)
+	ctr_skip_edges(&dev->counters[i], ticks, dev->clock);
+}
+
+
+/* Runs the PIT forward by the specified number of half clocks. Stretches in
+   which the counters only count down are skipped in one go, and only the edges
+   on which a counter changes state or OUT go through pit_ctr_set_clock(). */
+static void
+pit_advance(pit_t *dev, uint64_t edges)
+{
+    int i, next;
+
+    dev->syncing = 1;
+
+    while (edges > 0) {
+	next = pit_edges_to_event(dev);
+
+	if (((uint64_t) next) > edges) {
+		pit_skip_edges(dev, (int) edges);
+		break;
+	}
+
+	pit_skip_edges(dev, next - 1);
+
+	dev->edge_ts += dev->edge_period;
+	dev->clock ^= 1;
+
+	for (i = 0; i < 3; i++)
+		pit_ctr_set_clock(&dev->counters[i], dev->clock);
+
+	edges -= next;
+    }
+
+    dev->syncing = 0;
+}
+
+
+/* Arms the timer for the next edge on which something happens. */
+static void
+pit_schedule(pit_t *dev)
+{
+    if ((dev == NULL) || dev->syncing || !dev->edge_period)
+	return;
+
+    timer_disable(&dev->callback_timer);
+    dev->callback_timer.ts.ts64 = dev->edge_ts;
+    timer_advance_u64(&dev->callback_timer, ((uint64_t) pit_edges_to_event(dev)) * dev->edge_period);
+}
+
+
+/* Brings the counters up to date with the TSC, so that the count, status and
+   OUT are correct when accessed from outside of the timer callback. */
+static void
+pit_sync(pit_t *dev)
+{
+    uint64_t ts;
+    int64_t diff;
+
+    if ((dev == NULL) || dev->syncing || !dev->edge_period)
+	return;
+
+    /* All the edges with an integer timestamp up to the TSC are due. */
+    ts = ((((uint64_t) (uint32_t) tsc) + 1ULL) << 32ULL) - 1ULL;
+    diff = (int64_t) (ts - dev->edge_ts);
+
+    if (diff >= (int64_t) dev->edge_period) {
+	pit_advance(dev, ((uint64_t) diff) / dev->edge_period);
+	pit_schedule(dev);
+    }
+}
+
+
 static void
 ctr_set_state_1(ctr_t *ctr)
 {
@@ -425,8 +670,11 @@ pit_ctr_set_out_func(ctr_t *ctr, void (*func)(int new_out, int old_out))
 void
 pit_ctr_set_gate(ctr_t *ctr, int gate)
 {
-    int old = ctr->gate;
+    int old;
+
+    pit_sync(ctr->dev);
 
+    old = ctr->gate;
     ctr->gate = gate;
 
     switch (ctr->m & 0x07) {
@@ -455,6 +703,8 @@ pit_ctr_set_gate(ctr_t *ctr, int gate)
 		}
 		break;
    }
+
+    pit_schedule(ctr->dev);
 }
 
 
@@ -493,9 +743,11 @@ pit_ctr_set_clock(ctr_t *ctr, int clock)
 void
 pit_ctr_set_using_timer(ctr_t *ctr, int using_timer)
 {
-    timer_process();
+    pit_sync(ctr->dev);
 
     ctr->using_timer = using_timer;
+
+    pit_schedule(ctr->dev);
 }
 
 
@@ -503,14 +755,12 @@ static void
 pit_timer_over(void *p)
 {
     pit_t *dev = (pit_t *) p;
-    int i;
+    int64_t diff = (int64_t) (dev->callback_timer.ts.ts64 - dev->edge_ts);
 
-    dev->clock ^= 1;
+    if (diff > 0)
+	pit_advance(dev, ((uint64_t) diff) / dev->edge_period);
 
-    for (i = 0; i < 3; i++)
-	pit_ctr_set_clock(&dev->counters[i], dev->clock);
-
-    timer_advance_u64(&dev->callback_timer, PITCONST >> 1ULL);
+    pit_schedule(dev);
 }
 
 
@@ -523,6 +773,8 @@ pit_write(uint16_t addr, uint8_t val, void *priv)
 
     pit_log("[%04X:%08X] pit_write(%04X, %02X, %08X)\n", CS, cpu_state.pc, addr, val, priv);
 
+    pit_sync(dev);
+
     switch (addr & 3) {
 	case 3:		/* control */
 		t = val >> 6;
@@ -616,6 +868,8 @@ pit_write(uint16_t addr, uint8_t val, void *priv)
 		}
 		break;
     }
+
+    pit_schedule(dev);
 }
 
 
@@ -627,6 +881,8 @@ pit_read(uint16_t addr, void *priv)
     int count, t = (addr & 3);
     ctr_t *ctr;
 
+    pit_sync(dev);
+
     switch (addr & 3) {
 	case 3:		/* Control. */
 		/* This is 8254-only, 8253 returns 0x00. */
@@ -802,8 +1058,10 @@ pit_reset(pit_t *dev)
 
     dev->clock = 0;
 
-    for (i = 0; i < 3; i++)
+    for (i = 0; i < 3; i++) {
 	ctr_reset(&dev->counters[i]);
+	dev->counters[i].dev = dev;
+    }
 
     /* Disable speaker gate. */
     dev->counters[2].gate = 0;
@@ -833,6 +1091,22 @@ pit_close(void *priv)
 }
 
 
+static void
+pit_speed_changed(void *priv)
+{
+    pit_t *dev = (pit_t *) priv;
+
+    if (!dev->edge_period)
+	return;
+
+    /* Catch up at the old rate before switching to the new one. */
+    pit_sync(dev);
+
+    dev->edge_period = PITCONST >> 1ULL;
+    pit_schedule(dev);
+}
+
+
 static void *
 pit_init(const device_t *info)
 {
@@ -841,7 +1115,9 @@ pit_init(const device_t *info)
 
     if (!(dev->flags & PIT_PS2) && !(dev->flags & PIT_CUSTOM_CLOCK)) {
 	timer_add(&dev->callback_timer, pit_timer_over, (void *) dev, 0);
-	timer_set_delay_u64(&dev->callback_timer, PITCONST >> 1ULL);
+	dev->edge_ts = ((uint64_t) (uint32_t) tsc) << 32ULL;
+	dev->edge_period = PITCONST >> 1ULL;
+	pit_schedule(dev);
     }
 
     dev->flags = info->local;
@@ -859,7 +1135,7 @@ const device_t i8253_device =
         DEVICE_ISA,
 	PIT_8253,
         pit_init, pit_close, NULL,
-        NULL, NULL, NULL,
+        NULL, pit_speed_changed, NULL,
 	NULL
 };
 
@@ -870,7 +1146,7 @@ const device_t i8254_device =
         DEVICE_ISA,
 	PIT_8254,
         pit_init, pit_close, NULL,
-        NULL, NULL, NULL,
+        NULL, pit_speed_changed, NULL,
 	NULL
 };
 
@@ -881,7 +1157,7 @@ const device_t i8254_ext_io_device =
         DEVICE_ISA,
 	PIT_8254 | PIT_EXT_IO,
         pit_init, pit_close, NULL,
-        NULL, NULL, NULL,
+        NULL, pit_speed_changed, NULL,
 	NULL
 };
 
@@ -892,7 +1168,7 @@ const device_t i8254_ps2_device =
         DEVICE_ISA,
 	PIT_8254 | PIT_PS2 | PIT_EXT_IO,
         pit_init, pit_close, NULL,
-        NULL, NULL, NULL,
+        NULL, pit_speed_changed, NULL,
 	NULL
 };
 
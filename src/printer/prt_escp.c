@@ -85,6 +85,10 @@
 #define PAGE_CPI	10.0			/* standard 10 cpi */
 #define PAGE_LPI	6.0			/* standard 6 lpi */
 
+/* Glyph cache. */
+#define FONT_CACHE_SIZE	4			/* faces kept open */
+#define GLYPH_CACHE_SIZE	256			/* glyphs per face, power of 2 */
+
 
 #ifdef _WIN32
 # define PATH_FREETYPE_DLL	"freetype.dll"
@@ -197,6 +201,34 @@ typedef struct {
 } psurface_t;
 
 
+typedef struct {
+	uint16_t	code;		/* Unicode code point */
+	uint8_t	valid;
+	char	pad;
+
+	int	left, top;	/* bitmap offset from the pen */
+	uint16_t	width, rows;
+	long	advance_x;	/* in 26.6 units */
+
+	uint8_t	*buffer;	/* width * rows grayscale */
+} glyph_t;
+
+
+typedef struct {
+	FT_Face	face;
+
+	/* What update_font() would have built this face from. */
+	const wchar_t	*fn;
+	uint16_t	hsize, vsize;	/* in 26.6 points */
+	uint16_t	dpi;
+	int8_t	italic;
+
+	uint32_t	last_used;
+
+	glyph_t	glyphs[GLYPH_CACHE_SIZE];
+} font_cache_t;
+
+
 typedef struct {
 	const char	*name;
 
@@ -263,6 +295,9 @@ typedef struct {
 	double	curr_x, curr_y;		/* print head position (inch) */
 	uint16_t	current_font;
 	FT_Face	fontface;
+	font_cache_t	*font;		/* cache entry for fontface */
+	font_cache_t	font_cache[FONT_CACHE_SIZE];
+	uint32_t	font_cache_tick;
 	int8_t	lq_typeface;
 	uint16_t	font_style;
 	uint8_t	print_quality;
@@ -299,7 +334,7 @@ typedef struct {
 static void
 update_font(escp_t *dev);
 static void
-blit_glyph(escp_t *dev, unsigned destx, unsigned desty, int8_t add);
+blit_glyph(escp_t *dev, const glyph_t *glyph, unsigned destx, unsigned desty, int8_t add);
 static void
 draw_hline(escp_t *dev, unsigned from_x, unsigned to_x, unsigned y, int8_t broken);
 static void
@@ -550,6 +585,66 @@ init_codepage(escp_t *dev, uint16_t num)
 }
 
 
+/* Close a cached face and drop all of its rendered glyphs. */
+static void
+font_cache_release(font_cache_t *fc)
+{
+	int i;
+
+	for (i = 0; i < GLYPH_CACHE_SIZE; i++) {
+		if (fc->glyphs[i].buffer != NULL)
+			free(fc->glyphs[i].buffer);
+	}
+	memset(fc->glyphs, 0x00, sizeof(fc->glyphs));
+
+	if (fc->face != NULL) {
+		ft_Done_Face(fc->face);
+		fc->face = NULL;
+	}
+}
+
+
+/* Find a glyph in the current font, rendering it if it's not cached. */
+static const glyph_t *
+get_glyph(escp_t *dev, uint16_t code)
+{
+	glyph_t *g = &dev->font->glyphs[code & (GLYPH_CACHE_SIZE - 1)];
+	FT_GlyphSlot slot = dev->fontface->glyph;
+	FT_UInt char_index;
+	unsigned y;
+
+	if (g->valid && (g->code == code))
+		return g;
+
+	char_index = ft_Get_Char_Index(dev->fontface, code);
+	ft_Load_Glyph(dev->fontface, char_index, FT_LOAD_DEFAULT);
+	ft_Render_Glyph(slot, FT_RENDER_MODE_NORMAL);
+
+	if (g->buffer != NULL)
+		free(g->buffer);
+	memset(g, 0x00, sizeof(glyph_t));
+
+	g->width = slot->bitmap.width;
+	g->rows = slot->bitmap.rows;
+	if (g->width && g->rows) {
+		g->buffer = (uint8_t *)malloc(g->width * g->rows);
+		if (g->buffer == NULL)
+			return NULL;
+		for (y = 0; y < g->rows; y++)
+			memcpy(g->buffer + y * g->width,
+			       slot->bitmap.buffer + y * slot->bitmap.pitch, g->width);
+	}
+
+	g->code = code;
+	g->left = slot->bitmap_left;
+	g->top = slot->bitmap_top;
+	g->advance_x = slot->advance.x;
+	g->valid = 1;
+
+	return g;
+}
+
+
 static void
 update_font(escp_t *dev)
 {
@@ -557,17 +652,17 @@ update_font(escp_t *dev)
 	wchar_t *fn;
 	char temp[1024];
 	FT_Matrix matrix;
+	font_cache_t *fc;
 	double hpoints = 10.5;
 	double vpoints = 10.5;
+	uint16_t hsize, vsize;
+	int8_t italic;
+	int i;
 
 	/* We need the FreeType library. */
 	if (ft_lib == NULL)
 		return;
 
-	/* Release current font if we have one. */
-	if (dev->fontface)
-		ft_Done_Face(dev->fontface);
-
 	if (dev->print_quality == QUALITY_DRAFT)
 		fn = FONT_FILE_DOTMATRIX;
 	else switch (dev->lq_typeface) {
@@ -593,22 +688,6 @@ update_font(escp_t *dev)
 		fn = FONT_FILE_DOTMATRIX;
 	}
 
-	/* Create a full pathname for the ROM file. */
-	wcscpy(path, dev->fontpath);
-	plat_path_slash(path);
-	wcscat(path, fn);
-
-	/* Convert (back) to ANSI for the FreeType API. */
-	wcstombs(temp, path, sizeof(temp));
-
-	escp_log("Temp file=%s\n", temp);
-
-	/* Load the new font. */
-	if (ft_New_Face(ft_lib, temp, 0, &dev->fontface)) {
-		escp_log("ESC/P: unable to load font '%s'\n", temp);
-		dev->fontface = NULL;
-	}
-
 	if (!dev->multipoint_mode) {
 		dev->actual_cpi = dev->cpi;
 
@@ -653,19 +732,78 @@ update_font(escp_t *dev)
 		dev->actual_cpi /= 2.0 / 3.0;
 	}
 
-	ft_Set_Char_Size(dev->fontface,
-		(uint16_t)(hpoints * 64), (uint16_t)(vpoints * 64),
-		dev->dpi, dev->dpi);
-
-	if ((dev->font_style & STYLE_ITALICS) ||
-		(dev->char_tables[dev->curr_char_table] == 0)) {
-		/* Italics transformation. */
-		matrix.xx = 0x10000L;
-		matrix.xy = (FT_Fixed)(0.20 * 0x10000L);
-		matrix.yx = 0;
-		matrix.yy = 0x10000L;
-		ft_Set_Transform(dev->fontface, &matrix, 0);
+	hsize = (uint16_t)(hpoints * 64);
+	vsize = (uint16_t)(vpoints * 64);
+	italic = (dev->font_style & STYLE_ITALICS) ||
+		 (dev->char_tables[dev->curr_char_table] == 0);
+
+	/* Most calls leave the font as it was; reuse the face if we have it. */
+	fc = NULL;
+	for (i = 0; i < FONT_CACHE_SIZE; i++) {
+		if ((dev->font_cache[i].face != NULL) &&
+		    !wcscmp(dev->font_cache[i].fn, fn) &&
+		    (dev->font_cache[i].hsize == hsize) &&
+		    (dev->font_cache[i].vsize == vsize) &&
+		    (dev->font_cache[i].dpi == dev->dpi) &&
+		    (dev->font_cache[i].italic == italic)) {
+			fc = &dev->font_cache[i];
+			break;
+		}
 	}
+
+	if (fc == NULL) {
+		/* Take a free entry, or the least recently used one. */
+		fc = &dev->font_cache[0];
+		for (i = 0; i < FONT_CACHE_SIZE; i++) {
+			if (dev->font_cache[i].face == NULL) {
+				fc = &dev->font_cache[i];
+				break;
+			}
+			if (dev->font_cache[i].last_used < fc->last_used)
+				fc = &dev->font_cache[i];
+		}
+		font_cache_release(fc);
+
+		/* Create a full pathname for the ROM file. */
+		wcscpy(path, dev->fontpath);
+		plat_path_slash(path);
+		wcscat(path, fn);
+
+		/* Convert (back) to ANSI for the FreeType API. */
+		wcstombs(temp, path, sizeof(temp));
+
+		escp_log("Temp file=%s\n", temp);
+
+		/* Load the new font. */
+		if (ft_New_Face(ft_lib, temp, 0, &fc->face)) {
+			escp_log("ESC/P: unable to load font '%s'\n", temp);
+			fc->face = NULL;
+			dev->fontface = NULL;
+			dev->font = NULL;
+			return;
+		}
+
+		fc->fn = fn;
+		fc->hsize = hsize;
+		fc->vsize = vsize;
+		fc->dpi = dev->dpi;
+		fc->italic = italic;
+
+		ft_Set_Char_Size(fc->face, hsize, vsize, dev->dpi, dev->dpi);
+
+		if (italic) {
+			/* Italics transformation. */
+			matrix.xx = 0x10000L;
+			matrix.xy = (FT_Fixed)(0.20 * 0x10000L);
+			matrix.yx = 0;
+			matrix.yy = 0x10000L;
+			ft_Set_Transform(fc->face, &matrix, 0);
+		}
+	}
+
+	fc->last_used = ++dev->font_cache_tick;
+	dev->font = fc;
+	dev->fontface = fc->face;
 }
 
 
@@ -1609,7 +1747,7 @@ process_char(escp_t *dev, uint8_t ch)
 static void
 handle_char(escp_t *dev, uint8_t ch)
 {
-	FT_UInt char_index;
+	const glyph_t *glyph;
 	uint16_t pen_x, pen_y;
 	uint16_t line_start, line_y;
 	double x_advance;
@@ -1649,43 +1787,41 @@ handle_char(escp_t *dev, uint8_t ch)
 		ch = 0x20;
 
 	/* ok, so we need to print the character now */
-	if (ft_lib) {
-		char_index = ft_Get_Char_Index(dev->fontface, dev->curr_cpmap[ch]);
-		ft_Load_Glyph(dev->fontface, char_index, FT_LOAD_DEFAULT);
-		ft_Render_Glyph(dev->fontface->glyph, FT_RENDER_MODE_NORMAL);
-	}
+	glyph = get_glyph(dev, dev->curr_cpmap[ch]);
+	if (glyph == NULL)
+		return;
 
-	pen_x = PIXX + dev->fontface->glyph->bitmap_left;
-	pen_y = (uint16_t)(PIXY - dev->fontface->glyph->bitmap_top + dev->fontface->size->metrics.ascender / 64);
+	pen_x = PIXX + glyph->left;
+	pen_y = (uint16_t)(PIXY - glyph->top + dev->fontface->size->metrics.ascender / 64);
 
 	if (dev->font_style & STYLE_SUBSCRIPT)
-		pen_y += dev->fontface->glyph->bitmap.rows / 2;
+		pen_y += glyph->rows / 2;
 
 	/* mark the page as dirty if anything is drawn */
 	if ((ch != 0x20) || (dev->font_score != SCORE_NONE))
 		dev->page->dirty = 1;
 
 	/* draw the glyph */
-	blit_glyph(dev, pen_x, pen_y, 0);
-	blit_glyph(dev, pen_x + 1, pen_y, 1);
+	blit_glyph(dev, glyph, pen_x, pen_y, 0);
+	blit_glyph(dev, glyph, pen_x + 1, pen_y, 1);
 
 	/* doublestrike -> draw glyph a second time, 1px below */
 	if (dev->font_style & STYLE_DOUBLESTRIKE) {
-		blit_glyph(dev, pen_x, pen_y + 1, 1);
-		blit_glyph(dev, pen_x + 1, pen_y + 1, 1);
+		blit_glyph(dev, glyph, pen_x, pen_y + 1, 1);
+		blit_glyph(dev, glyph, pen_x + 1, pen_y + 1, 1);
 	}
 
 	/* bold -> draw glyph a second time, 1px to the right */
 	if (dev->font_style & STYLE_BOLD) {
-		blit_glyph(dev, pen_x + 1, pen_y, 1);
-		blit_glyph(dev, pen_x + 2, pen_y, 1);
-		blit_glyph(dev, pen_x + 3, pen_y, 1);
+		blit_glyph(dev, glyph, pen_x + 1, pen_y, 1);
+		blit_glyph(dev, glyph, pen_x + 2, pen_y, 1);
+		blit_glyph(dev, glyph, pen_x + 3, pen_y, 1);
 	}
 
 	line_start = PIXX;
 
 	if (dev->font_style & STYLE_PROP)
-		x_advance = dev->fontface->glyph->advance.x / (dev->dpi * 64.0);
+		x_advance = glyph->advance_x / (dev->dpi * 64.0);
 	else {
 		if (dev->hmi < 0)
 			x_advance = 1.0 / dev->actual_cpi;
@@ -1723,37 +1859,44 @@ handle_char(escp_t *dev, uint8_t ch)
 }
 
 
-/* TODO: This can be optimized quite a bit... I'm just too lazy right now ;-) */
 static void
-blit_glyph(escp_t *dev, unsigned destx, unsigned desty, int8_t add)
+blit_glyph(escp_t *dev, const glyph_t *glyph, unsigned destx, unsigned desty, int8_t add)
 {
-	FT_Bitmap *bitmap = &dev->fontface->glyph->bitmap;
-	unsigned x, y;
+	const uint8_t *srow;
 	uint8_t src, *dst;
+	unsigned x, y, w, h;
 
-	/* check if freetype is available */
-	if (ft_lib == NULL)
+	/* Clip against the page once, rather than for every pixel. */
+	if ((destx >= (unsigned)dev->page->w) || (desty >= (unsigned)dev->page->h))
 		return;
-
-	for (y = 0; y < bitmap->rows; y++) {
-		for (x = 0; x < bitmap->width; x++) {
-			src = *(bitmap->buffer + x + y * bitmap->pitch);
-			/* ignore background, and respect page size */
-			if (src > 0 && (destx + x < (unsigned)dev->page->w) && (desty + y < (unsigned)dev->page->h)) {
-				dst = (uint8_t *)dev->page->pixels + (x + destx) + (y + desty) * dev->page->pitch;
-				src >>= 3;
-
-				if (add) {
-					if (((*dst) & 0x1f) + src > 31)
-						*dst |= (dev->color | 0x1f);
-					else {
-						*dst += src;
-						*dst |= dev->color;
-					}
+	w = glyph->width;
+	if (w > ((unsigned)dev->page->w - destx))
+		w = (unsigned)dev->page->w - destx;
+	h = glyph->rows;
+	if (h > ((unsigned)dev->page->h - desty))
+		h = (unsigned)dev->page->h - desty;
+
+	for (y = 0; y < h; y++) {
+		srow = glyph->buffer + y * glyph->width;
+		dst = (uint8_t *)dev->page->pixels + destx + (y + desty) * dev->page->pitch;
+
+		for (x = 0; x < w; x++, dst++) {
+			src = srow[x];
+			/* ignore background */
+			if (src == 0)
+				continue;
+			src >>= 3;
+
+			if (add) {
+				if (((*dst) & 0x1f) + src > 31)
+					*dst |= (dev->color | 0x1f);
+				else {
+					*dst += src;
+					*dst |= dev->color;
 				}
-				else
-					*dst = src | dev->color;
 			}
+			else
+				*dst = src | dev->color;
 		}
 	}
 }
@@ -2139,9 +2282,13 @@ static void
 escp_close(void *priv)
 {
 	escp_t *dev = (escp_t *)priv;
+	int i;
 
 	if (dev == NULL) return;
 
+	for (i = 0; i < FONT_CACHE_SIZE; i++)
+		font_cache_release(&dev->font_cache[i]);
+
 	if (dev->page != NULL) {
 		/* Print last page if it contains data. */
 		if (dev->page->dirty)
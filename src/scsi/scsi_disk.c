@@ -1095,11 +1095,13 @@ scsi_disk_phase_data_out(scsi_common_t *sc)
 	case GPCMD_WRITE_AND_VERIFY_10:
 	case GPCMD_WRITE_12:
 	case GPCMD_WRITE_AND_VERIFY_12:
+		/* The data is copied, so the command can complete while the
+		   write is still on its way to the image. */
 		if ((dev->requested_blocks > 0) && (*BufLen > 0)) {
 			if (dev->packet_len > (uint32_t) *BufLen)
-				hdd_image_write(dev->id, dev->sector_pos, *BufLen >> 9, dev->temp_buffer);
+				hdd_image_write_async(dev->id, dev->sector_pos, *BufLen >> 9, dev->temp_buffer);
 			else
-				hdd_image_write(dev->id, dev->sector_pos, dev->requested_blocks, dev->temp_buffer);
+				hdd_image_write_async(dev->id, dev->sector_pos, dev->requested_blocks, dev->temp_buffer);
 		}
 		break;
 	case GPCMD_WRITE_SAME_10:
@@ -180,6 +180,12 @@
 
 #define NCR_BUF_SIZE	  4096
 
+/* One decoded-instruction slot per DWORD of on-chip SCRIPTS RAM. */
+#define NCR_ICACHE_SIZE	  (NCR_BUF_SIZE >> 2)
+
+/* Instructions run back to back in one timer callback before yielding. */
+#define NCR_SCRIPT_BATCH  100
+
 typedef struct ncr53c8xx_request {
     uint32_t tag;
     uint32_t dma_len;
@@ -188,6 +194,13 @@ typedef struct ncr53c8xx_request {
     int out;
 } ncr53c8xx_request;
 
+typedef struct {
+    uint32_t insn;
+    uint32_t addr;
+    uint32_t dest;	/* Third DWORD, Memory Move only. */
+    uint8_t valid;
+} ncr53c8xx_insn_t;
+
 typedef enum
 {
         SCSI_STATE_SEND_COMMAND,
@@ -227,6 +240,10 @@ typedef struct {
     uint8_t nvram_index;
 #endif
     uint8_t ram[NCR_BUF_SIZE];	/* NCR 53c875 RAM (4 kB). */
+    /* Fetched instructions, keyed by DSP offset into the RAM above;
+       a write to the RAM drops the slots it overlaps. */
+    ncr53c8xx_insn_t icache[NCR_ICACHE_SIZE];
+    ncr53c8xx_insn_t fetch;	/* Scratch slot for uncached fetches. */
     /* 0 if SCRIPTS are running or stopped.
      * 1 if a Wait Reselect instruction has been issued.
      * 2 if processing DMA from ncr53c8xx_execute_script.
@@ -490,16 +507,91 @@ ncr53c8xx_write(ncr53c8xx_t *dev, uint32_t addr, uint8_t *buf, uint32_t len)
 }
 
 
+/* Return a pointer into the on-chip RAM if [addr, addr + len) falls
+   entirely inside its enabled window, NULL otherwise. */
+static __inline uint8_t *
+ncr53c8xx_ram_ptr(ncr53c8xx_t *dev, uint32_t addr, uint32_t len)
+{
+    if (!dev->ram_mapping.enable || (addr < dev->ram_mapping.base) ||
+	((addr - dev->ram_mapping.base + len) > NCR_BUF_SIZE))
+	return NULL;
+
+    return &dev->ram[addr - dev->ram_mapping.base];
+}
+
+
+/* SCRIPTS-side read: on-chip RAM is read directly, anything else goes
+   through bus mastering. */
+static __inline void
+ncr53c8xx_script_read(ncr53c8xx_t *dev, uint32_t addr, uint8_t *buf, uint32_t len)
+{
+    uint8_t *p = ncr53c8xx_ram_ptr(dev, addr, len);
+
+    if (p != NULL)
+	memcpy(buf, p, len);
+    else
+	dma_bm_read(addr, buf, len, 4);
+}
+
+
 static __inline uint32_t
 read_dword(ncr53c8xx_t *dev, uint32_t addr)
 {
     uint32_t buf;
     ncr53c8xx_log("Reading the next DWORD from memory (%08X)...\n", addr);
-    dma_bm_read(addr, (uint8_t *)&buf, 4, 4);
+    ncr53c8xx_script_read(dev, addr, (uint8_t *)&buf, 4);
     return buf;
 }
 
 
+static void
+ncr53c8xx_icache_invalidate(ncr53c8xx_t *dev, uint32_t offset)
+{
+    int i, slot = (offset & (NCR_BUF_SIZE - 1)) >> 2;
+
+    /* An instruction is up to three DWORDs long, so a byte can belong to
+       the slot it lies in or to either of the two before it. */
+    for (i = 0; (i < 3) && (slot >= i); i++)
+	dev->icache[slot - i].valid = 0;
+}
+
+
+/* Fetch the instruction at DSP.  Instructions in on-chip RAM are cached,
+   since every write to that RAM passes through ncr53c8xx_ram_writeb();
+   host memory can be rewritten behind our back and is always re-read. */
+static ncr53c8xx_insn_t *
+ncr53c8xx_fetch(ncr53c8xx_t *dev)
+{
+    ncr53c8xx_insn_t *ci;
+    uint32_t buf[3];
+    uint8_t *p = NULL;
+
+    if (!(dev->dsp & 3))
+	p = ncr53c8xx_ram_ptr(dev, dev->dsp, 12);
+
+    if (p == NULL) {
+	ci = &dev->fetch;
+	dma_bm_read(dev->dsp, (uint8_t *)buf, 8, 4);
+	ci->insn = buf[0];
+	ci->addr = buf[1];
+	if ((ci->insn & 0xe0000000) == 0xc0000000)
+		ci->dest = read_dword(dev, dev->dsp + 8);
+	return ci;
+    }
+
+    ci = &dev->icache[(dev->dsp - dev->ram_mapping.base) >> 2];
+    if (!ci->valid) {
+	memcpy(buf, p, 12);
+	ci->insn = buf[0];
+	ci->addr = buf[1];
+	ci->dest = buf[2];
+	ci->valid = 1;
+    }
+
+    return ci;
+}
+
+
 static
 void do_irq(ncr53c8xx_t *dev, int level)
 {
@@ -1035,6 +1127,7 @@ ncr53c8xx_process_script(ncr53c8xx_t *dev)
     int opcode, insn_processed = 0, reg, operator, cond, jmp, n, i, c;
     int32_t offset;
     uint8_t op0, op1, data8, mask, data[7];
+    ncr53c8xx_insn_t *ci;
 #ifdef ENABLE_NCR53C8XX_LOG
     uint8_t *pp;
 #endif
@@ -1042,19 +1135,20 @@ ncr53c8xx_process_script(ncr53c8xx_t *dev)
     dev->sstop = 0;
 again:
     insn_processed++;
-    insn = read_dword(dev, dev->dsp);
+    ci = ncr53c8xx_fetch(dev);
+    insn = ci->insn;
     if (!insn) {
 	/* If we receive an empty opcode increment the DSP by 4 bytes
 	   instead of 8 and execute the next opcode at that location */
 	dev->dsp += 4;
-	if (insn_processed < 100)
+	if (insn_processed < NCR_SCRIPT_BATCH)
 		goto again;
 	else {
 		timer_on_auto(&dev->timer, 10.0);
 		return;
 	}
     }
-    addr = read_dword(dev, dev->dsp + 4);
+    addr = ci->addr;
     ncr53c8xx_log("SCRIPTS dsp=%08x opcode %08x arg %08x\n", dev->dsp, insn, addr);
     dev->dsps = addr;
     dev->dcmd = insn >> 24;
@@ -1082,7 +1176,7 @@ again:
 
 			/* 32-bit Table indirect */
 			offset = sextract32(addr, 0, 24);
-			dma_bm_read(dev->dsa + offset, (uint8_t *)buf, 8, 4);
+			ncr53c8xx_script_read(dev, dev->dsa + offset, (uint8_t *)buf, 8);
 			/* byte count is stored in bits 0:23 only */
 			dev->dbc = buf[0] & 0xffffff;
 			addr = buf[1];
@@ -1357,7 +1451,7 @@ again:
 			/* ??? The docs imply the destination address is loaded into
 			   the TEMP register.  However the Linux drivers rely on
 			   the value being presrved.  */
-			dest = read_dword(dev, dev->dsp);
+			dest = ci->dest;
 			dev->dsp += 4;
 			ncr53c8xx_memcpy(dev, dest, addr, insn & 0xffffff);
 		} else {
@@ -1404,7 +1498,7 @@ again:
 		ncr53c8xx_script_dma_interrupt(dev, NCR_DSTAT_SSI);
 	} else {
 		ncr53c8xx_log("NCR 810: SCRIPTS: Normal mode\n");
-		if (insn_processed < 100)
+		if (insn_processed < NCR_SCRIPT_BATCH)
 			goto again;
 	}
     } else {
@@ -2243,7 +2337,10 @@ ncr53c8xx_ram_writeb(uint32_t addr, uint8_t val, void *p)
 {
     ncr53c8xx_t *dev = (ncr53c8xx_t *)p;
 
-    dev->ram[addr & 0x0fff] = val;
+    if (dev->ram[addr & 0x0fff] != val) {
+	dev->ram[addr & 0x0fff] = val;
+	ncr53c8xx_icache_invalidate(dev, addr & 0x0fff);
+    }
 }
 
 
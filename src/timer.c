@@ -1,122 +1,178 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <wchar.h>
 #include <86box/86box.h>
 #include <86box/timer.h>
 
 
+/* Initial number of slots in the timer heap, doubled whenever it fills up. */
+#define TIMER_HEAP_INIT	64
+
+
 uint64_t TIMER_USEC;
 uint32_t timer_target;
 
-/*Enabled timers are stored in a linked list, with the first timer to expire at
-  the head.*/
-static pc_timer_t *timer_head = NULL;
+/*Enabled timers are stored in an implicit 4-ary min-heap, with the first timer
+  to expire at the root. Each timer remembers its slot in the heap, so that
+  enabling, disabling and expiring a timer is O(log n) instead of a walk of a
+  sorted list. Timers with the same timestamp are ordered by the sequence in
+  which they were enabled, most recent first, exactly like the old list did.*/
+static pc_timer_t **timer_heap = NULL;
+static int	timer_heap_count = 0, timer_heap_size = 0;
+static uint32_t	timer_seq = 0;
 
 /* Are we initialized? */
 static int timer_inited = 0;
 
 
-void
-timer_enable(pc_timer_t *timer)
+/*True if timer a has to run before timer b*/
+static __inline int
+timer_heap_before(pc_timer_t *a, pc_timer_t *b)
 {
-    pc_timer_t *timer_node = timer_head;
+    if (a->ts.ts64 != b->ts.ts64)
+	return TIMER_LESS_THAN(a, b);
 
-    if (!timer_inited || (timer == NULL))
-	return;
+    return ((int32_t) (a->seq - b->seq)) > 0;
+}
 
-    if (timer->flags & TIMER_ENABLED)
-	timer_disable(timer);
 
-    if (timer->next || timer->prev)
-	fatal("timer_enable - timer->next\n");
+static __inline void
+timer_heap_set(int pos, pc_timer_t *timer)
+{
+    timer_heap[pos] = timer;
+    timer->heap_pos = pos + 1;
+}
 
-    timer->flags |= TIMER_ENABLED;
 
-    /*List currently empty - add to head*/
-    if (!timer_head) {
-	timer_head = timer;
-	timer->next = timer->prev = NULL;
-#if 0
-	timer_target = timer_head->ts_integer;
-#else
-	timer_target = timer_head->ts.ts32.integer;
-#endif
-	return;
+static void
+timer_heap_up(int pos)
+{
+    pc_timer_t *timer = timer_heap[pos];
+    int parent;
+
+    while (pos > 0) {
+	parent = (pos - 1) >> 2;
+	if (!timer_heap_before(timer, timer_heap[parent]))
+		break;
+	timer_heap_set(pos, timer_heap[parent]);
+	pos = parent;
     }
 
-    timer_node = timer_head;
-
-    while(1) {
-	/*Timer expires before timer_node. Add to list in front of timer_node*/
-	if (TIMER_LESS_THAN(timer, timer_node)) {
-		timer->next = timer_node;
-		timer->prev = timer_node->prev;
-		timer_node->prev = timer;
-		if (timer->prev)
-			timer->prev->next = timer;
-		else {
-			timer_head = timer;
-#if 0
-			timer_target = timer_head->ts_integer;
-#else
-			timer_target = timer_head->ts.ts32.integer;
-#endif
-		}
-		return;
-	}
+    timer_heap_set(pos, timer);
+}
+
+
+static void
+timer_heap_down(int pos)
+{
+    pc_timer_t *timer = timer_heap[pos];
+    int child, last, best, i;
 
-	/*timer_node is last in the list. Add timer to end of list*/
-	if (!timer_node->next) {
-		timer_node->next = timer;
-		timer->prev = timer_node;
-		return;
+    while (1) {
+	child = (pos << 2) + 1;
+	if (child >= timer_heap_count)
+		break;
+
+	last = child + 4;
+	if (last > timer_heap_count)
+		last = timer_heap_count;
+
+	best = child;
+	for (i = child + 1; i < last; i++) {
+		if (timer_heap_before(timer_heap[i], timer_heap[best]))
+			best = i;
 	}
 
-	timer_node = timer_node->next;
+	if (!timer_heap_before(timer_heap[best], timer))
+		break;
+
+	timer_heap_set(pos, timer_heap[best]);
+	pos = best;
     }
+
+    timer_heap_set(pos, timer);
 }
 
 
-void
-timer_disable(pc_timer_t *timer)
+static void
+timer_heap_remove(int pos)
 {
-    if (!timer_inited || (timer == NULL) || !(timer->flags & TIMER_ENABLED))
-	return;
+    pc_timer_t *last;
 
-    if (!timer->next && !timer->prev && timer != timer_head)
-	fatal("timer_disable - !timer->next\n");
+    timer_heap[pos]->heap_pos = 0;
+    timer_heap_count--;
 
-    timer->flags &= ~TIMER_ENABLED;
+    if (pos == timer_heap_count) {
+	timer_heap[pos] = NULL;
+	return;
+    }
+
+    /* Move the last timer into the hole and restore the heap property
+       in whichever direction it is violated. */
+    last = timer_heap[timer_heap_count];
+    timer_heap[timer_heap_count] = NULL;
+    timer_heap_set(pos, last);
 
-    if (timer->prev)
-	timer->prev->next = timer->next;
+    if ((pos > 0) && timer_heap_before(last, timer_heap[(pos - 1) >> 2]))
+	timer_heap_up(pos);
     else
-	timer_head = timer->next;
-    if (timer->next)
-	timer->next->prev = timer->prev;
-    timer->prev = timer->next = NULL;
+	timer_heap_down(pos);
 }
 
 
-static void
-timer_remove_head(void)
+static __inline void
+timer_update_target(void)
 {
-    pc_timer_t *timer;
+    if (timer_heap_count)
+	timer_target = timer_heap[0]->ts.ts32.integer;
+}
 
-    if (!timer_inited)
+
+void
+timer_enable(pc_timer_t *timer)
+{
+    if (!timer_inited || (timer == NULL))
 	return;
 
-    if (timer_head) {
-	timer = timer_head;
-	timer_head = timer->next;
-	if (timer_head) {
-		timer_head->prev = NULL;
-		timer->next->prev = NULL;
-	}
-	timer->next = timer->prev = NULL;
-	timer->flags &= ~TIMER_ENABLED;
+    if (timer->flags & TIMER_ENABLED)
+	timer_disable(timer);
+
+    if (timer->heap_pos)
+	fatal("timer_enable - timer->heap_pos\n");
+
+    if (timer_heap_count == timer_heap_size) {
+	timer_heap_size = timer_heap_size ? (timer_heap_size << 1) : TIMER_HEAP_INIT;
+	timer_heap = (pc_timer_t **) realloc(timer_heap, timer_heap_size * sizeof(pc_timer_t *));
+	if (timer_heap == NULL)
+		fatal("timer_enable - out of memory\n");
     }
+
+    timer->flags |= TIMER_ENABLED;
+    timer->seq = timer_seq++;
+
+    timer_heap_set(timer_heap_count++, timer);
+    timer_heap_up(timer->heap_pos - 1);
+
+    if (timer->heap_pos == 1)
+	timer_target = timer->ts.ts32.integer;
+}
+
+
+void
+timer_disable(pc_timer_t *timer)
+{
+    if (!timer_inited || (timer == NULL) || !(timer->flags & TIMER_ENABLED))
+	return;
+
+    if (!timer->heap_pos || (timer->heap_pos > timer_heap_count) ||
+	(timer_heap[timer->heap_pos - 1] != timer))
+	fatal("timer_disable - timer->heap_pos\n");
+
+    timer->flags &= ~TIMER_ENABLED;
+
+    timer_heap_remove(timer->heap_pos - 1);
 }
 
 
@@ -125,16 +181,17 @@ timer_process(void)
 {
     pc_timer_t *timer;
 
-    if (!timer_inited || !timer_head)
+    if (!timer_inited || !timer_heap_count)
 	return;
 
-    while(1) {
-	timer = timer_head;
+    while (timer_heap_count) {
+	timer = timer_heap[0];
 
 	if (!TIMER_LESS_THAN_VAL(timer, (uint32_t)tsc))
 		break;
 
-	timer_remove_head();
+	timer->flags &= ~TIMER_ENABLED;
+	timer_heap_remove(0);
 
 	if (timer->flags & TIMER_SPLIT)
 		timer_advance_ex(timer, 0);	/* We're splitting a > 1 s period into multiple <= 1 s periods. */
@@ -142,29 +199,28 @@ timer_process(void)
 		timer->callback(timer->p);
     }
 
-#if 0
-    timer_target = timer_head->ts_integer;
-#else
-    timer_target = timer_head->ts.ts32.integer;
-#endif
+    timer_update_target();
 }
 
 
 void
 timer_close(void)
 {
-    pc_timer_t *t = timer_head, *r;
+    int i;
 
-    /* Set all timers' prev and next to NULL so it is assured that
+    /* Detach all the timers from the heap so it is assured that
        timers that are not in malloc'd structs don't keep pointing
-       to timers that may be in malloc'd structs. */
-    while (t != NULL) {
-	r = t;
-	r->prev = r->next = NULL;
-	t = r->next;
+       into a heap that no longer exists. */
+    for (i = 0; i < timer_heap_count; i++) {
+	timer_heap[i]->heap_pos = 0;
+	timer_heap[i]->flags &= ~TIMER_ENABLED;
     }
 
-    timer_head = NULL;
+    if (timer_heap != NULL) {
+	free(timer_heap);
+	timer_heap = NULL;
+    }
+    timer_heap_count = timer_heap_size = 0;
 
     timer_inited = 0;
 }
@@ -176,6 +232,9 @@ timer_init(void)
     timer_target = 0ULL;
     tsc = 0;
 
+    timer_heap_count = 0;
+    timer_seq = 0;
+
     timer_inited = 1;
 }
 
@@ -188,7 +247,7 @@ timer_add(pc_timer_t *timer, void (*callback)(void *p), void *p, int start_timer
     timer->callback = callback;
     timer->p = p;
     timer->flags = 0;
-    timer->prev = timer->next = NULL;
+    timer->heap_pos = 0;
     if (start_timer)
 	timer_set_delay_u64(timer, 0);
 }
@@ -32,6 +32,7 @@
 #include <86box/rom.h>
 #include <86box/device.h>
 #include <86box/timer.h>
+#include <86box/plat.h>
 #include <86box/video.h>
 #include <86box/vid_svga.h>
 #include <86box/vid_svga_render.h>
@@ -130,6 +131,27 @@
 #define CIRRUS_BLTMODEEXT_COLOREXPINV      0x02
 #define CIRRUS_BLTMODEEXT_DWORDGRANULARITY 0x01
 
+#define FIFO_SIZE		65536
+#define FIFO_MASK		(FIFO_SIZE - 1)
+
+#define FIFO_ENTRIES		(gd54xx->fifo_write_idx - gd54xx->fifo_read_idx)
+#define FIFO_FULL		((gd54xx->fifo_write_idx - gd54xx->fifo_read_idx) >= (FIFO_SIZE - 1))
+#define FIFO_EMPTY		(gd54xx->fifo_read_idx == gd54xx->fifo_write_idx)
+
+#define FIFO_TYPE		0xff000000
+#define FIFO_ADDR		0x00ffffff
+
+enum {
+	FIFO_INVALID	= (0x00 << 24),
+	FIFO_WRITE_BLT	= (0x01 << 24),
+	FIFO_START_BLT	= (0x02 << 24)
+};
+
+typedef struct {
+	uint32_t		addr_type;
+	uint32_t		val;
+} fifo_entry_t;
+
 #define CL_GD5428_SYSTEM_BUS_MCA  5
 #define CL_GD5428_SYSTEM_BUS_VESA 6
 #define CL_GD5428_SYSTEM_BUS_ISA  7
@@ -206,6 +228,16 @@ typedef struct gd54xx_t
 
 	uint32_t		extpallook[256];
 	PALETTE		extpal;
+
+	/* Blitter register writes and screen to screen blits are run by
+	   fifo_thread; blits fed from or to system memory stay on the CPU
+	   thread, since every host access steps them. */
+	fifo_entry_t	fifo[FIFO_SIZE];
+	volatile int	fifo_read_idx, fifo_write_idx;
+
+	thread_t		*fifo_thread;
+	event_t		*wake_fifo_thread;
+	event_t		*fifo_not_full_event;
 } gd54xx_t;
 
 
@@ -239,6 +271,8 @@ static void
 gd54xx_reset_blit(gd54xx_t *gd54xx);
 static void
 gd54xx_start_blit(uint32_t cpu_dat, uint32_t count, gd54xx_t *gd54xx, svga_t *svga);
+static void
+gd54xx_blt_write(gd54xx_t *gd54xx, uint8_t addr, uint8_t val);
 
 
 /* Returns 1 if the card is a 5422+ */
@@ -442,6 +476,7 @@ gd54xx_out(uint16_t addr, uint8_t val, void *p)
 			svga->dac_pos++;
 			break;
 		case 2:
+			svga_render_state_changed(svga);
 			index = svga->dac_addr & 0xff;
 			if (svga->seqregs[0x12] & 2) {
 				index &= 0x0f;
@@ -2040,168 +2075,275 @@ gd543x_do_mmio(svga_t *svga, uint32_t addr)
 
 
 static void
-gd543x_mmio_write(uint32_t addr, uint8_t val, void *p)
+fifo_thread(void *param)
+{
+	gd54xx_t *gd54xx = (gd54xx_t *)param;
+	fifo_entry_t *fifo;
+
+	while (1) {
+		thread_set_event(gd54xx->fifo_not_full_event);
+		thread_wait_event(gd54xx->wake_fifo_thread, -1);
+		thread_reset_event(gd54xx->wake_fifo_thread);
+
+		while (!FIFO_EMPTY) {
+			fifo = &gd54xx->fifo[gd54xx->fifo_read_idx & FIFO_MASK];
+
+			switch (fifo->addr_type & FIFO_TYPE) {
+			case FIFO_WRITE_BLT:
+				gd54xx_blt_write(gd54xx, fifo->addr_type & FIFO_ADDR, fifo->val);
+				break;
+			case FIFO_START_BLT:
+				gd54xx_start_blit(0, 0xffffffff, gd54xx, &gd54xx->svga);
+				break;
+			}
+
+			gd54xx->fifo_read_idx++;
+			fifo->addr_type = FIFO_INVALID;
+
+			if (FIFO_ENTRIES > 0xe000)
+				thread_set_event(gd54xx->fifo_not_full_event);
+		}
+	}
+}
+
+
+static __inline void
+wake_fifo_thread(gd54xx_t *gd54xx)
+{
+	thread_set_event(gd54xx->wake_fifo_thread); /* Wake up FIFO thread if moving from idle */
+}
+
+
+static void
+gd54xx_wait_fifo_idle(gd54xx_t *gd54xx)
+{
+	while (!FIFO_EMPTY) {
+		wake_fifo_thread(gd54xx);
+		thread_wait_event(gd54xx->fifo_not_full_event, 1);
+	}
+}
+
+
+static void
+gd54xx_queue(gd54xx_t *gd54xx, uint32_t addr, uint32_t val, uint32_t type)
+{
+	fifo_entry_t *fifo = &gd54xx->fifo[gd54xx->fifo_write_idx & FIFO_MASK];
+
+	if (FIFO_FULL) {
+		thread_reset_event(gd54xx->fifo_not_full_event);
+		if (FIFO_FULL)
+			thread_wait_event(gd54xx->fifo_not_full_event, -1); /* Wait for room in ringbuffer */
+	}
+
+	fifo->val = val;
+	fifo->addr_type = (addr & FIFO_ADDR) | type;
+
+	gd54xx->fifo_write_idx++;
+
+	if (FIFO_ENTRIES > 0xe000 || FIFO_ENTRIES < 8)
+		wake_fifo_thread(gd54xx);
+}
+
+
+/* Blits the host feeds through system memory run synchronously as before;
+   screen to screen and pattern blits go to the FIFO thread, with BUSY set
+   until it has finished them. */
+static void
+gd54xx_blt_start(gd54xx_t *gd54xx)
+{
+	gd54xx->blt.status |= CIRRUS_BLT_BUSY;
+
+	if (gd54xx->blt.mode & (CIRRUS_BLTMODE_MEMSYSSRC | CIRRUS_BLTMODE_MEMSYSDEST))
+		gd54xx_start_blit(0, 0xffffffff, gd54xx, &gd54xx->svga);
+	else
+		gd54xx_queue(gd54xx, 0, 0, FIFO_START_BLT);
+}
+
+
+static void
+gd54xx_blt_write(gd54xx_t *gd54xx, uint8_t addr, uint8_t val)
 {
-	gd54xx_t *gd54xx = (gd54xx_t *)p;
 	svga_t *svga = &gd54xx->svga;
 	uint8_t old;
 
-	if (gd543x_do_mmio(svga, addr)) {
-		switch (addr & 0xff) {
-		case 0x00:
-			if (gd54xx_is_5434(svga))
-				gd54xx->blt.bg_col = (gd54xx->blt.bg_col & 0xffffff00) | val;
-			else
-				gd54xx->blt.bg_col = (gd54xx->blt.bg_col & 0xff00) | val;
-			break;
-		case 0x01:
-			if (gd54xx_is_5434(svga))
-				gd54xx->blt.bg_col = (gd54xx->blt.bg_col & 0xffff00ff) | (val << 8);
-			else
-				gd54xx->blt.bg_col = (gd54xx->blt.bg_col & 0x00ff) | (val << 8);
-			break;
-		case 0x02:
-			if (gd54xx_is_5434(svga))
-				gd54xx->blt.bg_col = (gd54xx->blt.bg_col & 0xff00ffff) | (val << 16);
-			break;
-		case 0x03:
-			if (gd54xx_is_5434(svga))
-				gd54xx->blt.bg_col = (gd54xx->blt.bg_col & 0x00ffffff) | (val << 24);
-			break;
+	switch (addr) {
+	case 0x00:
+		if (gd54xx_is_5434(svga))
+			gd54xx->blt.bg_col = (gd54xx->blt.bg_col & 0xffffff00) | val;
+		else
+			gd54xx->blt.bg_col = (gd54xx->blt.bg_col & 0xff00) | val;
+		break;
+	case 0x01:
+		if (gd54xx_is_5434(svga))
+			gd54xx->blt.bg_col = (gd54xx->blt.bg_col & 0xffff00ff) | (val << 8);
+		else
+			gd54xx->blt.bg_col = (gd54xx->blt.bg_col & 0x00ff) | (val << 8);
+		break;
+	case 0x02:
+		if (gd54xx_is_5434(svga))
+			gd54xx->blt.bg_col = (gd54xx->blt.bg_col & 0xff00ffff) | (val << 16);
+		break;
+	case 0x03:
+		if (gd54xx_is_5434(svga))
+			gd54xx->blt.bg_col = (gd54xx->blt.bg_col & 0x00ffffff) | (val << 24);
+		break;
 
-		case 0x04:
-			if (gd54xx_is_5434(svga))
-				gd54xx->blt.fg_col = (gd54xx->blt.fg_col & 0xffffff00) | val;
-			else
-				gd54xx->blt.fg_col = (gd54xx->blt.fg_col & 0xff00) | val;
-			break;
-		case 0x05:
-			if (gd54xx_is_5434(svga))
-				gd54xx->blt.fg_col = (gd54xx->blt.fg_col & 0xffff00ff) | (val << 8);
-			else
-				gd54xx->blt.fg_col = (gd54xx->blt.fg_col & 0x00ff) | (val << 8);
-			break;
-		case 0x06:
-			if (gd54xx_is_5434(svga))
-				gd54xx->blt.fg_col = (gd54xx->blt.fg_col & 0xff00ffff) | (val << 16);
-			break;
-		case 0x07:
-			if (gd54xx_is_5434(svga))
-				gd54xx->blt.fg_col = (gd54xx->blt.fg_col & 0x00ffffff) | (val << 24);
-			break;
+	case 0x04:
+		if (gd54xx_is_5434(svga))
+			gd54xx->blt.fg_col = (gd54xx->blt.fg_col & 0xffffff00) | val;
+		else
+			gd54xx->blt.fg_col = (gd54xx->blt.fg_col & 0xff00) | val;
+		break;
+	case 0x05:
+		if (gd54xx_is_5434(svga))
+			gd54xx->blt.fg_col = (gd54xx->blt.fg_col & 0xffff00ff) | (val << 8);
+		else
+			gd54xx->blt.fg_col = (gd54xx->blt.fg_col & 0x00ff) | (val << 8);
+		break;
+	case 0x06:
+		if (gd54xx_is_5434(svga))
+			gd54xx->blt.fg_col = (gd54xx->blt.fg_col & 0xff00ffff) | (val << 16);
+		break;
+	case 0x07:
+		if (gd54xx_is_5434(svga))
+			gd54xx->blt.fg_col = (gd54xx->blt.fg_col & 0x00ffffff) | (val << 24);
+		break;
 
-		case 0x08:
-			gd54xx->blt.width = (gd54xx->blt.width & 0xff00) | val;
-			break;
-		case 0x09:
-			gd54xx->blt.width = (gd54xx->blt.width & 0x00ff) | (val << 8);
-			if (gd54xx_is_5434(svga))
-				gd54xx->blt.width &= 0x1fff;
-			else
-				gd54xx->blt.width &= 0x07ff;
-			break;
-		case 0x0a:
-			gd54xx->blt.height = (gd54xx->blt.height & 0xff00) | val;
-			break;
-		case 0x0b:
-			gd54xx->blt.height = (gd54xx->blt.height & 0x00ff) | (val << 8);
-			if (svga->crtc[0x27] >= CIRRUS_ID_CLGD5436)
-				gd54xx->blt.height &= 0x07ff;
-			else
-				gd54xx->blt.height &= 0x03ff;
-			break;
-		case 0x0c:
-			gd54xx->blt.dst_pitch = (gd54xx->blt.dst_pitch & 0xff00) | val;
-			break;
-		case 0x0d:
-			gd54xx->blt.dst_pitch = (gd54xx->blt.dst_pitch & 0x00ff) | (val << 8);
-			gd54xx->blt.dst_pitch &= 0x1fff;
-			break;
-		case 0x0e:
-			gd54xx->blt.src_pitch = (gd54xx->blt.src_pitch & 0xff00) | val;
-			break;
-		case 0x0f:
-			gd54xx->blt.src_pitch = (gd54xx->blt.src_pitch & 0x00ff) | (val << 8);
-			gd54xx->blt.src_pitch &= 0x1fff;
-			break;
+	case 0x08:
+		gd54xx->blt.width = (gd54xx->blt.width & 0xff00) | val;
+		break;
+	case 0x09:
+		gd54xx->blt.width = (gd54xx->blt.width & 0x00ff) | (val << 8);
+		if (gd54xx_is_5434(svga))
+			gd54xx->blt.width &= 0x1fff;
+		else
+			gd54xx->blt.width &= 0x07ff;
+		break;
+	case 0x0a:
+		gd54xx->blt.height = (gd54xx->blt.height & 0xff00) | val;
+		break;
+	case 0x0b:
+		gd54xx->blt.height = (gd54xx->blt.height & 0x00ff) | (val << 8);
+		if (svga->crtc[0x27] >= CIRRUS_ID_CLGD5436)
+			gd54xx->blt.height &= 0x07ff;
+		else
+			gd54xx->blt.height &= 0x03ff;
+		break;
+	case 0x0c:
+		gd54xx->blt.dst_pitch = (gd54xx->blt.dst_pitch & 0xff00) | val;
+		break;
+	case 0x0d:
+		gd54xx->blt.dst_pitch = (gd54xx->blt.dst_pitch & 0x00ff) | (val << 8);
+		gd54xx->blt.dst_pitch &= 0x1fff;
+		break;
+	case 0x0e:
+		gd54xx->blt.src_pitch = (gd54xx->blt.src_pitch & 0xff00) | val;
+		break;
+	case 0x0f:
+		gd54xx->blt.src_pitch = (gd54xx->blt.src_pitch & 0x00ff) | (val << 8);
+		gd54xx->blt.src_pitch &= 0x1fff;
+		break;
 
-		case 0x10:
-			gd54xx->blt.dst_addr = (gd54xx->blt.dst_addr & 0xffff00) | val;
-			break;
-		case 0x11:
-			gd54xx->blt.dst_addr = (gd54xx->blt.dst_addr & 0xff00ff) | (val << 8);
-			break;
-		case 0x12:
-			gd54xx->blt.dst_addr = (gd54xx->blt.dst_addr & 0x00ffff) | (val << 16);
-			if (gd54xx_is_5434(svga))
-				gd54xx->blt.dst_addr &= 0x3fffff;
-			else
-				gd54xx->blt.dst_addr &= 0x1fffff;
+	case 0x10:
+		gd54xx->blt.dst_addr = (gd54xx->blt.dst_addr & 0xffff00) | val;
+		break;
+	case 0x11:
+		gd54xx->blt.dst_addr = (gd54xx->blt.dst_addr & 0xff00ff) | (val << 8);
+		break;
+	case 0x12:
+		gd54xx->blt.dst_addr = (gd54xx->blt.dst_addr & 0x00ffff) | (val << 16);
+		if (gd54xx_is_5434(svga))
+			gd54xx->blt.dst_addr &= 0x3fffff;
+		else
+			gd54xx->blt.dst_addr &= 0x1fffff;
 
-			if ((svga->crtc[0x27] >= CIRRUS_ID_CLGD5436) && (gd54xx->blt.status & CIRRUS_BLT_AUTOSTART) &&
-				!(gd54xx->blt.status & CIRRUS_BLT_BUSY)) {
-				gd54xx->blt.status |= CIRRUS_BLT_BUSY;
-				gd54xx_start_blit(0, 0xffffffff, gd54xx, svga);
-			}
-			break;
+		if ((svga->crtc[0x27] >= CIRRUS_ID_CLGD5436) && (gd54xx->blt.status & CIRRUS_BLT_AUTOSTART) &&
+			!(gd54xx->blt.status & CIRRUS_BLT_BUSY)) {
+			gd54xx_blt_start(gd54xx);
+		}
+		break;
 
-		case 0x14:
-			gd54xx->blt.src_addr = (gd54xx->blt.src_addr & 0xffff00) | val;
-			break;
-		case 0x15:
-			gd54xx->blt.src_addr = (gd54xx->blt.src_addr & 0xff00ff) | (val << 8);
-			break;
-		case 0x16:
-			gd54xx->blt.src_addr = (gd54xx->blt.src_addr & 0x00ffff) | (val << 16);
-			if (gd54xx_is_5434(svga))
-				gd54xx->blt.src_addr &= 0x3fffff;
-			else
-				gd54xx->blt.src_addr &= 0x1fffff;
-			break;
+	case 0x14:
+		gd54xx->blt.src_addr = (gd54xx->blt.src_addr & 0xffff00) | val;
+		break;
+	case 0x15:
+		gd54xx->blt.src_addr = (gd54xx->blt.src_addr & 0xff00ff) | (val << 8);
+		break;
+	case 0x16:
+		gd54xx->blt.src_addr = (gd54xx->blt.src_addr & 0x00ffff) | (val << 16);
+		if (gd54xx_is_5434(svga))
+			gd54xx->blt.src_addr &= 0x3fffff;
+		else
+			gd54xx->blt.src_addr &= 0x1fffff;
+		break;
 
-		case 0x17:
-			gd54xx->blt.mask = val;
-			break;
-		case 0x18:
-			gd54xx->blt.mode = val;
-			gd543x_recalc_mapping(gd54xx);
-			break;
+	case 0x17:
+		gd54xx->blt.mask = val;
+		break;
+	case 0x18:
+		gd54xx->blt.mode = val;
+		gd543x_recalc_mapping(gd54xx);
+		break;
 
-		case 0x1a:
-			gd54xx->blt.rop = val;
-			break;
+	case 0x1a:
+		gd54xx->blt.rop = val;
+		break;
 
-		case 0x1b:
-			if (svga->crtc[0x27] >= CIRRUS_ID_CLGD5436)
-				gd54xx->blt.modeext = val;
-			break;
+	case 0x1b:
+		if (svga->crtc[0x27] >= CIRRUS_ID_CLGD5436)
+			gd54xx->blt.modeext = val;
+		break;
 
-		case 0x1c:
-			gd54xx->blt.trans_col = (gd54xx->blt.trans_col & 0xff00) | val;
-			break;
-		case 0x1d:
-			gd54xx->blt.trans_col = (gd54xx->blt.trans_col & 0x00ff) | (val << 8);
-			break;
+	case 0x1c:
+		gd54xx->blt.trans_col = (gd54xx->blt.trans_col & 0xff00) | val;
+		break;
+	case 0x1d:
+		gd54xx->blt.trans_col = (gd54xx->blt.trans_col & 0x00ff) | (val << 8);
+		break;
 
-		case 0x20:
-			gd54xx->blt.trans_mask = (gd54xx->blt.trans_mask & 0xff00) | val;
-			break;
-		case 0x21:
-			gd54xx->blt.trans_mask = (gd54xx->blt.trans_mask & 0x00ff) | (val << 8);
-			break;
+	case 0x20:
+		gd54xx->blt.trans_mask = (gd54xx->blt.trans_mask & 0xff00) | val;
+		break;
+	case 0x21:
+		gd54xx->blt.trans_mask = (gd54xx->blt.trans_mask & 0x00ff) | (val << 8);
+		break;
 
-		case 0x40:
-			old = gd54xx->blt.status;
-			gd54xx->blt.status = val;
-			gd543x_recalc_mapping(gd54xx);
-			if (!(old & CIRRUS_BLT_RESET) && (gd54xx->blt.status & CIRRUS_BLT_RESET))
-				gd54xx_reset_blit(gd54xx);
-			else if (!(old & CIRRUS_BLT_START) && (gd54xx->blt.status & CIRRUS_BLT_START)) {
-				gd54xx->blt.status |= CIRRUS_BLT_BUSY;
-				gd54xx_start_blit(0, 0xffffffff, gd54xx, svga);
-			}
-			break;
+	case 0x40:
+		old = gd54xx->blt.status;
+		gd54xx->blt.status = val;
+		gd543x_recalc_mapping(gd54xx);
+		if (!(old & CIRRUS_BLT_RESET) && (gd54xx->blt.status & CIRRUS_BLT_RESET))
+			gd54xx_reset_blit(gd54xx);
+		else if (!(old & CIRRUS_BLT_START) && (gd54xx->blt.status & CIRRUS_BLT_START)) {
+			gd54xx_blt_start(gd54xx);
 		}
+		break;
+	}
+}
+
+
+static void
+gd543x_mmio_write(uint32_t addr, uint8_t val, void *p)
+{
+	gd54xx_t *gd54xx = (gd54xx_t *)p;
+	svga_t *svga = &gd54xx->svga;
+
+	if (gd543x_do_mmio(svga, addr)) {
+		addr &= 0xff;
+
+		/* Writes that can start a blit (GR31/0x40, and the destination
+		   high byte at 0x12 - also reached through GR2A - in autostart
+		   mode), BLTMODE (it remaps memory, which must stay on the CPU
+		   thread) and anything touching a blit the host is feeding are
+		   done here once the FIFO has drained; the rest queue up behind
+		   whatever blit is running. */
+		if ((addr == 0x40) || (addr == 0x18) || gd54xx->countminusone ||
+		    ((addr == 0x12) && (svga->crtc[0x27] >= CIRRUS_ID_CLGD5436) &&
+		    (gd54xx->blt.status & CIRRUS_BLT_AUTOSTART))) {
+			gd54xx_wait_fifo_idle(gd54xx);
+			gd54xx_blt_write(gd54xx, addr, val);
+		} else
+			gd54xx_queue(gd54xx, addr, val, FIFO_WRITE_BLT);
 	}
 	else if (gd54xx->mmio_vram_overlap)
 		gd54xx_write(addr, val, gd54xx);
@@ -2286,6 +2428,11 @@ gd543x_mmio_read(uint32_t addr, void *p)
 	uint8_t ret = 0xff;
 
 	if (gd543x_do_mmio(svga, addr)) {
+		/* Only the status register may be read while the blitter is
+		   still working through the FIFO. */
+		if ((addr & 0xff) != 0x40)
+			gd54xx_wait_fifo_idle(gd54xx);
+
 		switch (addr & 0xff) {
 		case 0x00:
 			ret = gd54xx->blt.bg_col & 0xff;
@@ -2406,6 +2553,8 @@ gd543x_mmio_read(uint32_t addr, void *p)
 
 		case 0x40:
 			ret = gd54xx->blt.status;
+			if (!FIFO_EMPTY)
+				ret |= CIRRUS_BLT_BUSY;
 			break;
 		}
 	}
@@ -3248,6 +3397,10 @@ static void
 		mca_add(gd5428_mca_read, gd5428_mca_write, gd5428_mca_feedb, NULL, gd54xx);
 	}
 
+	gd54xx->wake_fifo_thread = thread_create_event();
+	gd54xx->fifo_not_full_event = thread_create_event();
+	gd54xx->fifo_thread = thread_create(fifo_thread, gd54xx);
+
 	return gd54xx;
 }
 
@@ -3356,6 +3509,10 @@ gd54xx_close(void *p)
 
 	svga_close(&gd54xx->svga);
 
+	thread_kill(gd54xx->fifo_thread);
+	thread_destroy_event(gd54xx->wake_fifo_thread);
+	thread_destroy_event(gd54xx->fifo_not_full_event);
+
 	free(gd54xx);
 }
 
@@ -642,7 +642,7 @@ ega_doblit(int y1, int y2, int wx, int wy, ega_t *ega)
     int x_start = (enable_overscan) ? 0 : (overscan_x >> 1);
     int bottom = (overscan_y >> 1) + (ega->crtc[8] & 0x1f);
     uint32_t *p;
-    int i, j;
+    int i, j, row, changed;
     int xs_temp, ys_temp;
 
     if (ega->vres) {
@@ -693,24 +693,34 @@ ega_doblit(int y1, int y2, int wx, int wy, ega_t *ega)
 		video_force_resize_set(0);
     }
 
-    if ((wx >= 160) && ((wy + 1) >= 120)) {
-	/* Draw (overscan_size - scroll size) lines of overscan on top and bottom. */
-	for (i  = 0; i < ega->y_add; i++) {
-		p = &buffer32->line[i & 0x7ff][0];
-
-		for (j = 0; j < (xsize + x_add); j++)
-			p[j] = ega->overscan_color;
-	}
+    y2 += y_add;
 
-	for (i  = 0; i < bottom; i++) {
-		p = &buffer32->line[(ysize + ega->y_add + i) & 0x7ff][0];
+    if ((wx >= 160) && ((wy + 1) >= 120)) {
+	/* Draw (overscan_size - scroll size) lines of overscan on top and bottom,
+	   and widen the blitted range to take in any of those lines that changed,
+	   as they lie outside the lines the renderer drew. */
+	for (i  = 0; i < (ega->y_add + bottom); i++) {
+		row = (i < ega->y_add) ? i : (ysize + i);
+		p = &buffer32->line[row & 0x7ff][0];
+
+		changed = 0;
+		for (j = 0; j < (xsize + x_add); j++) {
+			if (p[j] != ega->overscan_color) {
+				p[j] = ega->overscan_color;
+				changed = 1;
+			}
+		}
 
-		for (j = 0; j < (xsize + x_add); j++)
-			p[j] = ega->overscan_color;
+		if (changed) {
+			if ((row - y_start) < y1)
+				y1 = row - y_start;
+			if ((row - y_start + 1) > y2)
+				y2 = row - y_start + 1;
+		}
 	}
     }
 
-    video_blit_memtoscreen(x_start, y_start, y1, y2 + y_add, xsize + x_add, ysize + y_add);
+    video_blit_memtoscreen(x_start, y_start, y1, y2, xsize + x_add, ysize + y_add);
 
     if (ega->vres)
 	ega->y_add >>= 1;
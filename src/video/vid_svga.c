@@ -34,6 +34,7 @@
 #include <86box/pit.h>
 #include <86box/mem.h>
 #include <86box/rom.h>
+#include <86box/plat.h>
 #include <86box/video.h>
 #include <86box/vid_svga.h>
 #include <86box/vid_svga_render.h>
@@ -51,6 +52,64 @@ uint8_t		svga_rotate[8][256];
 static svga_t	*svga_pri;
 
 
+/*Threaded scanline rendering. When enabled, svga_poll() records a small job for
+  every displayed line (the render function, ma, ca, sc, displine, x_add and the
+  other values that change from line to line) and hands bands of
+  SVGA_RENDER_BAND lines to the worker threads in turn. Each worker keeps its own
+  copy of svga_t, refreshed from the card when a band is started for it, which
+  holds the mode registers, the palette and the lookup tables; the job's fields
+  are written over it before each line is rendered. Each line renders into its
+  own line of buffer32, so the workers never touch the same pixels. A write that
+  changes any of the copied state (svga_out(), svga_recalctimings(), a palette
+  write from a card's own DAC port) ends the current band through
+  svga_render_state_changed(), so every band renders with the state its lines
+  were queued under. Lines with a
+  hardware cursor or overlay are drawn on the emulation thread after the queue
+  has been drained, as those callbacks read card state. The queue is always
+  drained before changedvram is aged and before svga_doblit(), and the workers'
+  firstline_draw/lastline_draw are merged back at that point.*/
+#define SVGA_RENDER_MAX_THREADS	8
+#define SVGA_RENDER_MAX_LINES	2048
+#define SVGA_RENDER_BAND	16
+
+struct svga_render_threads_t;
+
+typedef struct {
+    void	(*render)(struct svga_t *svga);
+
+    uint32_t	ma, ca,
+		*map8;			/*NULL for the copy's own pallook*/
+
+    int		displine, sc,
+		x_add, y_add,
+		scrollcache, hdisp,
+		fullchange,
+		con, cursoron, blink;
+} svga_render_job_t;
+
+typedef struct {
+    struct svga_render_threads_t *rt;
+
+    thread_t	*thread;
+    event_t	*wake_event, *done_event;
+
+    int		busy, start, end,
+		firstline_draw, lastline_draw;
+
+    svga_t	svga;
+} svga_render_worker_t;
+
+typedef struct svga_render_threads_t {
+    svga_render_job_t *jobs;
+
+    int		queued, dispatched,
+		nr_workers, next_worker,
+		run;
+
+    svga_render_worker_t worker[SVGA_RENDER_MAX_THREADS];
+} svga_render_threads_t;
+
+
 svga_t
 *svga_get_pri()
 {
@@ -91,6 +150,8 @@ svga_out(uint16_t addr, uint8_t val, void *p)
     int c;
     uint8_t o, index;
 
+    svga_render_state_changed(svga);
+
     switch (addr) {
 	case 0x3c0:
 	case 0x3c1:
@@ -395,6 +456,8 @@ svga_recalctimings(svga_t *svga)
 {
     double crtcconst, _dispontime, _dispofftime, disptime;
 
+    svga_render_state_changed(svga);
+
     svga->vtotal = svga->crtc[6];
     svga->dispend = svga->crtc[0x12];
     svga->vsyncstart = svga->crtc[0x10];
@@ -567,16 +630,258 @@ svga_recalctimings(svga_t *svga)
 }
 
 
+static void
+svga_render_line(svga_t *svga)
+{
+    svga->render(svga);
+
+    svga->x_add = (overscan_x >> 1);
+    svga_render_overscan_left(svga);
+    svga_render_overscan_right(svga);
+    svga->x_add = (overscan_x >> 1) - svga->scrollcache;
+}
+
+
+static void
+svga_render_thread(void *param)
+{
+    svga_render_worker_t *w = (svga_render_worker_t *)param;
+    svga_render_threads_t *rt = w->rt;
+    svga_render_job_t *job;
+    svga_t *svga = &w->svga;
+    int c;
+
+    while (1) {
+	thread_wait_event(w->wake_event, -1);
+	thread_reset_event(w->wake_event);
+
+	if (!rt->run)
+		break;
+
+	w->firstline_draw = 2000;
+	w->lastline_draw = 0;
+
+	for (c = w->start; c < w->end; c++) {
+		job = &rt->jobs[c];
+
+		svga->render = job->render;
+		svga->ma = job->ma;
+		svga->ca = job->ca;
+		svga->map8 = job->map8 ? job->map8 : svga->pallook;
+		svga->displine = job->displine;
+		svga->sc = job->sc;
+		svga->x_add = job->x_add;
+		svga->y_add = job->y_add;
+		svga->scrollcache = job->scrollcache;
+		svga->hdisp = job->hdisp;
+		svga->fullchange = job->fullchange;
+		svga->con = job->con;
+		svga->cursoron = job->cursoron;
+		svga->blink = job->blink;
+		svga->firstline_draw = 2000;
+		svga->lastline_draw = 0;
+
+		svga_render_line(svga);
+
+		if (svga->firstline_draw != 2000) {
+			if (svga->firstline_draw < w->firstline_draw)
+				w->firstline_draw = svga->firstline_draw;
+			if (svga->lastline_draw > w->lastline_draw)
+				w->lastline_draw = svga->lastline_draw;
+		}
+	}
+
+	thread_set_event(w->done_event);
+    }
+}
+
+
+/*Wait for a worker to finish its band, and fold the lines it drew into the
+  frame's dirty range.*/
+static void
+svga_render_collect(svga_t *svga, svga_render_worker_t *w)
+{
+    if (!w->busy)
+	return;
+
+    thread_wait_event(w->done_event, -1);
+    thread_reset_event(w->done_event);
+    w->busy = 0;
+
+    if (w->firstline_draw < svga->firstline_draw)
+	svga->firstline_draw = w->firstline_draw;
+    if (w->lastline_draw > svga->lastline_draw)
+	svga->lastline_draw = w->lastline_draw;
+}
+
+
+static void
+svga_render_dispatch(svga_t *svga)
+{
+    svga_render_threads_t *rt = (svga_render_threads_t *)svga->render_threads;
+    svga_render_worker_t *w = &rt->worker[rt->next_worker];
+
+    if (rt->dispatched == rt->queued)
+	return;
+
+    svga_render_collect(svga, w);
+
+    w->start = rt->dispatched;
+    w->end = rt->queued;
+    w->busy = 1;
+    rt->dispatched = rt->queued;
+
+    thread_set_event(w->wake_event);
+
+    rt->next_worker = (rt->next_worker + 1) % rt->nr_workers;
+}
+
+
+/*Hand the lines queued so far to a worker, so the next queued line starts a new
+  band with a fresh copy of svga_t. Called before or just after anything in
+  svga_t that the renderers read is changed, so that it never shows up on lines
+  queued before the change.*/
+void
+svga_render_state_changed(svga_t *svga)
+{
+    if (svga->render_threads)
+	svga_render_dispatch(svga);
+}
+
+
+/*Render every queued line and return once buffer32 is up to date.*/
+static void
+svga_render_flush(svga_t *svga)
+{
+    svga_render_threads_t *rt = (svga_render_threads_t *)svga->render_threads;
+    int c;
+
+    if (!rt)
+	return;
+
+    svga_render_dispatch(svga);
+
+    for (c = 0; c < rt->nr_workers; c++)
+	svga_render_collect(svga, &rt->worker[c]);
+
+    rt->queued = rt->dispatched = 0;
+}
+
+
+/*Queue the current line for the render threads. Returns 0 if the line has to be
+  rendered on the emulation thread instead.*/
+static int
+svga_render_queue(svga_t *svga)
+{
+    svga_render_threads_t *rt = (svga_render_threads_t *)svga->render_threads;
+    svga_render_worker_t *w;
+    svga_render_job_t *job;
+
+    if (!rt)
+	return 0;
+
+    if (svga->hwcursor_on || svga->dac_hwcursor_on || svga->overlay_on) {
+	svga_render_flush(svga);
+	return 0;
+    }
+
+    if (rt->queued == SVGA_RENDER_MAX_LINES)
+	svga_render_flush(svga);
+
+    /*First line of a band, bring the copy of the card state up to date for the
+      worker that will render it.*/
+    if (rt->queued == rt->dispatched) {
+	w = &rt->worker[rt->next_worker];
+	svga_render_collect(svga, w);
+	memcpy(&w->svga, svga, sizeof(svga_t));
+    }
+
+    job = &rt->jobs[rt->queued++];
+    job->render = svga->render;
+    job->ma = svga->ma;
+    job->ca = svga->ca;
+    job->map8 = (svga->map8 == svga->pallook) ? NULL : svga->map8;
+    job->displine = svga->displine;
+    job->sc = svga->sc;
+    job->x_add = svga->x_add;
+    job->y_add = svga->y_add;
+    job->scrollcache = svga->scrollcache;
+    job->hdisp = svga->hdisp;
+    job->fullchange = svga->fullchange;
+    job->con = svga->con;
+    job->cursoron = svga->cursoron;
+    job->blink = svga->blink;
+
+    if ((rt->queued - rt->dispatched) >= SVGA_RENDER_BAND)
+	svga_render_dispatch(svga);
+
+    return 1;
+}
+
+
+static void
+svga_render_threads_init(svga_t *svga, int nr_threads)
+{
+    svga_render_threads_t *rt;
+    svga_render_worker_t *w;
+    int c;
+
+    if (nr_threads > SVGA_RENDER_MAX_THREADS)
+	nr_threads = SVGA_RENDER_MAX_THREADS;
+
+    rt = (svga_render_threads_t *)malloc(sizeof(svga_render_threads_t));
+    memset(rt, 0, sizeof(svga_render_threads_t));
+    rt->jobs = (svga_render_job_t *)malloc(SVGA_RENDER_MAX_LINES * sizeof(svga_render_job_t));
+    rt->nr_workers = nr_threads;
+    rt->run = 1;
+
+    for (c = 0; c < nr_threads; c++) {
+	w = &rt->worker[c];
+	w->rt = rt;
+	w->wake_event = thread_create_event();
+	w->done_event = thread_create_event();
+	w->thread = thread_create(svga_render_thread, w);
+    }
+
+    svga->render_threads = rt;
+}
+
+
+static void
+svga_render_threads_close(svga_t *svga)
+{
+    svga_render_threads_t *rt = (svga_render_threads_t *)svga->render_threads;
+    svga_render_worker_t *w;
+    int c;
+
+    if (!rt)
+	return;
+
+    svga_render_flush(svga);
+
+    rt->run = 0;
+    for (c = 0; c < rt->nr_workers; c++) {
+	w = &rt->worker[c];
+	thread_set_event(w->wake_event);
+	thread_wait(w->thread, -1);
+	thread_destroy_event(w->wake_event);
+	thread_destroy_event(w->done_event);
+    }
+
+    free(rt->jobs);
+    free(rt);
+    svga->render_threads = NULL;
+}
+
+
 static void
 svga_do_render(svga_t *svga)
 {
     if (!svga->override) {
-	svga->render(svga);
-
-	svga->x_add = (overscan_x >> 1);
-	svga_render_overscan_left(svga);
-	svga_render_overscan_right(svga);
-	svga->x_add = (overscan_x >> 1) - svga->scrollcache;
+	if (svga_render_queue(svga))
+		svga->x_add = (overscan_x >> 1) - svga->scrollcache;
+	else
+		svga_render_line(svga);
     }
 
     if (svga->overlay_on) {
@@ -750,6 +1055,8 @@ svga_poll(void *p)
 		}
 	}
 	if (svga->vc == svga->dispend) {
+		svga_render_flush(svga);
+
 		if (svga->vblank_start)
 			svga->vblank_start(svga);
 		svga->dispon = 0;
@@ -773,6 +1080,8 @@ svga_poll(void *p)
 			svga->fullchange--;
 	}
 	if (svga->vc == svga->vsyncstart) {
+		svga_render_flush(svga);
+
 		svga->dispon = 0;
 		svga->cgastat |= 8;
 		x = svga->hdisp;
@@ -940,6 +1249,9 @@ svga_init(const device_t *info, svga_t *svga, void *p, int memsize,
 
     svga->map8 = svga->pallook;
 
+    if (svga_render_threads > 0)
+	svga_render_threads_init(svga, svga_render_threads);
+
     return 0;
 }
 
@@ -947,6 +1259,8 @@ svga_init(const device_t *info, svga_t *svga, void *p, int memsize,
 void
 svga_close(svga_t *svga)
 {
+    svga_render_threads_close(svga);
+
     free(svga->changedvram);
     free(svga->vram);
 
@@ -1262,7 +1576,7 @@ svga_doblit(int y1, int y2, int wx, int wy, svga_t *svga)
 {
     int y_add, x_add, y_start, x_start, bottom;
     uint32_t *p;
-    int i, j;
+    int i, j, row, changed;
     int xs_temp, ys_temp;
 
     y_add = (enable_overscan) ? overscan_y : 0;
@@ -1319,24 +1633,34 @@ svga_doblit(int y1, int y2, int wx, int wy, svga_t *svga)
 		video_force_resize_set(0);
     }
 
-    if ((wx >= 160) && ((wy + 1) >= 120)) {
-	/* Draw (overscan_size - scroll size) lines of overscan on top and bottom. */
-	for (i  = 0; i < svga->y_add; i++) {
-		p = &buffer32->line[i & 0x7ff][0];
-
-		for (j = 0; j < (xsize + x_add); j++)
-			p[j] = svga->overscan_color;
-	}
+    y2 += y_add;
 
-	for (i  = 0; i < bottom; i++) {
-		p = &buffer32->line[(ysize + svga->y_add + i) & 0x7ff][0];
+    if ((wx >= 160) && ((wy + 1) >= 120)) {
+	/* Draw (overscan_size - scroll size) lines of overscan on top and bottom,
+	   and widen the blitted range to take in any of those lines that changed,
+	   as they lie outside the lines the renderer drew. */
+	for (i  = 0; i < (svga->y_add + bottom); i++) {
+		row = (i < svga->y_add) ? i : (ysize + i);
+		p = &buffer32->line[row & 0x7ff][0];
+
+		changed = 0;
+		for (j = 0; j < (xsize + x_add); j++) {
+			if (p[j] != svga->overscan_color) {
+				p[j] = svga->overscan_color;
+				changed = 1;
+			}
+		}
 
-		for (j = 0; j < (xsize + x_add); j++)
-			p[j] = svga->overscan_color;
+		if (changed) {
+			if ((row - y_start) < y1)
+				y1 = row - y_start;
+			if ((row - y_start + 1) > y2)
+				y2 = row - y_start + 1;
+		}
 	}
     }
 
-    video_blit_memtoscreen(x_start, y_start, y1, y2 + y_add, xsize + x_add, ysize + y_add);
+    video_blit_memtoscreen(x_start, y_start, y1, y2, xsize + x_add, ysize + y_add);
 
     if (svga->vertical_linedbl)
 	svga->vertical_linedbl >>= 1;
@@ -27,6 +27,118 @@
 #include <86box/video.h>
 #include <86box/vid_svga.h>
 #include <86box/vid_svga_render.h>
+#if defined __SSE2__ || defined __amd64__ || defined _M_X64
+#define USE_SSE2_RENDER
+#include <emmintrin.h>
+#endif
+
+
+#ifdef USE_SSE2_RENDER
+/*SSE2 versions of the inner loops of the high resolution direct colour
+  renderers. These are only used when the whole line is contiguous in VRAM (ie
+  it does not wrap around vram_display_mask), otherwise the scalar loops below
+  handle the wrap one dword at a time.
+
+  The 15/16 bpp kernels compute the same values as the video_15to32/video_16to32
+  tables (c * 255 / 31 or 63, truncated) with a 16-bit fixed point multiply
+  rather than two lookups per dword.*/
+static __inline int
+svga_render_linear(svga_t *svga, uint32_t addr, uint32_t len)
+{
+    return ((addr + len) <= ((uint32_t) svga->vram_display_mask + 1)) &&
+	   ((addr + len) <= (svga->vram_mask + 1));
+}
+
+
+static __inline void
+svga_render_store_rgb(uint32_t *p, __m128i b, __m128i g, __m128i r, int g_mul)
+{
+    __m128i lo, hi;
+
+    b = _mm_mulhi_epu16(b, _mm_set1_epi16((short) 33693));
+    g = _mm_mulhi_epu16(g, _mm_set1_epi16((short) g_mul));
+    r = _mm_mulhi_epu16(r, _mm_set1_epi16((short) 33693));
+
+    lo = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+    hi = r;
+
+    _mm_storeu_si128((__m128i *) p, _mm_unpacklo_epi16(lo, hi));
+    _mm_storeu_si128((__m128i *) (p + 4), _mm_unpackhi_epi16(lo, hi));
+}
+
+
+/*5-bit channels are scaled by 33693 from bits 4-8, 6-bit ones by 33159 from bits
+  3-8, so that the high half of the product is the 8-bit channel value.*/
+static void
+svga_render_15to32_sse2(uint32_t *p, uint8_t *src, int pixels)
+{
+    __m128i v, b, g, r;
+    __m128i mask = _mm_set1_epi16(0x1f0);
+    int x;
+
+    for (x = 0; x < pixels; x += 8) {
+	v = _mm_loadu_si128((__m128i *) &src[x << 1]);
+
+	b = _mm_and_si128(_mm_slli_epi16(v, 4), mask);
+	g = _mm_and_si128(_mm_srli_epi16(v, 1), mask);
+	r = _mm_and_si128(_mm_srli_epi16(v, 6), mask);
+
+	svga_render_store_rgb(&p[x], b, g, r, 33693);
+    }
+}
+
+
+static void
+svga_render_16to32_sse2(uint32_t *p, uint8_t *src, int pixels)
+{
+    __m128i v, b, g, r;
+    __m128i mask = _mm_set1_epi16(0x1f0);
+    int x;
+
+    for (x = 0; x < pixels; x += 8) {
+	v = _mm_loadu_si128((__m128i *) &src[x << 1]);
+
+	b = _mm_and_si128(_mm_slli_epi16(v, 4), mask);
+	g = _mm_and_si128(_mm_srli_epi16(v, 2), _mm_set1_epi16(0x1f8));
+	r = _mm_and_si128(_mm_srli_epi16(v, 7), mask);
+
+	svga_render_store_rgb(&p[x], b, g, r, 33159);
+    }
+}
+
+
+/*32 bpp, with three variants of byte order: 0 = xRGB, 1 = xBGR (red and blue
+  swapped), 2 = RGBx (shifted down by one byte).*/
+static void
+svga_render_32to32_sse2(uint32_t *p, uint8_t *src, int pixels, int order)
+{
+    __m128i v;
+    __m128i mask = _mm_set1_epi32(0x00ffffff);
+    __m128i mask_g = _mm_set1_epi32(0x0000ff00);
+    __m128i mask_rb = _mm_set1_epi32(0x000000ff);
+    int x;
+
+    for (x = 0; x < (pixels & ~3); x += 4) {
+	v = _mm_loadu_si128((__m128i *) &src[x << 2]);
+
+	switch (order) {
+		case 0:
+			v = _mm_and_si128(v, mask);
+			break;
+		case 1:
+			v = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), mask_rb),
+						      _mm_and_si128(v, mask_g)),
+					 _mm_slli_epi32(_mm_and_si128(v, mask_rb), 16));
+			break;
+		case 2:
+			v = _mm_srli_epi32(v, 8);
+			break;
+	}
+
+	_mm_storeu_si128((__m128i *) &p[x], v);
+    }
+}
+#endif
 
 
 void
@@ -738,7 +850,14 @@ svga_render_15bpp_highres(svga_t *svga)
 		svga->firstline_draw = svga->displine;
 	svga->lastline_draw = svga->displine;
 
-	for (x = 0; x <= (svga->hdisp + svga->scrollcache); x += 8) {
+	x = 0;
+#ifdef USE_SSE2_RENDER
+	if (svga_render_linear(svga, svga->ma, (((svga->hdisp + svga->scrollcache) & ~7) + 8) << 1)) {
+		x = ((svga->hdisp + svga->scrollcache) & ~7) + 8;
+		svga_render_15to32_sse2(p, &svga->vram[svga->ma], x);
+	}
+#endif
+	for (; x <= (svga->hdisp + svga->scrollcache); x += 8) {
 		dat = *(uint32_t *)(&svga->vram[(svga->ma + (x << 1)) & svga->vram_display_mask]);
 		p[x]     = video_15to32[dat & 0xffff];
 		p[x + 1] = video_15to32[dat >> 16];
@@ -889,7 +1008,14 @@ svga_render_16bpp_highres(svga_t *svga)
 		svga->firstline_draw = svga->displine;
 	svga->lastline_draw = svga->displine;
 
-	for (x = 0; x <= (svga->hdisp + svga->scrollcache); x += 8) {
+	x = 0;
+#ifdef USE_SSE2_RENDER
+	if (svga_render_linear(svga, svga->ma, (((svga->hdisp + svga->scrollcache) & ~7) + 8) << 1)) {
+		x = ((svga->hdisp + svga->scrollcache) & ~7) + 8;
+		svga_render_16to32_sse2(p, &svga->vram[svga->ma], x);
+	}
+#endif
+	for (; x <= (svga->hdisp + svga->scrollcache); x += 8) {
 		uint32_t dat = *(uint32_t *)(&svga->vram[(svga->ma + (x << 1)) & svga->vram_display_mask]);
 		p[x]     = video_16to32[dat & 0xffff];
 		p[x + 1] = video_16to32[dat >> 16];
@@ -1016,7 +1142,14 @@ svga_render_32bpp_highres(svga_t *svga)
 		svga->firstline_draw = svga->displine;
 	svga->lastline_draw = svga->displine;
 
-	for (x = 0; x <= (svga->hdisp + svga->scrollcache); x++) {
+	x = 0;
+#ifdef USE_SSE2_RENDER
+	if (svga_render_linear(svga, svga->ma, (svga->hdisp + svga->scrollcache + 1) << 2)) {
+		x = (svga->hdisp + svga->scrollcache + 1) & ~3;
+		svga_render_32to32_sse2(p, &svga->vram[svga->ma], x, 0);
+	}
+#endif
+	for (; x <= (svga->hdisp + svga->scrollcache); x++) {
 		dat = *(uint32_t *)(&svga->vram[(svga->ma + (x << 2)) & svga->vram_display_mask]);
 		p[x] = dat & 0xffffff;
 	}
@@ -1043,7 +1176,14 @@ svga_render_ABGR8888_highres(svga_t *svga)
 		svga->firstline_draw = svga->displine;
 	svga->lastline_draw = svga->displine;
 
-	for (x = 0; x <= (svga->hdisp + svga->scrollcache); x++) {
+	x = 0;
+#ifdef USE_SSE2_RENDER
+	if (svga_render_linear(svga, svga->ma, (svga->hdisp + svga->scrollcache + 1) << 2)) {
+		x = (svga->hdisp + svga->scrollcache + 1) & ~3;
+		svga_render_32to32_sse2(p, &svga->vram[svga->ma], x, 1);
+	}
+#endif
+	for (; x <= (svga->hdisp + svga->scrollcache); x++) {
 		dat = *(uint32_t *)(&svga->vram[(svga->ma + (x << 2)) & svga->vram_display_mask]);
 		p[x] = ((dat & 0xff0000) >> 16) | (dat & 0x00ff00) | ((dat & 0x0000ff) << 16);
 	}
@@ -1070,7 +1210,14 @@ svga_render_RGBA8888_highres(svga_t *svga)
 		svga->firstline_draw = svga->displine;
 	svga->lastline_draw = svga->displine;
 
-	for (x = 0; x <= (svga->hdisp + svga->scrollcache); x++) {
+	x = 0;
+#ifdef USE_SSE2_RENDER
+	if (svga_render_linear(svga, svga->ma, (svga->hdisp + svga->scrollcache + 1) << 2)) {
+		x = (svga->hdisp + svga->scrollcache + 1) & ~3;
+		svga_render_32to32_sse2(p, &svga->vram[svga->ma], x, 2);
+	}
+#endif
+	for (; x <= (svga->hdisp + svga->scrollcache); x++) {
 		dat = *(uint32_t *)(&svga->vram[(svga->ma + (x << 2)) & svga->vram_display_mask]);
 		p[x] = dat >> 8;
 	}
@@ -47,7 +47,14 @@
 
 #define TEX_DIRTY_SHIFT 10
 
-#define TEX_CACHE_MAX 64
+/*Decoded textures are kept in a cache of texture_cache_size entries per TMU
+  (TEX_CACHE_DEFAULT unless configured larger). Entries are found through a hash
+  of base address, tLOD and palette, and replaced least recently used first.
+  texture_present[] counts the cached textures that cover each 1kB page of
+  texture memory, so a texture memory write only looks for textures to evict
+  when it hits a page that is in use.*/
+#define TEX_CACHE_DEFAULT 64
+#define TEX_HASH_SIZE 256
 
 enum
 {
@@ -117,12 +124,16 @@ enum
 #define PARAM_MASK (PARAM_SIZE - 1)
 #define PARAM_ENTRY_SIZE (1 << 31)
 
-#define PARAM_ENTRIES_1 (voodoo->params_write_idx - voodoo->params_read_idx[0])
-#define PARAM_ENTRIES_2 (voodoo->params_write_idx - voodoo->params_read_idx[1])
-#define PARAM_FULL_1 ((voodoo->params_write_idx - voodoo->params_read_idx[0]) >= PARAM_SIZE)
-#define PARAM_FULL_2 ((voodoo->params_write_idx - voodoo->params_read_idx[1]) >= PARAM_SIZE)
-#define PARAM_EMPTY_1   (voodoo->params_read_idx[0] == voodoo->params_write_idx)
-#define PARAM_EMPTY_2   (voodoo->params_read_idx[1] == voodoo->params_write_idx)
+#define PARAM_ENTRIES(x) (voodoo->params_write_idx - voodoo->params_read_idx[x])
+#define PARAM_FULL(x) ((voodoo->params_write_idx - voodoo->params_read_idx[x]) >= PARAM_SIZE)
+#define PARAM_EMPTY(x)  (voodoo->params_read_idx[x] == voodoo->params_write_idx)
+
+/*Triangles are rendered by up to RENDER_THREADS_MAX threads. Every thread walks
+  all queued triangles, but only draws the scanlines where
+  (y & odd_even_mask) == its index, so render_threads must be a power of two.
+  Each thread has its own read index into params_buffer, pixel/texel counters,
+  texture refcount and set of recompiled blocks.*/
+#define RENDER_THREADS_MAX 8
 
 typedef struct
 {
@@ -207,11 +218,13 @@ typedef struct texture_t
 {
         uint32_t base;
         uint32_t tLOD;
-        volatile int refcount, refcount_r[2];
+        volatile int refcount, refcount_r[RENDER_THREADS_MAX];
         int is16;
         uint32_t palette_checksum;
         uint32_t addr_start[4], addr_end[4];
         uint32_t *data;
+        uint32_t last_used;
+        int hash_next;
 } texture_t;
 
 typedef struct vert_t
@@ -223,6 +236,14 @@ typedef struct vert_t
         float sW1, sS1, sT1;
 } vert_t;
 
+struct voodoo_t;
+
+typedef struct voodoo_render_thread_t
+{
+        struct voodoo_t *voodoo;
+        int odd_even;
+} voodoo_render_thread_t;
+
 typedef struct voodoo_t
 {
         mem_mapping_t mapping;
@@ -293,21 +314,22 @@ typedef struct voodoo_t
         int ncc_dirty[2];
 
         thread_t *fifo_thread;
-        thread_t *render_thread[2];
+        thread_t *render_thread[RENDER_THREADS_MAX];
         event_t *wake_fifo_thread;
         event_t *wake_main_thread;
         event_t *fifo_not_full_event;
-        event_t *render_not_full_event[2];
-        event_t *wake_render_thread[2];
+        event_t *render_not_full_event[RENDER_THREADS_MAX];
+        event_t *wake_render_thread[RENDER_THREADS_MAX];
+        voodoo_render_thread_t render_thread_data[RENDER_THREADS_MAX];
         
         int voodoo_busy;
-        int render_voodoo_busy[2];
+        int render_voodoo_busy[RENDER_THREADS_MAX];
         
         int render_threads;
         int odd_even_mask;
         
-        int pixel_count[2], texel_count[2], tri_count, frame_count;
-        int pixel_count_old[2], texel_count_old[2];
+        int pixel_count[RENDER_THREADS_MAX], texel_count[RENDER_THREADS_MAX], tri_count, frame_count;
+        int pixel_count_old[RENDER_THREADS_MAX], texel_count_old[RENDER_THREADS_MAX];
         int wr_count, rd_count, tex_count;
         
         int retrace_count;
@@ -331,7 +353,7 @@ typedef struct voodoo_t
 	volatile int cmd_read, cmd_written, cmd_written_fifo;
 
         voodoo_params_t params_buffer[PARAM_SIZE];
-        volatile int params_read_idx[2], params_write_idx;
+        volatile int params_read_idx[RENDER_THREADS_MAX], params_write_idx;
         
         uint32_t cmdfifo_base, cmdfifo_end;
         int cmdfifo_rp;
@@ -409,18 +431,22 @@ typedef struct voodoo_t
         /* the voodoo adds purple lines for some reason */
         uint16_t purpleline[256][3];
 
-        texture_t texture_cache[2][TEX_CACHE_MAX];
-        uint8_t texture_present[2][4096];
-        int texture_last_removed;
+        texture_t *texture_cache[2];
+        int texture_cache_size;
+        int texture_hash[2][TEX_HASH_SIZE];
+        uint16_t texture_present[2][4096];
+        uint32_t texture_stamp;
         
         uint32_t palette_checksum[2];
         int palette_dirty[2];
 
         uint64_t time;
-        int render_time[2];
+        int render_time[RENDER_THREADS_MAX];
         
         int use_recompiler;        
         void *codegen_data;
+        uint32_t codegen_stamp[RENDER_THREADS_MAX];
+        int codegen_hits[RENDER_THREADS_MAX], codegen_compiles[RENDER_THREADS_MAX];
         
         struct voodoo_set_t *set;
 } voodoo_t;
@@ -436,6 +462,20 @@ typedef struct voodoo_set_t
 
 static inline void wait_for_render_thread_idle(voodoo_t *voodoo);
 
+/*A texture is in use while any render thread has not yet drawn all the queued
+  triangles that reference it.*/
+static inline int texture_in_use(voodoo_t *voodoo, texture_t *texture)
+{
+        int c;
+        
+        for (c = 0; c < voodoo->render_threads; c++)
+        {
+                if (texture->refcount != texture->refcount_r[c])
+                        return 1;
+        }
+        return 0;
+}
+
 enum
 {
         SST_status = 0x000,
@@ -1281,13 +1321,92 @@ static void voodoo_recalc_tex(voodoo_t *voodoo, int tmu)
 
 #define makergba(r, g, b, a)  ((b) | ((g) << 8) | ((r) << 16) | ((a) << 24))
 
+static inline int texture_hash(uint32_t base, uint32_t tLOD, uint32_t palette_checksum)
+{
+        uint32_t h = base ^ (tLOD * 0x9e3779b1) ^ (palette_checksum * 0x85ebca6b);
+        
+        h ^= h >> 16;
+        h ^= h >> 8;
+        return h & (TEX_HASH_SIZE - 1);
+}
+
+/*Add delta to the present count of every texture memory page that texture
+  covers. Ranges that run off the end of texture memory wrap to the start, as
+  texture fetches do.*/
+static void texture_mark_pages(voodoo_t *voodoo, int tmu, texture_t *texture, int delta)
+{
+        int page_mask = voodoo->texture_mask >> TEX_DIRTY_SHIFT;
+        int d;
+        
+        for (d = 0; d < 4; d++)
+        {
+                if (texture->addr_end[d] != 0)
+                {
+                        int page = (texture->addr_start[d] & voodoo->texture_mask) >> TEX_DIRTY_SHIFT;
+                        int page_end = (texture->addr_end[d] & voodoo->texture_mask) >> TEX_DIRTY_SHIFT;
+                        
+                        while (1)
+                        {
+                                voodoo->texture_present[tmu][page] += delta;
+                                if (page == page_end)
+                                        break;
+                                page = (page + 1) & page_mask;
+                        }
+                }
+        }
+}
+
+static int texture_covers_page(voodoo_t *voodoo, texture_t *texture, int page)
+{
+        int d;
+        
+        for (d = 0; d < 4; d++)
+        {
+                if (texture->addr_end[d] != 0)
+                {
+                        int page_start = (texture->addr_start[d] & voodoo->texture_mask) >> TEX_DIRTY_SHIFT;
+                        int page_end = (texture->addr_end[d] & voodoo->texture_mask) >> TEX_DIRTY_SHIFT;
+                        
+                        if (page_start <= page_end)
+                        {
+                                if (page >= page_start && page <= page_end)
+                                        return 1;
+                        }
+                        else if (page >= page_start || page <= page_end)
+                                return 1;
+                }
+        }
+        return 0;
+}
+
+/*Drop a texture from the hash and the page counts. The decoded data is left
+  alone, the caller must make sure the render threads are done with it before
+  the entry is reused.*/
+static void texture_evict(voodoo_t *voodoo, int tmu, int entry)
+{
+        texture_t *texture = &voodoo->texture_cache[tmu][entry];
+        int *prev = &voodoo->texture_hash[tmu][texture_hash(texture->base, texture->tLOD, texture->palette_checksum)];
+        
+        while (*prev != entry)
+                prev = &voodoo->texture_cache[tmu][*prev].hash_next;
+        *prev = texture->hash_next;
+        texture->hash_next = -1;
+        
+        texture_mark_pages(voodoo, tmu, texture, -1);
+        
+        texture->base = -1;
+        texture->last_used = 0;
+}
+
 static void use_texture(voodoo_t *voodoo, voodoo_params_t *params, int tmu)
 {
         int c, d;
         int lod;
         int lod_min, lod_max;
-        uint32_t addr = 0, addr_end;
+        uint32_t addr = 0;
         uint32_t palette_checksum;
+        uint32_t tex_base, tex_lod;
+        int hash;
 
         lod_min = (params->tLOD[tmu] >> 2) & 15;
         lod_max = (params->tLOD[tmu] >> 8) & 15;
@@ -1314,45 +1433,57 @@ static void use_texture(voodoo_t *voodoo, voodoo_params_t *params, int tmu)
                 addr = params->texBaseAddr1[tmu];
         else
                 addr = params->texBaseAddr[tmu];
+        tex_base = addr;
+        tex_lod = params->tLOD[tmu] & 0xf00fff;
+        hash = texture_hash(tex_base, tex_lod, palette_checksum);
 
         /*Try to find texture in cache*/
-        for (c = 0; c < TEX_CACHE_MAX; c++)
+        for (c = voodoo->texture_hash[tmu][hash]; c != -1; c = voodoo->texture_cache[tmu][c].hash_next)
         {
-                if (voodoo->texture_cache[tmu][c].base == addr &&
-                    voodoo->texture_cache[tmu][c].tLOD == (params->tLOD[tmu] & 0xf00fff) &&
+                if (voodoo->texture_cache[tmu][c].base == tex_base &&
+                    voodoo->texture_cache[tmu][c].tLOD == tex_lod &&
                     voodoo->texture_cache[tmu][c].palette_checksum == palette_checksum)
                 {
                         params->tex_entry[tmu] = c;
                         voodoo->texture_cache[tmu][c].refcount++;
+                        voodoo->texture_cache[tmu][c].last_used = ++voodoo->texture_stamp;
                         return;
                 }
         }
         
-        /*Texture not found, search for unused texture*/
+        /*Texture not found, replace the least recently used texture that the
+          render threads are done with*/
         do
         {
-                for (c = 0; c < TEX_CACHE_MAX; c++)
+                uint32_t oldest = 0;
+                
+                c = -1;
+                for (d = 0; d < voodoo->texture_cache_size; d++)
                 {
-                        voodoo->texture_last_removed++;
-                        voodoo->texture_last_removed &= (TEX_CACHE_MAX-1);
-                        if (voodoo->texture_cache[tmu][voodoo->texture_last_removed].refcount == voodoo->texture_cache[tmu][voodoo->texture_last_removed].refcount_r[0] &&
-                            (voodoo->render_threads == 1 || voodoo->texture_cache[tmu][voodoo->texture_last_removed].refcount == voodoo->texture_cache[tmu][voodoo->texture_last_removed].refcount_r[1]))
+                        texture_t *texture = &voodoo->texture_cache[tmu][d];
+                        
+                        if (texture_in_use(voodoo, texture))
+                                continue;
+                        if (texture->base == -1)
+                        {
+                                c = d;
                                 break;
+                        }
+                        if (c == -1 || (voodoo->texture_stamp - texture->last_used) > oldest)
+                        {
+                                c = d;
+                                oldest = voodoo->texture_stamp - texture->last_used;
+                        }
                 }
-                if (c == TEX_CACHE_MAX)
+                if (c == -1)
                         wait_for_render_thread_idle(voodoo);
-        } while (c == TEX_CACHE_MAX);
-        if (c == TEX_CACHE_MAX)
-                fatal("Texture cache full!\n");
+        } while (c == -1);
 
-        c = voodoo->texture_last_removed;
-        
+        if (voodoo->texture_cache[tmu][c].base != -1)
+                texture_evict(voodoo, tmu, c);
 
-        if ((voodoo->params.tLOD[tmu] & LOD_SPLIT) && (voodoo->params.tLOD[tmu] & LOD_ODD) && (voodoo->params.tLOD[tmu] & LOD_TMULTIBASEADDR))
-                voodoo->texture_cache[tmu][c].base = params->texBaseAddr1[tmu];
-        else
-                voodoo->texture_cache[tmu][c].base = params->texBaseAddr[tmu];
-        voodoo->texture_cache[tmu][c].tLOD = params->tLOD[tmu] & 0xf00fff;
+        voodoo->texture_cache[tmu][c].base = tex_base;
+        voodoo->texture_cache[tmu][c].tLOD = tex_lod;
 
         lod_min = (params->tLOD[tmu] >> 2) & 15;
         lod_max = (params->tLOD[tmu] >> 8) & 15;
@@ -1586,10 +1717,7 @@ static void use_texture(voodoo_t *voodoo, voodoo_params_t *params, int tmu)
 
         voodoo->texture_cache[tmu][c].is16 = voodoo->params.tformat[tmu] & 8;
 
-        if (params->tformat[tmu] == TEX_PAL8 || params->tformat[tmu] == TEX_APAL8 || params->tformat[tmu] == TEX_APAL88)
-                voodoo->texture_cache[tmu][c].palette_checksum = palette_checksum;
-        else
-                voodoo->texture_cache[tmu][c].palette_checksum = 0;
+        voodoo->texture_cache[tmu][c].palette_checksum = palette_checksum;
 
         if (lod_min == 0)
         {
@@ -1624,64 +1752,33 @@ static void use_texture(voodoo_t *voodoo, voodoo_params_t *params, int tmu)
                 voodoo->texture_cache[tmu][c].addr_start[3] = voodoo->texture_cache[tmu][c].addr_end[3] = 0;
 
 
-        for (d = 0; d < 4; d++)
-        {
-                addr = voodoo->texture_cache[tmu][c].addr_start[d];
-                addr_end = voodoo->texture_cache[tmu][c].addr_end[d];
-
-                if (addr_end != 0)
-                {
-                        for (; addr <= addr_end; addr += (1 << TEX_DIRTY_SHIFT))
-                                voodoo->texture_present[tmu][(addr & voodoo->texture_mask) >> TEX_DIRTY_SHIFT] = 1;
-                }
-        }
+        texture_mark_pages(voodoo, tmu, &voodoo->texture_cache[tmu][c], 1);
+        voodoo->texture_cache[tmu][c].hash_next = voodoo->texture_hash[tmu][hash];
+        voodoo->texture_hash[tmu][hash] = c;
        
         params->tex_entry[tmu] = c;
         voodoo->texture_cache[tmu][c].refcount++;
+        voodoo->texture_cache[tmu][c].last_used = ++voodoo->texture_stamp;
 }
 
 static void flush_texture_cache(voodoo_t *voodoo, uint32_t dirty_addr, int tmu)
 {
         int wait_for_idle = 0;
+        int page = dirty_addr >> TEX_DIRTY_SHIFT;
         int c;
         
-        memset(voodoo->texture_present[tmu], 0, sizeof(voodoo->texture_present[0]));
 //        voodoo_log("Evict %08x %i\n", dirty_addr, sizeof(voodoo->texture_present));
-        for (c = 0; c < TEX_CACHE_MAX; c++)
+        for (c = 0; c < voodoo->texture_cache_size; c++)
         {
-                if (voodoo->texture_cache[tmu][c].base != -1)
+                if (voodoo->texture_cache[tmu][c].base != -1 &&
+                    texture_covers_page(voodoo, &voodoo->texture_cache[tmu][c], page))
                 {
-                        int d;
-                        
-                        for (d = 0; d < 4; d++)
-                        {
-                                int addr_start = voodoo->texture_cache[tmu][c].addr_start[d];
-                                int addr_end = voodoo->texture_cache[tmu][c].addr_end[d];
-                                
-                                if (addr_end != 0)
-                                {
-                                        int addr_start_masked = addr_start & voodoo->texture_mask & ~0x3ff;
-                                        int addr_end_masked = ((addr_end & voodoo->texture_mask) + 0x3ff) & ~0x3ff;
-                                        
-                                        if (addr_end_masked < addr_start_masked)
-                                                addr_end_masked = voodoo->texture_mask+1;
-                                        if (dirty_addr >= addr_start_masked && dirty_addr < addr_end_masked)
-                                        {
-//                                voodoo_log("  Evict texture %i %08x\n", c, voodoo->texture_cache[tmu][c].base);
+//                        voodoo_log("  Evict texture %i %08x\n", c, voodoo->texture_cache[tmu][c].base);
 
-                                                if (voodoo->texture_cache[tmu][c].refcount != voodoo->texture_cache[tmu][c].refcount_r[0] ||
-                                                    (voodoo->render_threads == 2 && voodoo->texture_cache[tmu][c].refcount != voodoo->texture_cache[tmu][c].refcount_r[1]))
-                                                        wait_for_idle = 1;
-                                        
-                                                voodoo->texture_cache[tmu][c].base = -1;
-                                        }
-                                        else
-                                        {
-                                                for (; addr_start <= addr_end; addr_start += (1 << TEX_DIRTY_SHIFT))
-                                                        voodoo->texture_present[tmu][(addr_start & voodoo->texture_mask) >> TEX_DIRTY_SHIFT] = 1;
-                                        }
-                                }
-                        }
+                        if (texture_in_use(voodoo, &voodoo->texture_cache[tmu][c]))
+                                wait_for_idle = 1;
+                        
+                        texture_evict(voodoo, tmu, c);
                 }
         }
         if (wait_for_idle)
@@ -3558,26 +3655,44 @@ static void voodoo_triangle(voodoo_t *voodoo, voodoo_params_t *params, int odd_e
 
 static inline void wake_render_thread(voodoo_t *voodoo)
 {
-        thread_set_event(voodoo->wake_render_thread[0]); /*Wake up render thread if moving from idle*/
-        if (voodoo->render_threads == 2)
-                thread_set_event(voodoo->wake_render_thread[1]); /*Wake up render thread if moving from idle*/
+        int c;
+        
+        for (c = 0; c < voodoo->render_threads; c++)
+                thread_set_event(voodoo->wake_render_thread[c]); /*Wake up render thread if moving from idle*/
+}
+
+static inline int render_thread_idle(voodoo_t *voodoo)
+{
+        int c;
+        
+        for (c = 0; c < voodoo->render_threads; c++)
+        {
+                if (!PARAM_EMPTY(c) || voodoo->render_voodoo_busy[c])
+                        return 0;
+        }
+        return 1;
 }
 
 static inline void wait_for_render_thread_idle(voodoo_t *voodoo)
 {
-        while (!PARAM_EMPTY_1 || (voodoo->render_threads == 2 && !PARAM_EMPTY_2) || voodoo->render_voodoo_busy[0] || (voodoo->render_threads == 2 && voodoo->render_voodoo_busy[1]))
+        int c;
+        
+        while (!render_thread_idle(voodoo))
         {
                 wake_render_thread(voodoo);
-                if (!PARAM_EMPTY_1 || voodoo->render_voodoo_busy[0])
-                        thread_wait_event(voodoo->render_not_full_event[0], 1);
-                if (voodoo->render_threads == 2 && (!PARAM_EMPTY_2 || voodoo->render_voodoo_busy[1]))
-                        thread_wait_event(voodoo->render_not_full_event[1], 1);
+                for (c = 0; c < voodoo->render_threads; c++)
+                {
+                        if (!PARAM_EMPTY(c) || voodoo->render_voodoo_busy[c])
+                                thread_wait_event(voodoo->render_not_full_event[c], 1);
+                }
         }
 }
 
-static void render_thread(void *param, int odd_even)
+static void render_thread(void *param)
 {
-        voodoo_t *voodoo = (voodoo_t *)param;
+        voodoo_render_thread_t *data = (voodoo_render_thread_t *)param;
+        voodoo_t *voodoo = data->voodoo;
+        int odd_even = data->odd_even;
         
         while (1)
         {
@@ -3586,7 +3701,7 @@ static void render_thread(void *param, int odd_even)
                 thread_reset_event(voodoo->wake_render_thread[odd_even]);
                 voodoo->render_voodoo_busy[odd_even] = 1;
 
-                while (!(odd_even ? PARAM_EMPTY_2 : PARAM_EMPTY_1))
+                while (!PARAM_EMPTY(odd_even))
                 {
                         uint64_t start_time = plat_timer_read();
                         uint64_t end_time;
@@ -3596,7 +3711,7 @@ static void render_thread(void *param, int odd_even)
 
                         voodoo->params_read_idx[odd_even]++;                                                
                         
-                        if ((odd_even ? PARAM_ENTRIES_2 : PARAM_ENTRIES_1) > (PARAM_SIZE - 10))
+                        if (PARAM_ENTRIES(odd_even) > (PARAM_SIZE - 10))
                                 thread_set_event(voodoo->render_not_full_event[odd_even]);
 
                         end_time = plat_timer_read();
@@ -3607,31 +3722,31 @@ static void render_thread(void *param, int odd_even)
         }
 }
 
-static void render_thread_1(void *param)
-{
-        render_thread(param, 0);
-}
-static void render_thread_2(void *param)
+static inline int render_thread_full(voodoo_t *voodoo)
 {
-        render_thread(param, 1);
+        int c;
+        
+        for (c = 0; c < voodoo->render_threads; c++)
+        {
+                if (PARAM_FULL(c))
+                        return 1;
+        }
+        return 0;
 }
 
 static inline void queue_triangle(voodoo_t *voodoo, voodoo_params_t *params)
 {
         voodoo_params_t *params_new = &voodoo->params_buffer[voodoo->params_write_idx & PARAM_MASK];
+        int c;
 
-        while (PARAM_FULL_1 || (voodoo->render_threads == 2 && PARAM_FULL_2))
+        while (render_thread_full(voodoo))
         {
-                thread_reset_event(voodoo->render_not_full_event[0]);
-                if (voodoo->render_threads == 2)
-                        thread_reset_event(voodoo->render_not_full_event[1]);
-                if (PARAM_FULL_1)
-                {
-                        thread_wait_event(voodoo->render_not_full_event[0], -1); /*Wait for room in ringbuffer*/
-                }
-                if (voodoo->render_threads == 2 && PARAM_FULL_2)
+                for (c = 0; c < voodoo->render_threads; c++)
+                        thread_reset_event(voodoo->render_not_full_event[c]);
+                for (c = 0; c < voodoo->render_threads; c++)
                 {
-                        thread_wait_event(voodoo->render_not_full_event[1], -1); /*Wait for room in ringbuffer*/
+                        if (PARAM_FULL(c))
+                                thread_wait_event(voodoo->render_not_full_event[c], -1); /*Wait for room in ringbuffer*/
                 }
         }
         
@@ -3643,8 +3758,14 @@ static inline void queue_triangle(voodoo_t *voodoo, voodoo_params_t *params)
         
         voodoo->params_write_idx++;
         
-        if (PARAM_ENTRIES_1 < 4 || (voodoo->render_threads == 2 && PARAM_ENTRIES_2 < 4))
-                wake_render_thread(voodoo);
+        for (c = 0; c < voodoo->render_threads; c++)
+        {
+                if (PARAM_ENTRIES(c) < 4)
+                {
+                        wake_render_thread(voodoo);
+                        break;
+                }
+        }
 }
 
 static void voodoo_fastfill(voodoo_t *voodoo, voodoo_params_t *params)
@@ -7544,9 +7665,15 @@ void *voodoo_card_init()
         voodoo->scrfilter = device_get_config_int("dacfilter");
         voodoo->texture_size = device_get_config_int("texture_memory");
         voodoo->texture_mask = (voodoo->texture_size << 20) - 1;
+        voodoo->texture_cache_size = device_get_config_int("texture_cache");
+        if (voodoo->texture_cache_size < TEX_CACHE_DEFAULT)
+                voodoo->texture_cache_size = TEX_CACHE_DEFAULT;
         voodoo->fb_size = device_get_config_int("framebuffer_memory");
         voodoo->fb_mask = (voodoo->fb_size << 20) - 1;
         voodoo->render_threads = device_get_config_int("render_threads");
+        if (voodoo->render_threads < 1 || voodoo->render_threads > RENDER_THREADS_MAX ||
+            (voodoo->render_threads & (voodoo->render_threads - 1)))
+                voodoo->render_threads = 2;
         voodoo->odd_even_mask = voodoo->render_threads - 1;
 #ifndef NO_CODEGEN
         voodoo->use_recompiler = device_get_config_int("recompiler");
@@ -7581,18 +7708,26 @@ void *voodoo_card_init()
         voodoo->tex_mem_w[0] = (uint16_t *)voodoo->tex_mem[0];
         voodoo->tex_mem_w[1] = (uint16_t *)voodoo->tex_mem[1];
         
-        for (c = 0; c < TEX_CACHE_MAX; c++)
+        voodoo->texture_cache[0] = malloc(voodoo->texture_cache_size * sizeof(texture_t));
+        voodoo->texture_cache[1] = malloc(voodoo->texture_cache_size * sizeof(texture_t));
+        memset(voodoo->texture_cache[0], 0, voodoo->texture_cache_size * sizeof(texture_t));
+        memset(voodoo->texture_cache[1], 0, voodoo->texture_cache_size * sizeof(texture_t));
+        for (c = 0; c < voodoo->texture_cache_size; c++)
         {
                 voodoo->texture_cache[0][c].data = malloc((256*256 + 256*256 + 128*128 + 64*64 + 32*32 + 16*16 + 8*8 + 4*4 + 2*2) * 4);
                 voodoo->texture_cache[0][c].base = -1; /*invalid*/
                 voodoo->texture_cache[0][c].refcount = 0;
+                voodoo->texture_cache[0][c].hash_next = -1;
+                voodoo->texture_cache[1][c].base = -1; /*invalid*/
+                voodoo->texture_cache[1][c].hash_next = -1;
                 if (voodoo->dual_tmus)
                 {
                         voodoo->texture_cache[1][c].data = malloc((256*256 + 256*256 + 128*128 + 64*64 + 32*32 + 16*16 + 8*8 + 4*4 + 2*2) * 4);
-                        voodoo->texture_cache[1][c].base = -1; /*invalid*/
                         voodoo->texture_cache[1][c].refcount = 0;
                 }
         }
+        for (c = 0; c < TEX_HASH_SIZE; c++)
+                voodoo->texture_hash[0][c] = voodoo->texture_hash[1][c] = -1;
 
         timer_add(&voodoo->timer, voodoo_callback, voodoo, 1);
         
@@ -7600,16 +7735,17 @@ void *voodoo_card_init()
         voodoo->fbiInit0 = 0;
 
         voodoo->wake_fifo_thread = thread_create_event();
-        voodoo->wake_render_thread[0] = thread_create_event();
-        voodoo->wake_render_thread[1] = thread_create_event();
         voodoo->wake_main_thread = thread_create_event();
         voodoo->fifo_not_full_event = thread_create_event();
-        voodoo->render_not_full_event[0] = thread_create_event();
-        voodoo->render_not_full_event[1] = thread_create_event();
         voodoo->fifo_thread = thread_create(fifo_thread, voodoo);
-        voodoo->render_thread[0] = thread_create(render_thread_1, voodoo);
-        if (voodoo->render_threads == 2)
-                voodoo->render_thread[1] = thread_create(render_thread_2, voodoo);
+        for (c = 0; c < voodoo->render_threads; c++)
+        {
+                voodoo->wake_render_thread[c] = thread_create_event();
+                voodoo->render_not_full_event[c] = thread_create_event();
+                voodoo->render_thread_data[c].voodoo = voodoo;
+                voodoo->render_thread_data[c].odd_even = c;
+                voodoo->render_thread[c] = thread_create(render_thread, &voodoo->render_thread_data[c]);
+        }
 
         timer_add(&voodoo->wake_timer, voodoo_wake_timer, (void *)voodoo, 0);
         
@@ -7749,23 +7885,25 @@ void voodoo_card_close(voodoo_t *voodoo)
 #endif
 
         thread_kill(voodoo->fifo_thread);
-        thread_kill(voodoo->render_thread[0]);
-        if (voodoo->render_threads == 2)
-                thread_kill(voodoo->render_thread[1]);
+        for (c = 0; c < voodoo->render_threads; c++)
+                thread_kill(voodoo->render_thread[c]);
         thread_destroy_event(voodoo->fifo_not_full_event);
         thread_destroy_event(voodoo->wake_main_thread);
         thread_destroy_event(voodoo->wake_fifo_thread);
-        thread_destroy_event(voodoo->wake_render_thread[0]);
-        thread_destroy_event(voodoo->wake_render_thread[1]);
-        thread_destroy_event(voodoo->render_not_full_event[0]);
-        thread_destroy_event(voodoo->render_not_full_event[1]);
+        for (c = 0; c < voodoo->render_threads; c++)
+        {
+                thread_destroy_event(voodoo->wake_render_thread[c]);
+                thread_destroy_event(voodoo->render_not_full_event[c]);
+        }
 
-        for (c = 0; c < TEX_CACHE_MAX; c++)
+        for (c = 0; c < voodoo->texture_cache_size; c++)
         {
                 if (voodoo->dual_tmus)
                         free(voodoo->texture_cache[1][c].data);
                 free(voodoo->texture_cache[0][c].data);
         }
+        free(voodoo->texture_cache[1]);
+        free(voodoo->texture_cache[0]);
 #ifndef NO_CODEGEN
         voodoo_codegen_close(voodoo);
 #endif
@@ -7853,6 +7991,30 @@ static const device_config_t voodoo_config[] =
                 },
                 .default_int = 2
         },
+        {
+                .name = "texture_cache",
+                .description = "Texture cache entries",
+                .type = CONFIG_SELECTION,
+                .selection =
+                {
+                        {
+                                .description = "64",
+                                .value = 64
+                        },
+                        {
+                                .description = "128",
+                                .value = 128
+                        },
+                        {
+                                .description = "256",
+                                .value = 256
+                        },
+                        {
+                                .description = ""
+                        }
+                },
+                .default_int = 64
+        },
         {
                 .name = "bilinear",
                 .description = "Bilinear filtering",
@@ -7879,6 +8041,14 @@ static const device_config_t voodoo_config[] =
                                 .description = "2",
                                 .value = 2
                         },
+                        {
+                                .description = "4",
+                                .value = 4
+                        },
+                        {
+                                .description = "8",
+                                .value = 8
+                        },
                         {
                                 .description = ""
                         }
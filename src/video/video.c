@@ -69,6 +69,10 @@
 #include <86box/plat.h>
 #include <86box/video.h>
 #include <86box/vid_svga.h>
+#if defined __SSE2__ || defined __amd64__ || defined _M_X64
+#define USE_SSE2_TRANSFORM
+#include <emmintrin.h>
+#endif
 
 
 volatile int	screenshots = 0;
@@ -431,12 +435,79 @@ video_screenshot(int x, int y, int w, int h)
 }
 
 
+#ifdef USE_SSE2_TRANSFORM
+/*Four pixels at a time version of video_color_transform(), for inversion and
+  the plain grayscale modes. The amber/green/white monitor modes go through the
+  shade[] table and are left to the scalar path. Returns the number of pixels
+  done.*/
+static int
+video_transform_copy_sse2(uint32_t *dst, uint32_t *src, int len)
+{
+    __m128i v, x, l, w_rb, w_g;
+    __m128i mask_rb = _mm_set1_epi32(0x00ff00ff);
+    __m128i mask_g = _mm_set1_epi32(0x000000ff);
+    __m128i inv = _mm_set1_epi32(invert_display ? 0x00ffffff : 0);
+    int i;
+
+    if (video_grayscale > 1)
+	return 0;
+
+    /*Weights are packed as (red << 16) | blue, to match the 16-bit lanes of
+      (color & 0x00ff00ff).*/
+    switch (video_graytype) {
+	case 0:
+		w_rb = _mm_set1_epi32((76 << 16) | 29);
+		w_g = _mm_set1_epi32(150);
+		break;
+	case 1:
+		w_rb = _mm_set1_epi32((54 << 16) | 18);
+		w_g = _mm_set1_epi32(183);
+		break;
+	default:
+		w_rb = _mm_set1_epi32((1 << 16) | 1);
+		w_g = _mm_set1_epi32(1);
+		break;
+    }
+
+    for (i = 0; i < (len & ~3); i += 4) {
+	v = _mm_loadu_si128((__m128i *) &src[i]);
+
+	if (video_grayscale) {
+		x = _mm_add_epi32(_mm_madd_epi16(_mm_and_si128(v, mask_rb), w_rb),
+				  _mm_madd_epi16(_mm_and_si128(_mm_srli_epi32(v, 8), mask_g), w_g));
+
+		if (video_graytype < 2) {
+			/*x / 255, exact for x < 65535*/
+			l = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(x, _mm_set1_epi32(1)),
+							 _mm_srli_epi32(x, 8)), 8);
+		} else {
+			/*x / 3, exact for x <= 765*/
+			l = _mm_srli_epi32(_mm_madd_epi16(x, _mm_set1_epi32(21846)), 16);
+		}
+
+		v = _mm_or_si128(l, _mm_or_si128(_mm_slli_epi32(l, 8), _mm_slli_epi32(l, 16)));
+	}
+
+	_mm_storeu_si128((__m128i *) &dst[i], _mm_xor_si128(v, inv));
+    }
+
+    return i;
+}
+#endif
+
+
 static void
 video_transform_copy(uint32_t *dst, uint32_t *src, int len)
 {
-    int i;
+    int i = 0;
 
-    for (i = 0; i < len; i++) {
+#ifdef USE_SSE2_TRANSFORM
+    i = video_transform_copy_sse2(dst, src, len);
+    dst += i;
+    src += i;
+#endif
+
+    for (; i < len; i++) {
 	*dst = video_color_transform(*src);
 	dst++;
 	src++;
@@ -447,10 +518,25 @@ video_transform_copy(uint32_t *dst, uint32_t *src, int len)
 void
 video_blit_memtoscreen(int x, int y, int y1, int y2, int w, int h)
 {
-    int yy;
+    static int last_transform = 0;
+    int yy, transform;
+
+    /* Only lines y1 to y2 have changed since the last blit, the rest of
+       render_buffer is still current, unless the color transform just
+       changed under it. */
+    transform = (video_grayscale << 1) | invert_display;
+    if (transform != last_transform) {
+	last_transform = transform;
+	y1 = 0;
+	y2 = h;
+    }
+    if (y1 < 0)
+	y1 = 0;
+    if (y2 > h)
+	y2 = h;
 
     if ((w > 0) && (h > 0)) {
-	for (yy = 0; yy < h; yy++) {
+	for (yy = y1; yy < y2; yy++) {
 		if (((y + yy) >= 0) && ((y + yy) < buffer32->h)) {
 			if (video_grayscale || invert_display)
 				video_transform_copy(&(render_buffer->line[y + yy][x]), &(buffer32->line[y + yy][x]), w);
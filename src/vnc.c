@@ -166,23 +166,72 @@ vnc_display(rfbClientPtr cl)
 }
 
 
+static void
+vnc_mark_rect(int x1, int y1, int x2, int y2)
+{
+    if (x2 > allowedX)
+	x2 = allowedX;
+    if (y2 > allowedY)
+	y2 = allowedY;
+
+    if (!updatingSize && (x1 < x2) && (y1 < y2))
+	rfbMarkRectAsModified(rfb, x1, y1, x2, y2);
+}
+
+
+/*
+ * Only lines y1 to y2 can have changed. Of those, copy just the pixels
+ * that differ from what the clients already have, and mark each run of
+ * changed lines as one rectangle spanning their changed columns, so a
+ * blinking cursor costs a few bytes instead of a full screen update.
+ */
 static void
 vnc_blit(int x, int y, int y1, int y2, int w, int h)
 {
-    uint32_t *p;
-    int yy;
+    uint32_t *p, *q;
+    int yy, l, r;
+    int rx1 = 0, rx2 = 0, ry1 = -1;
+
+    if (w > VNC_MAX_X)
+	w = VNC_MAX_X;
 
     for (yy=y1; yy<y2; yy++) {
-	p = (uint32_t *)&(((uint32_t *)rfb->frameBuffer)[yy*VNC_MAX_X]);
+	l = w;
+
+	if ((yy >= 0) && (yy < VNC_MAX_Y) && (y+yy) >= 0 && (y+yy) < VNC_MAX_Y) {
+		p = (uint32_t *)&(((uint32_t *)rfb->frameBuffer)[yy*VNC_MAX_X]);
+		q = &(render_buffer->line[y+yy][x]);
+
+		for (l = 0; (l < w) && (p[l] == q[l]); l++)
+			;
+		if (l < w) {
+			for (r = w; p[r - 1] == q[r - 1]; r--)
+				;
+			memcpy(&p[l], &q[l], (r - l) << 2);
+
+			if (ry1 < 0) {
+				ry1 = yy;
+				rx1 = l;
+				rx2 = r;
+			} else {
+				if (l < rx1)
+					rx1 = l;
+				if (r > rx2)
+					rx2 = r;
+			}
+		}
+	}
 
-	if ((y+yy) >= 0 && (y+yy) < VNC_MAX_Y)
-		memcpy(p, &(render_buffer->line[y+yy][x]), w*4);
+	if ((l == w) && (ry1 >= 0)) {
+		vnc_mark_rect(rx1, ry1, rx2, yy);
+		ry1 = -1;
+	}
     }
  
     video_blit_complete();
 
-    if (! updatingSize)
-	rfbMarkRectAsModified(rfb, 0,0, allowedX,allowedY);
+    if (ry1 >= 0)
+	vnc_mark_rect(rx1, ry1, rx2, y2);
 }
 
 
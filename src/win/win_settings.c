@@ -2847,6 +2847,9 @@ win_settings_hard_disks_add_proc(HWND hdlg, UINT message, WPARAM wParam, LPARAM
 			EnableWindow(h, FALSE);
 			h = GetDlgItem(hdlg, IDC_COMBO_HD_TYPE);
 			EnableWindow(h, FALSE);
+			h = GetDlgItem(hdlg, IDC_CHECK_HD_DYNAMIC);
+			EnableWindow(h, FALSE);
+			ShowWindow(h, SW_HIDE);
 			chs_enabled = 0;
 		}
 		else
@@ -2975,6 +2978,25 @@ win_settings_hard_disks_add_proc(HWND hdlg, UINT message, WPARAM wParam, LPARAM
 					fwrite(&zero, 1, 4, f);			/* 00000020: [Translation] Sectors per cylinder */
 					fwrite(&zero, 1, 4, f);			/* 00000004: [Translation] Heads per cylinder */
 				}
+				else if (image_is_vhd(hd_file_name, 0) &&
+					 SendMessage(GetDlgItem(hdlg, IDC_CHECK_HD_DYNAMIC), BM_GETCHECK, 0, 0)) {
+					/* Dynamic VHD, nothing to zero-fill. */
+					new_vhd_footer(&vft);
+					vft->orig_size = vft->curr_size = size;
+					vft->geom.cyl = tracks;
+					vft->geom.heads = hpc;
+					vft->geom.spt = spt;
+					vhd_create_dynamic(f, vft);
+					free(vft);
+					vft = NULL;
+
+					fclose(f);
+					settings_msgbox_header(MBX_INFO, (wchar_t *)IDS_4113, (wchar_t *)IDS_4117);
+
+					hard_disk_added = 1;
+					EndDialog(hdlg, 0);
+					return TRUE;
+				}
 
 				big_buf = (char *)malloc(1048576);
 				memset(big_buf, 0, 1048576);